@@ -0,0 +1,1652 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#include "BVH.h"
+#include "BVHLinearBuilder.h"
+#include "BVHSpatialBuilder.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <math.h>
+
+namespace dxrf
+{
+    static const int MAX_BIN_COUNT = 64;
+    static const UINT PARALLEL_TASK_THRESHOLD = 4096;
+    static const UINT PARALLEL_BIN_THRESHOLD = 65536;
+    static const UINT PARALLEL_BIN_GRAIN = 16384;
+    static const int REFIT_TASK_DEPTH = 6;
+    static const int REFIT_WIDE_GRAIN = 1024;
+    static const int TRIANGLE_BLOCK_GRAIN = 1024;
+
+    struct SplitBin
+    {
+        AABB bounds;
+        UINT count = 0;
+    };
+
+    std::unique_ptr<BVH> BVH::BuildFromMesh(const Mesh* mesh, const BVHBuildSettings& settings)
+    {
+        std::unique_ptr<BVH> bvh(new BVH());
+        bvh->m_settings = settings;
+        bvh->m_mesh = mesh;
+        bvh->m_positions = &mesh->vertices;
+        bvh->Rebuild();
+
+        return bvh;
+    }
+
+    std::unique_ptr<BVH> BVH::BuildFromBounds(const std::vector<AABB>& bounds, const BVHBuildSettings& settings)
+    {
+        std::unique_ptr<BVH> bvh(new BVH());
+        bvh->m_settings = settings;
+        bvh->Build(bounds);
+
+        return bvh;
+    }
+
+    BVH::~BVH()
+    {
+    }
+
+    void BVH::Rebuild()
+    {
+        assert(m_mesh != nullptr);
+
+        this->ComputeTriangleBounds();
+        this->Build(m_prim_bounds);
+    }
+
+    void BVH::Rebuild(const std::vector<AABB>& bounds)
+    {
+        this->Build(bounds);
+    }
+
+    void BVH::ComputeTriangleBounds()
+    {
+        auto compute = [this](int begin, int end) {
+            for (int i = begin; i < end; ++i)
+            {
+                AABB bounds;
+                for (int j = 0; j < 3; ++j)
+                {
+                    bounds.Grow((*m_positions)[m_mesh->indices[i * 3 + j]]);
+                }
+                m_prim_bounds[i] = bounds;
+            }
+        };
+
+        int triangle_count = (int) (m_mesh->indices.size() / 3);
+        m_prim_bounds.resize(triangle_count);
+        if (m_settings.parallel)
+        {
+            ThreadPool::GetInstance()->ParallelFor(0, triangle_count, PARALLEL_BIN_GRAIN, compute);
+        }
+        else
+        {
+            compute(0, triangle_count);
+        }
+    }
+
+    // Scratch node of the parallel builder. The subtree over the primitive range [begin, end) owns the
+    // slots [node_index, node_index + 2 * (end - begin) - 1), so concurrent subtrees never share slots and
+    // the tree does not depend on the order in which tasks finish.
+    struct BuildNode
+    {
+        AABB bounds;
+        UINT left = UINT_MAX;
+        UINT right = UINT_MAX;
+        UINT begin = 0;
+        UINT count = 0;
+    };
+
+    struct Split
+    {
+        int axis = -1;
+        int bin = 0;
+        float cost = FLT_MAX;
+    };
+
+    class SAHBuilder
+    {
+    public:
+        SAHBuilder(const BVHBuildSettings& settings, const std::vector<AABB>& prim_bounds, std::vector<UINT>& prim_indices):
+            m_settings(settings),
+            m_prim_bounds(prim_bounds),
+            m_prim_indices(prim_indices),
+            m_pool(settings.parallel ? ThreadPool::GetInstance() : nullptr)
+        {
+        }
+
+        void Build(std::vector<BVHNode>& nodes);
+
+    private:
+        void BuildNodeRange(UINT node_index, UINT begin, UINT end);
+        void ComputeBounds(UINT begin, UINT end, AABB* bounds, AABB* centroid_bounds) const;
+        void BinPrimitives(UINT begin, UINT end, const float axis_min[3], const float scale[3], SplitBin* bins) const;
+        Split FindSplit(UINT begin, UINT end, const AABB& bounds, const AABB& centroid_bounds) const;
+        int GetBin(UINT prim, int axis, float axis_min, float scale) const;
+        void Compact(std::vector<BVHNode>& nodes) const;
+
+    private:
+        const BVHBuildSettings& m_settings;
+        const std::vector<AABB>& m_prim_bounds;
+        std::vector<UINT>& m_prim_indices;
+        std::vector<XMFLOAT3> m_centroids;
+        std::vector<BuildNode> m_build_nodes;
+        ThreadPool* m_pool;
+    };
+
+    void SAHBuilder::Build(std::vector<BVHNode>& nodes)
+    {
+        UINT prim_count = (UINT) m_prim_bounds.size();
+        m_centroids.resize(prim_count);
+        m_prim_indices.resize(prim_count);
+        m_build_nodes.resize(prim_count * 2 - 1);
+
+        auto init = [this](int begin, int end) {
+            for (int i = begin; i < end; ++i)
+            {
+                m_centroids[i] = m_prim_bounds[i].Center();
+                m_prim_indices[i] = (UINT) i;
+            }
+        };
+        if (m_pool)
+        {
+            m_pool->ParallelFor(0, (int) prim_count, PARALLEL_BIN_GRAIN, init);
+        }
+        else
+        {
+            init(0, (int) prim_count);
+        }
+
+        this->BuildNodeRange(0, 0, prim_count);
+        this->Compact(nodes);
+    }
+
+    void SAHBuilder::BuildNodeRange(UINT node_index, UINT begin, UINT end)
+    {
+        UINT count = end - begin;
+        AABB bounds;
+        AABB centroid_bounds;
+        this->ComputeBounds(begin, end, &bounds, &centroid_bounds);
+
+        BuildNode& node = m_build_nodes[node_index];
+        node.bounds = bounds;
+        node.begin = begin;
+        node.count = count;
+
+        if (count == 1)
+        {
+            return;
+        }
+
+        Split split = this->FindSplit(begin, end, bounds, centroid_bounds);
+
+        float leaf_cost = m_settings.intersection_cost * count;
+        UINT mid = begin;
+        if (split.axis >= 0 && (split.cost < leaf_cost || count > (UINT) m_settings.max_leaf_size))
+        {
+            float axis_min = GetAxis(centroid_bounds.min, split.axis);
+            float scale = m_settings.bin_count * 0.9999f / (GetAxis(centroid_bounds.max, split.axis) - axis_min);
+            auto it = std::partition(m_prim_indices.begin() + begin, m_prim_indices.begin() + end, [&](UINT prim) {
+                return this->GetBin(prim, split.axis, axis_min, scale) < split.bin;
+            });
+            mid = (UINT) (it - m_prim_indices.begin());
+        }
+        else if (count > (UINT) m_settings.max_leaf_size)
+        {
+            // all centroids coincide, fall back to an object median split
+            mid = begin + count / 2;
+        }
+        else
+        {
+            return;
+        }
+
+        node.left = node_index + 1;
+        node.right = node_index + 2 * (mid - begin);
+
+        if (m_pool && count >= PARALLEL_TASK_THRESHOLD)
+        {
+            TaskGroup group(m_pool);
+            group.Run([=]() { this->BuildNodeRange(node_index + 1, begin, mid); });
+            this->BuildNodeRange(node_index + 2 * (mid - begin), mid, end);
+            group.Wait();
+        }
+        else
+        {
+            this->BuildNodeRange(node_index + 1, begin, mid);
+            this->BuildNodeRange(node_index + 2 * (mid - begin), mid, end);
+        }
+    }
+
+    void SAHBuilder::ComputeBounds(UINT begin, UINT end, AABB* bounds, AABB* centroid_bounds) const
+    {
+        if (m_pool && end - begin >= PARALLEL_BIN_THRESHOLD)
+        {
+            int chunk_count = (int) ((end - begin + PARALLEL_BIN_GRAIN - 1) / PARALLEL_BIN_GRAIN);
+            std::vector<AABB> chunk_bounds(chunk_count * 2);
+            m_pool->ParallelFor(0, chunk_count, 1, [&](int chunk_begin, int chunk_end) {
+                for (int c = chunk_begin; c < chunk_end; ++c)
+                {
+                    UINT b = begin + c * PARALLEL_BIN_GRAIN;
+                    this->ComputeBounds(b, (std::min)(end, b + PARALLEL_BIN_GRAIN), &chunk_bounds[c * 2], &chunk_bounds[c * 2 + 1]);
+                }
+            });
+            for (int c = 0; c < chunk_count; ++c)
+            {
+                bounds->Grow(chunk_bounds[c * 2]);
+                centroid_bounds->Grow(chunk_bounds[c * 2 + 1]);
+            }
+            return;
+        }
+
+        for (UINT i = begin; i < end; ++i)
+        {
+            bounds->Grow(m_prim_bounds[m_prim_indices[i]]);
+            centroid_bounds->Grow(m_centroids[m_prim_indices[i]]);
+        }
+    }
+
+    int SAHBuilder::GetBin(UINT prim, int axis, float axis_min, float scale) const
+    {
+        return (std::min)(m_settings.bin_count - 1, (int) ((GetAxis(m_centroids[prim], axis) - axis_min) * scale));
+    }
+
+    // bins is laid out as [axis][bin]
+    void SAHBuilder::BinPrimitives(UINT begin, UINT end, const float axis_min[3], const float scale[3], SplitBin* bins) const
+    {
+        for (UINT i = begin; i < end; ++i)
+        {
+            UINT prim = m_prim_indices[i];
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                SplitBin& bin = bins[axis * MAX_BIN_COUNT + this->GetBin(prim, axis, axis_min[axis], scale[axis])];
+                bin.bounds.Grow(m_prim_bounds[prim]);
+                bin.count += 1;
+            }
+        }
+    }
+
+    Split SAHBuilder::FindSplit(UINT begin, UINT end, const AABB& bounds, const AABB& centroid_bounds) const
+    {
+        const int bin_count = m_settings.bin_count;
+        float axis_min[3];
+        float scale[3];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float extent = GetAxis(centroid_bounds.max, axis) - GetAxis(centroid_bounds.min, axis);
+            axis_min[axis] = GetAxis(centroid_bounds.min, axis);
+            scale[axis] = extent > 0.0f ? bin_count * 0.9999f / extent : 0.0f;
+        }
+
+        SplitBin bins[3 * MAX_BIN_COUNT];
+        if (m_pool && end - begin >= PARALLEL_BIN_THRESHOLD)
+        {
+            // per chunk bins merged in chunk order, min / max and integer sums keep the result exact
+            int chunk_count = (int) ((end - begin + PARALLEL_BIN_GRAIN - 1) / PARALLEL_BIN_GRAIN);
+            std::vector<SplitBin> chunk_bins(chunk_count * 3 * MAX_BIN_COUNT);
+            m_pool->ParallelFor(0, chunk_count, 1, [&](int chunk_begin, int chunk_end) {
+                for (int c = chunk_begin; c < chunk_end; ++c)
+                {
+                    UINT b = begin + c * PARALLEL_BIN_GRAIN;
+                    this->BinPrimitives(b, (std::min)(end, b + PARALLEL_BIN_GRAIN), axis_min, scale, &chunk_bins[c * 3 * MAX_BIN_COUNT]);
+                }
+            });
+            for (int c = 0; c < chunk_count; ++c)
+            {
+                for (int i = 0; i < 3 * MAX_BIN_COUNT; ++i)
+                {
+                    bins[i].bounds.Grow(chunk_bins[c * 3 * MAX_BIN_COUNT + i].bounds);
+                    bins[i].count += chunk_bins[c * 3 * MAX_BIN_COUNT + i].count;
+                }
+            }
+        }
+        else
+        {
+            this->BinPrimitives(begin, end, axis_min, scale, bins);
+        }
+
+        float inv_area = bounds.SurfaceArea() > 0.0f ? 1.0f / bounds.SurfaceArea() : 0.0f;
+        Split best;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (scale[axis] == 0.0f)
+            {
+                continue;
+            }
+
+            const SplitBin* axis_bins = &bins[axis * MAX_BIN_COUNT];
+            float right_area[MAX_BIN_COUNT];
+            UINT right_count[MAX_BIN_COUNT];
+            AABB right_bounds;
+            UINT right_sum = 0;
+            for (int i = bin_count - 1; i > 0; --i)
+            {
+                right_bounds.Grow(axis_bins[i].bounds);
+                right_sum += axis_bins[i].count;
+                right_area[i] = right_bounds.SurfaceArea();
+                right_count[i] = right_sum;
+            }
+
+            AABB left_bounds;
+            UINT left_sum = 0;
+            for (int i = 0; i < bin_count - 1; ++i)
+            {
+                left_bounds.Grow(axis_bins[i].bounds);
+                left_sum += axis_bins[i].count;
+                if (left_sum == 0 || right_count[i + 1] == 0)
+                {
+                    continue;
+                }
+
+                float cost = m_settings.traversal_cost + m_settings.intersection_cost * inv_area *
+                    (left_bounds.SurfaceArea() * left_sum + right_area[i + 1] * right_count[i + 1]);
+                if (cost < best.cost)
+                {
+                    best.axis = axis;
+                    best.bin = i + 1;
+                    best.cost = cost;
+                }
+            }
+        }
+
+        return best;
+    }
+
+    // Renumbers the sparse build nodes depth first, with siblings stored next to each other.
+    void SAHBuilder::Compact(std::vector<BVHNode>& nodes) const
+    {
+        nodes.clear();
+        nodes.reserve(m_build_nodes.size());
+        nodes.emplace_back();
+
+        std::vector<std::pair<UINT, UINT>> stack;
+        stack.push_back({ 0, 0 });
+        while (!stack.empty())
+        {
+            UINT build_index = stack.back().first;
+            UINT node_index = stack.back().second;
+            stack.pop_back();
+
+            const BuildNode& build_node = m_build_nodes[build_index];
+            nodes[node_index].bounds = build_node.bounds;
+            if (build_node.left == UINT_MAX)
+            {
+                nodes[node_index].left_first = build_node.begin;
+                nodes[node_index].count = build_node.count;
+            }
+            else
+            {
+                UINT left = (UINT) nodes.size();
+                nodes.emplace_back();
+                nodes.emplace_back();
+                nodes[node_index].left_first = left;
+                nodes[node_index].count = 0;
+                stack.push_back({ build_node.right, left + 1 });
+                stack.push_back({ build_node.left, left });
+            }
+        }
+    }
+
+    void BVH::Build(const std::vector<AABB>& prim_bounds)
+    {
+        m_settings.bin_count = (std::max)(2, (std::min)(m_settings.bin_count, MAX_BIN_COUNT));
+        m_settings.max_leaf_size = (std::max)(1, m_settings.max_leaf_size);
+        if (m_settings.compress)
+        {
+            // every leaf of a compressed node is a byte offset from the first one
+            m_settings.max_leaf_size = (std::min)(m_settings.max_leaf_size, QUANTIZED_MAX / (std::max)(2, m_settings.width));
+        }
+
+        if (prim_bounds.empty())
+        {
+            m_nodes.clear();
+            m_prim_indices.clear();
+            m_nodes.emplace_back();
+        }
+        else if (m_settings.type == BVHBuildType::Linear)
+        {
+            if (!m_linear_builder)
+            {
+                m_linear_builder.reset(new BVHLinearBuilder());
+            }
+            m_linear_builder->Build(m_settings, prim_bounds, m_nodes, m_prim_indices);
+        }
+        else if (m_settings.type == BVHBuildType::Spatial && m_mesh != nullptr)
+        {
+            if (!m_spatial_builder)
+            {
+                m_spatial_builder.reset(new BVHSpatialBuilder());
+            }
+            m_spatial_builder->Build(m_settings, *m_mesh, *m_positions, prim_bounds, m_nodes, m_prim_indices);
+        }
+        else
+        {
+            SAHBuilder builder(m_settings, prim_bounds, m_prim_indices);
+            builder.Build(m_nodes);
+        }
+        m_bounds = m_nodes[0].bounds;
+        float root_area = m_bounds.SurfaceArea();
+        m_build_cost = m_prim_indices.empty() || root_area <= 0.0f ? 0.0f : this->ComputeCost(0) / root_area;
+        m_cost = m_build_cost;
+
+        this->Collapse();
+        if (m_mesh != nullptr)
+        {
+            this->CreateTriangleBlocks();
+        }
+        if (m_settings.compress)
+        {
+            this->Compress();
+        }
+    }
+
+    size_t BVH::GetWideNodeCount() const
+    {
+        return m_nodes2.size() + m_nodes4.size() + m_nodes8.size() +
+            m_quantized_nodes2.size() + m_quantized_nodes4.size() + m_quantized_nodes8.size();
+    }
+
+    size_t BVH::GetWideNodeByteSize() const
+    {
+        return m_nodes2.size() * sizeof(BVHNode2) + m_nodes4.size() * sizeof(BVHNode4) + m_nodes8.size() * sizeof(BVHNode8) +
+            m_quantized_nodes2.size() * sizeof(BVHQuantizedNode2) + m_quantized_nodes4.size() * sizeof(BVHQuantizedNode4) +
+            m_quantized_nodes8.size() * sizeof(BVHQuantizedNode8);
+    }
+
+    // SAH cost of the subtree, not yet divided by the root area.
+    float BVH::ComputeCost(UINT index) const
+    {
+        const BVHNode& node = m_nodes[index];
+        float area = node.bounds.SurfaceArea();
+        if (node.IsLeaf())
+        {
+            return m_settings.intersection_cost * area * node.count;
+        }
+        return m_settings.traversal_cost * area + this->ComputeCost(node.left_first) + this->ComputeCost(node.left_first + 1);
+    }
+
+    // Pulls the binary subtree rooted at index up into one wide node by repeatedly opening the
+    // inner child with the largest surface area, then recurses into the remaining inner children.
+    template<int N>
+    static int CollapseNode(const std::vector<BVHNode>& binary, UINT index, std::vector<BVHWideNode<N>>& wide, std::vector<UINT>& sources)
+    {
+        int wide_index = (int) wide.size();
+        wide.emplace_back();
+        sources.resize(wide.size() * N, UINT_MAX);
+
+        UINT children[N];
+        int child_count = 0;
+        const BVHNode& node = binary[index];
+        if (node.IsLeaf())
+        {
+            children[child_count++] = index;
+        }
+        else
+        {
+            children[child_count++] = node.left_first;
+            children[child_count++] = node.left_first + 1;
+            while (child_count < N)
+            {
+                int best = -1;
+                float best_area = -1.0f;
+                for (int i = 0; i < child_count; ++i)
+                {
+                    const BVHNode& child = binary[children[i]];
+                    if (!child.IsLeaf() && child.bounds.SurfaceArea() > best_area)
+                    {
+                        best = i;
+                        best_area = child.bounds.SurfaceArea();
+                    }
+                }
+                if (best < 0)
+                {
+                    break;
+                }
+
+                UINT open = children[best];
+                children[best] = binary[open].left_first;
+                children[child_count++] = binary[open].left_first + 1;
+            }
+        }
+
+        BVHWideNode<N> result;
+        for (int i = 0; i < N; ++i)
+        {
+            for (int a = 0; a < 3; ++a)
+            {
+                result.bounds[0][a][i] = FLT_MAX;
+                result.bounds[1][a][i] = -FLT_MAX;
+            }
+            result.child[i] = -1;
+            result.count[i] = 0;
+        }
+
+        for (int i = 0; i < child_count; ++i)
+        {
+            const BVHNode& child = binary[children[i]];
+            sources[wide_index * N + i] = children[i];
+            for (int a = 0; a < 3; ++a)
+            {
+                result.bounds[0][a][i] = GetAxis(child.bounds.min, a);
+                result.bounds[1][a][i] = GetAxis(child.bounds.max, a);
+            }
+            if (child.IsLeaf())
+            {
+                result.child[i] = (int) child.left_first;
+                result.count[i] = (int) child.count;
+            }
+            else
+            {
+                result.child[i] = CollapseNode<N>(binary, children[i], wide, sources);
+            }
+        }
+
+        wide[wide_index] = result;
+        return wide_index;
+    }
+
+    void BVH::Collapse()
+    {
+        m_nodes2.clear();
+        m_nodes4.clear();
+        m_nodes8.clear();
+        m_wide_sources.clear();
+
+        if (m_prim_indices.empty())
+        {
+            return;
+        }
+
+        switch (m_settings.width)
+        {
+            case 8:
+                m_nodes8.reserve(m_nodes.size() / 7 + 1);
+                m_wide_sources.reserve(m_nodes8.capacity() * 8);
+                CollapseNode<8>(m_nodes, 0, m_nodes8, m_wide_sources);
+                break;
+            case 4:
+                m_nodes4.reserve(m_nodes.size() / 3 + 1);
+                m_wide_sources.reserve(m_nodes4.capacity() * 4);
+                CollapseNode<4>(m_nodes, 0, m_nodes4, m_wide_sources);
+                break;
+            default:
+                m_settings.width = 2;
+                m_nodes2.reserve(m_nodes.size());
+                m_wide_sources.reserve(m_nodes2.capacity() * 2);
+                CollapseNode<2>(m_nodes, 0, m_nodes2, m_wide_sources);
+                break;
+        }
+    }
+
+    bool BVH::Refit(const std::vector<XMFLOAT3>& positions)
+    {
+        assert(m_mesh != nullptr && positions.size() == m_mesh->vertices.size());
+
+        m_positions = &positions;
+        if (m_prim_indices.empty())
+        {
+            return false;
+        }
+
+        float cost = this->RefitNode(0, 0);
+        m_bounds = m_nodes[0].bounds;
+        float root_area = m_bounds.SurfaceArea();
+        m_cost = root_area > 0.0f ? cost / root_area : 0.0f;
+
+        // refitted boxes overlap more and more as the mesh moves away from the pose it was built in
+        if (m_cost > m_build_cost * m_settings.refit_threshold)
+        {
+            this->Rebuild();
+            return true;
+        }
+
+        this->RefitWideNodes();
+        this->UpdateTriangleBlocks();
+        return false;
+    }
+
+    // Bottom up bounds update, the top levels of the tree fork into tasks. Returns the unnormalized SAH cost of the subtree.
+    float BVH::RefitNode(UINT index, int depth)
+    {
+        BVHNode& node = m_nodes[index];
+        if (node.IsLeaf())
+        {
+            AABB bounds;
+            for (UINT i = 0; i < node.count; ++i)
+            {
+                UINT prim = m_prim_indices[node.left_first + i];
+                for (int j = 0; j < 3; ++j)
+                {
+                    bounds.Grow((*m_positions)[m_mesh->indices[prim * 3 + j]]);
+                }
+            }
+            node.bounds = bounds;
+            return m_settings.intersection_cost * bounds.SurfaceArea() * node.count;
+        }
+
+        float left_cost;
+        float right_cost;
+        if (m_settings.parallel && depth < REFIT_TASK_DEPTH)
+        {
+            TaskGroup group(ThreadPool::GetInstance());
+            group.Run([&]() {
+                left_cost = this->RefitNode(node.left_first, depth + 1);
+            });
+            right_cost = this->RefitNode(node.left_first + 1, depth + 1);
+            group.Wait();
+        }
+        else
+        {
+            left_cost = this->RefitNode(node.left_first, depth + 1);
+            right_cost = this->RefitNode(node.left_first + 1, depth + 1);
+        }
+
+        AABB bounds = m_nodes[node.left_first].bounds;
+        bounds.Grow(m_nodes[node.left_first + 1].bounds);
+        node.bounds = bounds;
+        return m_settings.traversal_cost * bounds.SurfaceArea() + left_cost + right_cost;
+    }
+
+    template<int N>
+    static void RefitWide(const std::vector<BVHNode>& binary, const std::vector<UINT>& sources, std::vector<BVHWideNode<N>>& wide, bool parallel)
+    {
+        auto refit = [&](int begin, int end) {
+            for (int w = begin; w < end; ++w)
+            {
+                for (int i = 0; i < N; ++i)
+                {
+                    UINT source = sources[w * N + i];
+                    if (source == UINT_MAX)
+                    {
+                        continue;
+                    }
+                    const AABB& bounds = binary[source].bounds;
+                    for (int a = 0; a < 3; ++a)
+                    {
+                        wide[w].bounds[0][a][i] = GetAxis(bounds.min, a);
+                        wide[w].bounds[1][a][i] = GetAxis(bounds.max, a);
+                    }
+                }
+            }
+        };
+
+        if (parallel)
+        {
+            ThreadPool::GetInstance()->ParallelFor(0, (int) wide.size(), REFIT_WIDE_GRAIN, refit);
+        }
+        else
+        {
+            refit(0, (int) wide.size());
+        }
+    }
+
+    // Quantizes the child boxes of a node against their union. The exponent is the smallest that spans the union
+    // in QUANTIZED_MAX steps, then every bound moves outward until its decoded value contains the exact one.
+    template<int N>
+    static void QuantizeBounds(const AABB child_bounds[N], BVHQuantizedNode<N>& node)
+    {
+        AABB node_bounds;
+        for (int i = 0; i < N; ++i)
+        {
+            if ((node.slot_mask & (1 << i)) != 0)
+            {
+                node_bounds.Grow(child_bounds[i]);
+            }
+        }
+
+        for (int a = 0; a < 3; ++a)
+        {
+            float origin = GetAxis(node_bounds.min, a);
+            float extent = GetAxis(node_bounds.max, a) - origin;
+            int exponent = extent > 0.0f ? (int) ceilf(log2f(extent / QUANTIZED_MAX)) : QUANTIZED_MIN_EXPONENT;
+            exponent = (std::max)(exponent, QUANTIZED_MIN_EXPONENT);
+            while (exponent < QUANTIZED_MAX_EXPONENT &&
+                DecodeQuantizedBound(origin, GetQuantizedScale(exponent), QUANTIZED_MAX) < GetAxis(node_bounds.max, a))
+            {
+                exponent += 1;
+            }
+            float scale = GetQuantizedScale(exponent);
+            node.origin[a] = origin;
+            node.exponent[a] = (int8_t) exponent;
+
+            for (int i = 0; i < N; ++i)
+            {
+                if ((node.slot_mask & (1 << i)) == 0)
+                {
+                    // inverted, the slot mask rejects it anyway
+                    node.bounds[0][a][i] = QUANTIZED_MAX;
+                    node.bounds[1][a][i] = 0;
+                    continue;
+                }
+                float child_min = GetAxis(child_bounds[i].min, a);
+                float child_max = GetAxis(child_bounds[i].max, a);
+                int q_min = (std::min)((std::max)((int) floorf((child_min - origin) / scale), 0), QUANTIZED_MAX);
+                int q_max = (std::min)((std::max)((int) ceilf((child_max - origin) / scale), 0), QUANTIZED_MAX);
+                while (q_min > 0 && DecodeQuantizedBound(origin, scale, (uint8_t) q_min) > child_min)
+                {
+                    q_min -= 1;
+                }
+                while (q_max < QUANTIZED_MAX && DecodeQuantizedBound(origin, scale, (uint8_t) q_max) < child_max)
+                {
+                    q_max += 1;
+                }
+                node.bounds[0][a][i] = (uint8_t) q_min;
+                node.bounds[1][a][i] = (uint8_t) q_max;
+            }
+        }
+    }
+
+    // Lays the wide nodes out breadth first, so the inner children of every node are consecutive. Leaves of mesh
+    // BVHs point at triangle blocks, which AssignTriangleBlocks already gave consecutive runs per node. Leaves of
+    // bounds BVHs get their primitive ranges copied next to each other, and their binary leaves follow them.
+    // False when a leaf offset or count does not fit a byte, nothing but quantized is changed then.
+    template<int N>
+    static bool QuantizeNodes(const std::vector<BVHWideNode<N>>& wide, bool block_leaves, std::vector<BVHNode>& binary,
+        std::vector<UINT>& prim_indices, std::vector<UINT>& sources, std::vector<BVHQuantizedNode<N>>& quantized)
+    {
+        std::vector<UINT> order;
+        order.reserve(wide.size());
+        order.push_back(0);
+        quantized.resize(wide.size());
+        std::vector<UINT> quantized_sources(wide.size() * N, UINT_MAX);
+        std::vector<UINT> leaf_prim_indices;
+        leaf_prim_indices.reserve(block_leaves ? 0 : prim_indices.size());
+        // binary leaves move along with their primitives once every leaf fit
+        std::vector<std::pair<UINT, UINT>> binary_leaf_firsts;
+
+        for (size_t k = 0; k < order.size(); ++k)
+        {
+            const BVHWideNode<N>& node = wide[order[k]];
+            BVHQuantizedNode<N>& result = quantized[k];
+            result.slot_mask = 0;
+            result.inner_base = (UINT) order.size();
+            result.leaf_base = UINT_MAX;
+            AABB child_bounds[N];
+            for (int i = 0; i < N; ++i)
+            {
+                UINT source = sources[order[k] * N + i];
+                quantized_sources[k * N + i] = source;
+                result.child[i] = 0;
+                result.count[i] = 0;
+                if (source == UINT_MAX)
+                {
+                    continue;
+                }
+
+                result.slot_mask |= 1 << i;
+                for (int a = 0; a < 3; ++a)
+                {
+                    (&child_bounds[i].min.x)[a] = node.bounds[0][a][i];
+                    (&child_bounds[i].max.x)[a] = node.bounds[1][a][i];
+                }
+                if (node.count[i] == 0)
+                {
+                    result.child[i] = (uint8_t) (order.size() - result.inner_base);
+                    order.push_back((UINT) node.child[i]);
+                    continue;
+                }
+
+                UINT first = (UINT) node.child[i];
+                if (!block_leaves)
+                {
+                    first = (UINT) leaf_prim_indices.size();
+                    leaf_prim_indices.insert(leaf_prim_indices.end(), prim_indices.begin() + node.child[i], prim_indices.begin() + node.child[i] + node.count[i]);
+                    binary_leaf_firsts.push_back({ source, first });
+                }
+                if (result.leaf_base == UINT_MAX)
+                {
+                    result.leaf_base = first;
+                }
+                if (first < result.leaf_base || first - result.leaf_base > QUANTIZED_MAX || node.count[i] > QUANTIZED_MAX)
+                {
+                    return false;
+                }
+                result.child[i] = (uint8_t) (first - result.leaf_base);
+                result.count[i] = (uint8_t) node.count[i];
+            }
+            result.leaf_base = result.leaf_base == UINT_MAX ? 0 : result.leaf_base;
+            QuantizeBounds<N>(child_bounds, result);
+        }
+
+        sources.swap(quantized_sources);
+        if (!block_leaves)
+        {
+            prim_indices.swap(leaf_prim_indices);
+            for (const std::pair<UINT, UINT>& leaf_first : binary_leaf_firsts)
+            {
+                binary[leaf_first.first].left_first = leaf_first.second;
+            }
+        }
+        return true;
+    }
+
+    template<int N>
+    static void RefitQuantized(const std::vector<BVHNode>& binary, const std::vector<UINT>& sources, std::vector<BVHQuantizedNode<N>>& quantized, bool parallel)
+    {
+        auto refit = [&](int begin, int end) {
+            for (int q = begin; q < end; ++q)
+            {
+                AABB child_bounds[N];
+                for (int i = 0; i < N; ++i)
+                {
+                    UINT source = sources[q * N + i];
+                    if (source != UINT_MAX)
+                    {
+                        child_bounds[i] = binary[source].bounds;
+                    }
+                }
+                QuantizeBounds<N>(child_bounds, quantized[q]);
+            }
+        };
+
+        if (parallel)
+        {
+            ThreadPool::GetInstance()->ParallelFor(0, (int) quantized.size(), REFIT_WIDE_GRAIN, refit);
+        }
+        else
+        {
+            refit(0, (int) quantized.size());
+        }
+    }
+
+    // Replaces the wide nodes with their quantized layout and releases them. Builders keep leaves within
+    // max_leaf_size, which Build limits for compression, but a leaf that still does not fit leaves the BVH on the
+    // uncompressed nodes with settings.compress cleared, traversals then pick those.
+    void BVH::Compress()
+    {
+        m_quantized_nodes2.clear();
+        m_quantized_nodes4.clear();
+        m_quantized_nodes8.clear();
+        if (m_prim_indices.empty())
+        {
+            return;
+        }
+
+        bool block_leaves = m_mesh != nullptr;
+        bool quantized = false;
+        switch (m_settings.width)
+        {
+            case 8:
+                quantized = QuantizeNodes<8>(m_nodes8, block_leaves, m_nodes, m_prim_indices, m_wide_sources, m_quantized_nodes8);
+                if (quantized)
+                {
+                    std::vector<BVHNode8>().swap(m_nodes8);
+                }
+                break;
+            case 4:
+                quantized = QuantizeNodes<4>(m_nodes4, block_leaves, m_nodes, m_prim_indices, m_wide_sources, m_quantized_nodes4);
+                if (quantized)
+                {
+                    std::vector<BVHNode4>().swap(m_nodes4);
+                }
+                break;
+            default:
+                quantized = QuantizeNodes<2>(m_nodes2, block_leaves, m_nodes, m_prim_indices, m_wide_sources, m_quantized_nodes2);
+                if (quantized)
+                {
+                    std::vector<BVHNode2>().swap(m_nodes2);
+                }
+                break;
+        }
+        if (!quantized)
+        {
+            std::vector<BVHQuantizedNode2>().swap(m_quantized_nodes2);
+            std::vector<BVHQuantizedNode4>().swap(m_quantized_nodes4);
+            std::vector<BVHQuantizedNode8>().swap(m_quantized_nodes8);
+            m_settings.compress = false;
+        }
+    }
+
+    // Wide nodes keep the structure of the last collapse, every child slot copies the bounds of its binary node.
+    void BVH::RefitWideNodes()
+    {
+        if (m_settings.compress)
+        {
+            switch (m_settings.width)
+            {
+                case 8:
+                    RefitQuantized<8>(m_nodes, m_wide_sources, m_quantized_nodes8, m_settings.parallel);
+                    break;
+                case 4:
+                    RefitQuantized<4>(m_nodes, m_wide_sources, m_quantized_nodes4, m_settings.parallel);
+                    break;
+                default:
+                    RefitQuantized<2>(m_nodes, m_wide_sources, m_quantized_nodes2, m_settings.parallel);
+                    break;
+            }
+            return;
+        }
+
+        switch (m_settings.width)
+        {
+            case 8:
+                RefitWide<8>(m_nodes, m_wide_sources, m_nodes8, m_settings.parallel);
+                break;
+            case 4:
+                RefitWide<4>(m_nodes, m_wide_sources, m_nodes4, m_settings.parallel);
+                break;
+            default:
+                RefitWide<2>(m_nodes, m_wide_sources, m_nodes2, m_settings.parallel);
+                break;
+        }
+    }
+
+    // Gives every wide leaf its own run of triangle blocks and points the leaf slot at the first of them.
+    template<int N>
+    static void AssignTriangleBlocks(std::vector<BVHWideNode<N>>& wide, const std::vector<UINT>& prim_indices, std::vector<BVHTriangleBlock>& blocks)
+    {
+        for (BVHWideNode<N>& node : wide)
+        {
+            for (int i = 0; i < N; ++i)
+            {
+                int count = node.count[i];
+                if (count == 0)
+                {
+                    continue;
+                }
+                int first = node.child[i];
+                node.child[i] = (int) blocks.size();
+                for (int j = 0; j < count; j += TRIANGLE_BLOCK_SIZE)
+                {
+                    BVHTriangleBlock block;
+                    for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; ++lane)
+                    {
+                        block.prim[lane] = j + lane < count ? prim_indices[first + j + lane] : UINT_MAX;
+                    }
+                    blocks.push_back(block);
+                }
+            }
+        }
+    }
+
+    void BVH::CreateTriangleBlocks()
+    {
+        m_triangle_blocks.clear();
+        m_triangle_blocks.reserve(m_prim_indices.size() / TRIANGLE_BLOCK_SIZE + m_wide_sources.size());
+        switch (m_settings.width)
+        {
+            case 8:
+                AssignTriangleBlocks<8>(m_nodes8, m_prim_indices, m_triangle_blocks);
+                break;
+            case 4:
+                AssignTriangleBlocks<4>(m_nodes4, m_prim_indices, m_triangle_blocks);
+                break;
+            default:
+                AssignTriangleBlocks<2>(m_nodes2, m_prim_indices, m_triangle_blocks);
+                break;
+        }
+        this->UpdateTriangleBlocks();
+    }
+
+    // Gathers the current vertex positions into the blocks, empty lanes get a degenerate triangle at the origin.
+    void BVH::UpdateTriangleBlocks()
+    {
+        auto update = [&](int begin, int end) {
+            for (int b = begin; b < end; ++b)
+            {
+                BVHTriangleBlock& block = m_triangle_blocks[b];
+                for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; ++lane)
+                {
+                    UINT prim = block.prim[lane];
+                    for (int j = 0; j < 3; ++j)
+                    {
+                        XMFLOAT3 p = prim != UINT_MAX ? (*m_positions)[m_mesh->indices[prim * 3 + j]] : XMFLOAT3(0, 0, 0);
+                        block.vertices[j][0][lane] = p.x;
+                        block.vertices[j][1][lane] = p.y;
+                        block.vertices[j][2][lane] = p.z;
+                    }
+                }
+            }
+        };
+
+        if (m_settings.parallel)
+        {
+            ThreadPool::GetInstance()->ParallelFor(0, (int) m_triangle_blocks.size(), TRIANGLE_BLOCK_GRAIN, update);
+        }
+        else
+        {
+            update(0, (int) m_triangle_blocks.size());
+        }
+    }
+
+    // Watertight ray triangle test of Woop, Benthin and Wald 2013 over the four lanes of a block. Edge functions
+    // of neighboring triangles are computed from the same sheared vertices, so a ray through a shared edge or
+    // vertex hits at least one of them. Writes t and the DXR barycentrics of every lane, returns the hit lanes.
+    static UINT IntersectTriangleBlock(const BVHTriangleBlock& block, const WatertightRay& ray, float t_max, UINT lane_mask, float t[4], float u[4], float v[4])
+    {
+        __m128 shear_x = _mm_set1_ps(ray.shear_x);
+        __m128 shear_y = _mm_set1_ps(ray.shear_y);
+        __m128 shear_z = _mm_set1_ps(ray.shear_z);
+        __m128 x[3];
+        __m128 y[3];
+        __m128 z[3];
+        for (int j = 0; j < 3; ++j)
+        {
+            __m128 px = _mm_sub_ps(_mm_loadu_ps(block.vertices[j][ray.kx]), _mm_set1_ps(ray.origin[ray.kx]));
+            __m128 py = _mm_sub_ps(_mm_loadu_ps(block.vertices[j][ray.ky]), _mm_set1_ps(ray.origin[ray.ky]));
+            __m128 pz = _mm_sub_ps(_mm_loadu_ps(block.vertices[j][ray.kz]), _mm_set1_ps(ray.origin[ray.kz]));
+            x[j] = _mm_sub_ps(px, _mm_mul_ps(shear_x, pz));
+            y[j] = _mm_sub_ps(py, _mm_mul_ps(shear_y, pz));
+            z[j] = _mm_mul_ps(shear_z, pz);
+        }
+
+        // scaled barycentrics, each one is the edge function opposite its vertex
+        __m128 e0 = _mm_sub_ps(_mm_mul_ps(x[2], y[1]), _mm_mul_ps(y[2], x[1]));
+        __m128 e1 = _mm_sub_ps(_mm_mul_ps(x[0], y[2]), _mm_mul_ps(y[0], x[2]));
+        __m128 e2 = _mm_sub_ps(_mm_mul_ps(x[1], y[0]), _mm_mul_ps(y[1], x[0]));
+
+        // the ray misses when the edge functions disagree in sign, zeros count for both sides
+        __m128 zero = _mm_setzero_ps();
+        __m128 any_negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(e0, zero), _mm_cmplt_ps(e1, zero)), _mm_cmplt_ps(e2, zero));
+        __m128 any_positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(e0, zero), _mm_cmpgt_ps(e1, zero)), _mm_cmpgt_ps(e2, zero));
+        __m128 det = _mm_add_ps(_mm_add_ps(e0, e1), e2);
+        __m128 valid = _mm_andnot_ps(_mm_and_ps(any_negative, any_positive), _mm_cmpneq_ps(det, zero));
+
+        __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+        __m128 scaled_t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0, z[0]), _mm_mul_ps(e1, z[1])), _mm_mul_ps(e2, z[2]));
+        __m128 hit_t = _mm_mul_ps(scaled_t, inv_det);
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(hit_t, _mm_set1_ps(ray.t_min)));
+        valid = _mm_and_ps(valid, _mm_cmplt_ps(hit_t, _mm_set1_ps(t_max)));
+
+        _mm_storeu_ps(t, hit_t);
+        _mm_storeu_ps(u, _mm_mul_ps(e1, inv_det));
+        _mm_storeu_ps(v, _mm_mul_ps(e2, inv_det));
+        return (UINT) _mm_movemask_ps(valid) & lane_mask;
+    }
+
+    static UINT GetBlockLaneMask(int count, int block)
+    {
+        int lanes = (std::min)(count - block * TRIANGLE_BLOCK_SIZE, TRIANGLE_BLOCK_SIZE);
+        return (1u << lanes) - 1;
+    }
+
+    bool BVH::Intersect(const Ray& ray, RayHit* hit) const
+    {
+        assert(m_mesh != nullptr);
+
+        TraversalRay traversal_ray(ray);
+        WatertightRay triangle_ray(ray);
+        float t_max = (std::min)(ray.t_max, hit->t);
+        bool found = false;
+
+        this->Traverse(traversal_ray, t_max, [&](int first, int count) {
+            for (int b = 0; b * TRIANGLE_BLOCK_SIZE < count; ++b)
+            {
+                const BVHTriangleBlock& block = m_triangle_blocks[first + b];
+                float t[TRIANGLE_BLOCK_SIZE];
+                float u[TRIANGLE_BLOCK_SIZE];
+                float v[TRIANGLE_BLOCK_SIZE];
+                UINT mask = IntersectTriangleBlock(block, triangle_ray, t_max, GetBlockLaneMask(count, b), t, u, v);
+                for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; ++lane)
+                {
+                    if ((mask & (1 << lane)) != 0 && t[lane] < t_max)
+                    {
+                        t_max = t[lane];
+                        hit->t = t[lane];
+                        hit->barycentrics = { u[lane], v[lane] };
+                        hit->primitive_index = block.prim[lane];
+                        found = true;
+                    }
+                }
+            }
+            return false;
+        });
+
+        return found;
+    }
+
+    bool BVH::Occluded(const Ray& ray) const
+    {
+        assert(m_mesh != nullptr);
+
+        TraversalRay traversal_ray(ray);
+        WatertightRay triangle_ray(ray);
+        float t_max = ray.t_max;
+        bool occluded = false;
+
+        this->Traverse(traversal_ray, t_max, [&](int first, int count) {
+            for (int b = 0; b * TRIANGLE_BLOCK_SIZE < count; ++b)
+            {
+                float t[TRIANGLE_BLOCK_SIZE];
+                float u[TRIANGLE_BLOCK_SIZE];
+                float v[TRIANGLE_BLOCK_SIZE];
+                if (IntersectTriangleBlock(m_triangle_blocks[first + b], triangle_ray, t_max, GetBlockLaneMask(count, b), t, u, v) != 0)
+                {
+                    occluded = true;
+                    return true;
+                }
+            }
+            return false;
+        });
+
+        return occluded;
+    }
+
+    // Lane indices of the set bits of every 8 bit mask, packed to the front, for left packing with a permute.
+    struct StreamCompactTable
+    {
+        uint8_t lanes[256][8];
+        uint8_t count[256];
+
+        StreamCompactTable()
+        {
+            for (int mask = 0; mask < 256; ++mask)
+            {
+                int n = 0;
+                for (int lane = 0; lane < 8; ++lane)
+                {
+                    if ((mask & (1 << lane)) != 0)
+                    {
+                        lanes[mask][n++] = (uint8_t) lane;
+                    }
+                }
+                count[mask] = (uint8_t) n;
+                for (int lane = n; lane < 8; ++lane)
+                {
+                    lanes[mask][lane] = 0;
+                }
+            }
+        }
+    };
+
+    static const StreamCompactTable STREAM_COMPACT_TABLE;
+
+    template<int N>
+    void FilterStream(const TraversalStream& stream, const float bounds[2][3][N], UINT slot_mask, const UINT* rays, int ray_count,
+        UINT* lists[N], int counts[N])
+    {
+        for (int c = 0; c < N; ++c)
+        {
+            counts[c] = 0;
+        }
+
+        int i = 0;
+#if defined(__AVX2__)
+        // ray fields are gathered from the TraversalRay array in float steps
+        static_assert(sizeof(TraversalRay) % sizeof(float) == 0, "TraversalRay must be gatherable");
+        const __m256i stride = _mm256_set1_epi32((int) (sizeof(TraversalRay) / sizeof(float)));
+        const TraversalRay* traversal_rays = &stream.traversal_rays[0];
+        const float* t_max = &stream.t_max[0];
+        __m256 far_scale = _mm256_set1_ps(SLAB_FAR_SCALE);
+        for (; i + 8 <= ray_count; i += 8)
+        {
+            __m256i index = _mm256_loadu_si256((const __m256i*) (rays + i));
+            __m256i offset = _mm256_mullo_epi32(index, stride);
+            __m256 ray_t_min = _mm256_i32gather_ps(&traversal_rays->t_min, offset, 4);
+            __m256 ray_t_max = _mm256_i32gather_ps(t_max, index, 4);
+            __m256 origin[3];
+            __m256 inv_dir[3];
+            for (int a = 0; a < 3; ++a)
+            {
+                origin[a] = _mm256_i32gather_ps(&traversal_rays->origin[a], offset, 4);
+                inv_dir[a] = _mm256_i32gather_ps(&traversal_rays->inv_dir[a], offset, 4);
+            }
+
+            for (int c = 0; c < N; ++c)
+            {
+                if ((slot_mask & (1 << c)) == 0)
+                {
+                    continue;
+                }
+                __m256 t_near = ray_t_min;
+                __m256 t_far = ray_t_max;
+                for (int a = 0; a < 3; ++a)
+                {
+                    __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bounds[0][a][c]), origin[a]), inv_dir[a]);
+                    __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bounds[1][a][c]), origin[a]), inv_dir[a]);
+                    t_near = _mm256_max_ps(t_near, _mm256_min_ps(t0, t1));
+                    t_far = _mm256_min_ps(t_far, _mm256_mul_ps(_mm256_max_ps(t0, t1), far_scale));
+                }
+                int mask = _mm256_movemask_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ));
+                if (mask == 0)
+                {
+                    continue;
+                }
+                __m256i lanes = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) STREAM_COMPACT_TABLE.lanes[mask]));
+                _mm256_storeu_si256((__m256i*) (lists[c] + counts[c]), _mm256_permutevar8x32_epi32(index, lanes));
+                counts[c] += STREAM_COMPACT_TABLE.count[mask];
+            }
+        }
+#endif
+        for (; i < ray_count; ++i)
+        {
+            UINT r = rays[i];
+            const TraversalRay& ray = stream.traversal_rays[r];
+            for (int c = 0; c < N; ++c)
+            {
+                if ((slot_mask & (1 << c)) == 0)
+                {
+                    continue;
+                }
+                float t_near = ray.t_min;
+                float t_far = stream.t_max[r];
+                for (int a = 0; a < 3; ++a)
+                {
+                    t_near = (std::max)(t_near, (bounds[ray.near_plane[a]][a][c] - ray.origin[a]) * ray.inv_dir[a]);
+                    t_far = (std::min)(t_far, (bounds[1 - ray.near_plane[a]][a][c] - ray.origin[a]) * ray.inv_dir[a] * SLAB_FAR_SCALE);
+                }
+                if (t_near <= t_far)
+                {
+                    lists[c][counts[c]++] = r;
+                }
+            }
+        }
+    }
+
+    template void FilterStream<2>(const TraversalStream&, const float[2][3][2], UINT, const UINT*, int, UINT*[2], int[2]);
+    template void FilterStream<4>(const TraversalStream&, const float[2][3][4], UINT, const UINT*, int, UINT*[4], int[4]);
+    template void FilterStream<8>(const TraversalStream&, const float[2][3][8], UINT, const UINT*, int, UINT*[8], int[8]);
+
+    void BVH::Intersect(TraversalStream& stream) const
+    {
+        assert(m_mesh != nullptr);
+
+        stream.triangle_rays.resize(stream.rays.size());
+        for (int i = 0; i < stream.ray_count; ++i)
+        {
+            stream.triangle_rays[i] = WatertightRay(stream.rays[i]);
+        }
+
+        this->TraverseStream(stream, [&](int first, int count, const UINT* rays, int ray_count) {
+            for (int b = 0; b * TRIANGLE_BLOCK_SIZE < count; ++b)
+            {
+                const BVHTriangleBlock& block = m_triangle_blocks[first + b];
+                UINT lane_mask = GetBlockLaneMask(count, b);
+                for (int i = 0; i < ray_count; ++i)
+                {
+                    UINT r = rays[i];
+                    float& t_max = stream.t_max[r];
+                    float t[TRIANGLE_BLOCK_SIZE];
+                    float u[TRIANGLE_BLOCK_SIZE];
+                    float v[TRIANGLE_BLOCK_SIZE];
+                    UINT mask = IntersectTriangleBlock(block, stream.triangle_rays[r], t_max, lane_mask, t, u, v);
+                    for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; ++lane)
+                    {
+                        if ((mask & (1 << lane)) != 0 && t[lane] < t_max)
+                        {
+                            RayHit& hit = stream.hits[r];
+                            t_max = t[lane];
+                            hit.t = t[lane];
+                            hit.barycentrics = { u[lane], v[lane] };
+                            hit.primitive_index = block.prim[lane];
+                        }
+                    }
+                }
+            }
+        });
+    }
+
+    void BVH::Occluded(TraversalStream& stream) const
+    {
+        assert(m_mesh != nullptr);
+
+        stream.triangle_rays.resize(stream.rays.size());
+        for (int i = 0; i < stream.ray_count; ++i)
+        {
+            stream.triangle_rays[i] = WatertightRay(stream.rays[i]);
+        }
+
+        this->TraverseStream(stream, [&](int first, int count, const UINT* rays, int ray_count) {
+            for (int b = 0; b * TRIANGLE_BLOCK_SIZE < count; ++b)
+            {
+                const BVHTriangleBlock& block = m_triangle_blocks[first + b];
+                UINT lane_mask = GetBlockLaneMask(count, b);
+                for (int i = 0; i < ray_count; ++i)
+                {
+                    UINT r = rays[i];
+                    const WatertightRay& triangle_ray = stream.triangle_rays[r];
+                    // blocked by an earlier block of this leaf
+                    if (stream.t_max[r] < triangle_ray.t_min)
+                    {
+                        continue;
+                    }
+                    float t[TRIANGLE_BLOCK_SIZE];
+                    float u[TRIANGLE_BLOCK_SIZE];
+                    float v[TRIANGLE_BLOCK_SIZE];
+                    UINT mask = IntersectTriangleBlock(block, triangle_ray, stream.t_max[r], lane_mask, t, u, v);
+                    if (mask != 0)
+                    {
+                        int lane = 0;
+                        while ((mask & (1 << lane)) == 0)
+                        {
+                            ++lane;
+                        }
+                        RayHit& hit = stream.hits[r];
+                        hit.t = t[lane];
+                        hit.barycentrics = { u[lane], v[lane] };
+                        hit.primitive_index = block.prim[lane];
+                        stream.t_max[r] = -FLT_MAX;
+                    }
+                }
+            }
+        });
+    }
+
+    static const char BVH_FILE_MAGIC[8] = { 'D', 'X', 'R', 'F', 'B', 'V', 'H', 0 };
+    // bump whenever the layout of the header or of any node type changes
+    static const UINT BVH_FILE_VERSION = 1;
+    static const size_t BVH_FILE_ALIGNMENT = 64;
+
+    enum BVHFileSection
+    {
+        SECTION_NODES,
+        SECTION_PRIM_INDICES,
+        SECTION_NODES2,
+        SECTION_NODES4,
+        SECTION_NODES8,
+        SECTION_QUANTIZED_NODES2,
+        SECTION_QUANTIZED_NODES4,
+        SECTION_QUANTIZED_NODES8,
+        SECTION_WIDE_SOURCES,
+        SECTION_TRIANGLE_BLOCKS,
+        SECTION_COUNT,
+    };
+
+    struct BVHFileArray
+    {
+        uint64_t offset = 0;    // bytes from the start of the header
+        uint64_t count = 0;
+        UINT element_size = 0;
+        UINT reserved = 0;
+    };
+
+    struct BVHFileHeader
+    {
+        char magic[8];
+        UINT version = 0;
+        UINT header_size = 0;
+        uint64_t vertex_count = 0;
+        uint64_t index_count = 0;
+        BVHBuildSettings settings;
+        AABB bounds;
+        float build_cost = 0.0f;
+        float cost = 0.0f;
+        BVHFileArray arrays[SECTION_COUNT];
+    };
+
+    template<class T>
+    static void WriteArray(const std::vector<T>& src, BVHFileArray* array, std::vector<uint8_t>* data)
+    {
+        size_t offset = (data->size() + BVH_FILE_ALIGNMENT - 1) & ~(BVH_FILE_ALIGNMENT - 1);
+        array->offset = offset;
+        array->count = src.size();
+        array->element_size = (UINT) sizeof(T);
+        data->resize(offset + sizeof(T) * src.size());
+        if (!src.empty())
+        {
+            memcpy(&(*data)[offset], &src[0], sizeof(T) * src.size());
+        }
+    }
+
+    template<class T>
+    static bool ReadArray(const uint8_t* data, size_t size, const BVHFileArray& array, std::vector<T>* dst)
+    {
+        if (array.element_size != sizeof(T) || array.offset > size || array.count > (size - array.offset) / sizeof(T))
+        {
+            return false;
+        }
+        dst->resize((size_t) array.count);
+        if (array.count > 0)
+        {
+            memcpy(&(*dst)[0], data + array.offset, sizeof(T) * (size_t) array.count);
+        }
+        return true;
+    }
+
+    void BVH::Serialize(std::vector<uint8_t>* data) const
+    {
+        assert(m_mesh != nullptr);
+
+        BVHFileHeader header;
+        memcpy(header.magic, BVH_FILE_MAGIC, sizeof(header.magic));
+        header.version = BVH_FILE_VERSION;
+        header.header_size = (UINT) sizeof(BVHFileHeader);
+        header.vertex_count = m_mesh->vertices.size();
+        header.index_count = m_mesh->indices.size();
+        header.settings = m_settings;
+        header.bounds = m_bounds;
+        header.build_cost = m_build_cost;
+        header.cost = m_cost;
+
+        data->assign(sizeof(BVHFileHeader), 0);
+        WriteArray(m_nodes, &header.arrays[SECTION_NODES], data);
+        WriteArray(m_prim_indices, &header.arrays[SECTION_PRIM_INDICES], data);
+        WriteArray(m_nodes2, &header.arrays[SECTION_NODES2], data);
+        WriteArray(m_nodes4, &header.arrays[SECTION_NODES4], data);
+        WriteArray(m_nodes8, &header.arrays[SECTION_NODES8], data);
+        WriteArray(m_quantized_nodes2, &header.arrays[SECTION_QUANTIZED_NODES2], data);
+        WriteArray(m_quantized_nodes4, &header.arrays[SECTION_QUANTIZED_NODES4], data);
+        WriteArray(m_quantized_nodes8, &header.arrays[SECTION_QUANTIZED_NODES8], data);
+        WriteArray(m_wide_sources, &header.arrays[SECTION_WIDE_SOURCES], data);
+        WriteArray(m_triangle_blocks, &header.arrays[SECTION_TRIANGLE_BLOCKS], data);
+        memcpy(&(*data)[0], &header, sizeof(BVHFileHeader));
+    }
+
+    // Leaves of mesh BVHs cover count triangles in the blocks from first, each lane below count holds a mesh triangle.
+    static bool IsValidLeaf(size_t first, UINT count, const std::vector<BVHTriangleBlock>& blocks, UINT triangle_count)
+    {
+        size_t block_count = (count + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+        if (first > blocks.size() || block_count > blocks.size() - first)
+        {
+            return false;
+        }
+        for (UINT j = 0; j < count; ++j)
+        {
+            if (blocks[first + j / TRIANGLE_BLOCK_SIZE].prim[j % TRIANGLE_BLOCK_SIZE] >= triangle_count)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Every builder places inner children after their node, which also rules out cycles. Empty slots keep the
+    // inverted bounds that reject every ray, the traversal reaches no other slot unchecked.
+    template<int N>
+    static bool IsValidWideNodes(const std::vector<BVHWideNode<N>>& nodes, const std::vector<BVHTriangleBlock>& blocks, UINT triangle_count)
+    {
+        for (size_t k = 0; k < nodes.size(); ++k)
+        {
+            const BVHWideNode<N>& node = nodes[k];
+            for (int i = 0; i < N; ++i)
+            {
+                int child = node.child[i];
+                int count = node.count[i];
+                bool valid = false;
+                if (count > 0)
+                {
+                    valid = child >= 0 && IsValidLeaf((size_t) child, (UINT) count, blocks, triangle_count);
+                }
+                else if (count == 0 && child == -1)
+                {
+                    valid = node.bounds[0][0][i] > node.bounds[1][0][i];
+                }
+                else if (count == 0)
+                {
+                    valid = child > 0 && (size_t) child > k && (size_t) child < nodes.size();
+                }
+                if (!valid)
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    template<int N>
+    static bool IsValidQuantizedNodes(const std::vector<BVHQuantizedNode<N>>& nodes, const std::vector<BVHTriangleBlock>& blocks, UINT triangle_count)
+    {
+        for (size_t k = 0; k < nodes.size(); ++k)
+        {
+            const BVHQuantizedNode<N>& node = nodes[k];
+            if ((node.slot_mask >> N) != 0)
+            {
+                return false;
+            }
+            for (int i = 0; i < N; ++i)
+            {
+                if ((node.slot_mask & (1 << i)) == 0)
+                {
+                    continue;
+                }
+                bool valid;
+                if (node.count[i] > 0)
+                {
+                    valid = IsValidLeaf((size_t) node.leaf_base + node.child[i], node.count[i], blocks, triangle_count);
+                }
+                else
+                {
+                    size_t child = (size_t) node.inner_base + node.child[i];
+                    valid = child > k && child < nodes.size();
+                }
+                if (!valid)
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    std::unique_ptr<BVH> BVH::Deserialize(const Mesh* mesh, const uint8_t* data, size_t size)
+    {
+        BVHFileHeader header;
+        if (size < sizeof(BVHFileHeader))
+        {
+            return nullptr;
+        }
+        memcpy(&header, data, sizeof(BVHFileHeader));
+        if (memcmp(header.magic, BVH_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != BVH_FILE_VERSION ||
+            header.header_size != sizeof(BVHFileHeader) ||
+            header.vertex_count != mesh->vertices.size() || header.index_count != mesh->indices.size())
+        {
+            return nullptr;
+        }
+
+        std::unique_ptr<BVH> bvh(new BVH());
+        bvh->m_settings = header.settings;
+        bvh->m_mesh = mesh;
+        bvh->m_positions = &mesh->vertices;
+        bvh->m_bounds = header.bounds;
+        bvh->m_build_cost = header.build_cost;
+        bvh->m_cost = header.cost;
+        const BVHFileArray* arrays = header.arrays;
+        if (!ReadArray(data, size, arrays[SECTION_NODES], &bvh->m_nodes) ||
+            !ReadArray(data, size, arrays[SECTION_PRIM_INDICES], &bvh->m_prim_indices) ||
+            !ReadArray(data, size, arrays[SECTION_NODES2], &bvh->m_nodes2) ||
+            !ReadArray(data, size, arrays[SECTION_NODES4], &bvh->m_nodes4) ||
+            !ReadArray(data, size, arrays[SECTION_NODES8], &bvh->m_nodes8) ||
+            !ReadArray(data, size, arrays[SECTION_QUANTIZED_NODES2], &bvh->m_quantized_nodes2) ||
+            !ReadArray(data, size, arrays[SECTION_QUANTIZED_NODES4], &bvh->m_quantized_nodes4) ||
+            !ReadArray(data, size, arrays[SECTION_QUANTIZED_NODES8], &bvh->m_quantized_nodes8) ||
+            !ReadArray(data, size, arrays[SECTION_WIDE_SOURCES], &bvh->m_wide_sources) ||
+            !ReadArray(data, size, arrays[SECTION_TRIANGLE_BLOCKS], &bvh->m_triangle_blocks))
+        {
+            return nullptr;
+        }
+
+        // traversals, refits and attribute lookups index the arrays and the mesh through these, check them once
+        // instead of per query, a file that does not hold together is a cache miss
+        UINT node_count = (UINT) bvh->m_nodes.size();
+        UINT prim_count = (UINT) bvh->m_prim_indices.size();
+        UINT triangle_count = (UINT) (mesh->indices.size() / 3);
+        int width = bvh->m_settings.width;
+        if (node_count == 0 || (width != 2 && width != 4 && width != 8))
+        {
+            return nullptr;
+        }
+        for (const BVHNode& node : bvh->m_nodes)
+        {
+            bool valid = node.IsLeaf() ? node.left_first <= prim_count && node.count <= prim_count - node.left_first : node.left_first < node_count - 1;
+            if (!valid)
+            {
+                return nullptr;
+            }
+        }
+        // refits recurse from the root, which must reach every node once, the linear builder does not order them
+        std::vector<uint8_t> reached(node_count, 0);
+        std::vector<UINT> stack(1, 0);
+        while (!stack.empty())
+        {
+            UINT index = stack.back();
+            stack.pop_back();
+            if (reached[index])
+            {
+                return nullptr;
+            }
+            reached[index] = 1;
+            const BVHNode& node = bvh->m_nodes[index];
+            if (!node.IsLeaf())
+            {
+                stack.push_back(node.left_first);
+                stack.push_back(node.left_first + 1);
+            }
+        }
+        for (UINT prim : bvh->m_prim_indices)
+        {
+            if (prim >= triangle_count)
+            {
+                return nullptr;
+            }
+        }
+        for (UINT source : bvh->m_wide_sources)
+        {
+            if (source != UINT_MAX && source >= node_count)
+            {
+                return nullptr;
+            }
+        }
+
+        // only the node array of the width and layout the settings select may be filled, traversals start at its root
+        size_t wide_count = 0;
+        bool valid_wide_nodes = false;
+        const std::vector<BVHTriangleBlock>& blocks = bvh->m_triangle_blocks;
+        if (bvh->m_settings.compress)
+        {
+            wide_count = width == 8 ? bvh->m_quantized_nodes8.size() : (width == 4 ? bvh->m_quantized_nodes4.size() : bvh->m_quantized_nodes2.size());
+            valid_wide_nodes = width == 8 ? IsValidQuantizedNodes<8>(bvh->m_quantized_nodes8, blocks, triangle_count) :
+                (width == 4 ? IsValidQuantizedNodes<4>(bvh->m_quantized_nodes4, blocks, triangle_count) :
+                IsValidQuantizedNodes<2>(bvh->m_quantized_nodes2, blocks, triangle_count));
+        }
+        else
+        {
+            wide_count = width == 8 ? bvh->m_nodes8.size() : (width == 4 ? bvh->m_nodes4.size() : bvh->m_nodes2.size());
+            valid_wide_nodes = width == 8 ? IsValidWideNodes<8>(bvh->m_nodes8, blocks, triangle_count) :
+                (width == 4 ? IsValidWideNodes<4>(bvh->m_nodes4, blocks, triangle_count) : IsValidWideNodes<2>(bvh->m_nodes2, blocks, triangle_count));
+        }
+        if (!valid_wide_nodes || wide_count != bvh->GetWideNodeCount() || (prim_count > 0) != (wide_count > 0) ||
+            bvh->m_wide_sources.size() != wide_count * width)
+        {
+            return nullptr;
+        }
+        // refits gather every filled lane from the mesh
+        for (const BVHTriangleBlock& block : blocks)
+        {
+            for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; ++lane)
+            {
+                if (block.prim[lane] != UINT_MAX && block.prim[lane] >= triangle_count)
+                {
+                    return nullptr;
+                }
+            }
+        }
+
+        return bvh;
+    }
+}
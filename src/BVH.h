@@ -0,0 +1,917 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include "Scene.h"
+#include <immintrin.h>
+#include <float.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace dxrf
+{
+    inline float GetAxis(const XMFLOAT3& v, int axis)
+    {
+        return (&v.x)[axis];
+    }
+
+    struct AABB
+    {
+        XMFLOAT3 min = { FLT_MAX, FLT_MAX, FLT_MAX };
+        XMFLOAT3 max = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+        bool IsValid() const { return min.x <= max.x && min.y <= max.y && min.z <= max.z; }
+
+        void Grow(const XMFLOAT3& p)
+        {
+            min = { (std::min)(min.x, p.x), (std::min)(min.y, p.y), (std::min)(min.z, p.z) };
+            max = { (std::max)(max.x, p.x), (std::max)(max.y, p.y), (std::max)(max.z, p.z) };
+        }
+
+        void Grow(const AABB& b)
+        {
+            min = { (std::min)(min.x, b.min.x), (std::min)(min.y, b.min.y), (std::min)(min.z, b.min.z) };
+            max = { (std::max)(max.x, b.max.x), (std::max)(max.y, b.max.y), (std::max)(max.z, b.max.z) };
+        }
+
+        XMFLOAT3 Center() const
+        {
+            return { (min.x + max.x) * 0.5f, (min.y + max.y) * 0.5f, (min.z + max.z) * 0.5f };
+        }
+
+        float SurfaceArea() const
+        {
+            if (!this->IsValid())
+            {
+                return 0.0f;
+            }
+            float x = max.x - min.x;
+            float y = max.y - min.y;
+            float z = max.z - min.z;
+            return 2.0f * (x * y + y * z + z * x);
+        }
+    };
+
+    // CPU counterpart of the HLSL RayDesc.
+    struct Ray
+    {
+        XMFLOAT3 origin = { 0, 0, 0 };
+        float t_min = 0.0f;
+        XMFLOAT3 direction = { 0, 0, 1 };
+        float t_max = FLT_MAX;
+    };
+
+    struct RayHit
+    {
+        float t = FLT_MAX;
+        XMFLOAT2 barycentrics = { 0, 0 };
+        UINT primitive_index = UINT_MAX;
+        UINT instance_id = UINT_MAX;
+    };
+
+    enum class BVHBuildType
+    {
+        SAH,        // binned SAH, best trees for static geometry
+        Linear,     // Morton code LBVH, for per frame rebuilds of deforming meshes and moving instances
+        Spatial,    // SBVH with spatial splits, for static meshes baked offline, bounds only builds fall back to SAH
+    };
+
+    struct BVHBuildSettings
+    {
+        BVHBuildType type = BVHBuildType::SAH;
+        int width = 4;          // children per traversal node: 2, 4 or 8
+        int max_leaf_size = 4;
+        int bin_count = 16;
+        float traversal_cost = 1.0f;
+        float intersection_cost = 1.0f;
+        bool parallel = true;   // build on the shared thread pool, the tree is the same for any thread count
+        int morton_bits = 30;   // Linear: 30 or 63 bit Morton codes
+        bool treelet_optimize = false; // Linear: restructure treelets of 7 leaves to lower the SAH cost
+        float refit_threshold = 1.5f; // Refit: rebuild once the SAH cost grew past this ratio of the last build
+        float spatial_split_budget = 0.3f; // Spatial: extra triangle references allowed, as a fraction of the triangle count
+        float spatial_split_alpha = 1e-5f; // Spatial: child overlap relative to the root area above which spatial splits are tried
+        // Traverse BVHQuantizedNode instead of BVHWideNode, about a third of the node memory for a few more
+        // instructions per node and slightly looser boxes. Leaves are limited to 255 / width primitives, a tree whose
+        // leaves still do not fit a byte stays uncompressed and GetSettings reports compress as false.
+        bool compress = false;
+    };
+
+    class BVHLinearBuilder;
+    class BVHSpatialBuilder;
+
+    // Binary build node. Inner nodes store the left child index in left_first, the right child is left_first + 1.
+    // Linear builds may leave unreachable nodes in the array, walk the tree from the root.
+    // Spatial builds may reference a triangle from several leaves.
+    struct BVHNode
+    {
+        AABB bounds;
+        UINT left_first = 0;
+        UINT count = 0;
+
+        bool IsLeaf() const { return count > 0; }
+    };
+
+    // N-wide traversal node with SoA child bounds, indexed as bounds[min / max][axis][child].
+    // Inner children store a wide node index in child, leaves store the first primitive and a non zero count.
+    // Leaves of mesh BVHs store the first BVHTriangleBlock instead, count stays the triangle count.
+    // Empty slots have inverted bounds so the slab test always rejects them.
+    template<int N>
+    struct BVHWideNode
+    {
+        float bounds[2][3][N];
+        int child[N];
+        int count[N];
+    };
+
+    typedef BVHWideNode<2> BVHNode2;
+    typedef BVHWideNode<4> BVHNode4;
+    typedef BVHWideNode<8> BVHNode8;
+
+    // Compressed N-wide node (Ylitie et al. 2017). Child bounds are 8 bit steps of 2^exponent from origin, the
+    // union of the children, rounded outward so the decoded boxes contain the exact ones. The inner children of a
+    // node are consecutive from inner_base and its leaves consecutive from leaf_base, child is the offset of the
+    // slot from its base and count is zero for inner children. slot_mask has a bit per used slot.
+    template<int N>
+    struct BVHQuantizedNode
+    {
+        float origin[3];
+        int8_t exponent[3];
+        uint8_t slot_mask;
+        UINT inner_base;
+        UINT leaf_base;
+        uint8_t bounds[2][3][N];
+        uint8_t child[N];
+        uint8_t count[N];
+    };
+
+    typedef BVHQuantizedNode<2> BVHQuantizedNode2;
+    typedef BVHQuantizedNode<4> BVHQuantizedNode4;
+    typedef BVHQuantizedNode<8> BVHQuantizedNode8;
+
+    static const int QUANTIZED_MIN_EXPONENT = -126;
+    static const int QUANTIZED_MAX_EXPONENT = 127;
+    static const int QUANTIZED_MAX = 255;
+
+    // 2^exponent from the float bits, the product with a quantized bound is exact.
+    inline float GetQuantizedScale(int exponent)
+    {
+        UINT bits = (UINT) (exponent + 127) << 23;
+        float scale;
+        memcpy(&scale, &bits, sizeof(scale));
+        return scale;
+    }
+
+    // The builder and the traversal decode the same way, so the outward rounding holds for the decoded values.
+    inline float DecodeQuantizedBound(float origin, float scale, uint8_t q)
+    {
+        return origin + (float) q * scale;
+    }
+
+    template<int N>
+    inline int GetChild(const BVHWideNode<N>& node, int i)
+    {
+        return node.child[i];
+    }
+
+    template<int N>
+    inline int GetChildCount(const BVHWideNode<N>& node, int i)
+    {
+        return node.count[i];
+    }
+
+    template<int N>
+    inline int GetChild(const BVHQuantizedNode<N>& node, int i)
+    {
+        return (int) ((node.count[i] > 0 ? node.leaf_base : node.inner_base) + node.child[i]);
+    }
+
+    template<int N>
+    inline int GetChildCount(const BVHQuantizedNode<N>& node, int i)
+    {
+        return node.count[i];
+    }
+
+    static const int TRIANGLE_BLOCK_SIZE = 4;
+
+    // Up to four triangles of one leaf with their vertices gathered into SoA lanes, indexed as
+    // vertices[vertex][axis][lane], so the leaf test reads no index buffer. The watertight test works on
+    // vertices relative to the ray origin, which edge vectors or Woop transforms could not give back exactly.
+    // prim keeps the mesh triangle for attribute interpolation after the hit, UINT_MAX for empty lanes.
+    struct BVHTriangleBlock
+    {
+        float vertices[3][3][TRIANGLE_BLOCK_SIZE];
+        UINT prim[TRIANGLE_BLOCK_SIZE];
+    };
+
+    // Slab distances carry up to three roundings, growing the far distance by more than 2 * gamma(3) keeps rays
+    // through box faces and edges inside the box (Ize 2013), which the watertight triangle test relies on.
+    static const float SLAB_FAR_SCALE = 1.0f + 4.0f * FLT_EPSILON;
+
+    // Ray with the reciprocal direction precomputed for slab tests.
+    struct TraversalRay
+    {
+        float inv_dir[3];
+        float origin[3];
+        int near_plane[3];
+        float t_min;
+
+        TraversalRay() = default;
+        explicit TraversalRay(const Ray& ray)
+        {
+            const float* org = &ray.origin.x;
+            const float* dir = &ray.direction.x;
+            for (int i = 0; i < 3; ++i)
+            {
+                // avoid inf * 0 = nan in the slab test for axis aligned rays
+                float d = dir[i];
+                if (fabsf(d) < 1e-9f)
+                {
+                    d = d < 0.0f ? -1e-9f : 1e-9f;
+                }
+                inv_dir[i] = 1.0f / d;
+                origin[i] = org[i];
+                near_plane[i] = inv_dir[i] < 0.0f ? 1 : 0;
+            }
+            t_min = ray.t_min;
+        }
+    };
+
+    // Per ray setup of the watertight test: the axis of the largest direction component becomes z and
+    // the shear maps the direction onto it.
+    struct WatertightRay
+    {
+        int kx;
+        int ky;
+        int kz;
+        float shear_x;
+        float shear_y;
+        float shear_z;
+        float origin[3];
+        float t_min;
+
+        WatertightRay() = default;
+        explicit WatertightRay(const Ray& ray)
+        {
+            const float* dir = &ray.direction.x;
+            kz = fabsf(dir[0]) > fabsf(dir[1]) ? (fabsf(dir[0]) > fabsf(dir[2]) ? 0 : 2) : (fabsf(dir[1]) > fabsf(dir[2]) ? 1 : 2);
+            kx = (kz + 1) % 3;
+            ky = (kx + 1) % 3;
+            // keep the winding, so the sign of the edge functions does not depend on the direction
+            if (dir[kz] < 0.0f)
+            {
+                std::swap(kx, ky);
+            }
+            shear_x = dir[kx] / dir[kz];
+            shear_y = dir[ky] / dir[kz];
+            shear_z = 1.0f / dir[kz];
+            origin[0] = ray.origin.x;
+            origin[1] = ray.origin.y;
+            origin[2] = ray.origin.z;
+            t_min = ray.t_min;
+        }
+    };
+
+    // Single triangle version of the block test in BVH.cpp, same operations in the same order, so it agrees with
+    // the traversal bit for bit. Writes t and the DXR barycentrics when the ray hits in [t_min, t_max).
+    inline bool IntersectTriangle(const WatertightRay& ray, const XMFLOAT3& p0, const XMFLOAT3& p1, const XMFLOAT3& p2, float t_max,
+        float* t, float* u, float* v)
+    {
+        const float* vertices[3] = { &p0.x, &p1.x, &p2.x };
+        float x[3];
+        float y[3];
+        float z[3];
+        for (int j = 0; j < 3; ++j)
+        {
+            float px = vertices[j][ray.kx] - ray.origin[ray.kx];
+            float py = vertices[j][ray.ky] - ray.origin[ray.ky];
+            float pz = vertices[j][ray.kz] - ray.origin[ray.kz];
+            x[j] = px - ray.shear_x * pz;
+            y[j] = py - ray.shear_y * pz;
+            z[j] = ray.shear_z * pz;
+        }
+
+        float e0 = x[2] * y[1] - y[2] * x[1];
+        float e1 = x[0] * y[2] - y[0] * x[2];
+        float e2 = x[1] * y[0] - y[1] * x[0];
+        bool any_negative = e0 < 0.0f || e1 < 0.0f || e2 < 0.0f;
+        bool any_positive = e0 > 0.0f || e1 > 0.0f || e2 > 0.0f;
+        float det = (e0 + e1) + e2;
+        if ((any_negative && any_positive) || det == 0.0f)
+        {
+            return false;
+        }
+
+        float inv_det = 1.0f / det;
+        float hit_t = ((e0 * z[0] + e1 * z[1]) + e2 * z[2]) * inv_det;
+        if (!(hit_t >= ray.t_min && hit_t < t_max))
+        {
+            return false;
+        }
+        *t = hit_t;
+        *u = e1 * inv_det;
+        *v = e2 * inv_det;
+        return true;
+    }
+
+    // Slab test of all children of a wide node, returns the hit mask and writes the entry distances.
+    template<int N>
+    inline UINT IntersectChildren(const BVHWideNode<N>& node, const TraversalRay& ray, float t_max, float dist[N])
+    {
+        UINT mask = 0;
+        for (int i = 0; i < N; ++i)
+        {
+            float t_near = ray.t_min;
+            float t_far = t_max;
+            for (int a = 0; a < 3; ++a)
+            {
+                t_near = (std::max)(t_near, (node.bounds[ray.near_plane[a]][a][i] - ray.origin[a]) * ray.inv_dir[a]);
+                t_far = (std::min)(t_far, (node.bounds[1 - ray.near_plane[a]][a][i] - ray.origin[a]) * ray.inv_dir[a] * SLAB_FAR_SCALE);
+            }
+            dist[i] = t_near;
+            if (t_near <= t_far)
+            {
+                mask |= 1 << i;
+            }
+        }
+        return mask;
+    }
+
+    template<>
+    inline UINT IntersectChildren<4>(const BVHNode4& node, const TraversalRay& ray, float t_max, float dist[4])
+    {
+        __m128 t_near = _mm_set1_ps(ray.t_min);
+        __m128 t_far = _mm_set1_ps(t_max);
+        __m128 far_scale = _mm_set1_ps(SLAB_FAR_SCALE);
+        for (int a = 0; a < 3; ++a)
+        {
+            __m128 inv_dir = _mm_set1_ps(ray.inv_dir[a]);
+            __m128 origin = _mm_set1_ps(ray.origin[a]);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[ray.near_plane[a]][a]), origin), inv_dir);
+            __m128 t1 = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[1 - ray.near_plane[a]][a]), origin), inv_dir), far_scale);
+            t_near = _mm_max_ps(t_near, t0);
+            t_far = _mm_min_ps(t_far, t1);
+        }
+        _mm_storeu_ps(dist, t_near);
+        return (UINT) _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+    }
+
+#if defined(__AVX__)
+    template<>
+    inline UINT IntersectChildren<8>(const BVHNode8& node, const TraversalRay& ray, float t_max, float dist[8])
+    {
+        __m256 t_near = _mm256_set1_ps(ray.t_min);
+        __m256 t_far = _mm256_set1_ps(t_max);
+        __m256 far_scale = _mm256_set1_ps(SLAB_FAR_SCALE);
+        for (int a = 0; a < 3; ++a)
+        {
+            __m256 inv_dir = _mm256_set1_ps(ray.inv_dir[a]);
+            __m256 origin = _mm256_set1_ps(ray.origin[a]);
+            __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[ray.near_plane[a]][a]), origin), inv_dir);
+            __m256 t1 = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[1 - ray.near_plane[a]][a]), origin), inv_dir), far_scale);
+            t_near = _mm256_max_ps(t_near, t0);
+            t_far = _mm256_min_ps(t_far, t1);
+        }
+        _mm256_storeu_ps(dist, t_near);
+        return (UINT) _mm256_movemask_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ));
+    }
+#endif
+
+    // Same slab test on the decoded bounds of a compressed node.
+    template<int N>
+    inline UINT IntersectChildren(const BVHQuantizedNode<N>& node, const TraversalRay& ray, float t_max, float dist[N])
+    {
+        UINT mask = 0;
+        for (int i = 0; i < N; ++i)
+        {
+            float t_near = ray.t_min;
+            float t_far = t_max;
+            for (int a = 0; a < 3; ++a)
+            {
+                float scale = GetQuantizedScale(node.exponent[a]);
+                float near_bound = DecodeQuantizedBound(node.origin[a], scale, node.bounds[ray.near_plane[a]][a][i]);
+                float far_bound = DecodeQuantizedBound(node.origin[a], scale, node.bounds[1 - ray.near_plane[a]][a][i]);
+                t_near = (std::max)(t_near, (near_bound - ray.origin[a]) * ray.inv_dir[a]);
+                t_far = (std::min)(t_far, (far_bound - ray.origin[a]) * ray.inv_dir[a] * SLAB_FAR_SCALE);
+            }
+            dist[i] = t_near;
+            if (t_near <= t_far)
+            {
+                mask |= 1 << i;
+            }
+        }
+        return mask & node.slot_mask;
+    }
+
+    template<>
+    inline UINT IntersectChildren<4>(const BVHQuantizedNode4& node, const TraversalRay& ray, float t_max, float dist[4])
+    {
+        __m128 t_near = _mm_set1_ps(ray.t_min);
+        __m128 t_far = _mm_set1_ps(t_max);
+        __m128 far_scale = _mm_set1_ps(SLAB_FAR_SCALE);
+        __m128i zero = _mm_setzero_si128();
+        for (int a = 0; a < 3; ++a)
+        {
+            __m128 inv_dir = _mm_set1_ps(ray.inv_dir[a]);
+            __m128 origin = _mm_set1_ps(ray.origin[a]);
+            __m128 node_origin = _mm_set1_ps(node.origin[a]);
+            __m128 scale = _mm_set1_ps(GetQuantizedScale(node.exponent[a]));
+            __m128 bounds[2];
+            for (int side = 0; side < 2; ++side)
+            {
+                int bytes;
+                memcpy(&bytes, node.bounds[side][a], sizeof(bytes));
+                __m128i q = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+                bounds[side] = _mm_add_ps(node_origin, _mm_mul_ps(_mm_cvtepi32_ps(q), scale));
+            }
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(bounds[ray.near_plane[a]], origin), inv_dir);
+            __m128 t1 = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(bounds[1 - ray.near_plane[a]], origin), inv_dir), far_scale);
+            t_near = _mm_max_ps(t_near, t0);
+            t_far = _mm_min_ps(t_far, t1);
+        }
+        _mm_storeu_ps(dist, t_near);
+        return (UINT) _mm_movemask_ps(_mm_cmple_ps(t_near, t_far)) & node.slot_mask;
+    }
+
+#if defined(__AVX2__)
+    template<>
+    inline UINT IntersectChildren<8>(const BVHQuantizedNode8& node, const TraversalRay& ray, float t_max, float dist[8])
+    {
+        __m256 t_near = _mm256_set1_ps(ray.t_min);
+        __m256 t_far = _mm256_set1_ps(t_max);
+        __m256 far_scale = _mm256_set1_ps(SLAB_FAR_SCALE);
+        for (int a = 0; a < 3; ++a)
+        {
+            __m256 inv_dir = _mm256_set1_ps(ray.inv_dir[a]);
+            __m256 origin = _mm256_set1_ps(ray.origin[a]);
+            __m256 node_origin = _mm256_set1_ps(node.origin[a]);
+            __m256 scale = _mm256_set1_ps(GetQuantizedScale(node.exponent[a]));
+            __m256 bounds[2];
+            for (int side = 0; side < 2; ++side)
+            {
+                __m256i q = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) node.bounds[side][a]));
+                bounds[side] = _mm256_add_ps(node_origin, _mm256_mul_ps(_mm256_cvtepi32_ps(q), scale));
+            }
+            __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(bounds[ray.near_plane[a]], origin), inv_dir);
+            __m256 t1 = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(bounds[1 - ray.near_plane[a]], origin), inv_dir), far_scale);
+            t_near = _mm256_max_ps(t_near, t0);
+            t_far = _mm256_min_ps(t_far, t1);
+        }
+        _mm256_storeu_ps(dist, t_near);
+        return (UINT) _mm256_movemask_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ)) & node.slot_mask;
+    }
+#endif
+
+    // Moves a traversal stack that cannot take N more entries to the heap with twice the capacity. Each level
+    // leaves up to N - 1 siblings pending, so only trees deeper than about 256 / (N - 1) levels get here, which
+    // SBVH and degenerate SAH input can build.
+    template<class Entry>
+    inline Entry* GrowTraversalStack(const Entry* stack, int stack_size, int* capacity, std::vector<Entry>* heap_stack)
+    {
+        std::vector<Entry> grown((size_t) *capacity * 2);
+        std::copy(stack, stack + stack_size, grown.begin());
+        heap_stack->swap(grown);
+        *capacity *= 2;
+        return heap_stack->data();
+    }
+
+    // Depth first traversal of a wide BVH of BVHWideNode<N> or BVHQuantizedNode<N>, children are visited front to back.
+    // leaf(first, count) is called for every leaf reached and returns true to terminate the traversal,
+    // it may shrink t_max to cull farther nodes. root is the node the traversal starts from.
+    template<int N, class Node, class LeafFunc>
+    inline void TraverseWide(const Node* nodes, const TraversalRay& ray, float& t_max, LeafFunc&& leaf, int root = 0)
+    {
+        struct StackEntry
+        {
+            int child;
+            int count;
+            float dist;
+        };
+        static const int STACK_SIZE = 256;
+        StackEntry local_stack[STACK_SIZE];
+        std::vector<StackEntry> heap_stack;
+        StackEntry* stack = local_stack;
+        int stack_capacity = STACK_SIZE;
+        int stack_size = 0;
+        stack[stack_size++] = { root, 0, ray.t_min };
+
+        while (stack_size > 0)
+        {
+            StackEntry entry = stack[--stack_size];
+            if (entry.dist > t_max)
+            {
+                continue;
+            }
+
+            if (entry.count > 0)
+            {
+                if (leaf(entry.child, entry.count))
+                {
+                    return;
+                }
+                continue;
+            }
+
+            const Node& node = nodes[entry.child];
+            float dist[N];
+            UINT mask = IntersectChildren<N>(node, ray, t_max, dist);
+            if (stack_size + N > stack_capacity)
+            {
+                stack = GrowTraversalStack(stack, stack_size, &stack_capacity, &heap_stack);
+            }
+
+            // insertion sort hit children far to near, so the nearest one is popped first
+            int first = stack_size;
+            for (int i = 0; i < N; ++i)
+            {
+                if ((mask & (1 << i)) == 0)
+                {
+                    continue;
+                }
+                StackEntry child = { GetChild(node, i), GetChildCount(node, i), dist[i] };
+                int j = stack_size++;
+                while (j > first && stack[j - 1].dist < child.dist)
+                {
+                    stack[j] = stack[j - 1];
+                    --j;
+                }
+                stack[j] = child;
+            }
+        }
+    }
+
+    // Batch of rays for breadth first traversal, indexed by their position in the batch. t_max shrinks as closest
+    // hits are found and drops below t_min once an occlusion query found a blocker, which filters the ray out of
+    // every later node. hits[i].primitive_index stays UINT_MAX until ray i hit something. Buffers only grow.
+    struct TraversalStream
+    {
+        int ray_count = 0;
+        std::vector<Ray> rays;
+        std::vector<TraversalRay> traversal_rays;
+        std::vector<WatertightRay> triangle_rays;
+        std::vector<float> t_max;
+        std::vector<RayHit> hits;
+        std::vector<UINT> active;   // ray lists of the nodes on the traversal stack
+
+        void Resize(int count)
+        {
+            ray_count = count;
+            if ((int) rays.size() < count)
+            {
+                rays.resize(count);
+                traversal_rays.resize(count);
+                t_max.resize(count);
+                hits.resize(count);
+            }
+        }
+
+        void SetRay(int index, const Ray& ray)
+        {
+            rays[index] = ray;
+            traversal_rays[index] = TraversalRay(ray);
+            t_max[index] = ray.t_max;
+            hits[index] = RayHit();
+        }
+    };
+
+    // Entries FilterStream may write past the end of a list, every list needs this much room after its rays.
+    static const int STREAM_FILTER_PADDING = 8;
+    // Lists below this size leave the breadth first traversal.
+    static const int STREAM_SPLIT_RAY_COUNT = 16;
+
+    // Splits a ray list over the children of a node with child bounds indexed as bounds[min / max][axis][child]:
+    // lists[i] receives the rays whose segment overlaps child i and counts[i] their number. Slots outside
+    // slot_mask are skipped. Each group of eight rays is gathered once and tested against all children with AVX2.
+    template<int N>
+    void FilterStream(const TraversalStream& stream, const float bounds[2][3][N], UINT slot_mask, const UINT* rays, int ray_count,
+        UINT* lists[N], int counts[N]);
+
+    // Writes the child bounds as FilterStream takes them, returns the used slots.
+    template<int N>
+    inline UINT GetChildBounds(const BVHWideNode<N>& node, float bounds[2][3][N])
+    {
+        memcpy(bounds, node.bounds, sizeof(node.bounds));
+        UINT slot_mask = 0;
+        for (int i = 0; i < N; ++i)
+        {
+            // empty slots are inverted
+            if (bounds[0][0][i] <= bounds[1][0][i])
+            {
+                slot_mask |= 1 << i;
+            }
+        }
+        return slot_mask;
+    }
+
+    template<int N>
+    inline UINT GetChildBounds(const BVHQuantizedNode<N>& node, float bounds[2][3][N])
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            float scale = GetQuantizedScale(node.exponent[a]);
+            for (int i = 0; i < N; ++i)
+            {
+                bounds[0][a][i] = DecodeQuantizedBound(node.origin[a], scale, node.bounds[0][a][i]);
+                bounds[1][a][i] = DecodeQuantizedBound(node.origin[a], scale, node.bounds[1][a][i]);
+            }
+        }
+        return node.slot_mask;
+    }
+
+    // Breadth first traversal of a batch (Wald et al. 2007, Tsakok 2009): every node is visited once with the list
+    // of rays that reached it, each child gets the part of the list that overlaps its box. Child lists are stacked
+    // in stream.active in the order of the node stack, so popping a node frees everything above its list. Nodes
+    // are read once per batch instead of once per ray, which pays off once the tree no longer fits the caches.
+    // Children are pushed far to near along the first ray of the list, the rays of a sorted batch mostly agree.
+    // leaf(first, count, rays, ray_count) is called for every leaf reached, with the indices of the rays that
+    // reached it, and tests them against their current t_max.
+    template<int N, class Node, class LeafFunc>
+    inline void TraverseStreamWide(const Node* nodes, TraversalStream& stream, LeafFunc&& leaf)
+    {
+        struct StackEntry
+        {
+            int child;
+            int count;
+            UINT begin;
+            UINT end;
+        };
+        static const int STACK_SIZE = 256;
+        StackEntry local_stack[STACK_SIZE];
+        std::vector<StackEntry> heap_stack;
+        StackEntry* stack = local_stack;
+        int stack_capacity = STACK_SIZE;
+        int stack_size = 0;
+
+        std::vector<UINT>& active = stream.active;
+        UINT ray_count = (UINT) stream.ray_count;
+        if (active.size() < ray_count + STREAM_FILTER_PADDING)
+        {
+            active.resize(ray_count + STREAM_FILTER_PADDING);
+        }
+        for (UINT i = 0; i < ray_count; ++i)
+        {
+            active[i] = i;
+        }
+        stack[stack_size++] = { 0, 0, 0, ray_count };
+
+        while (stack_size > 0)
+        {
+            StackEntry entry = stack[--stack_size];
+            int list_count = (int) (entry.end - entry.begin);
+            if (entry.count > 0)
+            {
+                leaf(entry.child, entry.count, &active[entry.begin], list_count);
+                continue;
+            }
+
+            // few rays share little, they finish the subtree depth first
+            if (list_count < STREAM_SPLIT_RAY_COUNT)
+            {
+                for (int i = 0; i < list_count; ++i)
+                {
+                    UINT r = active[entry.begin + i];
+                    const TraversalRay& ray = stream.traversal_rays[r];
+                    float& t_max = stream.t_max[r];
+                    TraverseWide<N>(nodes, ray, t_max, [&](int first, int count) {
+                        leaf(first, count, &r, 1);
+                        return t_max < ray.t_min;
+                    }, entry.child);
+                }
+                continue;
+            }
+
+            // every child list starts with room for the whole parent list and is moved down once filtered
+            size_t list_stride = (size_t) list_count + STREAM_FILTER_PADDING;
+            size_t required = entry.end + list_stride * N;
+            if (active.size() < required)
+            {
+                active.resize((std::max)(required, active.size() * 2));
+            }
+
+            const Node& node = nodes[entry.child];
+            UINT first_ray = active[entry.begin];
+            float dist[N];
+            UINT first_mask = IntersectChildren<N>(node, stream.traversal_rays[first_ray], stream.t_max[first_ray], dist);
+            int order[N];
+            for (int i = 0; i < N; ++i)
+            {
+                float d = (first_mask & (1 << i)) != 0 ? dist[i] : FLT_MAX;
+                dist[i] = d;
+                int j = i;
+                while (j > 0 && dist[order[j - 1]] < d)
+                {
+                    order[j] = order[j - 1];
+                    --j;
+                }
+                order[j] = i;
+            }
+
+            float bounds[2][3][N];
+            UINT slot_mask = GetChildBounds(node, bounds);
+            UINT* lists[N];
+            int counts[N];
+            for (int k = 0; k < N; ++k)
+            {
+                lists[order[k]] = &active[entry.end + k * list_stride];
+            }
+            FilterStream<N>(stream, bounds, slot_mask, &active[entry.begin], list_count, lists, counts);
+
+            if (stack_size + N > stack_capacity)
+            {
+                stack = GrowTraversalStack(stack, stack_size, &stack_capacity, &heap_stack);
+            }
+            UINT top = entry.end;
+            for (int k = 0; k < N; ++k)
+            {
+                int i = order[k];
+                if (counts[i] == 0)
+                {
+                    continue;
+                }
+                if (lists[i] != &active[top])
+                {
+                    memmove(&active[top], lists[i], sizeof(UINT) * counts[i]);
+                }
+                stack[stack_size++] = { GetChild(node, i), GetChildCount(node, i), top, top + (UINT) counts[i] };
+                top += counts[i];
+            }
+        }
+    }
+
+    class BVH
+    {
+    public:
+        // Builds a binary BVH of settings.type over the triangles of the mesh and collapses it to settings.width.
+        // The mesh must outlive the BVH.
+        static std::unique_ptr<BVH> BuildFromMesh(const Mesh* mesh, const BVHBuildSettings& settings);
+        // Builds over arbitrary primitive bounds, leaves reference indices into the bounds array.
+        static std::unique_ptr<BVH> BuildFromBounds(const std::vector<AABB>& bounds, const BVHBuildSettings& settings);
+        // Restores a mesh BVH written by Serialize, without building. Returns nullptr when the data is truncated,
+        // of another format version or does not fit the mesh. The mesh must outlive the BVH.
+        static std::unique_ptr<BVH> Deserialize(const Mesh* mesh, const uint8_t* data, size_t size);
+        ~BVH();
+        // Rebuilds from the current mesh vertices, reusing the buffers of the previous build.
+        void Rebuild();
+        // Rebuilds over new primitive bounds, reusing the buffers of the previous build.
+        void Rebuild(const std::vector<AABB>& bounds);
+        // Updates the node bounds for deformed vertices of the same topology, the tree structure is kept.
+        // Falls back to a full rebuild once the refitted tree degraded past settings.refit_threshold and returns true then.
+        // positions replaces the mesh vertices for all later queries and must outlive the BVH.
+        bool Refit(const std::vector<XMFLOAT3>& positions);
+        // Closest hit against the mesh triangles, only hits closer than both ray.t_max and hit->t are reported.
+        bool Intersect(const Ray& ray, RayHit* hit) const;
+        // Any hit against the mesh triangles in [ray.t_min, ray.t_max], traversal stops at the first hit found.
+        bool Occluded(const Ray& ray) const;
+        // Closest hits of all rays of the stream, breadth first. Rays keep hits found by earlier calls unless the
+        // mesh has a closer one.
+        void Intersect(TraversalStream& stream) const;
+        // Any hits of all rays of the stream, breadth first. Occluded rays get a hit and t_max below t_min.
+        void Occluded(TraversalStream& stream) const;
+        template<class LeafFunc>
+        void Traverse(const TraversalRay& ray, float& t_max, LeafFunc&& leaf) const;
+        template<class LeafFunc>
+        void TraverseStream(TraversalStream& stream, LeafFunc&& leaf) const;
+        // Relocatable image of a mesh BVH: a header followed by the node and primitive arrays at 64 byte aligned
+        // offsets from the start, without pointers, so it can be stored as it is and mapped or read back.
+        void Serialize(std::vector<uint8_t>* data) const;
+        const BVHBuildSettings& GetSettings() const { return m_settings; }
+        const Mesh* GetMesh() const { return m_mesh; }
+        const AABB& GetBounds() const { return m_bounds; }
+        const std::vector<BVHNode>& GetNodes() const { return m_nodes; }
+        const std::vector<UINT>& GetPrimitiveIndices() const { return m_prim_indices; }
+        size_t GetWideNodeCount() const;
+        // Bytes of the traversal nodes, BVHWideNode or BVHQuantizedNode as settings.compress selects.
+        size_t GetWideNodeByteSize() const;
+        // SAH cost of the binary tree relative to the root area, as of the last build and the last refit.
+        float GetBuildCost() const { return m_build_cost; }
+        float GetCost() const { return m_cost; }
+
+    private:
+        BVH() = default;
+        void ComputeTriangleBounds();
+        void Build(const std::vector<AABB>& prim_bounds);
+        void Collapse();
+        float ComputeCost(UINT index) const;
+        float RefitNode(UINT index, int depth);
+        void RefitWideNodes();
+        void CreateTriangleBlocks();
+        void Compress();
+        void UpdateTriangleBlocks();
+
+    private:
+        BVHBuildSettings m_settings;
+        const Mesh* m_mesh = nullptr;
+        const std::vector<XMFLOAT3>* m_positions = nullptr;
+        AABB m_bounds;
+        float m_build_cost = 0.0f;
+        float m_cost = 0.0f;
+        std::vector<BVHNode> m_nodes;
+        std::vector<UINT> m_prim_indices;
+        std::vector<BVHNode2> m_nodes2;
+        std::vector<BVHNode4> m_nodes4;
+        std::vector<BVHNode8> m_nodes8;
+        // compressed builds quantize the wide nodes and release them
+        std::vector<BVHQuantizedNode2> m_quantized_nodes2;
+        std::vector<BVHQuantizedNode4> m_quantized_nodes4;
+        std::vector<BVHQuantizedNode8> m_quantized_nodes8;
+        std::vector<UINT> m_wide_sources; // binary node of each wide child slot, for refits
+        std::vector<BVHTriangleBlock> m_triangle_blocks;
+        std::vector<AABB> m_prim_bounds;
+        std::unique_ptr<BVHLinearBuilder> m_linear_builder;
+        std::unique_ptr<BVHSpatialBuilder> m_spatial_builder;
+    };
+
+    template<class LeafFunc>
+    inline void BVH::Traverse(const TraversalRay& ray, float& t_max, LeafFunc&& leaf) const
+    {
+        if (m_prim_indices.empty())
+        {
+            return;
+        }
+
+        if (m_settings.compress)
+        {
+            switch (m_settings.width)
+            {
+                case 8:
+                    TraverseWide<8>(&m_quantized_nodes8[0], ray, t_max, leaf);
+                    break;
+                case 4:
+                    TraverseWide<4>(&m_quantized_nodes4[0], ray, t_max, leaf);
+                    break;
+                default:
+                    TraverseWide<2>(&m_quantized_nodes2[0], ray, t_max, leaf);
+                    break;
+            }
+            return;
+        }
+
+        switch (m_settings.width)
+        {
+            case 8:
+                TraverseWide<8>(&m_nodes8[0], ray, t_max, leaf);
+                break;
+            case 4:
+                TraverseWide<4>(&m_nodes4[0], ray, t_max, leaf);
+                break;
+            default:
+                TraverseWide<2>(&m_nodes2[0], ray, t_max, leaf);
+                break;
+        }
+    }
+
+    template<class LeafFunc>
+    inline void BVH::TraverseStream(TraversalStream& stream, LeafFunc&& leaf) const
+    {
+        if (m_prim_indices.empty() || stream.ray_count == 0)
+        {
+            return;
+        }
+
+        if (m_settings.compress)
+        {
+            switch (m_settings.width)
+            {
+                case 8:
+                    TraverseStreamWide<8>(&m_quantized_nodes8[0], stream, leaf);
+                    break;
+                case 4:
+                    TraverseStreamWide<4>(&m_quantized_nodes4[0], stream, leaf);
+                    break;
+                default:
+                    TraverseStreamWide<2>(&m_quantized_nodes2[0], stream, leaf);
+                    break;
+            }
+            return;
+        }
+
+        switch (m_settings.width)
+        {
+            case 8:
+                TraverseStreamWide<8>(&m_nodes8[0], stream, leaf);
+                break;
+            case 4:
+                TraverseStreamWide<4>(&m_nodes4[0], stream, leaf);
+                break;
+            default:
+                TraverseStreamWide<2>(&m_nodes2[0], stream, leaf);
+                break;
+        }
+    }
+}
@@ -0,0 +1,182 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#include "BVHCache.h"
+#include <fstream>
+
+namespace dxrf
+{
+    static const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
+    static const uint64_t FNV_PRIME = 1099511628211ull;
+
+    // FNV-1a over 8 byte words, the tail byte by byte. Meshes run to many megabytes, hashing words keeps the key
+    // well below the cost of a build.
+    static uint64_t HashBytes(uint64_t hash, const void* data, size_t size)
+    {
+        const uint8_t* bytes = (const uint8_t*) data;
+        size_t word_count = size / sizeof(uint64_t);
+        for (size_t i = 0; i < word_count; ++i)
+        {
+            uint64_t word;
+            memcpy(&word, bytes + i * sizeof(uint64_t), sizeof(word));
+            hash = (hash ^ word) * FNV_PRIME;
+        }
+        for (size_t i = word_count * sizeof(uint64_t); i < size; ++i)
+        {
+            hash = (hash ^ bytes[i]) * FNV_PRIME;
+        }
+        return hash;
+    }
+
+    template<class T>
+    static uint64_t HashValue(uint64_t hash, const T& value)
+    {
+        return HashBytes(hash, &value, sizeof(T));
+    }
+
+    // word steps leave the high bits of the last words poorly mixed
+    static uint64_t FinalizeHash(uint64_t hash)
+    {
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdull;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ull;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+    std::unique_ptr<BVHCache> BVHCache::Create(const std::string& directory)
+    {
+        std::unique_ptr<BVHCache> cache(new BVHCache());
+        cache->m_directory = directory;
+        CreateDirectoryA(directory.c_str(), nullptr);
+
+        return cache;
+    }
+
+    uint64_t BVHCache::GetMeshKey(const Mesh& mesh, uint64_t seed)
+    {
+        uint64_t hash = HashValue(FNV_OFFSET_BASIS, seed);
+        hash = HashValue(hash, (uint64_t) mesh.vertices.size());
+        hash = HashValue(hash, (uint64_t) mesh.indices.size());
+        if (!mesh.vertices.empty())
+        {
+            hash = HashBytes(hash, &mesh.vertices[0], sizeof(XMFLOAT3) * mesh.vertices.size());
+        }
+        if (!mesh.indices.empty())
+        {
+            hash = HashBytes(hash, &mesh.indices[0], sizeof(uint16_t) * mesh.indices.size());
+        }
+        return FinalizeHash(hash);
+    }
+
+    uint64_t BVHCache::GetMeshKey(const Mesh& mesh, const BVHBuildSettings& settings)
+    {
+        // field by field, the padding bytes of the struct are undefined
+        uint64_t seed = FNV_OFFSET_BASIS;
+        seed = HashValue(seed, (int) settings.type);
+        seed = HashValue(seed, settings.width);
+        seed = HashValue(seed, settings.max_leaf_size);
+        seed = HashValue(seed, settings.bin_count);
+        seed = HashValue(seed, settings.traversal_cost);
+        seed = HashValue(seed, settings.intersection_cost);
+        seed = HashValue(seed, settings.morton_bits);
+        seed = HashValue(seed, (int) settings.treelet_optimize);
+        seed = HashValue(seed, settings.refit_threshold);
+        seed = HashValue(seed, settings.spatial_split_budget);
+        seed = HashValue(seed, settings.spatial_split_alpha);
+        seed = HashValue(seed, (int) settings.compress);
+        // the tree is the same for any thread count, but the loaded BVH keeps the flag for its refits
+        seed = HashValue(seed, (int) settings.parallel);
+        return GetMeshKey(mesh, seed);
+    }
+
+    std::unique_ptr<BVH> BVHCache::BuildFromMesh(const Mesh* mesh, const BVHBuildSettings& settings)
+    {
+        uint64_t key = GetMeshKey(*mesh, settings);
+        std::vector<uint8_t> data;
+        if (this->Load(key, &data))
+        {
+            std::unique_ptr<BVH> bvh = BVH::Deserialize(mesh, data.empty() ? nullptr : &data[0], data.size());
+            if (bvh)
+            {
+                return bvh;
+            }
+        }
+
+        // missing, or stale from an older format: build and replace
+        std::unique_ptr<BVH> bvh = BVH::BuildFromMesh(mesh, settings);
+        bvh->Serialize(&data);
+        this->Store(key, &data[0], data.size());
+
+        return bvh;
+    }
+
+    bool BVHCache::Load(uint64_t key, std::vector<uint8_t>* data)
+    {
+        std::ifstream is(this->GetPath(key), std::ios::binary | std::ios::in);
+        if (!is)
+        {
+            ++m_miss_count;
+            return false;
+        }
+
+        is.seekg(0, std::ios::end);
+        std::streamoff size = is.tellg();
+        is.seekg(0, std::ios::beg);
+        data->resize((size_t) (std::max)(size, (std::streamoff) 0));
+        if (size > 0)
+        {
+            is.read((char*) &(*data)[0], size);
+        }
+        if (!is)
+        {
+            ++m_miss_count;
+            return false;
+        }
+
+        ++m_hit_count;
+        return true;
+    }
+
+    void BVHCache::Store(uint64_t key, const void* data, size_t size)
+    {
+        std::string path = this->GetPath(key);
+        // unique per process and call, concurrent stores of the same key each rename a complete file
+        char suffix[64];
+        sprintf(suffix, ".%lu.%u.tmp", (unsigned long) GetCurrentProcessId(), (UINT) m_temp_index++);
+        std::string temp_path = path + suffix;
+
+        std::ofstream os(temp_path, std::ios::binary | std::ios::out | std::ios::trunc);
+        if (!os)
+        {
+            return;
+        }
+        os.write((const char*) data, size);
+        os.close();
+        if (!os || !MoveFileExA(temp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+        {
+            DeleteFileA(temp_path.c_str());
+        }
+    }
+
+    std::string BVHCache::GetPath(uint64_t key) const
+    {
+        char name[32];
+        sprintf(name, "/%016llx.bvh", (unsigned long long) key);
+        return m_directory + name;
+    }
+}
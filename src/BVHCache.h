@@ -0,0 +1,55 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include "BVH.h"
+#include <atomic>
+#include <string>
+
+namespace dxrf
+{
+    // Directory of built acceleration structures, one file per key. Keys hash everything a build depends on, so
+    // an entry never needs invalidation: changed meshes or settings simply miss and store a new file. Files are
+    // written to a temporary name and renamed, readers never see a partial entry.
+    class BVHCache
+    {
+    public:
+        // The directory is created when it does not exist.
+        static std::unique_ptr<BVHCache> Create(const std::string& directory);
+        // Hash of the mesh positions and indices and of every build setting.
+        static uint64_t GetMeshKey(const Mesh& mesh, const BVHBuildSettings& settings);
+        // Hash of the positions and indices combined with a caller defined seed, for structures of other builders.
+        static uint64_t GetMeshKey(const Mesh& mesh, uint64_t seed);
+        // Loads the BVH of the mesh from the cache, or builds and stores it. Safe to call from several threads.
+        std::unique_ptr<BVH> BuildFromMesh(const Mesh* mesh, const BVHBuildSettings& settings);
+        // Raw entries, Load returns false when the key has no file.
+        bool Load(uint64_t key, std::vector<uint8_t>* data);
+        void Store(uint64_t key, const void* data, size_t size);
+        int GetHitCount() const { return m_hit_count; }
+        int GetMissCount() const { return m_miss_count; }
+
+    private:
+        BVHCache() = default;
+        std::string GetPath(uint64_t key) const;
+
+    private:
+        std::string m_directory;
+        std::atomic<int> m_hit_count{ 0 };
+        std::atomic<int> m_miss_count{ 0 };
+        std::atomic<UINT> m_temp_index{ 0 };
+    };
+}
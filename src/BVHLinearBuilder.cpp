@@ -0,0 +1,493 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#include "BVHLinearBuilder.h"
+#include "ThreadPool.h"
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace dxrf
+{
+    static const int LINEAR_GRAIN = 65536;
+    static const int EMIT_GRAIN = 4096;
+    static const UINT LINEAR_TASK_THRESHOLD = 4096;
+    static const int RADIX_BITS = 8;
+    static const int RADIX_SIZE = 1 << RADIX_BITS;
+    static const int TREELET_SIZE = 7;
+
+    static int CountLeadingZeros(uint64_t x)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        return _BitScanReverse64(&index, x) ? 63 - (int) index : 64;
+#else
+        return x ? __builtin_clzll(x) : 64;
+#endif
+    }
+
+    // spreads the low 10 bits of x to every third bit
+    static uint64_t ExpandBits10(uint64_t x)
+    {
+        x &= 0x3ff;
+        x = (x | x << 16) & 0x30000ff;
+        x = (x | x << 8) & 0x300f00f;
+        x = (x | x << 4) & 0x30c30c3;
+        x = (x | x << 2) & 0x9249249;
+        return x;
+    }
+
+    // spreads the low 21 bits of x to every third bit
+    static uint64_t ExpandBits21(uint64_t x)
+    {
+        x &= 0x1fffff;
+        x = (x | x << 32) & 0x1f00000000ffffull;
+        x = (x | x << 16) & 0x1f0000ff0000ffull;
+        x = (x | x << 8) & 0x100f00f00f00f00full;
+        x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+        x = (x | x << 2) & 0x1249249249249249ull;
+        return x;
+    }
+
+    static void ForEachChunk(ThreadPool* pool, int count, int grain, const std::function<void(int, int)>& func)
+    {
+        if (pool)
+        {
+            pool->ParallelFor(0, count, grain, func);
+        }
+        else if (count > 0)
+        {
+            func(0, count);
+        }
+    }
+
+    void BVHLinearBuilder::Build(const BVHBuildSettings& settings, const std::vector<AABB>& prim_bounds, std::vector<BVHNode>& nodes, std::vector<UINT>& prim_indices)
+    {
+        m_settings = &settings;
+        m_prim_bounds = &prim_bounds;
+        m_nodes = &nodes;
+        m_prim_indices = &prim_indices;
+        m_pool = settings.parallel ? ThreadPool::GetInstance() : nullptr;
+        m_prim_count = (int) prim_bounds.size();
+
+        nodes.resize(m_prim_count * 2 - 1);
+        prim_indices.resize(m_prim_count);
+        m_keys.resize(m_prim_count);
+        m_costs.resize(m_prim_count * 2 - 1);
+
+        this->ComputeMortonCodes();
+        this->SortMortonCodes();
+
+        if (m_prim_count == 1)
+        {
+            nodes[0].left_first = 0;
+            nodes[0].count = 1;
+        }
+        else
+        {
+            ForEachChunk(m_pool, m_prim_count - 1, EMIT_GRAIN, [this](int begin, int end) {
+                this->EmitNodes(begin, end);
+            });
+        }
+
+        this->FinalizeNode(0, 0, (UINT) m_prim_count);
+    }
+
+    void BVHLinearBuilder::ComputeMortonCodes()
+    {
+        const auto& prim_bounds = *m_prim_bounds;
+        auto& prim_indices = *m_prim_indices;
+
+        int chunk_count = (m_prim_count + LINEAR_GRAIN - 1) / LINEAR_GRAIN;
+        m_chunk_bounds.resize(chunk_count);
+        ForEachChunk(m_pool, chunk_count, 1, [&](int begin, int end) {
+            for (int c = begin; c < end; ++c)
+            {
+                AABB bounds;
+                int last = (std::min)(m_prim_count, (c + 1) * LINEAR_GRAIN);
+                for (int i = c * LINEAR_GRAIN; i < last; ++i)
+                {
+                    bounds.Grow(prim_bounds[i].Center());
+                }
+                m_chunk_bounds[c] = bounds;
+            }
+        });
+
+        AABB centroid_bounds;
+        for (int c = 0; c < chunk_count; ++c)
+        {
+            centroid_bounds.Grow(m_chunk_bounds[c]);
+        }
+
+        bool wide_codes = m_settings->morton_bits > 30;
+        float quantize_max = wide_codes ? (float) ((1 << 21) - 1) : (float) ((1 << 10) - 1);
+        const float* axis_min = &centroid_bounds.min.x;
+        const float* axis_max = &centroid_bounds.max.x;
+        float scale[3];
+        for (int a = 0; a < 3; ++a)
+        {
+            float extent = axis_max[a] - axis_min[a];
+            scale[a] = extent > 0.0f ? quantize_max / extent : 0.0f;
+        }
+
+        ForEachChunk(m_pool, m_prim_count, LINEAR_GRAIN, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i)
+            {
+                XMFLOAT3 center = prim_bounds[i].Center();
+                const float* c = &center.x;
+                uint64_t q[3];
+                for (int a = 0; a < 3; ++a)
+                {
+                    q[a] = (uint64_t) (std::min)(quantize_max, (std::max)(0.0f, (c[a] - axis_min[a]) * scale[a]));
+                }
+
+                if (wide_codes)
+                {
+                    m_keys[i] = (ExpandBits21(q[0]) << 2) | (ExpandBits21(q[1]) << 1) | ExpandBits21(q[2]);
+                }
+                else
+                {
+                    m_keys[i] = (ExpandBits10(q[0]) << 2) | (ExpandBits10(q[1]) << 1) | ExpandBits10(q[2]);
+                }
+                prim_indices[i] = (UINT) i;
+            }
+        });
+    }
+
+    // LSD radix sort of the codes with the primitive indices as values. Histograms are per fixed size chunk
+    // and the scatter is stable, so the order never depends on the thread count.
+    void BVHLinearBuilder::SortMortonCodes()
+    {
+        auto& values = *m_prim_indices;
+        int pass_count = m_settings->morton_bits > 30 ? 8 : 4;
+        int chunk_count = (m_prim_count + LINEAR_GRAIN - 1) / LINEAR_GRAIN;
+
+        m_keys_temp.resize(m_prim_count);
+        m_values_temp.resize(m_prim_count);
+        m_histograms.resize(chunk_count * RADIX_SIZE);
+
+        for (int pass = 0; pass < pass_count; ++pass)
+        {
+            int shift = pass * RADIX_BITS;
+
+            ForEachChunk(m_pool, chunk_count, 1, [&](int begin, int end) {
+                for (int c = begin; c < end; ++c)
+                {
+                    UINT* histogram = &m_histograms[c * RADIX_SIZE];
+                    memset(histogram, 0, sizeof(UINT) * RADIX_SIZE);
+                    int last = (std::min)(m_prim_count, (c + 1) * LINEAR_GRAIN);
+                    for (int i = c * LINEAR_GRAIN; i < last; ++i)
+                    {
+                        histogram[(m_keys[i] >> shift) & (RADIX_SIZE - 1)] += 1;
+                    }
+                }
+            });
+
+            UINT sum = 0;
+            for (int d = 0; d < RADIX_SIZE; ++d)
+            {
+                for (int c = 0; c < chunk_count; ++c)
+                {
+                    UINT count = m_histograms[c * RADIX_SIZE + d];
+                    m_histograms[c * RADIX_SIZE + d] = sum;
+                    sum += count;
+                }
+            }
+
+            ForEachChunk(m_pool, chunk_count, 1, [&](int begin, int end) {
+                for (int c = begin; c < end; ++c)
+                {
+                    UINT* offsets = &m_histograms[c * RADIX_SIZE];
+                    int last = (std::min)(m_prim_count, (c + 1) * LINEAR_GRAIN);
+                    for (int i = c * LINEAR_GRAIN; i < last; ++i)
+                    {
+                        UINT pos = offsets[(m_keys[i] >> shift) & (RADIX_SIZE - 1)]++;
+                        m_keys_temp[pos] = m_keys[i];
+                        m_values_temp[pos] = values[i];
+                    }
+                }
+            });
+
+            // an even pass count leaves the result in the caller's index buffer
+            m_keys.swap(m_keys_temp);
+            values.swap(m_values_temp);
+        }
+    }
+
+    // Length of the common prefix of two sorted codes, ties between equal codes are broken by index.
+    int BVHLinearBuilder::Delta(int i, int j) const
+    {
+        if (j < 0 || j >= m_prim_count)
+        {
+            return -1;
+        }
+
+        uint64_t a = m_keys[i];
+        uint64_t b = m_keys[j];
+        if (a == b)
+        {
+            return 64 + CountLeadingZeros((uint64_t) (i ^ j));
+        }
+        return CountLeadingZeros(a ^ b);
+    }
+
+    void BVHLinearBuilder::EmitNodes(int begin, int end)
+    {
+        auto& nodes = *m_nodes;
+        UINT max_leaf_size = (UINT) m_settings->max_leaf_size;
+
+        for (int i = begin; i < end; ++i)
+        {
+            // direction and extent of the key range covered by internal node i
+            int d = this->Delta(i, i + 1) - this->Delta(i, i - 1) >= 0 ? 1 : -1;
+            int delta_min = this->Delta(i, i - d);
+            int l_max = 2;
+            while (this->Delta(i, i + l_max * d) > delta_min)
+            {
+                l_max *= 2;
+            }
+            int l = 0;
+            for (int t = l_max / 2; t >= 1; t /= 2)
+            {
+                if (this->Delta(i, i + (l + t) * d) > delta_min)
+                {
+                    l += t;
+                }
+            }
+            int j = i + l * d;
+
+            // split position, the highest differing bit inside the range
+            int delta_node = this->Delta(i, j);
+            int s = 0;
+            for (int div = 2; ; div *= 2)
+            {
+                int t = (l + div - 1) / div;
+                if (this->Delta(i, i + (s + t) * d) > delta_node)
+                {
+                    s += t;
+                }
+                if (t <= 1)
+                {
+                    break;
+                }
+            }
+            UINT split = (UINT) (i + s * d + (std::min)(d, 0));
+            UINT first = (UINT) (std::min)(i, j);
+            UINT last = (UINT) (std::max)(i, j);
+
+            // node i is the right child of its parent when it starts its range, the left child when it ends it
+            UINT slot = d > 0 ? 2 * i : 2 * i + 1;
+            BVHNode& node = nodes[slot];
+            if (last - first + 1 <= max_leaf_size)
+            {
+                // the subtree below becomes unreachable, its slots are left unused
+                node.left_first = first;
+                node.count = last - first + 1;
+            }
+            else
+            {
+                node.left_first = 2 * split + 1;
+                node.count = 0;
+            }
+
+            if (split == first)
+            {
+                nodes[2 * split + 1].left_first = split;
+                nodes[2 * split + 1].count = 1;
+            }
+            if (split + 1 == last)
+            {
+                nodes[2 * split + 2].left_first = split + 1;
+                nodes[2 * split + 2].count = 1;
+            }
+        }
+    }
+
+    // Post order pass computing bounds and SAH costs, treelets are restructured once their children are final.
+    void BVHLinearBuilder::FinalizeNode(UINT slot, UINT first, UINT count)
+    {
+        auto& nodes = *m_nodes;
+        BVHNode& node = nodes[slot];
+
+        if (node.IsLeaf())
+        {
+            AABB bounds;
+            for (UINT i = first; i < first + count; ++i)
+            {
+                bounds.Grow((*m_prim_bounds)[(*m_prim_indices)[i]]);
+            }
+            node.bounds = bounds;
+            m_costs[slot] = m_settings->intersection_cost * bounds.SurfaceArea() * count;
+            return;
+        }
+
+        UINT left = node.left_first;
+        UINT left_count = (left - 1) / 2 + 1 - first;
+        if (m_pool && count >= LINEAR_TASK_THRESHOLD)
+        {
+            TaskGroup group(m_pool);
+            group.Run([=]() { this->FinalizeNode(left, first, left_count); });
+            this->FinalizeNode(left + 1, first + left_count, count - left_count);
+            group.Wait();
+        }
+        else
+        {
+            this->FinalizeNode(left, first, left_count);
+            this->FinalizeNode(left + 1, first + left_count, count - left_count);
+        }
+
+        node.bounds = nodes[left].bounds;
+        node.bounds.Grow(nodes[left + 1].bounds);
+        m_costs[slot] = m_settings->traversal_cost * node.bounds.SurfaceArea() + m_costs[left] + m_costs[left + 1];
+
+        if (m_settings->treelet_optimize)
+        {
+            this->OptimizeTreelet(slot);
+        }
+    }
+
+    // Grows a treelet of up to 7 leaves below slot, finds the topology with the lowest SAH cost by dynamic
+    // programming over leaf subsets and rebuilds the treelet in place, reusing its own child slot pairs.
+    void BVHLinearBuilder::OptimizeTreelet(UINT slot)
+    {
+        auto& nodes = *m_nodes;
+
+        UINT leaves[TREELET_SIZE];
+        UINT pairs[TREELET_SIZE - 1];
+        int leaf_count = 0;
+        int pair_count = 0;
+
+        pairs[pair_count++] = nodes[slot].left_first;
+        leaves[leaf_count++] = nodes[slot].left_first;
+        leaves[leaf_count++] = nodes[slot].left_first + 1;
+        while (leaf_count < TREELET_SIZE)
+        {
+            int best = -1;
+            float best_area = -1.0f;
+            for (int i = 0; i < leaf_count; ++i)
+            {
+                const BVHNode& leaf = nodes[leaves[i]];
+                if (!leaf.IsLeaf() && leaf.bounds.SurfaceArea() > best_area)
+                {
+                    best = i;
+                    best_area = leaf.bounds.SurfaceArea();
+                }
+            }
+            if (best < 0)
+            {
+                break;
+            }
+
+            UINT open = nodes[leaves[best]].left_first;
+            pairs[pair_count++] = open;
+            leaves[best] = open;
+            leaves[leaf_count++] = open + 1;
+        }
+
+        if (leaf_count < 3)
+        {
+            return;
+        }
+
+        const int subset_count = 1 << leaf_count;
+        AABB bounds[1 << TREELET_SIZE];
+        float cost[1 << TREELET_SIZE];
+        int partition[1 << TREELET_SIZE];
+        for (int i = 0; i < leaf_count; ++i)
+        {
+            bounds[1 << i] = nodes[leaves[i]].bounds;
+            cost[1 << i] = m_costs[leaves[i]];
+        }
+
+        for (int s = 1; s < subset_count; ++s)
+        {
+            int low = s & -s;
+            if (s == low)
+            {
+                continue;
+            }
+
+            bounds[s] = bounds[s & ~low];
+            bounds[s].Grow(bounds[low]);
+
+            // each partition once, with the lowest leaf always on the left
+            float best = FLT_MAX;
+            int best_partition = low;
+            for (int p = (s - 1) & s; p > 0; p = (p - 1) & s)
+            {
+                if ((p & low) == 0)
+                {
+                    continue;
+                }
+                float c = cost[p] + cost[s ^ p];
+                if (c < best)
+                {
+                    best = c;
+                    best_partition = p;
+                }
+            }
+            cost[s] = m_settings->traversal_cost * bounds[s].SurfaceArea() + best;
+            partition[s] = best_partition;
+        }
+
+        const int full = subset_count - 1;
+        if (!(cost[full] < m_costs[slot] * 0.9999f))
+        {
+            return;
+        }
+
+        BVHNode leaf_nodes[TREELET_SIZE];
+        float leaf_costs[TREELET_SIZE];
+        for (int i = 0; i < leaf_count; ++i)
+        {
+            leaf_nodes[i] = nodes[leaves[i]];
+            leaf_costs[i] = m_costs[leaves[i]];
+        }
+
+        struct Emit
+        {
+            int subset;
+            UINT slot;
+        };
+        Emit stack[TREELET_SIZE * 2];
+        int stack_size = 0;
+        int next_pair = 0;
+        stack[stack_size++] = { full, slot };
+        while (stack_size > 0)
+        {
+            Emit e = stack[--stack_size];
+            if ((e.subset & (e.subset - 1)) == 0)
+            {
+                int i = 0;
+                while ((1 << i) != e.subset)
+                {
+                    ++i;
+                }
+                nodes[e.slot] = leaf_nodes[i];
+                m_costs[e.slot] = leaf_costs[i];
+                continue;
+            }
+
+            UINT pair = pairs[next_pair++];
+            nodes[e.slot].bounds = bounds[e.subset];
+            nodes[e.slot].left_first = pair;
+            nodes[e.slot].count = 0;
+            m_costs[e.slot] = cost[e.subset];
+            stack[stack_size++] = { e.subset ^ partition[e.subset], pair + 1 };
+            stack[stack_size++] = { partition[e.subset], pair };
+        }
+    }
+}
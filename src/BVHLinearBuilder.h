@@ -0,0 +1,55 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include "BVH.h"
+
+namespace dxrf
+{
+    class ThreadPool;
+
+    // Morton code LBVH builder (Karras 2012) with optional treelet restructuring (Karras and Aila 2013).
+    // Internal node i owns the child slots 2 * split + 1 and 2 * split + 2, so every node is placed without
+    // synchronization. Scratch buffers are kept between builds, rebuilding the same primitive count does not resize them.
+    class BVHLinearBuilder
+    {
+    public:
+        void Build(const BVHBuildSettings& settings, const std::vector<AABB>& prim_bounds, std::vector<BVHNode>& nodes, std::vector<UINT>& prim_indices);
+
+    private:
+        void ComputeMortonCodes();
+        void SortMortonCodes();
+        void EmitNodes(int begin, int end);
+        void FinalizeNode(UINT slot, UINT first, UINT count);
+        void OptimizeTreelet(UINT slot);
+        int Delta(int i, int j) const;
+
+    private:
+        const BVHBuildSettings* m_settings = nullptr;
+        const std::vector<AABB>* m_prim_bounds = nullptr;
+        std::vector<BVHNode>* m_nodes = nullptr;
+        std::vector<UINT>* m_prim_indices = nullptr;
+        ThreadPool* m_pool = nullptr;
+        int m_prim_count = 0;
+        std::vector<uint64_t> m_keys;
+        std::vector<uint64_t> m_keys_temp;
+        std::vector<UINT> m_values_temp;
+        std::vector<UINT> m_histograms;
+        std::vector<float> m_costs;
+        std::vector<AABB> m_chunk_bounds;
+    };
+}
@@ -0,0 +1,439 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#include "BVHSpatialBuilder.h"
+#include <algorithm>
+
+namespace dxrf
+{
+    static const int SPATIAL_MAX_DEPTH = 64;
+    static const int MAX_SPATIAL_BIN_COUNT = 64; // same as the SAH builder, BVH::Build clamps bin_count to it
+
+    static void SetAxis(XMFLOAT3& v, int axis, float value)
+    {
+        (&v.x)[axis] = value;
+    }
+
+    static AABB Overlap(const AABB& a, const AABB& b)
+    {
+        AABB result;
+        result.min = { (std::max)(a.min.x, b.min.x), (std::max)(a.min.y, b.min.y), (std::max)(a.min.z, b.min.z) };
+        result.max = { (std::min)(a.max.x, b.max.x), (std::min)(a.max.y, b.max.y), (std::min)(a.max.z, b.max.z) };
+        return result;
+    }
+
+    void BVHSpatialBuilder::Build(const BVHBuildSettings& settings, const Mesh& mesh, const std::vector<XMFLOAT3>& positions,
+        const std::vector<AABB>& prim_bounds, std::vector<BVHNode>& nodes, std::vector<UINT>& prim_indices)
+    {
+        assert(settings.bin_count <= MAX_SPATIAL_BIN_COUNT);
+
+        m_settings = &settings;
+        m_mesh = &mesh;
+        m_positions = &positions;
+        m_nodes = &nodes;
+        m_prim_indices = &prim_indices;
+
+        UINT prim_count = (UINT) prim_bounds.size();
+        m_remaining_budget = (int) (prim_count * (std::max)(0.0f, settings.spatial_split_budget));
+
+        std::vector<Reference> refs(prim_count);
+        AABB bounds;
+        for (UINT i = 0; i < prim_count; ++i)
+        {
+            refs[i].bounds = prim_bounds[i];
+            refs[i].prim = i;
+            bounds.Grow(prim_bounds[i]);
+        }
+        m_root_area = bounds.SurfaceArea();
+
+        nodes.clear();
+        nodes.reserve(prim_count * 2);
+        nodes.emplace_back();
+        prim_indices.clear();
+        prim_indices.reserve(prim_count + m_remaining_budget);
+
+        this->BuildNode(0, refs, bounds, 0);
+    }
+
+    void BVHSpatialBuilder::BuildNode(UINT node_index, std::vector<Reference>& refs, const AABB& bounds, int depth)
+    {
+        UINT count = (UINT) refs.size();
+        (*m_nodes)[node_index].bounds = bounds;
+        if (count == 1 || (depth >= SPATIAL_MAX_DEPTH && count <= (UINT) m_settings->max_leaf_size))
+        {
+            this->MakeLeaf(node_index, refs, bounds);
+            return;
+        }
+
+        AABB centroid_bounds;
+        for (const Reference& ref : refs)
+        {
+            centroid_bounds.Grow(ref.bounds.Center());
+        }
+
+        std::vector<Reference> left;
+        std::vector<Reference> right;
+        if (depth >= SPATIAL_MAX_DEPTH)
+        {
+            // past the depth cap median splits halve the references until they fit a leaf, compressed nodes
+            // cannot hold larger ones
+            this->PartitionMedian(refs, centroid_bounds, left, right);
+        }
+        else
+        {
+            ObjectSplit object_split = this->FindObjectSplit(refs, bounds, centroid_bounds);
+
+            // spatial splits only pay off where the object split children overlap noticeably
+            SpatialSplit spatial_split;
+            if (m_remaining_budget > 0)
+            {
+                float overlap = object_split.axis >= 0 ? Overlap(object_split.left_bounds, object_split.right_bounds).SurfaceArea() : FLT_MAX;
+                if (overlap > m_settings->spatial_split_alpha * m_root_area)
+                {
+                    spatial_split = this->FindSpatialSplit(refs, bounds);
+                }
+            }
+
+            float leaf_cost = m_settings->intersection_cost * count;
+            float split_cost = (std::min)(object_split.cost, spatial_split.cost);
+            if (split_cost >= leaf_cost && count <= (UINT) m_settings->max_leaf_size)
+            {
+                this->MakeLeaf(node_index, refs, bounds);
+                return;
+            }
+
+            if (spatial_split.axis >= 0 && spatial_split.cost < object_split.cost)
+            {
+                this->PartitionSpatial(refs, spatial_split, left, right);
+                if (left.empty() || right.empty())
+                {
+                    left.clear();
+                    right.clear();
+                }
+            }
+            if (left.empty())
+            {
+                if (object_split.axis >= 0)
+                {
+                    this->PartitionObjects(refs, object_split, centroid_bounds, left, right);
+                }
+                else
+                {
+                    this->PartitionMedian(refs, centroid_bounds, left, right);
+                }
+            }
+        }
+        m_remaining_budget -= (int) (left.size() + right.size() - count);
+
+        // the parent references are no longer needed, release them before going deeper
+        std::vector<Reference>().swap(refs);
+
+        AABB left_bounds;
+        for (const Reference& ref : left)
+        {
+            left_bounds.Grow(ref.bounds);
+        }
+        AABB right_bounds;
+        for (const Reference& ref : right)
+        {
+            right_bounds.Grow(ref.bounds);
+        }
+
+        UINT left_index = (UINT) m_nodes->size();
+        m_nodes->emplace_back();
+        m_nodes->emplace_back();
+        (*m_nodes)[node_index].left_first = left_index;
+        (*m_nodes)[node_index].count = 0;
+
+        this->BuildNode(left_index, left, left_bounds, depth + 1);
+        this->BuildNode(left_index + 1, right, right_bounds, depth + 1);
+    }
+
+    // Halves the references at the median centroid along the longest axis of the centroid bounds, or in list order
+    // when all centroids coincide.
+    void BVHSpatialBuilder::PartitionMedian(std::vector<Reference>& refs, const AABB& centroid_bounds, std::vector<Reference>& left,
+        std::vector<Reference>& right) const
+    {
+        XMFLOAT3 extent = { centroid_bounds.max.x - centroid_bounds.min.x, centroid_bounds.max.y - centroid_bounds.min.y,
+            centroid_bounds.max.z - centroid_bounds.min.z };
+        int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+        size_t half = refs.size() / 2;
+        if (GetAxis(extent, axis) > 0.0f)
+        {
+            std::nth_element(refs.begin(), refs.begin() + half, refs.end(), [axis](const Reference& a, const Reference& b) {
+                return GetAxis(a.bounds.Center(), axis) < GetAxis(b.bounds.Center(), axis);
+            });
+        }
+        left.assign(refs.begin(), refs.begin() + half);
+        right.assign(refs.begin() + half, refs.end());
+    }
+
+    void BVHSpatialBuilder::MakeLeaf(UINT node_index, const std::vector<Reference>& refs, const AABB& bounds)
+    {
+        BVHNode& node = (*m_nodes)[node_index];
+        node.bounds = bounds;
+        node.left_first = (UINT) m_prim_indices->size();
+        node.count = (UINT) refs.size();
+        for (const Reference& ref : refs)
+        {
+            m_prim_indices->push_back(ref.prim);
+        }
+    }
+
+    int BVHSpatialBuilder::GetObjectBin(const Reference& ref, int axis, float axis_min, float scale) const
+    {
+        return (std::min)(m_settings->bin_count - 1, (int) ((GetAxis(ref.bounds.Center(), axis) - axis_min) * scale));
+    }
+
+    BVHSpatialBuilder::ObjectSplit BVHSpatialBuilder::FindObjectSplit(const std::vector<Reference>& refs, const AABB& bounds, const AABB& centroid_bounds) const
+    {
+        const int bin_count = m_settings->bin_count;
+        float inv_area = bounds.SurfaceArea() > 0.0f ? 1.0f / bounds.SurfaceArea() : 0.0f;
+        ObjectSplit best;
+
+        AABB bin_bounds[MAX_SPATIAL_BIN_COUNT];
+        UINT bin_counts[MAX_SPATIAL_BIN_COUNT];
+        AABB right_bounds[MAX_SPATIAL_BIN_COUNT];
+        UINT right_counts[MAX_SPATIAL_BIN_COUNT];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float axis_min = GetAxis(centroid_bounds.min, axis);
+            float extent = GetAxis(centroid_bounds.max, axis) - axis_min;
+            if (extent <= 0.0f)
+            {
+                continue;
+            }
+            float scale = bin_count * 0.9999f / extent;
+
+            for (int i = 0; i < bin_count; ++i)
+            {
+                bin_bounds[i] = AABB();
+                bin_counts[i] = 0;
+            }
+            for (const Reference& ref : refs)
+            {
+                int bin = this->GetObjectBin(ref, axis, axis_min, scale);
+                bin_bounds[bin].Grow(ref.bounds);
+                bin_counts[bin] += 1;
+            }
+
+            AABB right;
+            UINT right_sum = 0;
+            for (int i = bin_count - 1; i > 0; --i)
+            {
+                right.Grow(bin_bounds[i]);
+                right_sum += bin_counts[i];
+                right_bounds[i] = right;
+                right_counts[i] = right_sum;
+            }
+
+            AABB left;
+            UINT left_sum = 0;
+            for (int i = 0; i < bin_count - 1; ++i)
+            {
+                left.Grow(bin_bounds[i]);
+                left_sum += bin_counts[i];
+                if (left_sum == 0 || right_counts[i + 1] == 0)
+                {
+                    continue;
+                }
+
+                float cost = m_settings->traversal_cost + m_settings->intersection_cost * inv_area *
+                    (left.SurfaceArea() * left_sum + right_bounds[i + 1].SurfaceArea() * right_counts[i + 1]);
+                if (cost < best.cost)
+                {
+                    best.axis = axis;
+                    best.bin = i + 1;
+                    best.cost = cost;
+                    best.left_bounds = left;
+                    best.right_bounds = right_bounds[i + 1];
+                }
+            }
+        }
+
+        return best;
+    }
+
+    // Bins the clipped reference bounds over the node bounds. A reference counts as entering its first bin and
+    // exiting its last one, so a split plane between bins sees every straddling reference on both sides.
+    BVHSpatialBuilder::SpatialSplit BVHSpatialBuilder::FindSpatialSplit(const std::vector<Reference>& refs, const AABB& bounds) const
+    {
+        const int bin_count = m_settings->bin_count;
+        float inv_area = bounds.SurfaceArea() > 0.0f ? 1.0f / bounds.SurfaceArea() : 0.0f;
+        SpatialSplit best;
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float axis_min = GetAxis(bounds.min, axis);
+            float extent = GetAxis(bounds.max, axis) - axis_min;
+            if (extent <= 0.0f)
+            {
+                continue;
+            }
+            float bin_size = extent / bin_count;
+            float scale = bin_count / extent;
+
+            SpatialBin bins[MAX_SPATIAL_BIN_COUNT];
+            for (const Reference& ref : refs)
+            {
+                int first = (std::max)(0, (std::min)(bin_count - 1, (int) ((GetAxis(ref.bounds.min, axis) - axis_min) * scale)));
+                int last = (std::max)(first, (std::min)(bin_count - 1, (int) ((GetAxis(ref.bounds.max, axis) - axis_min) * scale)));
+
+                Reference current = ref;
+                for (int i = first; i < last; ++i)
+                {
+                    Reference left;
+                    Reference right;
+                    this->SplitReference(current, axis, axis_min + bin_size * (i + 1), &left, &right);
+                    bins[i].bounds.Grow(left.bounds);
+                    current = right;
+                }
+                bins[last].bounds.Grow(current.bounds);
+                bins[first].enter += 1;
+                bins[last].exit += 1;
+            }
+
+            float right_area[MAX_SPATIAL_BIN_COUNT];
+            UINT right_count[MAX_SPATIAL_BIN_COUNT];
+            AABB right;
+            UINT right_sum = 0;
+            for (int i = bin_count - 1; i > 0; --i)
+            {
+                right.Grow(bins[i].bounds);
+                right_sum += bins[i].exit;
+                right_area[i] = right.SurfaceArea();
+                right_count[i] = right_sum;
+            }
+
+            AABB left;
+            UINT left_sum = 0;
+            for (int i = 0; i < bin_count - 1; ++i)
+            {
+                left.Grow(bins[i].bounds);
+                left_sum += bins[i].enter;
+                if (left_sum == 0 || right_count[i + 1] == 0)
+                {
+                    continue;
+                }
+                int duplicates = (int) (left_sum + right_count[i + 1]) - (int) refs.size();
+                if (duplicates > m_remaining_budget)
+                {
+                    continue;
+                }
+
+                float cost = m_settings->traversal_cost + m_settings->intersection_cost * inv_area *
+                    (left.SurfaceArea() * left_sum + right_area[i + 1] * right_count[i + 1]);
+                if (cost < best.cost)
+                {
+                    best.axis = axis;
+                    best.position = axis_min + bin_size * (i + 1);
+                    best.cost = cost;
+                }
+            }
+        }
+
+        return best;
+    }
+
+    void BVHSpatialBuilder::PartitionObjects(std::vector<Reference>& refs, const ObjectSplit& split, const AABB& centroid_bounds,
+        std::vector<Reference>& left, std::vector<Reference>& right) const
+    {
+        float axis_min = GetAxis(centroid_bounds.min, split.axis);
+        float scale = m_settings->bin_count * 0.9999f / (GetAxis(centroid_bounds.max, split.axis) - axis_min);
+        for (const Reference& ref : refs)
+        {
+            if (this->GetObjectBin(ref, split.axis, axis_min, scale) < split.bin)
+            {
+                left.push_back(ref);
+            }
+            else
+            {
+                right.push_back(ref);
+            }
+        }
+    }
+
+    void BVHSpatialBuilder::PartitionSpatial(std::vector<Reference>& refs, const SpatialSplit& split,
+        std::vector<Reference>& left, std::vector<Reference>& right) const
+    {
+        for (const Reference& ref : refs)
+        {
+            if (GetAxis(ref.bounds.max, split.axis) <= split.position)
+            {
+                left.push_back(ref);
+            }
+            else if (GetAxis(ref.bounds.min, split.axis) >= split.position)
+            {
+                right.push_back(ref);
+            }
+            else
+            {
+                Reference left_ref;
+                Reference right_ref;
+                this->SplitReference(ref, split.axis, split.position, &left_ref, &right_ref);
+                if (left_ref.bounds.IsValid())
+                {
+                    left.push_back(left_ref);
+                }
+                if (right_ref.bounds.IsValid())
+                {
+                    right.push_back(right_ref);
+                }
+            }
+        }
+    }
+
+    // Clips the triangle against the plane and bounds both halves, limited to the bounds the reference already had.
+    void BVHSpatialBuilder::SplitReference(const Reference& ref, int axis, float position, Reference* left, Reference* right) const
+    {
+        const XMFLOAT3* v[3];
+        for (int i = 0; i < 3; ++i)
+        {
+            v[i] = &(*m_positions)[m_mesh->indices[ref.prim * 3 + i]];
+        }
+
+        AABB left_bounds;
+        AABB right_bounds;
+        for (int i = 0; i < 3; ++i)
+        {
+            const XMFLOAT3& a = *v[i];
+            const XMFLOAT3& b = *v[(i + 1) % 3];
+            float pa = GetAxis(a, axis);
+            float pb = GetAxis(b, axis);
+            if (pa <= position)
+            {
+                left_bounds.Grow(a);
+            }
+            if (pa >= position)
+            {
+                right_bounds.Grow(a);
+            }
+            if ((pa < position && pb > position) || (pa > position && pb < position))
+            {
+                float t = (std::max)(0.0f, (std::min)(1.0f, (position - pa) / (pb - pa)));
+                XMFLOAT3 p = { a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t };
+                SetAxis(p, axis, position);
+                left_bounds.Grow(p);
+                right_bounds.Grow(p);
+            }
+        }
+
+        left->prim = ref.prim;
+        left->bounds = Overlap(left_bounds, ref.bounds);
+        right->prim = ref.prim;
+        right->bounds = Overlap(right_bounds, ref.bounds);
+    }
+}
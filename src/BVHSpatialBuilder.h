@@ -0,0 +1,85 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include "BVH.h"
+
+namespace dxrf
+{
+    // Spatial split BVH builder (Stich et al. 2009). Triangles straddling a spatial split plane are clipped and
+    // referenced from both sides, which removes the node overlap long and large triangles cause in object split
+    // trees. Duplication stops once settings.spatial_split_budget is used up. The build is serial, it is meant
+    // for static meshes baked offline.
+    class BVHSpatialBuilder
+    {
+    public:
+        void Build(const BVHBuildSettings& settings, const Mesh& mesh, const std::vector<XMFLOAT3>& positions,
+            const std::vector<AABB>& prim_bounds, std::vector<BVHNode>& nodes, std::vector<UINT>& prim_indices);
+
+    private:
+        struct Reference
+        {
+            AABB bounds;
+            UINT prim = 0;
+        };
+
+        struct SpatialBin
+        {
+            AABB bounds;
+            UINT enter = 0;
+            UINT exit = 0;
+        };
+
+        struct ObjectSplit
+        {
+            int axis = -1;
+            int bin = 0;
+            float cost = FLT_MAX;
+            AABB left_bounds;
+            AABB right_bounds;
+        };
+
+        struct SpatialSplit
+        {
+            int axis = -1;
+            float position = 0.0f;
+            float cost = FLT_MAX;
+        };
+
+        void BuildNode(UINT node_index, std::vector<Reference>& refs, const AABB& bounds, int depth);
+        ObjectSplit FindObjectSplit(const std::vector<Reference>& refs, const AABB& bounds, const AABB& centroid_bounds) const;
+        SpatialSplit FindSpatialSplit(const std::vector<Reference>& refs, const AABB& bounds) const;
+        void PartitionObjects(std::vector<Reference>& refs, const ObjectSplit& split, const AABB& centroid_bounds,
+            std::vector<Reference>& left, std::vector<Reference>& right) const;
+        void PartitionSpatial(std::vector<Reference>& refs, const SpatialSplit& split,
+            std::vector<Reference>& left, std::vector<Reference>& right) const;
+        void PartitionMedian(std::vector<Reference>& refs, const AABB& centroid_bounds, std::vector<Reference>& left,
+            std::vector<Reference>& right) const;
+        void SplitReference(const Reference& ref, int axis, float position, Reference* left, Reference* right) const;
+        int GetObjectBin(const Reference& ref, int axis, float axis_min, float scale) const;
+        void MakeLeaf(UINT node_index, const std::vector<Reference>& refs, const AABB& bounds);
+
+    private:
+        const BVHBuildSettings* m_settings = nullptr;
+        const Mesh* m_mesh = nullptr;
+        const std::vector<XMFLOAT3>* m_positions = nullptr;
+        std::vector<BVHNode>* m_nodes = nullptr;
+        std::vector<UINT>* m_prim_indices = nullptr;
+        float m_root_area = 0.0f;
+        int m_remaining_budget = 0;
+    };
+}
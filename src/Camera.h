@@ -0,0 +1,52 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include "DeviceResources.h"
+#include "RaytracingHlslCompat.h"
+
+namespace dxrf
+{
+    struct CameraPose
+    {
+        XMFLOAT3 eye = { -6.0f, 7.0f, -7.0f };
+        XMFLOAT3 at = { 0.0f, 0.0f, 0.0f };
+        XMFLOAT3 up = { 0.0f, 1.0f, 0.0f };
+    };
+
+    static const float CAMERA_FOV = 45.0f;      // vertical, in degrees
+    static const float CAMERA_NEAR = 0.01f;
+    static const float CAMERA_FAR = 1000.0f;
+
+    // Constants of a width x height frame seen from pose, the window and the console renderer both use them.
+    inline SceneConstantBuffer GetSceneConstants(const CameraPose& pose, int width, int height)
+    {
+        XMVECTOR eye = XMVectorSet(pose.eye.x, pose.eye.y, pose.eye.z, 1.0f);
+        XMVECTOR at = XMVectorSet(pose.at.x, pose.at.y, pose.at.z, 1.0f);
+        XMVECTOR up = XMVectorSet(pose.up.x, pose.up.y, pose.up.z, 1.0f);
+        XMMATRIX view = XMMatrixLookAtLH(eye, at, up);
+        XMMATRIX proj = XMMatrixPerspectiveFovLH(XMConvertToRadians(CAMERA_FOV), width / (float) height, CAMERA_NEAR, CAMERA_FAR);
+        XMMATRIX view_proj = view * proj;
+
+        SceneConstantBuffer constants = {};
+        constants.camera_position = eye;
+        constants.projection_to_world = XMMatrixInverse(nullptr, view_proj);
+        constants.pixel_spread_angle = atanf(2.0f * tanf(XMConvertToRadians(CAMERA_FOV) * 0.5f) / height);
+        constants.light_position = XMVectorSet(0, 4, 3, 0);
+        return constants;
+    }
+}
@@ -0,0 +1,226 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#include "CameraPath.h"
+#include "CpuMath.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+namespace dxrf
+{
+    static XMFLOAT3 Lerp(const XMFLOAT3& a, const XMFLOAT3& b, float s)
+    {
+        return Add(a, Scale(Sub(b, a), s));
+    }
+
+    // cubic Hermite segment from p0 to p1 with tangents m0 and m1 per unit of time over a segment of duration
+    static XMFLOAT3 Hermite(const XMFLOAT3& p0, const XMFLOAT3& m0, const XMFLOAT3& p1, const XMFLOAT3& m1, float duration, float s)
+    {
+        float s2 = s * s;
+        float s3 = s2 * s;
+        float h00 = 2.0f * s3 - 3.0f * s2 + 1.0f;
+        float h10 = s3 - 2.0f * s2 + s;
+        float h01 = -2.0f * s3 + 3.0f * s2;
+        float h11 = s3 - s2;
+        XMFLOAT3 result = Add(Scale(p0, h00), Scale(p1, h01));
+        return Add(result, Add(Scale(m0, h10 * duration), Scale(m1, h11 * duration)));
+    }
+
+    static bool ReadVector(std::istringstream& is, XMFLOAT3* v)
+    {
+        return (bool) (is >> v->x >> v->y >> v->z);
+    }
+
+    std::unique_ptr<CameraPath> CameraPath::LoadFromFile(const std::string& path)
+    {
+        std::ifstream file(path);
+        if (!file)
+        {
+            return nullptr;
+        }
+
+        std::vector<CameraKey> keys;
+        int frame_count = 1;
+        int warmup_frame_count = 0;
+        CameraInterpolation interpolation = CameraInterpolation::CatmullRom;
+        std::string line;
+        while (std::getline(file, line))
+        {
+            line = line.substr(0, line.find('#'));
+            std::istringstream is(line);
+            std::string statement;
+            if (!(is >> statement))
+            {
+                continue;
+            }
+
+            bool valid = true;
+            if (statement == "frames")
+            {
+                valid = (bool) (is >> frame_count) && frame_count >= 1;
+            }
+            else if (statement == "warmup")
+            {
+                valid = (bool) (is >> warmup_frame_count) && warmup_frame_count >= 0;
+            }
+            else if (statement == "interpolation")
+            {
+                std::string name;
+                is >> name;
+                valid = name == "linear" || name == "catmull_rom";
+                interpolation = name == "linear" ? CameraInterpolation::Linear : CameraInterpolation::CatmullRom;
+            }
+            else if (statement == "key")
+            {
+                CameraKey key;
+                valid = (is >> key.time) && ReadVector(is, &key.pose.eye) && ReadVector(is, &key.pose.at);
+                XMFLOAT3 up;
+                if (valid && ReadVector(is, &up))
+                {
+                    key.pose.up = up;
+                }
+                valid = valid && (keys.empty() || key.time > keys.back().time);
+                keys.push_back(key);
+            }
+            else
+            {
+                valid = false;
+            }
+
+            if (!valid)
+            {
+                return nullptr;
+            }
+        }
+        if (keys.empty())
+        {
+            return nullptr;
+        }
+
+        std::unique_ptr<CameraPath> camera_path = CameraPath::Create(keys, frame_count, interpolation);
+        camera_path->m_warmup_frame_count = warmup_frame_count;
+
+        return camera_path;
+    }
+
+    std::unique_ptr<CameraPath> CameraPath::Create(const std::vector<CameraKey>& keys, int frame_count, CameraInterpolation interpolation)
+    {
+        assert(!keys.empty());
+
+        std::unique_ptr<CameraPath> camera_path(new CameraPath());
+        camera_path->m_keys = keys;
+        camera_path->m_frame_count = (std::max)(1, frame_count);
+        camera_path->m_interpolation = interpolation;
+
+        return camera_path;
+    }
+
+    float CameraPath::GetFrameTime(int frame) const
+    {
+        float begin = m_keys.front().time;
+        float end = m_keys.back().time;
+        if (m_frame_count <= 1)
+        {
+            return begin;
+        }
+        return begin + (end - begin) * frame / (float) (m_frame_count - 1);
+    }
+
+    CameraPose CameraPath::Evaluate(float time) const
+    {
+        if (time <= m_keys.front().time)
+        {
+            return m_keys.front().pose;
+        }
+        if (time >= m_keys.back().time)
+        {
+            return m_keys.back().pose;
+        }
+
+        // first key after time, the segment runs from the key before it
+        int next = (int) (std::upper_bound(m_keys.begin(), m_keys.end(), time, [](float t, const CameraKey& key) { return t < key.time; }) - m_keys.begin());
+        int prev = next - 1;
+        const CameraKey& k0 = m_keys[prev];
+        const CameraKey& k1 = m_keys[next];
+        float duration = k1.time - k0.time;
+        float s = (time - k0.time) / duration;
+
+        CameraPose pose;
+        // up only steers the roll, it blends linearly and is renormalized
+        pose.up = Normalize(Lerp(k0.pose.up, k1.pose.up, s));
+        if (m_interpolation == CameraInterpolation::Linear)
+        {
+            pose.eye = Lerp(k0.pose.eye, k1.pose.eye, s);
+            pose.at = Lerp(k0.pose.at, k1.pose.at, s);
+            return pose;
+        }
+
+        // tangents from the neighbor keys, one sided at the ends of the path
+        const CameraKey& before = m_keys[(std::max)(prev - 1, 0)];
+        const CameraKey& after = m_keys[(std::min)(next + 1, (int) m_keys.size() - 1)];
+        auto tangent = [](const CameraKey& a, const CameraKey& b, XMFLOAT3 CameraPose::* point) {
+            return Scale(Sub(b.pose.*point, a.pose.*point), 1.0f / (b.time - a.time));
+        };
+        pose.eye = Hermite(k0.pose.eye, tangent(before, k1, &CameraPose::eye), k1.pose.eye, tangent(k0, after, &CameraPose::eye), duration, s);
+        pose.at = Hermite(k0.pose.at, tangent(before, k1, &CameraPose::at), k1.pose.at, tangent(k0, after, &CameraPose::at), duration, s);
+        return pose;
+    }
+
+    FrameTimeSummary FrameTimeLog::GetSummary() const
+    {
+        FrameTimeSummary summary;
+        summary.frame_count = (int) m_frame_ms.size();
+        if (m_frame_ms.empty())
+        {
+            return summary;
+        }
+
+        std::vector<double> sorted = m_frame_ms;
+        std::sort(sorted.begin(), sorted.end());
+        double sum = 0.0;
+        for (double ms : sorted)
+        {
+            sum += ms;
+        }
+        // nearest rank percentiles
+        auto percentile = [&](double p) {
+            size_t rank = (size_t) ceil(p * sorted.size());
+            return sorted[(std::max)(rank, (size_t) 1) - 1];
+        };
+        summary.mean_ms = sum / sorted.size();
+        summary.median_ms = percentile(0.5);
+        summary.p95_ms = percentile(0.95);
+        summary.min_ms = sorted.front();
+        summary.max_ms = sorted.back();
+        return summary;
+    }
+
+    bool FrameTimeLog::WriteCsv(const std::string& path) const
+    {
+        std::ofstream file(path);
+        if (!file)
+        {
+            return false;
+        }
+        file << "frame,ms\n";
+        for (size_t i = 0; i < m_frame_ms.size(); ++i)
+        {
+            file << i << "," << m_frame_ms[i] << "\n";
+        }
+        return (bool) file;
+    }
+}
@@ -0,0 +1,93 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include "Camera.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace dxrf
+{
+    enum class CameraInterpolation
+    {
+        Linear,
+        CatmullRom,     // C1 through the keys, tangents from the neighbor keys scaled by their time spacing
+    };
+
+    struct CameraKey
+    {
+        float time = 0.0f;
+        CameraPose pose;
+    };
+
+    // Keyframed camera for reproducible playback runs. Playback renders a fixed number of frames spread evenly
+    // from the first key to the last, key times only place the keys relative to each other. Text file, one
+    // statement per line, # starts a comment:
+    //
+    //   frames <count>                         frames to render, at least 1
+    //   warmup <count>                         frames rendered at the first pose before the timed ones, default 0
+    //   interpolation linear | catmull_rom     default catmull_rom
+    //   key <time> <eye x y z> <at x y z> [<up x y z>]     times increasing, up defaults to +y
+    class CameraPath
+    {
+    public:
+        // nullptr when the file cannot be read, a line does not parse or there is no key.
+        static std::unique_ptr<CameraPath> LoadFromFile(const std::string& path);
+        static std::unique_ptr<CameraPath> Create(const std::vector<CameraKey>& keys, int frame_count, CameraInterpolation interpolation);
+        // Clamps to the first and last key outside of their times.
+        CameraPose Evaluate(float time) const;
+        int GetFrameCount() const { return m_frame_count; }
+        int GetWarmupFrameCount() const { return m_warmup_frame_count; }
+        float GetFrameTime(int frame) const;
+        CameraPose GetFramePose(int frame) const { return this->Evaluate(this->GetFrameTime(frame)); }
+
+    private:
+        CameraPath() = default;
+
+    private:
+        std::vector<CameraKey> m_keys;
+        int m_frame_count = 1;
+        int m_warmup_frame_count = 0;
+        CameraInterpolation m_interpolation = CameraInterpolation::CatmullRom;
+    };
+
+    struct FrameTimeSummary
+    {
+        int frame_count = 0;
+        double mean_ms = 0.0;
+        double median_ms = 0.0;
+        double p95_ms = 0.0;
+        double min_ms = 0.0;
+        double max_ms = 0.0;
+    };
+
+    // Times of the frames of a playback, in frame order.
+    class FrameTimeLog
+    {
+    public:
+        void Clear() { m_frame_ms.clear(); }
+        void Add(double ms) { m_frame_ms.push_back(ms); }
+        int GetFrameCount() const { return (int) m_frame_ms.size(); }
+        FrameTimeSummary GetSummary() const;
+        // One "frame,ms" line per frame after a header line.
+        bool WriteCsv(const std::string& path) const;
+
+    private:
+        std::vector<double> m_frame_ms;
+    };
+}
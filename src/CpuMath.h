@@ -0,0 +1,146 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include "DeviceResources.h"
+#include <float.h>
+#include <math.h>
+
+namespace dxrf
+{
+    // Scalar helpers shared by the CPU shading code.
+
+    const float PI = 3.14159265f;
+
+    inline XMFLOAT3 Add(const XMFLOAT3& a, const XMFLOAT3& b) { return { a.x + b.x, a.y + b.y, a.z + b.z }; }
+    inline XMFLOAT3 Sub(const XMFLOAT3& a, const XMFLOAT3& b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+    inline XMFLOAT3 Mul(const XMFLOAT3& a, const XMFLOAT3& b) { return { a.x * b.x, a.y * b.y, a.z * b.z }; }
+    inline XMFLOAT3 Scale(const XMFLOAT3& a, float s) { return { a.x * s, a.y * s, a.z * s }; }
+    inline float Dot(const XMFLOAT3& a, const XMFLOAT3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+    inline XMFLOAT3 Cross(const XMFLOAT3& a, const XMFLOAT3& b) { return { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x }; }
+    inline float Length(const XMFLOAT3& a) { return sqrtf(Dot(a, a)); }
+    inline XMFLOAT3 Normalize(const XMFLOAT3& a) { float l = Length(a); return l > 0.0f ? Scale(a, 1.0f / l) : a; }
+    inline float Luminance(const XMFLOAT3& c) { return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; }
+    inline float Fract(float x) { return x - floorf(x); }
+
+    inline UINT Hash(UINT x)
+    {
+        x ^= x >> 16;
+        x *= 0x7feb352d;
+        x ^= x >> 15;
+        x *= 0x846ca68b;
+        x ^= x >> 16;
+        return x;
+    }
+
+    inline float ToUnitFloat(UINT x)
+    {
+        return (x >> 8) * (1.0f / 16777216.0f);
+    }
+
+    // Orthonormal t, b completing the unit vector w.
+    inline void BuildBasis(const XMFLOAT3& w, XMFLOAT3* t, XMFLOAT3* b)
+    {
+        XMFLOAT3 a = fabsf(w.x) > 0.9f ? XMFLOAT3(0, 1, 0) : XMFLOAT3(1, 0, 0);
+        *b = Normalize(Cross(w, a));
+        *t = Cross(*b, w);
+    }
+
+    inline XMFLOAT3 SampleCosineHemisphere(const XMFLOAT3& n, const XMFLOAT2& u)
+    {
+        XMFLOAT3 t, b;
+        BuildBasis(n, &t, &b);
+        float r = sqrtf(u.x);
+        float phi = 2.0f * PI * u.y;
+        float z = sqrtf((std::max)(0.0f, 1.0f - u.x));
+        return Add(Add(Scale(t, r * cosf(phi)), Scale(b, r * sinf(phi))), Scale(n, z));
+    }
+
+    inline XMFLOAT3 SampleUniformSphere(const XMFLOAT2& u)
+    {
+        float z = 1.0f - 2.0f * u.x;
+        float r = sqrtf((std::max)(0.0f, 1.0f - z * z));
+        float phi = 2.0f * PI * u.y;
+        return { r * cosf(phi), r * sinf(phi), z };
+    }
+
+    struct SphereLightSample
+    {
+        XMFLOAT3 direction;
+        float distance;     // to the near side of the sphere
+        float pdf;          // solid angle density
+    };
+
+    // Uniform sample of the cone the sphere subtends, false when position is inside the sphere.
+    inline bool SampleSphereLight(const XMFLOAT3& position, const XMFLOAT3& center, float radius, const XMFLOAT2& u, SphereLightSample* sample)
+    {
+        XMFLOAT3 to_light = Sub(center, position);
+        float distance = Length(to_light);
+        if (distance <= radius)
+        {
+            return false;
+        }
+
+        XMFLOAT3 w = Scale(to_light, 1.0f / distance);
+        XMFLOAT3 t, b;
+        BuildBasis(w, &t, &b);
+
+        float cos_max = sqrtf((std::max)(0.0f, 1.0f - radius * radius / (distance * distance)));
+        float cos_theta = 1.0f - u.x * (1.0f - cos_max);
+        float sin_theta = sqrtf((std::max)(0.0f, 1.0f - cos_theta * cos_theta));
+        float phi = 2.0f * PI * u.y;
+        sample->direction = Add(Add(Scale(t, cosf(phi) * sin_theta), Scale(b, sinf(phi) * sin_theta)), Scale(w, cos_theta));
+
+        float proj = distance * cos_theta;
+        float c = distance * distance - radius * radius;
+        sample->distance = proj - sqrtf((std::max)(0.0f, proj * proj - c));
+        sample->pdf = 1.0f / (2.0f * PI * (std::max)(1.0f - cos_max, 1e-7f));
+        return true;
+    }
+
+    // Density of SampleSphereLight for any direction inside the cone.
+    inline float SphereLightPdf(const XMFLOAT3& position, const XMFLOAT3& center, float radius)
+    {
+        float distance_sq = Dot(Sub(center, position), Sub(center, position));
+        if (distance_sq <= radius * radius)
+        {
+            return 0.0f;
+        }
+        float cos_max = sqrtf(1.0f - radius * radius / distance_sq);
+        return 1.0f / (2.0f * PI * (std::max)(1.0f - cos_max, 1e-7f));
+    }
+
+    // Nearest hit distance of a unit direction ray with the sphere in [t_min, t_max], FLT_MAX on a miss.
+    inline float IntersectSphere(const XMFLOAT3& origin, const XMFLOAT3& direction, const XMFLOAT3& center, float radius, float t_min, float t_max)
+    {
+        XMFLOAT3 oc = Sub(origin, center);
+        float b = Dot(oc, direction);
+        float c = Dot(oc, oc) - radius * radius;
+        float discriminant = b * b - c;
+        if (discriminant < 0.0f)
+        {
+            return FLT_MAX;
+        }
+        float root = sqrtf(discriminant);
+        float t = -b - root;
+        if (t < t_min)
+        {
+            t = -b + root;
+        }
+        return t >= t_min && t <= t_max ? t : FLT_MAX;
+    }
+}
@@ -0,0 +1,1047 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#include "CpuRenderer.h"
+#include "CpuMath.h"
+#include "MipChain.h"
+#include "ThreadPool.h"
+#include "Timer.h"
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+
+namespace dxrf
+{
+    // keep in sync with Raytracing.hlsl
+    static const float RAY_T_MIN = 0.01f;
+    static const float RAY_T_MAX = 1000.0f;
+    static const float LIGHT_INTENSITY = 60.0f;
+    static const UINT PRIMARY_INSTANCE_MASK = VISIBILITY_CAMERA;
+    static const UINT SHADOW_INSTANCE_MASK = VISIBILITY_SHADOW_CASTER;
+
+    static const int TILE_GRAIN = 1;
+    static const int PATH_PIXEL_GRAIN = 1024;
+    static const int SKY_BATCH_SIZE = 64;
+    static const int PROBE_GRAIN = 1;
+    static const UINT MIN_DENOISE_VARIANCE_SAMPLES = 4;
+
+    // Jimenez 2014, a cheap per pixel offset with blue noise like spectrum
+    static float InterleavedGradientNoise(float x, float y)
+    {
+        return Fract(52.9829189f * Fract(0.06711056f * x + 0.00583715f * y));
+    }
+
+    std::unique_ptr<CpuRenderer> CpuRenderer::CreateFromScene(Scene* scene, int width, int height, const BVHBuildSettings& bvh_settings,
+        BVHCache* bvh_cache)
+    {
+        std::unique_ptr<CpuRenderer> renderer(new CpuRenderer());
+        renderer->m_tracer = Tracer::CreateFromScene(scene, bvh_settings, bvh_cache);
+        renderer->m_shadow_stream = RayStream::Create(renderer->m_tracer.get());
+        renderer->m_path_integrator = PathIntegrator::Create(renderer->m_tracer.get());
+        renderer->m_denoiser = Denoiser::Create();
+        renderer->m_rasterizer = Rasterizer::Create(renderer->m_tracer.get());
+        renderer->m_light_cache = LightVisibilityCache::Create();
+        renderer->OnSizeChanged(width, height);
+
+        return renderer;
+    }
+
+    void CpuRenderer::OnSizeChanged(int width, int height)
+    {
+        m_width = width;
+        m_height = height;
+        m_region_x = 0;
+        m_region_y = 0;
+        m_region_width = width;
+        m_region_height = height;
+        m_hits.resize(width * height);
+        m_sky_colors.resize(width * height);
+        m_visibility.resize(width * height);
+        m_sample_offsets.resize(width * height);
+        m_output.resize(width * height);
+        m_guides.resize(width * height);
+        m_variance.resize(width * height);
+        m_denoised.resize(width * height);
+        this->ResetAccumulation();
+    }
+
+    void CpuRenderer::SetSettings(const CpuRenderSettings& settings)
+    {
+        // tiles of another size cover other pixels, the active flags start over
+        if ((std::max)(1, settings.tile_size) != m_settings.tile_size)
+        {
+            m_tile_active.clear();
+        }
+        m_settings = settings;
+        m_settings.tile_size = (std::max)(1, m_settings.tile_size);
+        m_settings.min_samples = (std::max)(2, m_settings.min_samples);
+        // the light radius, the shadow sampling or the integrator may change what the cached rays saw
+        m_light_version += 1;
+        this->ResetAccumulation();
+    }
+
+    void CpuRenderer::SetEnvironment(std::unique_ptr<EnvironmentMap> environment)
+    {
+        m_environment = std::move(environment);
+        m_path_integrator->SetEnvironment(m_environment.get());
+        this->ResetAccumulation();
+    }
+
+    void CpuRenderer::SetMeshTexture(const MipChain* texture)
+    {
+        m_mesh_texture = texture;
+        m_path_integrator->SetMeshTexture(texture);
+        this->ResetAccumulation();
+    }
+
+    void CpuRenderer::SetRegion(int x, int y, int width, int height)
+    {
+        this->ActivateRegion(false);
+        m_region_x = (std::max)(0, (std::min)(x, m_width));
+        m_region_y = (std::max)(0, (std::min)(y, m_height));
+        m_region_width = (std::max)(0, (std::min)(width, m_width - m_region_x));
+        m_region_height = (std::max)(0, (std::min)(height, m_height - m_region_y));
+        this->ResetAccumulation();
+    }
+
+    // Only the region is ever active, so a reset touches the region alone and small regions of large frames
+    // stay cheap to restart.
+    void CpuRenderer::ResetAccumulation()
+    {
+        m_tile_count_x = (m_width + m_settings.tile_size - 1) / m_settings.tile_size;
+        m_tile_count_y = (m_height + m_settings.tile_size - 1) / m_settings.tile_size;
+        if (m_pixel_active.size() != (size_t) (m_width * m_height) || m_tile_active.size() != (size_t) (m_tile_count_x * m_tile_count_y))
+        {
+            m_accumulators.assign(m_width * m_height, PixelAccumulator());
+            m_pixel_active.assign(m_width * m_height, 0);
+            m_pixel_unconverged.assign(m_width * m_height, 0);
+            m_tile_active.assign(m_tile_count_x * m_tile_count_y, 0);
+        }
+        this->ActivateRegion(true);
+        m_accumulated_sample_count = 0;
+    }
+
+    // Starts every pixel and tile of the region sampling from scratch, or stops them.
+    void CpuRenderer::ActivateRegion(bool active)
+    {
+        if (m_region_width <= 0 || m_region_height <= 0)
+        {
+            return;
+        }
+        int x_end = m_region_x + m_region_width;
+        int y_end = m_region_y + m_region_height;
+        for (int y = m_region_y; y < y_end; ++y)
+        {
+            int row = y * m_width;
+            std::fill(&m_pixel_active[row + m_region_x], &m_pixel_active[row + x_end], (uint8_t) (active ? 1 : 0));
+            std::fill(&m_pixel_unconverged[row + m_region_x], &m_pixel_unconverged[row + x_end], (uint8_t) 0);
+            if (active)
+            {
+                std::fill(&m_accumulators[row + m_region_x], &m_accumulators[row + x_end], PixelAccumulator());
+            }
+        }
+        int tile_size = m_settings.tile_size;
+        for (int tile_y = m_region_y / tile_size; tile_y <= (y_end - 1) / tile_size; ++tile_y)
+        {
+            for (int tile_x = m_region_x / tile_size; tile_x <= (x_end - 1) / tile_size; ++tile_x)
+            {
+                m_tile_active[tile_y * m_tile_count_x + tile_x] = active ? 1 : 0;
+            }
+        }
+    }
+
+    // Pixels of a tile inside the region, tiles on the region border are cut.
+    void CpuRenderer::GetTileBounds(int tile, int* x_begin, int* y_begin, int* x_end, int* y_end) const
+    {
+        int tile_size = m_settings.tile_size;
+        int x = (tile % m_tile_count_x) * tile_size;
+        int y = (tile / m_tile_count_x) * tile_size;
+        *x_begin = (std::max)(x, m_region_x);
+        *y_begin = (std::max)(y, m_region_y);
+        *x_end = (std::min)(x + tile_size, m_region_x + m_region_width);
+        *y_end = (std::min)(y + tile_size, m_region_y + m_region_height);
+    }
+
+    // Runs func(x_begin, y_begin, x_end, y_end) over the tiles that still take samples.
+    template<class Func>
+    void CpuRenderer::ForEachActiveTile(Func&& func)
+    {
+        ThreadPool::GetInstance()->ParallelFor(0, m_tile_count_x * m_tile_count_y, TILE_GRAIN, [&](int tile_begin, int tile_end) {
+            for (int tile = tile_begin; tile < tile_end; ++tile)
+            {
+                if (!m_tile_active[tile])
+                {
+                    continue;
+                }
+                int x_begin, y_begin, x_end, y_end;
+                this->GetTileBounds(tile, &x_begin, &y_begin, &x_end, &y_end);
+                func(x_begin, y_begin, x_end, y_end);
+            }
+        });
+    }
+
+    void CpuRenderer::Render(const SceneConstantBuffer& constants)
+    {
+        if (m_settings.accumulate && m_has_constants && memcmp(&constants, &m_constants, sizeof(constants)) != 0)
+        {
+            this->ResetAccumulation();
+        }
+        if (m_has_constants && XMVector3NotEqual(constants.light_position, m_constants.light_position))
+        {
+            m_light_version += 1;
+        }
+        m_constants = constants;
+        m_has_constants = true;
+        m_stats = CpuRenderStats();
+        if (m_settings.cache_light_visibility)
+        {
+            m_light_cache->Prepare(m_settings.light_cache, m_tracer->GetVersion(), m_light_version);
+        }
+
+        if (m_settings.integrator == CpuIntegrator::PathTracing)
+        {
+            this->TracePaths();
+        }
+        else
+        {
+            Timer timer;
+            this->TracePrimaryRays();
+            m_stats.primary_ms = timer.GetElapsedMs();
+
+            timer.Reset();
+            this->TraceShadowRays();
+            m_stats.shadow_ms = timer.GetElapsedMs();
+
+            timer.Reset();
+            this->ShadePixels();
+            m_stats.shade_ms = timer.GetElapsedMs();
+        }
+
+        if (m_settings.accumulate)
+        {
+            this->UpdateConvergence();
+        }
+        for (uint8_t active : m_tile_active)
+        {
+            m_stats.active_tile_count += active;
+        }
+        m_stats.accumulated_sample_count = m_accumulated_sample_count;
+
+        if (m_settings.denoise)
+        {
+            Timer timer;
+            this->Denoise();
+            m_stats.denoise_ms = timer.GetElapsedMs();
+        }
+
+        m_frame_index += 1;
+    }
+
+    XMFLOAT2 CpuRenderer::GetPixelSample(int x, int y) const
+    {
+        // accumulated samples jitter over the pixel footprint to resolve edges
+        if (m_settings.accumulate)
+        {
+            UINT seed = Hash((UINT) (y * m_width + x) ^ Hash(m_frame_index * 0x632be5abu));
+            return { ToUnitFloat(seed), ToUnitFloat(Hash(seed)) };
+        }
+        return { 0.5f, 0.5f };
+    }
+
+    Ray CpuRenderer::GenerateCameraRay(int x, int y) const
+    {
+        XMFLOAT2 sample = this->GetPixelSample(x, y);
+        float screen_x = (x + sample.x) / m_width * 2.0f - 1.0f;
+        float screen_y = -((y + sample.y) / m_height * 2.0f - 1.0f);
+        XMFLOAT3 world;
+        XMStoreFloat3(&world, XMVector3TransformCoord(XMVectorSet(screen_x, screen_y, 0, 1), m_constants.projection_to_world));
+
+        Ray ray;
+        XMStoreFloat3(&ray.origin, m_constants.camera_position);
+        ray.direction = Normalize(Sub(world, ray.origin));
+        ray.t_min = RAY_T_MIN;
+        ray.t_max = RAY_T_MAX;
+        return ray;
+    }
+
+    // Visibility buffer of the active pixels, sampled where GenerateCameraRay shoots.
+    void CpuRenderer::RasterizeVisibility()
+    {
+        const XMFLOAT2* sample_offsets = nullptr;
+        if (m_settings.accumulate)
+        {
+            this->ForEachActiveTile([&](int x_begin, int y_begin, int x_end, int y_end) {
+                for (int y = y_begin; y < y_end; ++y)
+                {
+                    for (int x = x_begin; x < x_end; ++x)
+                    {
+                        m_sample_offsets[y * m_width + x] = this->GetPixelSample(x, y);
+                    }
+                }
+            });
+            sample_offsets = m_sample_offsets.data();
+        }
+
+        XMMATRIX world_to_projection = XMMatrixInverse(nullptr, m_constants.projection_to_world);
+        this->ProjectSceneBounds(world_to_projection);
+        m_rasterizer->Render(world_to_projection, PRIMARY_INSTANCE_MASK, m_width, m_height, sample_offsets, m_pixel_active.data(),
+            m_visibility.data());
+    }
+
+    // Pixel rectangle covering the scene bounds seen through the camera, the whole frame once a corner of the
+    // bounds is behind the camera plane.
+    void CpuRenderer::ProjectSceneBounds(const XMMATRIX& world_to_projection)
+    {
+        m_scene_x_begin = 0;
+        m_scene_y_begin = 0;
+        m_scene_x_end = m_width;
+        m_scene_y_end = m_height;
+        const AABB& bounds = m_tracer->GetTopStructure()->GetBounds();
+        if (!bounds.IsValid())
+        {
+            m_scene_x_end = 0;
+            m_scene_y_end = 0;
+            return;
+        }
+
+        float x_min = FLT_MAX;
+        float y_min = FLT_MAX;
+        float x_max = -FLT_MAX;
+        float y_max = -FLT_MAX;
+        for (int corner = 0; corner < 8; ++corner)
+        {
+            XMFLOAT3 p = { (corner & 1) ? bounds.max.x : bounds.min.x, (corner & 2) ? bounds.max.y : bounds.min.y, (corner & 4) ? bounds.max.z : bounds.min.z };
+            XMFLOAT4 clip;
+            XMStoreFloat4(&clip, XMVector3Transform(XMLoadFloat3(&p), world_to_projection));
+            if (clip.w <= 0.0f)
+            {
+                return;
+            }
+            // same mapping as Rasterizer::SetupScreenTriangle
+            float x = (clip.x / clip.w * 0.5f + 0.5f) * m_width;
+            float y = (0.5f - clip.y / clip.w * 0.5f) * m_height;
+            x_min = (std::min)(x_min, x);
+            y_min = (std::min)(y_min, y);
+            x_max = (std::max)(x_max, x);
+            y_max = (std::max)(y_max, y);
+        }
+        // a pixel of margin for the rounding of the two mappings
+        m_scene_x_begin = (int) (std::max)(0.0f, (std::min)((float) m_width, floorf(x_min) - 1.0f));
+        m_scene_y_begin = (int) (std::max)(0.0f, (std::min)((float) m_height, floorf(y_min) - 1.0f));
+        m_scene_x_end = (int) (std::max)(0.0f, (std::min)((float) m_width, ceilf(x_max) + 1.0f));
+        m_scene_y_end = (int) (std::max)(0.0f, (std::min)((float) m_height, ceilf(y_max) + 1.0f));
+    }
+
+    // Closest hit of the camera ray of pixel (x, y). When rasterizing, the ray is only tested against the triangle
+    // its sample sees. Samples right on an edge, where the rasterizer and the watertight test may pick different
+    // sides, and corners inside the far plane but past RAY_T_MAX fall back to tracing, counted in traced_count.
+    // So do empty samples inside the projected scene bounds: the float edge functions of the rasterizer can leave
+    // cracks along shared edges, and it clips at the near plane rather than at RAY_T_MIN. Empty samples outside
+    // the bounds are misses.
+    bool CpuRenderer::TraceCameraRay(int x, int y, const Ray& ray, RayHit* hit, int* traced_count) const
+    {
+        if (m_settings.rasterize_primary)
+        {
+            const VisibilitySample& sample = m_visibility[y * m_width + x];
+            if (sample.instance_id == UINT_MAX)
+            {
+                if (x < m_scene_x_begin || x >= m_scene_x_end || y < m_scene_y_begin || y >= m_scene_y_end)
+                {
+                    return false;
+                }
+            }
+            else if (m_tracer->IntersectPrimitive(ray, sample.instance_id, sample.primitive_index, hit))
+            {
+                return true;
+            }
+        }
+        *traced_count += 1;
+        return m_tracer->TraceRay(ray, PRIMARY_INSTANCE_MASK, hit);
+    }
+
+    void CpuRenderer::TracePrimaryRays()
+    {
+        if (m_settings.rasterize_primary)
+        {
+            this->RasterizeVisibility();
+        }
+
+        std::atomic<int> traced_count(0);
+        this->ForEachActiveTile([&](int x_begin, int y_begin, int x_end, int y_end) {
+            int tile_traced_count = 0;
+            for (int y = y_begin; y < y_end; ++y)
+            {
+                for (int x = x_begin; x < x_end; ++x)
+                {
+                    SurfaceHit& surface = m_hits[y * m_width + x];
+                    surface.active = m_pixel_active[y * m_width + x] != 0;
+                    if (!surface.active)
+                    {
+                        continue;
+                    }
+                    surface.light_cache_key = 0;
+                    surface.cached_visibility = -1.0f;
+
+                    Ray ray = this->GenerateCameraRay(x, y);
+                    surface.origin = ray.origin;
+                    surface.direction = ray.direction;
+
+                    RayHit hit;
+                    if (!this->TraceCameraRay(x, y, ray, &hit, &tile_traced_count))
+                    {
+                        surface.t = FLT_MAX;
+                        m_guides[y * m_width + x] = DenoiserGuide();
+                        continue;
+                    }
+
+                    surface.t = hit.t;
+                    surface.position = Add(ray.origin, Scale(ray.direction, hit.t));
+                    surface.normal = m_tracer->GetShadingNormal(hit);
+                    surface.receive_shadow = m_tracer->GetInstances()[hit.instance_id].receive_shadow;
+                    // the cone of a camera ray starts at the pinhole, its width is the spread times the distance
+                    surface.albedo = this->GetSurfaceAlbedo(hit, ray.direction, m_constants.pixel_spread_angle * hit.t);
+                    XMFLOAT3 facing_normal = Dot(surface.normal, ray.direction) > 0.0f ? Scale(surface.normal, -1.0f) : surface.normal;
+                    m_guides[y * m_width + x] = { surface.albedo, facing_normal, hit.t };
+                }
+            }
+            traced_count += tile_traced_count;
+        });
+        m_stats.traced_primary_count = traced_count;
+    }
+
+    XMFLOAT3 CpuRenderer::GetSurfaceAlbedo(const RayHit& hit, const XMFLOAT3& direction, float cone_width) const
+    {
+        if (!m_mesh_texture)
+        {
+            return { 1.0f, 1.0f, 1.0f };
+        }
+        float lod = m_tracer->GetTextureLod(hit, direction, cone_width, m_mesh_texture->GetWidth(0), m_mesh_texture->GetHeight(0));
+        XMFLOAT4 texel = m_mesh_texture->SampleLevel(0, m_tracer->GetTextureCoordinate(hit), lod);
+        return { texel.x, texel.y, texel.z };
+    }
+
+    // Radiance the sphere light leaves on a surface, before tone mapping. Same falloff as MyClosestHitShader.
+    XMFLOAT3 CpuRenderer::GetDirectLight(const XMFLOAT3& light_position, const XMFLOAT3& position, const XMFLOAT3& normal, const XMFLOAT3& albedo,
+        float visibility) const
+    {
+        XMFLOAT3 light_offset = Sub(light_position, position);
+        float light_distance = Length(light_offset);
+        float n_dot_l = (std::max)(0.0f, Dot(normal, Scale(light_offset, 1.0f / light_distance)));
+        float light_atten = 1.0f / (light_distance * light_distance + light_distance + 1.0f);
+        return Scale(albedo, n_dot_l * light_atten * LIGHT_INTENSITY * visibility);
+    }
+
+    // Every probe ray takes the direct light of the surface it hits, with one shadow ray toward a random point of
+    // the light, plus the light the previous bake brought to that surface. Rays into the sky take the sky color.
+    void CpuRenderer::BakeIrradianceVolume(const SceneConstantBuffer& constants)
+    {
+        XMFLOAT3 light_position;
+        XMStoreFloat3(&light_position, constants.light_position);
+        const AABB& bounds = m_tracer->GetTopStructure()->GetBounds();
+        int bounce_count = (std::max)(1, m_settings.irradiance_volume.bounce_count);
+
+        std::unique_ptr<IrradianceVolume> previous;
+        for (int bounce = 0; bounce < bounce_count; ++bounce)
+        {
+            std::unique_ptr<IrradianceVolume> volume = IrradianceVolume::Create(bounds, m_settings.irradiance_volume);
+            int sample_count = volume->GetSampleCount();
+            // the rays of a probe share the sphere, each one is a cone of 4 pi / n steradians
+            float sample_spread = sqrtf(4.0f * PI / sample_count);
+            float sky_lod = m_environment ? log2f(sample_spread * m_environment->GetSize() * 0.5f) : 0.0f;
+
+            ThreadPool::GetInstance()->ParallelFor(0, volume->GetProbeCount(), PROBE_GRAIN, [&](int begin, int end) {
+                std::vector<XMFLOAT3> radiance(sample_count);
+                for (int probe = begin; probe < end; ++probe)
+                {
+                    UINT rng = Hash((UINT) probe ^ Hash((UINT) bounce * 0x9e3779b9u));
+                    int backface_count = 0;
+                    for (int i = 0; i < sample_count; ++i)
+                    {
+                        Ray ray;
+                        ray.origin = volume->GetProbePosition(probe);
+                        ray.direction = volume->GetSampleDirection(i);
+                        ray.t_min = RAY_T_MIN;
+                        ray.t_max = RAY_T_MAX;
+                        RayHit hit;
+                        if (!m_tracer->TraceRay(ray, PRIMARY_INSTANCE_MASK, &hit))
+                        {
+                            radiance[i] = m_environment ? m_environment->SampleLevel(ray.direction, sky_lod) : m_settings.background;
+                            continue;
+                        }
+
+                        XMFLOAT3 normal = m_tracer->GetShadingNormal(hit);
+                        if (Dot(normal, ray.direction) > 0.0f)
+                        {
+                            backface_count += 1;
+                            radiance[i] = { 0, 0, 0 };
+                            continue;
+                        }
+                        XMFLOAT3 position = Add(ray.origin, Scale(ray.direction, hit.t));
+                        XMFLOAT3 albedo = this->GetSurfaceAlbedo(hit, ray.direction, sample_spread * hit.t);
+
+                        float visibility = 1.0f;
+                        rng = Hash(rng);
+                        XMFLOAT2 u = { ToUnitFloat(rng), ToUnitFloat(Hash(rng)) };
+                        SphereLightSample light_sample;
+                        if (m_tracer->GetInstances()[hit.instance_id].receive_shadow &&
+                            SampleSphereLight(position, light_position, m_settings.light_radius, u, &light_sample))
+                        {
+                            Ray shadow_ray;
+                            shadow_ray.origin = position;
+                            shadow_ray.direction = light_sample.direction;
+                            shadow_ray.t_min = RAY_T_MIN;
+                            shadow_ray.t_max = light_sample.distance;
+                            visibility = m_tracer->TraceOcclusion(shadow_ray, SHADOW_INSTANCE_MASK) ? 0.0f : 1.0f;
+                        }
+                        radiance[i] = this->GetDirectLight(light_position, position, normal, albedo, visibility);
+                        if (previous)
+                        {
+                            XMFLOAT3 irradiance = previous->SampleIrradiance(position, normal);
+                            radiance[i] = Add(radiance[i], Mul(albedo, Scale(irradiance, 1.0f / PI)));
+                        }
+                    }
+                    volume->SetProbe(probe, radiance.data(), backface_count);
+                }
+            });
+            previous = std::move(volume);
+        }
+        m_irradiance_volume = std::move(previous);
+    }
+
+    int CpuRenderer::GetShadowSampleCount() const
+    {
+        return m_settings.shadow_sampling == ShadowSampling::Center ? 1 : (std::max)(1, m_settings.shadow_sample_count);
+    }
+
+    XMFLOAT2 CpuRenderer::GetLightSample(int x, int y, int sample_index, int sample_count) const
+    {
+        if (m_settings.shadow_sampling == ShadowSampling::BlueNoise)
+        {
+            // R2 sequence, Roberts 2018
+            float frame_offset = 5.588238f * (m_frame_index & 63);
+            float offset_x = InterleavedGradientNoise(x + frame_offset, (float) y);
+            float offset_y = InterleavedGradientNoise(x + frame_offset + 17.0f, y + 31.0f);
+            return { Fract(offset_x + 0.7548776662f * sample_index), Fract(offset_y + 0.5698402910f * sample_index) };
+        }
+
+        UINT seed = Hash((UINT) (y * m_width + x) ^ Hash(m_frame_index * 0x9e3779b9u + (UINT) sample_index));
+        float jitter_x = ToUnitFloat(seed);
+        float jitter_y = ToUnitFloat(Hash(seed));
+        int columns = (int) sqrtf((float) sample_count);
+        int rows = sample_count / columns;
+        if (sample_index >= columns * rows)
+        {
+            // leftover samples of non square counts are not stratified
+            return { jitter_x, jitter_y };
+        }
+        return { (sample_index % columns + jitter_x) / columns, (sample_index / columns + jitter_y) / rows };
+    }
+
+    Ray CpuRenderer::GenerateShadowRay(const XMFLOAT3& position, const XMFLOAT2& u) const
+    {
+        XMFLOAT3 light_position;
+        XMStoreFloat3(&light_position, m_constants.light_position);
+
+        Ray ray;
+        ray.origin = position;
+        ray.t_min = RAY_T_MIN;
+        SphereLightSample sample;
+        if (!SampleSphereLight(position, light_position, m_settings.light_radius, u, &sample))
+        {
+            // inside the light, nothing can block it
+            ray.t_max = RAY_T_MIN;
+            return ray;
+        }
+
+        ray.direction = sample.direction;
+        ray.t_max = sample.distance;
+        if (m_settings.shadow_sampling == ShadowSampling::Center)
+        {
+            XMFLOAT3 to_light = Sub(light_position, position);
+            float distance = Length(to_light);
+            ray.direction = Scale(to_light, 1.0f / distance);
+            ray.t_max = distance - m_settings.light_radius;
+        }
+        return ray;
+    }
+
+    // Surfaces whose cell is known as fully lit or shadowed take the visibility from the cache, the others keep
+    // the key to record their shadow rays under.
+    void CpuRenderer::LookupLightCache()
+    {
+        this->ForEachActiveTile([&](int x_begin, int y_begin, int x_end, int y_end) {
+            for (int y = y_begin; y < y_end; ++y)
+            {
+                for (int x = x_begin; x < x_end; ++x)
+                {
+                    SurfaceHit& surface = m_hits[y * m_width + x];
+                    if (!surface.active || surface.t == FLT_MAX || !surface.receive_shadow)
+                    {
+                        continue;
+                    }
+                    // shadow rays leave from the side the camera sees
+                    XMFLOAT3 facing_normal = Dot(surface.normal, surface.direction) > 0.0f ? Scale(surface.normal, -1.0f) : surface.normal;
+                    uint64_t key = m_light_cache->GetCellKey(surface.position, facing_normal, m_constants.pixel_spread_angle * surface.t);
+                    LightVisibility visibility = m_light_cache->Lookup(key);
+                    if (visibility == LightVisibility::Unknown)
+                    {
+                        surface.light_cache_key = key;
+                    }
+                    else
+                    {
+                        surface.cached_visibility = visibility == LightVisibility::Lit ? 1.0f : 0.0f;
+                    }
+                }
+            }
+        });
+    }
+
+    // All shadow rays of the frame go through one sorted stream. The samples of a pixel share the origin and
+    // stay next to each other after the sort, so they are traced back to back over the same nodes.
+    void CpuRenderer::TraceShadowRays()
+    {
+        if (m_settings.cache_light_visibility)
+        {
+            this->LookupLightCache();
+        }
+
+        int sample_count = this->GetShadowSampleCount();
+        UINT ray_count = 0;
+        int cached_ray_count = 0;
+        for (int tile = 0; tile < m_tile_count_x * m_tile_count_y; ++tile)
+        {
+            if (!m_tile_active[tile])
+            {
+                continue;
+            }
+            int x_begin, y_begin, x_end, y_end;
+            this->GetTileBounds(tile, &x_begin, &y_begin, &x_end, &y_end);
+            for (int y = y_begin; y < y_end; ++y)
+            {
+                for (int x = x_begin; x < x_end; ++x)
+                {
+                    SurfaceHit& surface = m_hits[y * m_width + x];
+                    if (!surface.active || surface.t == FLT_MAX || !surface.receive_shadow)
+                    {
+                        continue;
+                    }
+                    if (surface.cached_visibility >= 0.0f)
+                    {
+                        cached_ray_count += sample_count;
+                        continue;
+                    }
+                    surface.first_shadow_ray = ray_count;
+                    ray_count += sample_count;
+                }
+            }
+        }
+
+        m_shadow_stream->Clear();
+        m_shadow_stream->Resize(ray_count);
+        m_shadow_stream->SetSortEnabled(m_settings.sort_shadow_rays);
+        this->ForEachActiveTile([&](int x_begin, int y_begin, int x_end, int y_end) {
+            for (int y = y_begin; y < y_end; ++y)
+            {
+                for (int x = x_begin; x < x_end; ++x)
+                {
+                    const SurfaceHit& surface = m_hits[y * m_width + x];
+                    if (!surface.active || surface.t == FLT_MAX || !surface.receive_shadow || surface.cached_visibility >= 0.0f)
+                    {
+                        continue;
+                    }
+                    for (int i = 0; i < sample_count; ++i)
+                    {
+                        Ray ray = this->GenerateShadowRay(surface.position, this->GetLightSample(x, y, i, sample_count));
+                        m_shadow_stream->SetRay(surface.first_shadow_ray + i, ray);
+                    }
+                }
+            }
+        });
+
+        m_shadow_stream->TraceOcclusion(SHADOW_INSTANCE_MASK);
+        m_stats.shadow_ray_count = (int) ray_count;
+        m_stats.cached_shadow_ray_count = cached_ray_count;
+    }
+
+    XMFLOAT3 CpuRenderer::ShadeSphereLight(const XMFLOAT3& color, const XMFLOAT3& origin, const XMFLOAT3& direction, float hit_t) const
+    {
+        XMFLOAT3 light_position;
+        XMStoreFloat3(&light_position, m_constants.light_position);
+
+        XMFLOAT3 result = color;
+        float t = Dot(Sub(light_position, origin), direction);
+        if (t > 0.0f && t < hit_t)
+        {
+            float distance = Length(Sub(Add(origin, Scale(direction, t)), light_position));
+            if (distance <= 1.0f)
+            {
+                result = { 1.0f, 1.0f, 1.0f };
+            }
+            else if (distance <= 1.2f)
+            {
+                float glow = 1.0f - (distance - 1.0f) / 0.2f;
+                result = Add(result, XMFLOAT3(glow * glow, glow * glow, glow * glow));
+            }
+        }
+        return result;
+    }
+
+    // Environment lookups of the camera rays that missed, batched per tile so the cubemap samples eight at a time.
+    void CpuRenderer::ShadeMisses()
+    {
+        if (!m_environment)
+        {
+            return;
+        }
+
+        // same lod as MyMissShader, a texel at the face center subtends 2 / size radians
+        float lods[SKY_BATCH_SIZE];
+        std::fill(lods, lods + SKY_BATCH_SIZE, log2f(m_constants.pixel_spread_angle * m_environment->GetSize() * 0.5f));
+
+        this->ForEachActiveTile([&](int x_begin, int y_begin, int x_end, int y_end) {
+            XMFLOAT3 directions[SKY_BATCH_SIZE];
+            XMFLOAT3 colors[SKY_BATCH_SIZE];
+            int pixels[SKY_BATCH_SIZE];
+            int miss_count = 0;
+            auto flush = [&]() {
+                m_environment->SampleLevel(miss_count, directions, lods, colors);
+                for (int k = 0; k < miss_count; ++k)
+                {
+                    m_sky_colors[pixels[k]] = colors[k];
+                }
+                miss_count = 0;
+            };
+
+            for (int y = y_begin; y < y_end; ++y)
+            {
+                for (int x = x_begin; x < x_end; ++x)
+                {
+                    const SurfaceHit& surface = m_hits[y * m_width + x];
+                    if (!surface.active || surface.t < FLT_MAX)
+                    {
+                        continue;
+                    }
+                    directions[miss_count] = surface.direction;
+                    pixels[miss_count] = y * m_width + x;
+                    if (++miss_count == SKY_BATCH_SIZE)
+                    {
+                        flush();
+                    }
+                }
+            }
+            flush();
+        });
+    }
+
+    void CpuRenderer::ShadePixels()
+    {
+        this->ShadeMisses();
+
+        int sample_count = this->GetShadowSampleCount();
+        XMFLOAT3 light_position;
+        XMStoreFloat3(&light_position, m_constants.light_position);
+
+        // tiles next to each other shade at the same time, so the counts are kept per tile and summed in tile order
+        struct TileShadeStats
+        {
+            double variance = 0.0;
+            int shaded = 0;
+            int active = 0;
+        };
+        std::vector<TileShadeStats> tile_stats(m_tile_count_x * m_tile_count_y);
+        this->ForEachActiveTile([&](int x_begin, int y_begin, int x_end, int y_end) {
+            TileShadeStats stats;
+            for (int y = y_begin; y < y_end; ++y)
+            {
+                for (int x = x_begin; x < x_end; ++x)
+                {
+                    const SurfaceHit& surface = m_hits[y * m_width + x];
+                    if (!surface.active)
+                    {
+                        continue;
+                    }
+                    stats.active += 1;
+
+                    XMFLOAT3 color;
+                    if (surface.t == FLT_MAX)
+                    {
+                        XMFLOAT3 sky = m_environment ? m_sky_colors[y * m_width + x] : m_settings.background;
+                        color = this->ShadeSphereLight(sky, surface.origin, surface.direction, FLT_MAX);
+                    }
+                    else
+                    {
+                        float visibility = 1.0f;
+                        if (surface.receive_shadow && surface.cached_visibility >= 0.0f)
+                        {
+                            visibility = surface.cached_visibility;
+                            stats.shaded += 1;
+                        }
+                        else if (surface.receive_shadow)
+                        {
+                            int unoccluded = 0;
+                            for (int i = 0; i < sample_count; ++i)
+                            {
+                                unoccluded += m_shadow_stream->IsOccluded(surface.first_shadow_ray + i) ? 0 : 1;
+                            }
+                            visibility = (float) unoccluded / sample_count;
+                            stats.variance += visibility * (1.0f - visibility) / sample_count;
+                            stats.shaded += 1;
+                            if (surface.light_cache_key != 0)
+                            {
+                                m_light_cache->Record(surface.light_cache_key, sample_count, unoccluded);
+                            }
+                        }
+
+                        XMFLOAT3 radiance = this->GetDirectLight(light_position, surface.position, surface.normal, surface.albedo, visibility);
+                        if (m_settings.indirect_light && m_irradiance_volume)
+                        {
+                            XMFLOAT3 facing_normal = Dot(surface.normal, surface.direction) > 0.0f ? Scale(surface.normal, -1.0f) : surface.normal;
+                            XMFLOAT3 irradiance = m_irradiance_volume->SampleIrradiance(surface.position, facing_normal);
+                            radiance = Add(radiance, Mul(surface.albedo, Scale(irradiance, 1.0f / PI)));
+                        }
+                        // tone mapping
+                        XMFLOAT3 mapped = { 1.0f - expf(-radiance.x), 1.0f - expf(-radiance.y), 1.0f - expf(-radiance.z) };
+                        color = this->ShadeSphereLight(mapped, surface.origin, surface.direction, surface.t);
+                    }
+                    if (m_settings.accumulate)
+                    {
+                        this->Accumulate(x, y, color);
+                    }
+                    else
+                    {
+                        m_output[y * m_width + x] = { color.x, color.y, color.z, 1.0f };
+                    }
+                }
+            }
+            int tile_size = m_settings.tile_size;
+            tile_stats[(y_begin / tile_size) * m_tile_count_x + x_begin / tile_size] = stats;
+        });
+
+        double variance = 0.0;
+        int shaded = 0;
+        for (const TileShadeStats& stats : tile_stats)
+        {
+            variance += stats.variance;
+            shaded += stats.shaded;
+            m_stats.active_pixel_count += stats.active;
+        }
+        m_stats.shadow_variance = shaded > 0 ? variance / shaded : 0.0;
+        if (m_settings.accumulate)
+        {
+            m_accumulated_sample_count += m_stats.active_pixel_count;
+        }
+    }
+
+    // One path per active pixel, the integrator returns radiance which is tone mapped per sample like ShadePixels does.
+    void CpuRenderer::TracePaths()
+    {
+        Timer timer;
+        m_path_pixels.clear();
+        for (int tile = 0; tile < m_tile_count_x * m_tile_count_y; ++tile)
+        {
+            if (!m_tile_active[tile])
+            {
+                continue;
+            }
+            int x_begin, y_begin, x_end, y_end;
+            this->GetTileBounds(tile, &x_begin, &y_begin, &x_end, &y_end);
+            for (int y = y_begin; y < y_end; ++y)
+            {
+                for (int x = x_begin; x < x_end; ++x)
+                {
+                    if (m_pixel_active[y * m_width + x])
+                    {
+                        m_path_pixels.push_back(y * m_width + x);
+                    }
+                }
+            }
+        }
+
+        int path_count = (int) m_path_pixels.size();
+        m_camera_rays.resize(path_count);
+        m_path_radiance.resize(path_count);
+        m_path_guides.resize(m_settings.denoise ? path_count : 0);
+        m_camera_hits.resize(m_settings.rasterize_primary ? path_count : 0);
+        if (m_settings.rasterize_primary)
+        {
+            this->RasterizeVisibility();
+        }
+        std::atomic<int> traced_count(0);
+        ThreadPool::GetInstance()->ParallelFor(0, path_count, PATH_PIXEL_GRAIN, [&](int begin, int end) {
+            int batch_traced_count = 0;
+            for (int i = begin; i < end; ++i)
+            {
+                int x = m_path_pixels[i] % m_width;
+                int y = m_path_pixels[i] / m_width;
+                m_camera_rays[i] = this->GenerateCameraRay(x, y);
+                if (m_settings.rasterize_primary)
+                {
+                    m_camera_hits[i] = RayHit();
+                    this->TraceCameraRay(x, y, m_camera_rays[i], &m_camera_hits[i], &batch_traced_count);
+                }
+            }
+            traced_count += batch_traced_count;
+        });
+        m_stats.traced_primary_count = m_settings.rasterize_primary ? (int) traced_count : path_count;
+        double setup_ms = timer.GetElapsedMs();
+
+        PathIntegratorSettings path_settings;
+        path_settings.max_depth = m_settings.max_depth;
+        path_settings.russian_roulette_depth = m_settings.russian_roulette_depth;
+        path_settings.albedo = m_settings.albedo;
+        path_settings.pixel_spread_angle = m_constants.pixel_spread_angle;
+        XMStoreFloat3(&path_settings.light_position, m_constants.light_position);
+        path_settings.light_radius = m_settings.light_radius;
+        // a sphere of radiance L and radius r has the intensity L * pi * r^2, the Lambert brdf divides by pi
+        float light_radiance = LIGHT_INTENSITY / (m_settings.light_radius * m_settings.light_radius);
+        path_settings.light_radiance = { light_radiance, light_radiance, light_radiance };
+        path_settings.background = m_settings.background;
+        path_settings.instance_mask = PRIMARY_INSTANCE_MASK;
+        path_settings.shadow_instance_mask = SHADOW_INSTANCE_MASK;
+        path_settings.sort_rays = m_settings.sort_shadow_rays;
+        m_path_integrator->SetLightCache(m_settings.cache_light_visibility ? m_light_cache.get() : nullptr);
+        m_path_integrator->Render(path_settings, m_camera_rays.data(), path_count, m_frame_index, m_path_radiance.data(),
+            m_settings.denoise ? m_path_guides.data() : nullptr, m_settings.rasterize_primary ? m_camera_hits.data() : nullptr,
+            m_path_pixels.data());
+
+        timer.Reset();
+        ThreadPool::GetInstance()->ParallelFor(0, path_count, PATH_PIXEL_GRAIN, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i)
+            {
+                const XMFLOAT3& radiance = m_path_radiance[i];
+                // tone mapping
+                XMFLOAT3 color = { 1.0f - expf(-radiance.x), 1.0f - expf(-radiance.y), 1.0f - expf(-radiance.z) };
+                int x = m_path_pixels[i] % m_width;
+                int y = m_path_pixels[i] / m_width;
+                if (m_settings.denoise)
+                {
+                    m_guides[m_path_pixels[i]] = m_path_guides[i];
+                }
+                if (m_settings.accumulate)
+                {
+                    this->Accumulate(x, y, color);
+                }
+                else
+                {
+                    m_output[y * m_width + x] = { color.x, color.y, color.z, 1.0f };
+                }
+            }
+        });
+
+        const PathIntegratorStats& path_stats = m_path_integrator->GetStats();
+        m_stats.path_ray_count = path_stats.extension_ray_count;
+        m_stats.shadow_ray_count = path_stats.shadow_ray_count;
+        m_stats.cached_shadow_ray_count = path_stats.cached_shadow_ray_count;
+        m_stats.primary_ms = setup_ms + path_stats.extension_ms;
+        m_stats.shadow_ms = path_stats.shadow_ms;
+        m_stats.shade_ms = path_stats.shade_ms + timer.GetElapsedMs();
+        m_stats.active_pixel_count = path_count;
+        if (m_settings.accumulate)
+        {
+            m_accumulated_sample_count += path_count;
+        }
+    }
+
+    // Filters the output into m_denoised. Accumulated pixels pass the variance of their mean, estimated once a
+    // few samples are in, single samples leave the variance to the denoiser.
+    void CpuRenderer::Denoise()
+    {
+        const float* variance = nullptr;
+        if (m_settings.accumulate)
+        {
+            ThreadPool::GetInstance()->ParallelFor(0, m_width * m_height, PATH_PIXEL_GRAIN, [&](int begin, int end) {
+                for (int i = begin; i < end; ++i)
+                {
+                    const PixelAccumulator& pixel = m_accumulators[i];
+                    UINT n = pixel.sample_count;
+                    m_variance[i] = n >= MIN_DENOISE_VARIANCE_SAMPLES ? pixel.luminance_m2 / ((n - 1) * (float) n) : -1.0f;
+                }
+            });
+            variance = m_variance.data();
+        }
+        m_denoiser->Denoise(m_settings.denoiser, m_width, m_height, m_output.data(), m_guides.data(), variance, m_denoised.data());
+    }
+
+    // Welford update of the running mean color and the luminance variance.
+    void CpuRenderer::Accumulate(int x, int y, const XMFLOAT3& color)
+    {
+        PixelAccumulator& pixel = m_accumulators[y * m_width + x];
+        float luminance = Luminance(color);
+        float delta = luminance - Luminance(pixel.mean);
+        pixel.sample_count += 1;
+        pixel.mean = Add(pixel.mean, Scale(Sub(color, pixel.mean), 1.0f / pixel.sample_count));
+        pixel.luminance_m2 += delta * (luminance - Luminance(pixel.mean));
+        m_output[y * m_width + x] = { pixel.mean.x, pixel.mean.y, pixel.mean.z, 1.0f };
+    }
+
+    bool CpuRenderer::IsPixelConverged(const PixelAccumulator& pixel) const
+    {
+        if (pixel.sample_count < (UINT) m_settings.min_samples)
+        {
+            return false;
+        }
+        if (pixel.sample_count >= (UINT) m_settings.max_samples)
+        {
+            return true;
+        }
+        // standard error of the mean, relative to sqrt(mean) so that dark pixels do not take forever
+        float variance = pixel.luminance_m2 / (pixel.sample_count - 1);
+        float error = sqrtf(variance / pixel.sample_count) / sqrtf((std::max)(Luminance(pixel.mean), 1e-4f));
+        return error < m_settings.adaptive_threshold;
+    }
+
+    // A pixel keeps sampling while its own error or the error of a neighbor is above the threshold, so pixels
+    // whose first samples happened to agree do not stop next to noisy ones. A tile stops once all its pixels converged.
+    void CpuRenderer::UpdateConvergence()
+    {
+        this->ForEachActiveTile([&](int x_begin, int y_begin, int x_end, int y_end) {
+            for (int y = y_begin; y < y_end; ++y)
+            {
+                for (int x = x_begin; x < x_end; ++x)
+                {
+                    m_pixel_unconverged[y * m_width + x] = this->IsPixelConverged(m_accumulators[y * m_width + x]) ? 0 : 1;
+                }
+            }
+        });
+
+        this->ForEachActiveTile([&](int x_begin, int y_begin, int x_end, int y_end) {
+            bool tile_active = false;
+            for (int y = y_begin; y < y_end; ++y)
+            {
+                for (int x = x_begin; x < x_end; ++x)
+                {
+                    uint8_t active = 0;
+                    if (m_accumulators[y * m_width + x].sample_count >= (UINT) m_settings.max_samples)
+                    {
+                        m_pixel_active[y * m_width + x] = 0;
+                        continue;
+                    }
+                    for (int ny = (std::max)(0, y - 1); ny <= (std::min)(m_height - 1, y + 1); ++ny)
+                    {
+                        for (int nx = (std::max)(0, x - 1); nx <= (std::min)(m_width - 1, x + 1); ++nx)
+                        {
+                            active |= m_pixel_unconverged[ny * m_width + nx];
+                        }
+                    }
+                    m_pixel_active[y * m_width + x] = active;
+                    tile_active |= active != 0;
+                }
+            }
+            int tile = (y_begin / m_settings.tile_size) * m_tile_count_x + x_begin / m_settings.tile_size;
+            m_tile_active[tile] = tile_active ? 1 : 0;
+        });
+    }
+}
@@ -0,0 +1,258 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include "Tracer.h"
+#include "RayStream.h"
+#include "PathIntegrator.h"
+#include "EnvironmentMap.h"
+#include "Denoiser.h"
+#include "Rasterizer.h"
+#include "LightVisibilityCache.h"
+#include "IrradianceVolume.h"
+
+namespace dxrf
+{
+    class MipChain;
+
+    enum class ShadowSampling
+    {
+        Center,     // one ray toward the light center, same as MyClosestHitShader
+        Stratified, // jittered grid over the solid angle of the light
+        BlueNoise,  // R2 sequence rotated per pixel by interleaved gradient noise, the error shows as fine grained noise
+    };
+
+    enum class CpuIntegrator
+    {
+        DirectLighting, // one bounce of the sphere light, same shading as Raytracing.hlsl
+        PathTracing,    // PathIntegrator, every frame is one path per pixel
+    };
+
+    struct CpuRenderSettings
+    {
+        CpuIntegrator integrator = CpuIntegrator::DirectLighting;
+        ShadowSampling shadow_sampling = ShadowSampling::Stratified;
+        int shadow_sample_count = 4;
+        float light_radius = 1.0f;  // same sphere ShadeSphereLight draws
+        // Camera rays start from a rasterized visibility buffer instead of traversing the BVHs. Samples left empty over
+        // the scene and rays that miss the buffered triangle are traced, a sample may still resolve to a farther
+        // triangle where the float edge functions drop a nearer one right along its edge.
+        bool rasterize_primary = true;
+        bool sort_shadow_rays = true;
+        // Shadow rays toward the light are skipped for surfaces whose light cache cell only ever saw the light fully
+        // lit or fully blocked. Trades exact penumbra for speed across frames and accumulated samples, the cache
+        // empties whenever the tracer is rebuilt, the light moves or the settings change.
+        bool cache_light_visibility = false;
+        LightCacheSettings light_cache;
+        XMFLOAT3 background = { 0, 0, 0 };  // sky color when no environment map is set
+        // DirectLighting only, adds the bounced light and the sky from the baked irradiance volume, see
+        // BakeIrradianceVolume. Nothing is added before the first bake.
+        bool indirect_light = false;
+        IrradianceVolumeSettings irradiance_volume;
+        // path tracing only, the light radiance is chosen so a white surface gets the direct light of the
+        // DirectLighting mode
+        int max_depth = 8;
+        int russian_roulette_depth = 3;
+        XMFLOAT3 albedo = { 0.8f, 0.8f, 0.8f };
+        // Progressive accumulation: every Render adds one jittered sample to the pixels that have not converged yet.
+        // A pixel converges once the standard error of its mean luminance drops below adaptive_threshold
+        // relative to the square root of the mean, tiles whose pixels all converged are skipped entirely.
+        bool accumulate = false;
+        float adaptive_threshold = 0.01f;
+        int min_samples = 8;
+        int max_samples = 1024;
+        int tile_size = 16;
+        // Edge-aware filtering of the output, guided by the first hit of the camera rays. When accumulating, the
+        // filter gets the variance of the running means, otherwise it estimates the variance from the neighbors.
+        bool denoise = false;
+        DenoiserSettings denoiser;
+    };
+
+    // Default settings that accumulate exactly spp jittered samples per pixel, or render a single sample without
+    // accumulating for an spp of 1 or less.
+    inline CpuRenderSettings GetSampleCountSettings(CpuIntegrator integrator, int spp)
+    {
+        CpuRenderSettings settings;
+        settings.integrator = integrator;
+        if (spp > 1)
+        {
+            // a threshold of 0 never converges early, every pixel takes exactly spp samples
+            settings.accumulate = true;
+            settings.adaptive_threshold = 0.0f;
+            settings.min_samples = spp;
+            settings.max_samples = spp;
+        }
+        return settings;
+    }
+
+    struct CpuRenderStats
+    {
+        int shadow_ray_count = 0;
+        int cached_shadow_ray_count = 0;    // shadow rays the light cache answered, not part of shadow_ray_count
+        int path_ray_count = 0;         // extension rays of the path tracer, camera rays included unless rasterized
+        int traced_primary_count = 0;   // camera rays traced, only the ones the visibility buffer cannot resolve when rasterizing
+        double primary_ms = 0.0;
+        double shadow_ms = 0.0;
+        double shade_ms = 0.0;
+        double denoise_ms = 0.0;
+        // mean over the shaded pixels of p * (1 - p) / n for a light visibility p estimated from n samples,
+        // the variance of independent samples and an upper bound for the stratified patterns
+        double shadow_variance = 0.0;
+        int active_pixel_count = 0;     // pixels sampled this frame
+        int active_tile_count = 0;      // tiles still sampling after this frame
+        uint64_t accumulated_sample_count = 0;  // samples since the last accumulation reset
+    };
+
+    // CPU counterpart of the raytracing pipeline, traces the scene with Tracer and shades like Raytracing.hlsl.
+    class CpuRenderer
+    {
+    public:
+        // bvh_cache, when not nullptr, provides the mesh BVHs of the tracer, see Tracer::CreateFromScene.
+        static std::unique_ptr<CpuRenderer> CreateFromScene(Scene* scene, int width, int height, const BVHBuildSettings& bvh_settings,
+            BVHCache* bvh_cache = nullptr);
+        void OnSizeChanged(int width, int height);
+        void SetSettings(const CpuRenderSettings& settings);
+        // Sky cubemap for the miss rays, nullptr restores the background color.
+        void SetEnvironment(std::unique_ptr<EnvironmentMap> environment);
+        // Albedo texture of every mesh, same as the local texture of the GPU pipeline. Hits sample it at the mip
+        // level of the ray cone footprint, nullptr shades untextured. The texture must outlive the renderer.
+        void SetMeshTexture(const MipChain* texture);
+        // Places the irradiance probes over the scene bounds and traces them in parallel, the light is the one of
+        // constants. Bakes again with the previous result once per extra bounce. The volume is not updated with
+        // the scene, bake again after moving the light or the geometry.
+        void BakeIrradianceVolume(const SceneConstantBuffer& constants);
+        const IrradianceVolume* GetIrradianceVolume() const { return m_irradiance_volume.get(); }
+        const CpuRenderSettings& GetSettings() const { return m_settings; }
+        // Renders one frame with the same constants the GPU pipeline gets. When accumulating, changed constants
+        // restart the accumulation.
+        void Render(const SceneConstantBuffer& constants);
+        void ResetAccumulation();
+        // Limits Render to a rectangle of the frame, pixels outside keep their output. OnSizeChanged restores the
+        // whole frame. Restarts the accumulation.
+        void SetRegion(int x, int y, int width, int height);
+        // Seeds the pixel jitter and the light samples of the next Render, which then go on from it. Renderers at
+        // the same frame index sample every pixel the same way, whatever region they render.
+        void SetFrameIndex(UINT frame_index) { m_frame_index = frame_index; }
+        UINT GetFrameIndex() const { return m_frame_index; }
+        // True once every tile converged, further Render calls trace nothing.
+        bool IsConverged() const { return m_settings.accumulate && m_accumulated_sample_count > 0 && m_stats.active_tile_count == 0; }
+        int GetWidth() const { return m_width; }
+        int GetHeight() const { return m_height; }
+        const std::vector<XMFLOAT4>& GetOutput() const { return m_settings.denoise ? m_denoised : m_output; }
+        const CpuRenderStats& GetStats() const { return m_stats; }
+        Tracer* GetTracer() const { return m_tracer.get(); }
+
+    private:
+        struct SurfaceHit
+        {
+            float t = FLT_MAX;
+            XMFLOAT3 origin;
+            XMFLOAT3 direction;
+            XMFLOAT3 position;
+            XMFLOAT3 normal;
+            XMFLOAT3 albedo;
+            UINT first_shadow_ray = 0;      // shadow rays are only traced for receivers
+            uint64_t light_cache_key = 0;   // cell the shadow rays are recorded to, 0 when not cached
+            float cached_visibility = -1.0f;    // light visibility from the cache, negative when traced
+            bool receive_shadow = true;
+            bool active = false;
+        };
+
+        struct PixelAccumulator
+        {
+            XMFLOAT3 mean = { 0, 0, 0 };
+            float luminance_m2 = 0.0f; // Welford sum of squared luminance deviations
+            UINT sample_count = 0;
+        };
+
+        CpuRenderer() = default;
+        template<class Func>
+        void ForEachActiveTile(Func&& func);
+        void ActivateRegion(bool active);
+        void GetTileBounds(int tile, int* x_begin, int* y_begin, int* x_end, int* y_end) const;
+        void RasterizeVisibility();
+        void ProjectSceneBounds(const XMMATRIX& world_to_projection);
+        bool TraceCameraRay(int x, int y, const Ray& ray, RayHit* hit, int* traced_count) const;
+        void TracePrimaryRays();
+        void LookupLightCache();
+        void TraceShadowRays();
+        void ShadeMisses();
+        void ShadePixels();
+        void TracePaths();
+        void Accumulate(int x, int y, const XMFLOAT3& color);
+        void UpdateConvergence();
+        void Denoise();
+        bool IsPixelConverged(const PixelAccumulator& pixel) const;
+        XMFLOAT2 GetPixelSample(int x, int y) const;
+        Ray GenerateCameraRay(int x, int y) const;
+        XMFLOAT2 GetLightSample(int x, int y, int sample_index, int sample_count) const;
+        Ray GenerateShadowRay(const XMFLOAT3& position, const XMFLOAT2& u) const;
+        XMFLOAT3 GetSurfaceAlbedo(const RayHit& hit, const XMFLOAT3& direction, float cone_width) const;
+        XMFLOAT3 GetDirectLight(const XMFLOAT3& light_position, const XMFLOAT3& position, const XMFLOAT3& normal, const XMFLOAT3& albedo,
+            float visibility) const;
+        XMFLOAT3 ShadeSphereLight(const XMFLOAT3& color, const XMFLOAT3& origin, const XMFLOAT3& direction, float hit_t) const;
+        int GetShadowSampleCount() const;
+
+    private:
+        CpuRenderSettings m_settings;
+        SceneConstantBuffer m_constants;
+        std::unique_ptr<Tracer> m_tracer;
+        std::unique_ptr<RayStream> m_shadow_stream;
+        std::unique_ptr<PathIntegrator> m_path_integrator;
+        std::unique_ptr<EnvironmentMap> m_environment;
+        std::unique_ptr<Denoiser> m_denoiser;
+        std::unique_ptr<Rasterizer> m_rasterizer;
+        std::unique_ptr<LightVisibilityCache> m_light_cache;
+        std::unique_ptr<IrradianceVolume> m_irradiance_volume;
+        uint64_t m_light_version = 0;      // changes with the light position and the settings
+        const MipChain* m_mesh_texture = nullptr;
+        int m_width = 0;
+        int m_height = 0;
+        int m_region_x = 0;
+        int m_region_y = 0;
+        int m_region_width = 0;
+        int m_region_height = 0;
+        int m_tile_count_x = 0;
+        int m_tile_count_y = 0;
+        UINT m_frame_index = 0;
+        bool m_has_constants = false;
+        std::vector<SurfaceHit> m_hits;
+        std::vector<XMFLOAT3> m_sky_colors;
+        std::vector<VisibilitySample> m_visibility;
+        // pixels the scene bounds cover, set with the visibility buffer
+        int m_scene_x_begin = 0;
+        int m_scene_y_begin = 0;
+        int m_scene_x_end = 0;
+        int m_scene_y_end = 0;
+        std::vector<XMFLOAT2> m_sample_offsets;
+        std::vector<Ray> m_camera_rays;
+        std::vector<RayHit> m_camera_hits;
+        std::vector<UINT> m_path_pixels;
+        std::vector<XMFLOAT3> m_path_radiance;
+        std::vector<PixelAccumulator> m_accumulators;
+        std::vector<uint8_t> m_pixel_active;
+        std::vector<uint8_t> m_pixel_unconverged;
+        std::vector<uint8_t> m_tile_active;
+        uint64_t m_accumulated_sample_count = 0;
+        std::vector<XMFLOAT4> m_output;
+        std::vector<DenoiserGuide> m_guides;
+        std::vector<DenoiserGuide> m_path_guides;
+        std::vector<float> m_variance;
+        std::vector<XMFLOAT4> m_denoised;
+        CpuRenderStats m_stats;
+    };
+}
@@ -0,0 +1,445 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#include "Denoiser.h"
+#include "ThreadPool.h"
+#include <immintrin.h>
+#include <math.h>
+
+namespace dxrf
+{
+    static const float KERNEL[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+    static const float DEPTH_EPSILON = 1e-3f;
+    static const float LUMINANCE_EPSILON = 1e-4f;
+    static const float MIN_ALBEDO = 1e-3f;
+    static const int SIMD_WIDTH = 8;
+    static const int DENOISE_GRAIN_PIXELS = 16384;
+
+    static float GetLuminance(float r, float g, float b)
+    {
+        return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+    }
+
+    // max(cos_theta, 0)^exponent by squaring
+    static float NormalWeight(float cos_theta, int exponent)
+    {
+        float base = (std::max)(cos_theta, 0.0f);
+        float result = 1.0f;
+        for (; exponent > 0; exponent >>= 1)
+        {
+            if (exponent & 1)
+            {
+                result *= base;
+            }
+            base *= base;
+        }
+        return result;
+    }
+
+#if defined(__AVX2__)
+    // e^x with a degree 5 polynomial for 2^f after range reduction, relative error below 1e-6
+    static __m256 Exp8(__m256 x)
+    {
+        x = _mm256_max_ps(x, _mm256_set1_ps(-87.0f));
+        __m256 t = _mm256_mul_ps(x, _mm256_set1_ps(1.44269504f));
+        __m256 n = _mm256_floor_ps(t);
+        __m256 f = _mm256_sub_ps(t, n);
+        __m256 p = _mm256_set1_ps(1.8775767e-3f);
+        p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(8.9893397e-3f));
+        p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(5.5826318e-2f));
+        p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(2.4015361e-1f));
+        p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(6.9315308e-1f));
+        p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(9.9999994e-1f));
+        __m256i exponent = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+        return _mm256_mul_ps(p, _mm256_castsi256_ps(exponent));
+    }
+
+    static __m256 NormalWeight8(__m256 cos_theta, int exponent)
+    {
+        __m256 base = _mm256_max_ps(cos_theta, _mm256_setzero_ps());
+        __m256 result = _mm256_set1_ps(1.0f);
+        for (; exponent > 0; exponent >>= 1)
+        {
+            if (exponent & 1)
+            {
+                result = _mm256_mul_ps(result, base);
+            }
+            base = _mm256_mul_ps(base, base);
+        }
+        return result;
+    }
+#endif
+
+    std::unique_ptr<Denoiser> Denoiser::Create()
+    {
+        return std::unique_ptr<Denoiser>(new Denoiser());
+    }
+
+    void Denoiser::Resize(int width, int height, int margin)
+    {
+        // the right margin also takes the lanes of the last SIMD block that fall past the row
+        int stride = margin + width + margin + SIMD_WIDTH;
+        if (width == m_width && height == m_height && stride == m_stride)
+        {
+            return;
+        }
+
+        m_width = width;
+        m_height = height;
+        m_margin = margin;
+        m_stride = stride;
+        // margins stay zero, a zero normal gives the taps that land there no weight
+        size_t size = (size_t) stride * height;
+        for (auto& plane : m_guides)
+        {
+            plane.assign(size, 0.0f);
+        }
+        for (auto& planes : m_colors)
+        {
+            for (auto& channel : planes.channels)
+            {
+                channel.assign(size, 0.0f);
+            }
+        }
+        for (auto& channel : m_moments.channels)
+        {
+            channel.assign(size, 0.0f);
+        }
+    }
+
+    void Denoiser::Denoise(const DenoiserSettings& settings, int width, int height, const XMFLOAT4* color, const DenoiserGuide* guides,
+        const float* variance, XMFLOAT4* output)
+    {
+        m_settings = settings;
+        m_settings.iterations = (std::max)(1, m_settings.iterations);
+        this->Resize(width, height, 2 << (m_settings.iterations - 1));
+
+        ThreadPool* pool = ThreadPool::GetInstance();
+        int grain = (std::max)(1, DENOISE_GRAIN_PIXELS / width);
+        auto for_each_row = [&](const std::function<void(int)>& func) {
+            pool->ParallelFor(0, height, grain, [&](int begin, int end) {
+                for (int y = begin; y < end; ++y)
+                {
+                    func(y);
+                }
+            });
+        };
+
+        bool unknown_variance = variance == nullptr;
+        for (int i = 0; variance && !unknown_variance && i < width * height; ++i)
+        {
+            unknown_variance = variance[i] < 0.0f;
+        }
+
+        for_each_row([&](int y) { this->LoadRow(y, color, guides, variance); });
+        for_each_row([&](int y) { this->ComputeDepthGradientRow(y); });
+        if (unknown_variance)
+        {
+            // one pass over the luminance moments with the geometric weights only
+            for_each_row([&](int y) { this->FilterRow<false>(y, 1, m_moments, m_colors[1]); });
+            for_each_row([&](int y) { this->EstimateVarianceRow(y); });
+        }
+
+        int src = 0;
+        for (int i = 0; i < m_settings.iterations; ++i)
+        {
+            for_each_row([&](int y) { this->ComputeLuminanceRow(y, m_colors[src]); });
+            for_each_row([&](int y) { this->FilterRow<true>(y, 1 << i, m_colors[src], m_colors[1 - src]); });
+            src = 1 - src;
+        }
+
+        for_each_row([&](int y) { this->StoreRow(y, m_colors[src], guides, output); });
+    }
+
+    // Splits the color into illumination and albedo, pixels without a surface keep their color as is.
+    void Denoiser::LoadRow(int y, const XMFLOAT4* color, const DenoiserGuide* guides, const float* variance)
+    {
+        for (int x = 0; x < m_width; ++x)
+        {
+            int pixel = y * m_width + x;
+            size_t index = this->GetIndex(x, y);
+            const DenoiserGuide& guide = guides[pixel];
+            bool valid = guide.normal.x != 0.0f || guide.normal.y != 0.0f || guide.normal.z != 0.0f;
+            XMFLOAT3 albedo = valid ? guide.albedo : XMFLOAT3(1.0f, 1.0f, 1.0f);
+            XMFLOAT3 divisor = { (std::max)(albedo.x, MIN_ALBEDO), (std::max)(albedo.y, MIN_ALBEDO), (std::max)(albedo.z, MIN_ALBEDO) };
+            float r = color[pixel].x / divisor.x;
+            float g = color[pixel].y / divisor.y;
+            float b = color[pixel].z / divisor.z;
+            float luminance = GetLuminance(r, g, b);
+            // the given variance is of the color, dividing by the albedo scales the noise by about 1 / its luminance
+            float divisor_luminance = GetLuminance(divisor.x, divisor.y, divisor.z);
+            float pixel_variance = variance && variance[pixel] >= 0.0f ? variance[pixel] / (divisor_luminance * divisor_luminance) : -1.0f;
+
+            m_guides[GUIDE_NORMAL_X][index] = guide.normal.x;
+            m_guides[GUIDE_NORMAL_Y][index] = guide.normal.y;
+            m_guides[GUIDE_NORMAL_Z][index] = guide.normal.z;
+            m_guides[GUIDE_DEPTH][index] = guide.depth;
+            m_colors[0].channels[0][index] = r;
+            m_colors[0].channels[1][index] = g;
+            m_colors[0].channels[2][index] = b;
+            m_colors[0].channels[3][index] = pixel_variance;
+            m_moments.channels[0][index] = luminance;
+            m_moments.channels[1][index] = luminance * luminance;
+        }
+    }
+
+    // The smaller one sided difference toward a neighbor with a surface, so that depth discontinuities do not
+    // widen the depth tolerance of the pixels next to them.
+    void Denoiser::ComputeDepthGradientRow(int y)
+    {
+        const float* normal_x = m_guides[GUIDE_NORMAL_X].data();
+        const float* normal_y = m_guides[GUIDE_NORMAL_Y].data();
+        const float* normal_z = m_guides[GUIDE_NORMAL_Z].data();
+        const float* depth = m_guides[GUIDE_DEPTH].data();
+        auto gradient = [&](size_t index, int x, int y, int dx, int dy) {
+            float result = FLT_MAX;
+            for (int sign = -1; sign <= 1; sign += 2)
+            {
+                int nx = x + dx * sign;
+                int ny = y + dy * sign;
+                if (nx < 0 || nx >= m_width || ny < 0 || ny >= m_height)
+                {
+                    continue;
+                }
+                size_t neighbor = this->GetIndex(nx, ny);
+                if (normal_x[neighbor] != 0.0f || normal_y[neighbor] != 0.0f || normal_z[neighbor] != 0.0f)
+                {
+                    float difference = (depth[neighbor] - depth[index]) * sign;
+                    result = fabsf(difference) < fabsf(result) ? difference : result;
+                }
+            }
+            return result == FLT_MAX ? 0.0f : result;
+        };
+
+        for (int x = 0; x < m_width; ++x)
+        {
+            size_t index = this->GetIndex(x, y);
+            m_guides[GUIDE_DEPTH_DX][index] = gradient(index, x, y, 1, 0);
+            m_guides[GUIDE_DEPTH_DY][index] = gradient(index, x, y, 0, 1);
+        }
+    }
+
+    void Denoiser::EstimateVarianceRow(int y)
+    {
+        for (int x = 0; x < m_width; ++x)
+        {
+            size_t index = this->GetIndex(x, y);
+            float& variance = m_colors[0].channels[3][index];
+            if (variance < 0.0f)
+            {
+                float mean = m_colors[1].channels[0][index];
+                variance = (std::max)(0.0f, m_colors[1].channels[1][index] - mean * mean);
+            }
+        }
+    }
+
+    // Luminance of the pass input and the scale of its differences. The variance is blurred with a 3x3 gaussian
+    // first, a single pixel estimate is too noisy to steer the filter.
+    void Denoiser::ComputeLuminanceRow(int y, const ColorPlanes& planes)
+    {
+        static const float GAUSSIAN[3] = { 0.25f, 0.5f, 0.25f };
+        const float* variance = planes.channels[3].data();
+        float* scale = m_guides[GUIDE_LUMINANCE_SCALE].data();
+        float* luminance = m_guides[GUIDE_LUMINANCE].data();
+        for (int x = 0; x < m_width; ++x)
+        {
+            float sum = 0.0f;
+            for (int dy = -1; dy <= 1; ++dy)
+            {
+                int ny = (std::min)((std::max)(y + dy, 0), m_height - 1);
+                const float* row = &variance[this->GetIndex(x, ny)];
+                sum += GAUSSIAN[dy + 1] * (GAUSSIAN[0] * row[-1] + GAUSSIAN[1] * row[0] + GAUSSIAN[2] * row[1]);
+            }
+            size_t index = this->GetIndex(x, y);
+            scale[index] = 1.0f / (m_settings.luminance_sigma * sqrtf(sum) + LUMINANCE_EPSILON);
+            luminance[index] = GetLuminance(planes.channels[0][index], planes.channels[1][index], planes.channels[2][index]);
+        }
+    }
+
+    // One a-trous pass over a row: every pixel averages the 5x5 taps step pixels apart, weighted by the B3 spline
+    // and the edge stopping functions of SVGF. The variance channel is weighted by the squared weights, so that it
+    // follows the filtered color.
+    template<bool LUMINANCE_WEIGHT>
+    void Denoiser::FilterRow(int y, int step, const ColorPlanes& src, ColorPlanes& dst) const
+    {
+        const float* normal_x = m_guides[GUIDE_NORMAL_X].data();
+        const float* normal_y = m_guides[GUIDE_NORMAL_Y].data();
+        const float* normal_z = m_guides[GUIDE_NORMAL_Z].data();
+        const float* depth = m_guides[GUIDE_DEPTH].data();
+        const float* depth_dx = m_guides[GUIDE_DEPTH_DX].data();
+        const float* depth_dy = m_guides[GUIDE_DEPTH_DY].data();
+        const float* luminance = m_guides[GUIDE_LUMINANCE].data();
+        const float* luminance_scale = m_guides[GUIDE_LUMINANCE_SCALE].data();
+        const float* in[4] = { src.channels[0].data(), src.channels[1].data(), src.channels[2].data(), src.channels[3].data() };
+        float* out[4] = { dst.channels[0].data(), dst.channels[1].data(), dst.channels[2].data(), dst.channels[3].data() };
+        float center_weight = KERNEL[2] * KERNEL[2];
+
+        int x = 0;
+#if defined(__AVX2__)
+        // eight pixels per block, the taps of consecutive pixels are consecutive too. The last block runs into
+        // the right margin, whose lanes have no surface and keep their zero color.
+        __m256 sign_mask = _mm256_set1_ps(-0.0f);
+        __m256 depth_sigma = _mm256_set1_ps(m_settings.depth_sigma);
+        __m256 depth_epsilon = _mm256_set1_ps(DEPTH_EPSILON);
+        for (; x < m_width; x += SIMD_WIDTH)
+        {
+            size_t index = this->GetIndex(x, y);
+            __m256 center_nx = _mm256_loadu_ps(normal_x + index);
+            __m256 center_ny = _mm256_loadu_ps(normal_y + index);
+            __m256 center_nz = _mm256_loadu_ps(normal_z + index);
+            __m256 center_depth = _mm256_loadu_ps(depth + index);
+            __m256 center_dx = _mm256_loadu_ps(depth_dx + index);
+            __m256 center_dy = _mm256_loadu_ps(depth_dy + index);
+            __m256 center[4];
+            for (int c = 0; c < 4; ++c)
+            {
+                center[c] = _mm256_loadu_ps(in[c] + index);
+            }
+            __m256 center_luminance = _mm256_setzero_ps();
+            __m256 center_scale = _mm256_setzero_ps();
+            if (LUMINANCE_WEIGHT)
+            {
+                center_luminance = _mm256_loadu_ps(luminance + index);
+                center_scale = _mm256_loadu_ps(luminance_scale + index);
+            }
+
+            __m256 weight_sum = _mm256_set1_ps(center_weight);
+            __m256 sum[4];
+            for (int c = 0; c < 3; ++c)
+            {
+                sum[c] = _mm256_mul_ps(center[c], weight_sum);
+            }
+            sum[3] = _mm256_mul_ps(center[3], _mm256_mul_ps(weight_sum, weight_sum));
+
+            for (int dy = -2; dy <= 2; ++dy)
+            {
+                int ny = y + dy * step;
+                if (ny < 0 || ny >= m_height)
+                {
+                    continue;
+                }
+                for (int dx = -2; dx <= 2; ++dx)
+                {
+                    if (dx == 0 && dy == 0)
+                    {
+                        continue;
+                    }
+                    size_t tap = this->GetIndex(x + dx * step, ny);
+                    __m256 cos_theta = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(center_nx, _mm256_loadu_ps(normal_x + tap)),
+                        _mm256_mul_ps(center_ny, _mm256_loadu_ps(normal_y + tap))), _mm256_mul_ps(center_nz, _mm256_loadu_ps(normal_z + tap)));
+                    __m256 expected = _mm256_add_ps(_mm256_mul_ps(center_dx, _mm256_set1_ps((float) (dx * step))), _mm256_mul_ps(center_dy, _mm256_set1_ps((float) (dy * step))));
+                    __m256 tolerance = _mm256_add_ps(_mm256_mul_ps(depth_sigma, _mm256_andnot_ps(sign_mask, expected)), depth_epsilon);
+                    // the approximate reciprocal is plenty for a weight and much cheaper than a division
+                    __m256 exponent = _mm256_mul_ps(_mm256_andnot_ps(sign_mask, _mm256_sub_ps(center_depth, _mm256_loadu_ps(depth + tap))), _mm256_rcp_ps(tolerance));
+                    __m256 value[4];
+                    for (int c = 0; c < 4; ++c)
+                    {
+                        value[c] = _mm256_loadu_ps(in[c] + tap);
+                    }
+                    if (LUMINANCE_WEIGHT)
+                    {
+                        __m256 difference = _mm256_sub_ps(center_luminance, _mm256_loadu_ps(luminance + tap));
+                        exponent = _mm256_add_ps(exponent, _mm256_mul_ps(_mm256_andnot_ps(sign_mask, difference), center_scale));
+                    }
+                    __m256 weight = _mm256_mul_ps(_mm256_set1_ps(KERNEL[dx + 2] * KERNEL[dy + 2]),
+                        _mm256_mul_ps(NormalWeight8(cos_theta, m_settings.normal_exponent), Exp8(_mm256_sub_ps(_mm256_setzero_ps(), exponent))));
+
+                    weight_sum = _mm256_add_ps(weight_sum, weight);
+                    for (int c = 0; c < 3; ++c)
+                    {
+                        sum[c] = _mm256_add_ps(sum[c], _mm256_mul_ps(value[c], weight));
+                    }
+                    sum[3] = _mm256_add_ps(sum[3], _mm256_mul_ps(value[3], _mm256_mul_ps(weight, weight)));
+                }
+            }
+
+            __m256 inverse_sum = _mm256_div_ps(_mm256_set1_ps(1.0f), weight_sum);
+            for (int c = 0; c < 3; ++c)
+            {
+                _mm256_storeu_ps(out[c] + index, _mm256_mul_ps(sum[c], inverse_sum));
+            }
+            _mm256_storeu_ps(out[3] + index, _mm256_mul_ps(sum[3], _mm256_mul_ps(inverse_sum, inverse_sum)));
+        }
+#endif
+        for (; x < m_width; ++x)
+        {
+            size_t index = this->GetIndex(x, y);
+            float weight_sum = center_weight;
+            float sum[4];
+            for (int c = 0; c < 3; ++c)
+            {
+                sum[c] = in[c][index] * center_weight;
+            }
+            sum[3] = in[3][index] * center_weight * center_weight;
+
+            for (int dy = -2; dy <= 2; ++dy)
+            {
+                int ny = y + dy * step;
+                if (ny < 0 || ny >= m_height)
+                {
+                    continue;
+                }
+                for (int dx = -2; dx <= 2; ++dx)
+                {
+                    if (dx == 0 && dy == 0)
+                    {
+                        continue;
+                    }
+                    size_t tap = this->GetIndex(x + dx * step, ny);
+                    float cos_theta = normal_x[index] * normal_x[tap] + normal_y[index] * normal_y[tap] + normal_z[index] * normal_z[tap];
+                    float expected = depth_dx[index] * (dx * step) + depth_dy[index] * (dy * step);
+                    float exponent = fabsf(depth[index] - depth[tap]) / (m_settings.depth_sigma * fabsf(expected) + DEPTH_EPSILON);
+                    if (LUMINANCE_WEIGHT)
+                    {
+                        exponent += fabsf(luminance[index] - luminance[tap]) * luminance_scale[index];
+                    }
+                    float weight = KERNEL[dx + 2] * KERNEL[dy + 2] * NormalWeight(cos_theta, m_settings.normal_exponent) * expf(-exponent);
+
+                    weight_sum += weight;
+                    for (int c = 0; c < 3; ++c)
+                    {
+                        sum[c] += in[c][tap] * weight;
+                    }
+                    sum[3] += in[3][tap] * weight * weight;
+                }
+            }
+
+            for (int c = 0; c < 3; ++c)
+            {
+                out[c][index] = sum[c] / weight_sum;
+            }
+            out[3][index] = sum[3] / (weight_sum * weight_sum);
+        }
+    }
+
+    void Denoiser::StoreRow(int y, const ColorPlanes& planes, const DenoiserGuide* guides, XMFLOAT4* output) const
+    {
+        for (int x = 0; x < m_width; ++x)
+        {
+            int pixel = y * m_width + x;
+            size_t index = this->GetIndex(x, y);
+            const DenoiserGuide& guide = guides[pixel];
+            bool valid = guide.normal.x != 0.0f || guide.normal.y != 0.0f || guide.normal.z != 0.0f;
+            XMFLOAT3 albedo = valid ? guide.albedo : XMFLOAT3(1.0f, 1.0f, 1.0f);
+            output[pixel] = {
+                planes.channels[0][index] * (std::max)(albedo.x, MIN_ALBEDO),
+                planes.channels[1][index] * (std::max)(albedo.y, MIN_ALBEDO),
+                planes.channels[2][index] * (std::max)(albedo.z, MIN_ALBEDO),
+                1.0f,
+            };
+        }
+    }
+}
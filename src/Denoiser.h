@@ -0,0 +1,98 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include "DeviceResources.h"
+#include <memory>
+#include <vector>
+
+namespace dxrf
+{
+    struct DenoiserSettings
+    {
+        int iterations = 5;             // a-trous passes, the step doubles from 1 and the filter reaches 2 * (2^iterations - 1) pixels
+        float luminance_sigma = 4.0f;   // luminance differences are measured in standard deviations of the noise
+        float depth_sigma = 1.0f;       // depth differences are measured against the depth gradient
+        int normal_exponent = 128;
+    };
+
+    // Per pixel guides of the filter, taken at the first surface a camera ray hit. normal is zero where the ray
+    // missed, those pixels are passed through unfiltered.
+    struct DenoiserGuide
+    {
+        XMFLOAT3 albedo = { 1, 1, 1 };
+        XMFLOAT3 normal = { 0, 0, 0 };
+        float depth = 0.0f;
+    };
+
+    // Spatial part of SVGF (Schied et al. 2017): the color is divided by the albedo and the illumination goes
+    // through edge-aware a-trous wavelet passes, weighted by depth, normal and luminance relative to the
+    // estimated noise, before the albedo is multiplied back. Planes are stored per channel with a margin wide
+    // enough for the largest step, so eight pixels of a row filter at once with AVX2. Rows are spread over the
+    // thread pool, buffers are kept between calls of the same size.
+    class Denoiser
+    {
+    public:
+        static std::unique_ptr<Denoiser> Create();
+        // color and guides are width x height. variance is the luminance variance of each color as rendered, the
+        // filter divides it by the squared albedo luminance along with the color. Negative values or a nullptr
+        // array mark unknown variance, which is then estimated from the neighbors with similar guides.
+        void Denoise(const DenoiserSettings& settings, int width, int height, const XMFLOAT4* color, const DenoiserGuide* guides,
+            const float* variance, XMFLOAT4* output);
+
+    private:
+        enum GuidePlane
+        {
+            GUIDE_NORMAL_X,
+            GUIDE_NORMAL_Y,
+            GUIDE_NORMAL_Z,
+            GUIDE_DEPTH,
+            GUIDE_DEPTH_DX,
+            GUIDE_DEPTH_DY,
+            GUIDE_LUMINANCE,       // luminance of the current pass input
+            GUIDE_LUMINANCE_SCALE, // 1 / (luminance_sigma * standard deviation) of the current pass
+            GUIDE_PLANE_COUNT,
+        };
+
+        // red, green, blue and luminance variance
+        struct ColorPlanes
+        {
+            std::vector<float> channels[4];
+        };
+
+        Denoiser() = default;
+        void Resize(int width, int height, int margin);
+        size_t GetIndex(int x, int y) const { return (size_t) (y * m_stride + x + m_margin); }
+        void LoadRow(int y, const XMFLOAT4* color, const DenoiserGuide* guides, const float* variance);
+        void ComputeDepthGradientRow(int y);
+        void EstimateVarianceRow(int y);
+        void ComputeLuminanceRow(int y, const ColorPlanes& planes);
+        template<bool LUMINANCE_WEIGHT>
+        void FilterRow(int y, int step, const ColorPlanes& src, ColorPlanes& dst) const;
+        void StoreRow(int y, const ColorPlanes& planes, const DenoiserGuide* guides, XMFLOAT4* output) const;
+
+    private:
+        DenoiserSettings m_settings;
+        int m_width = 0;
+        int m_height = 0;
+        int m_margin = 0;
+        int m_stride = 0;
+        std::vector<float> m_guides[GUIDE_PLANE_COUNT];
+        ColorPlanes m_colors[2];    // ping-pong buffers of the passes
+        ColorPlanes m_moments;      // luminance and squared luminance for the variance estimate
+    };
+}
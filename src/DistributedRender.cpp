@@ -0,0 +1,416 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#include "DistributedRender.h"
+#include "Timer.h"
+#include <string.h>
+#include <thread>
+
+namespace dxrf
+{
+    // changes with any change of the messages, workers of another version are turned away
+    static const uint32_t PROTOCOL_VERSION = 1;
+
+    // frames larger than this come from a broken or foreign coordinator
+    static const int MAX_FRAME_SIZE = 16384;
+
+    static const int ACCEPT_POLL_MS = 1000;
+
+    enum MessageType : uint32_t
+    {
+        MESSAGE_HELLO = 1,      // worker to coordinator, HelloMessage
+        MESSAGE_WELCOME,        // coordinator to worker, accepted
+        MESSAGE_FRAME,          // FrameMessage, starts a frame
+        MESSAGE_TILE,           // TileMessage, a tile of the current frame to render
+        MESSAGE_TILE_RESULT,    // TileResultMessage followed by the tile pixels row by row
+        MESSAGE_SHUTDOWN,
+    };
+
+    struct HelloMessage
+    {
+        uint32_t version;
+        uint32_t settings_size;
+        uint32_t constants_size;
+    };
+
+    struct FrameMessage
+    {
+        uint32_t frame_id;      // also the frame index the pixels are sampled with
+        int32_t width;
+        int32_t height;
+        CpuRenderSettings settings;
+        SceneConstantBuffer constants;
+    };
+
+    struct TileMessage
+    {
+        uint32_t frame_id;
+        int32_t x;
+        int32_t y;
+        int32_t width;
+        int32_t height;
+    };
+
+    struct TileResultMessage
+    {
+        TileMessage tile;
+        float render_ms;
+    };
+
+    static HelloMessage GetHello()
+    {
+        return { PROTOCOL_VERSION, (uint32_t) sizeof(CpuRenderSettings), (uint32_t) sizeof(SceneConstantBuffer) };
+    }
+
+    // payloads are byte buffers without alignment, messages holding XMMATRIX are copied out
+    template<class T>
+    static bool ReadMessage(const std::vector<uint8_t>& payload, T* message)
+    {
+        if (payload.size() < sizeof(T))
+        {
+            return false;
+        }
+        memcpy(message, payload.data(), sizeof(T));
+        return true;
+    }
+
+    std::unique_ptr<RenderCoordinator> RenderCoordinator::Create(int port, const DistributedRenderSettings& settings)
+    {
+        std::unique_ptr<Socket> listener = Socket::Listen(port, !settings.remote_workers);
+        if (!listener)
+        {
+            return nullptr;
+        }
+
+        std::unique_ptr<RenderCoordinator> coordinator(new RenderCoordinator());
+        coordinator->m_settings = settings;
+        coordinator->m_settings.tile_size = (std::max)(1, settings.tile_size);
+        coordinator->m_settings.tiles_in_flight = (std::max)(1, settings.tiles_in_flight);
+        coordinator->m_listener = std::move(listener);
+
+        return coordinator;
+    }
+
+    RenderCoordinator::~RenderCoordinator()
+    {
+        for (Worker& worker : m_workers)
+        {
+            if (worker.connected)
+            {
+                worker.socket->SendPacket(MESSAGE_SHUTDOWN, nullptr, 0);
+            }
+        }
+    }
+
+    bool RenderCoordinator::AcceptWorkers(int count, const std::function<bool()>& keep_waiting)
+    {
+        int accepted = 0;
+        while (accepted < count)
+        {
+            bool timed_out = false;
+            std::unique_ptr<Socket> socket = m_listener->Accept(keep_waiting ? ACCEPT_POLL_MS : -1, &timed_out);
+            if (!socket)
+            {
+                if (timed_out && keep_waiting())
+                {
+                    continue;
+                }
+                return false;
+            }
+
+            uint32_t type = 0;
+            std::vector<uint8_t> payload;
+            HelloMessage hello;
+            HelloMessage expected = GetHello();
+            if (!socket->ReceivePacket(&type, &payload) || type != MESSAGE_HELLO || !ReadMessage(payload, &hello) ||
+                memcmp(&hello, &expected, sizeof(hello)) != 0)
+            {
+                continue;
+            }
+            if (!socket->SendPacket(MESSAGE_WELCOME, nullptr, 0))
+            {
+                continue;
+            }
+
+            Worker worker;
+            worker.socket = std::move(socket);
+            m_workers.push_back(std::move(worker));
+            accepted += 1;
+        }
+        return true;
+    }
+
+    bool RenderCoordinator::RenderFrame(const CpuRenderSettings& settings, const SceneConstantBuffer& constants, int width, int height,
+        XMFLOAT4* output)
+    {
+        Timer timer;
+        m_stats = DistributedRenderStats();
+        m_stats.worker_tile_count.assign(m_workers.size(), 0);
+        m_stats.worker_render_ms.assign(m_workers.size(), 0.0);
+
+        // popped from the back, so the first row of tiles goes out first
+        m_queue.clear();
+        int tile_size = m_settings.tile_size;
+        for (int y = ((height - 1) / tile_size) * tile_size; y >= 0; y -= tile_size)
+        {
+            for (int x = ((width - 1) / tile_size) * tile_size; x >= 0; x -= tile_size)
+            {
+                m_queue.push_back({ x, y, (std::min)(tile_size, width - x), (std::min)(tile_size, height - y) });
+            }
+        }
+        m_stats.tile_count = (int) m_queue.size();
+        m_remaining_tile_count = m_stats.tile_count;
+
+        uint32_t frame_id = m_frame_id;
+        FrameMessage frame;
+        frame.frame_id = frame_id;
+        frame.width = width;
+        frame.height = height;
+        frame.settings = settings;
+        frame.constants = constants;
+
+        std::vector<std::thread> threads;
+        for (int i = 0; i < (int) m_workers.size(); ++i)
+        {
+            if (!m_workers[i].connected)
+            {
+                continue;
+            }
+            if (!m_workers[i].socket->SendPacket(MESSAGE_FRAME, &frame, sizeof(frame)))
+            {
+                m_workers[i].connected = false;
+                continue;
+            }
+            threads.emplace_back([=]() {
+                this->RunWorker(i, frame_id, width, output);
+            });
+        }
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+
+        m_frame_id += 1;
+        m_stats.frame_ms = timer.GetElapsedMs();
+        return m_remaining_tile_count == 0;
+    }
+
+    bool RenderCoordinator::PopTile(std::vector<Tile>* in_flight)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_queue.empty())
+        {
+            return false;
+        }
+        in_flight->push_back(m_queue.back());
+        m_queue.pop_back();
+        return true;
+    }
+
+    // Keeps tiles_in_flight tiles queued on one worker and writes back its results until the frame is done. Workers
+    // render their tiles in order, the next result always belongs to the oldest tile in flight.
+    void RenderCoordinator::RunWorker(int worker_index, uint32_t frame_id, int frame_width, XMFLOAT4* output)
+    {
+        Worker& worker = m_workers[worker_index];
+        std::vector<Tile> in_flight;
+        std::vector<uint8_t> payload;
+        bool connected = true;
+        while (connected)
+        {
+            while ((int) in_flight.size() < m_settings.tiles_in_flight && this->PopTile(&in_flight))
+            {
+                const Tile& tile = in_flight.back();
+                TileMessage message = { frame_id, tile.x, tile.y, tile.width, tile.height };
+                if (!worker.socket->SendPacket(MESSAGE_TILE, &message, sizeof(message)))
+                {
+                    connected = false;
+                    break;
+                }
+            }
+            if (!connected)
+            {
+                break;
+            }
+
+            if (in_flight.empty())
+            {
+                // other workers still hold tiles, wait in case one of them drops out and gives them back
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, [&]() { return !m_queue.empty() || m_remaining_tile_count == 0; });
+                if (m_remaining_tile_count == 0)
+                {
+                    return;
+                }
+                continue;
+            }
+
+            const Tile& tile = in_flight.front();
+            uint32_t type = 0;
+            TileResultMessage result;
+            size_t pixel_size = sizeof(XMFLOAT4) * tile.width * tile.height;
+            if (!worker.socket->ReceivePacket(&type, &payload) || type != MESSAGE_TILE_RESULT || !ReadMessage(payload, &result) ||
+                result.tile.frame_id != frame_id || result.tile.x != tile.x || result.tile.y != tile.y ||
+                payload.size() != sizeof(result) + pixel_size)
+            {
+                connected = false;
+                break;
+            }
+
+            // tiles never overlap, the rows go straight to the frame
+            const XMFLOAT4* pixels = (const XMFLOAT4*) (payload.data() + sizeof(result));
+            for (int y = 0; y < tile.height; ++y)
+            {
+                memcpy(&output[(tile.y + y) * frame_width + tile.x], &pixels[y * tile.width], sizeof(XMFLOAT4) * tile.width);
+            }
+            in_flight.erase(in_flight.begin());
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stats.worker_tile_count[worker_index] += 1;
+            m_stats.worker_render_ms[worker_index] += result.render_ms;
+            m_remaining_tile_count -= 1;
+            if (m_remaining_tile_count == 0)
+            {
+                m_cv.notify_all();
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        worker.connected = false;
+        m_stats.requeued_tile_count += (int) in_flight.size();
+        m_queue.insert(m_queue.end(), in_flight.begin(), in_flight.end());
+        m_cv.notify_all();
+    }
+
+    std::unique_ptr<RenderWorker> RenderWorker::Create(CpuRenderer* renderer)
+    {
+        std::unique_ptr<RenderWorker> worker(new RenderWorker());
+        worker->m_renderer = renderer;
+
+        return worker;
+    }
+
+    bool RenderWorker::Run(const std::string& host, int port)
+    {
+        std::unique_ptr<Socket> socket = Socket::Connect(host, port);
+        if (!socket)
+        {
+            return false;
+        }
+
+        HelloMessage hello = GetHello();
+        uint32_t type = 0;
+        std::vector<uint8_t> payload;
+        if (!socket->SendPacket(MESSAGE_HELLO, &hello, sizeof(hello)) || !socket->ReceivePacket(&type, &payload) || type != MESSAGE_WELCOME)
+        {
+            return false;
+        }
+
+        while (socket->ReceivePacket(&type, &payload))
+        {
+            if (type == MESSAGE_FRAME)
+            {
+                if (!this->BeginFrame(payload))
+                {
+                    break;
+                }
+            }
+            else if (type == MESSAGE_TILE)
+            {
+                if (!this->RenderTile(socket.get(), payload))
+                {
+                    break;
+                }
+            }
+            else if (type == MESSAGE_SHUTDOWN)
+            {
+                break;
+            }
+        }
+        return true;
+    }
+
+    // Settings are only applied when they change, so the light cache and the irradiance volume carry over from
+    // frame to frame. False for a frame without pixels or larger than MAX_FRAME_SIZE, the worker leaves then.
+    bool RenderWorker::BeginFrame(const std::vector<uint8_t>& payload)
+    {
+        FrameMessage frame;
+        if (!ReadMessage(payload, &frame) || frame.width <= 0 || frame.height <= 0 || frame.width > MAX_FRAME_SIZE ||
+            frame.height > MAX_FRAME_SIZE)
+        {
+            return false;
+        }
+        // tiles are filtered without their neighbors, the seams would show
+        frame.settings.denoise = false;
+
+        bool settings_changed = !m_has_frame || memcmp(&frame.settings, &m_settings, sizeof(m_settings)) != 0;
+        bool light_changed = !m_has_frame || XMVector3NotEqual(frame.constants.light_position, m_constants.light_position);
+        if (frame.width != m_renderer->GetWidth() || frame.height != m_renderer->GetHeight())
+        {
+            m_renderer->OnSizeChanged(frame.width, frame.height);
+        }
+        if (settings_changed)
+        {
+            m_renderer->SetSettings(frame.settings);
+        }
+        if (frame.settings.indirect_light && (settings_changed || light_changed || !m_irradiance_baked))
+        {
+            m_renderer->BakeIrradianceVolume(frame.constants);
+            m_irradiance_baked = true;
+        }
+
+        m_frame_id = frame.frame_id;
+        m_settings = frame.settings;
+        m_constants = frame.constants;
+        m_has_frame = true;
+        return true;
+    }
+
+    bool RenderWorker::RenderTile(Socket* socket, const std::vector<uint8_t>& payload)
+    {
+        TileResultMessage result;
+        if (!m_has_frame || !ReadMessage(payload, &result.tile) || result.tile.frame_id != m_frame_id)
+        {
+            return false;
+        }
+        const TileMessage& tile = result.tile;
+        if (tile.x < 0 || tile.y < 0 || tile.width <= 0 || tile.height <= 0 || tile.x + tile.width > m_renderer->GetWidth() ||
+            tile.y + tile.height > m_renderer->GetHeight())
+        {
+            return false;
+        }
+
+        Timer timer;
+        m_renderer->SetRegion(tile.x, tile.y, tile.width, tile.height);
+        m_renderer->SetFrameIndex(m_frame_id);
+        m_renderer->Render(m_constants);
+        while (m_settings.accumulate && !m_renderer->IsConverged())
+        {
+            m_renderer->Render(m_constants);
+        }
+        result.render_ms = (float) timer.GetElapsedMs();
+
+        const std::vector<XMFLOAT4>& output = m_renderer->GetOutput();
+        int frame_width = m_renderer->GetWidth();
+        m_pixels.resize(tile.width * tile.height);
+        for (int y = 0; y < tile.height; ++y)
+        {
+            memcpy(&m_pixels[y * tile.width], &output[(tile.y + y) * frame_width + tile.x], sizeof(XMFLOAT4) * tile.width);
+        }
+        m_rendered_tile_count += 1;
+
+        return socket->SendPacket(MESSAGE_TILE_RESULT, &result, sizeof(result), m_pixels.data(), (uint32_t) (sizeof(XMFLOAT4) * m_pixels.size()));
+    }
+}
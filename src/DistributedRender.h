@@ -0,0 +1,125 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include "CpuRenderer.h"
+#include "Socket.h"
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+
+namespace dxrf
+{
+    struct DistributedRenderSettings
+    {
+        int tile_size = 64;         // pixels per side of the tiles handed to the workers
+        int tiles_in_flight = 2;    // tiles sent to a worker ahead of its results, hides the round trip
+        // Listens on every interface instead of the loopback interface only, so workers on other machines can
+        // join. Workers are not authenticated, keep it to trusted networks.
+        bool remote_workers = false;
+    };
+
+    struct DistributedRenderStats
+    {
+        double frame_ms = 0.0;
+        int tile_count = 0;
+        int requeued_tile_count = 0;        // tiles of workers that dropped out, rendered again by the others
+        std::vector<int> worker_tile_count;
+        std::vector<double> worker_render_ms; // time the workers spent in CpuRenderer::Render
+    };
+
+    // Splits frames into tiles and renders them on RenderWorker processes, each holding its own copy of the scene.
+    // Workers pull the next tile whenever they return one, so faster machines end up with more of the frame. A
+    // worker that disconnects gives its tiles back to the queue. Settings and constants travel as raw bytes,
+    // coordinator and workers have to be the same build.
+    class RenderCoordinator
+    {
+    public:
+        // Listens for workers on port, 0 takes any free port. Only local workers unless settings.remote_workers is set.
+        static std::unique_ptr<RenderCoordinator> Create(int port, const DistributedRenderSettings& settings);
+        // Tells the workers to exit.
+        ~RenderCoordinator();
+        int GetPort() const { return m_listener->GetPort(); }
+        // Blocks until count more workers connected, false when listening failed. keep_waiting is asked every
+        // second nobody connects and gives up the wait by returning false. Workers of another build are turned away.
+        bool AcceptWorkers(int count, const std::function<bool()>& keep_waiting = nullptr);
+        int GetWorkerCount() const { return (int) m_workers.size(); }
+        // Renders a width x height frame into output, same as CpuRenderer::Render with the settings would, but
+        // without the denoiser, which needs the whole frame. Frames sample differently one after another like
+        // consecutive Render calls do. False when every worker dropped out before the frame was done.
+        bool RenderFrame(const CpuRenderSettings& settings, const SceneConstantBuffer& constants, int width, int height,
+            XMFLOAT4* output);
+        const DistributedRenderStats& GetStats() const { return m_stats; }
+
+    private:
+        struct Tile
+        {
+            int x;
+            int y;
+            int width;
+            int height;
+        };
+
+        struct Worker
+        {
+            std::unique_ptr<Socket> socket;
+            bool connected = true;
+        };
+
+        RenderCoordinator() = default;
+        void RunWorker(int worker_index, uint32_t frame_id, int frame_width, XMFLOAT4* output);
+        bool PopTile(std::vector<Tile>* in_flight);
+
+    private:
+        DistributedRenderSettings m_settings;
+        std::unique_ptr<Socket> m_listener;
+        std::vector<Worker> m_workers;
+        uint32_t m_frame_id = 0;
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        std::vector<Tile> m_queue;
+        int m_remaining_tile_count = 0;
+        DistributedRenderStats m_stats;
+    };
+
+    // Renders the tiles a RenderCoordinator sends with a CpuRenderer set up with the scene, environment and
+    // texture the frames are meant for.
+    class RenderWorker
+    {
+    public:
+        static std::unique_ptr<RenderWorker> Create(CpuRenderer* renderer);
+        // Serves the coordinator at host:port until it shuts down or the connection breaks. False when the
+        // coordinator could not be reached or turned the worker away.
+        bool Run(const std::string& host, int port);
+        int GetRenderedTileCount() const { return m_rendered_tile_count; }
+
+    private:
+        RenderWorker() = default;
+        bool BeginFrame(const std::vector<uint8_t>& payload);
+        bool RenderTile(Socket* socket, const std::vector<uint8_t>& payload);
+
+    private:
+        CpuRenderer* m_renderer = nullptr;
+        uint32_t m_frame_id = 0;
+        CpuRenderSettings m_settings;
+        SceneConstantBuffer m_constants;
+        bool m_has_frame = false;
+        bool m_irradiance_baked = false;
+        int m_rendered_tile_count = 0;
+        std::vector<XMFLOAT4> m_pixels;
+    };
+}
@@ -0,0 +1,371 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#include "EnvironmentMap.h"
+#include "CpuMath.h"
+#include "MipChain.h"
+#include <algorithm>
+#include <immintrin.h>
+
+namespace dxrf
+{
+    // keeps black texels reachable, so the estimator stays unbiased whatever the sky looks like
+    static const float MIN_TEXEL_WEIGHT = 1e-3f;
+
+    static int GetLevelSize(int size, int level)
+    {
+        return (std::max)(1, size >> level);
+    }
+
+    static float Lerp(float a, float b, float t)
+    {
+        return a + (b - a) * t;
+    }
+
+    std::unique_ptr<EnvironmentMap> EnvironmentMap::CreateFromData(int size, void** faces_data)
+    {
+        std::unique_ptr<EnvironmentMap> environment(new EnvironmentMap());
+        environment->m_size = size;
+
+        // the levels the GPU cube gets with MipGeneration::Srgb, color averaged in linear space and stored sRGB
+        // encoded, so both renderers see the same blurred sky
+        std::unique_ptr<MipChain> mips = MipChain::Create(size, size, 6, faces_data, true);
+        int texel_count = 0;
+        for (int level = 0; level < mips->GetLevelCount(); ++level)
+        {
+            int level_size = GetLevelSize(size, level);
+            environment->m_level_offsets.push_back(texel_count);
+            texel_count += 6 * level_size * level_size;
+        }
+        for (auto& channel : environment->m_channels)
+        {
+            channel.resize(texel_count);
+        }
+
+        for (int level = 0; level < mips->GetLevelCount(); ++level)
+        {
+            int level_size = GetLevelSize(size, level);
+            for (int face = 0; face < 6; ++face)
+            {
+                const uint8_t* data = mips->GetData(face, level);
+                int base = environment->m_level_offsets[level] + face * level_size * level_size;
+                for (int i = 0; i < level_size * level_size; ++i)
+                {
+                    for (int c = 0; c < 3; ++c)
+                    {
+                        environment->m_channels[c][base + i] = data[i * 4 + c] / 255.0f;
+                    }
+                }
+            }
+        }
+        environment->BuildDistribution();
+
+        return environment;
+    }
+
+    // Solid angle of a texel relative to its area on the face at distance one.
+    static float GetCubeTexelSolidAngleScale(float s, float t)
+    {
+        float r_sq = 1.0f + s * s + t * t;
+        return 1.0f / (r_sq * sqrtf(r_sq));
+    }
+
+    void EnvironmentMap::BuildDistribution()
+    {
+        int texel_count = 6 * m_size * m_size;
+        m_cdf.resize(texel_count);
+        m_texel_pdf.resize(texel_count);
+
+        double sum = 0.0;
+        for (int i = 0; i < texel_count; ++i)
+        {
+            int x = i % m_size;
+            int y = (i / m_size) % m_size;
+            float s = (x + 0.5f) / m_size * 2.0f - 1.0f;
+            float t = (y + 0.5f) / m_size * 2.0f - 1.0f;
+            XMFLOAT3 color = { m_channels[0][i], m_channels[1][i], m_channels[2][i] };
+            float weight = ((std::max)(Luminance(color), 0.0f) + MIN_TEXEL_WEIGHT) * GetCubeTexelSolidAngleScale(s, t);
+            m_texel_pdf[i] = weight;
+            sum += weight;
+            m_cdf[i] = (float) sum;
+        }
+        for (int i = 0; i < texel_count; ++i)
+        {
+            m_texel_pdf[i] = (float) (m_texel_pdf[i] / sum);
+            m_cdf[i] = (float) (m_cdf[i] / sum);
+        }
+        m_cdf[texel_count - 1] = 1.0f;
+    }
+
+    // Face selection of the D3D cube addressing, s and t get the [-1, 1] coordinates on the face.
+    static int SelectCubeFace(const XMFLOAT3& direction, float* s, float* t)
+    {
+        float ax = fabsf(direction.x);
+        float ay = fabsf(direction.y);
+        float az = fabsf(direction.z);
+        int face;
+        float ma, sc, tc;
+        if (ax >= ay && ax >= az)
+        {
+            face = direction.x >= 0.0f ? 0 : 1;
+            ma = ax;
+            sc = direction.x >= 0.0f ? -direction.z : direction.z;
+            tc = -direction.y;
+        }
+        else if (ay >= az)
+        {
+            face = direction.y >= 0.0f ? 2 : 3;
+            ma = ay;
+            sc = direction.x;
+            tc = direction.y >= 0.0f ? direction.z : -direction.z;
+        }
+        else
+        {
+            face = direction.z >= 0.0f ? 4 : 5;
+            ma = az;
+            sc = direction.z >= 0.0f ? direction.x : -direction.x;
+            tc = -direction.y;
+        }
+        *s = sc / ma;
+        *t = tc / ma;
+        return face;
+    }
+
+    int EnvironmentMap::GetTexelIndex(const XMFLOAT3& direction, XMFLOAT2* face_uv) const
+    {
+        int face = SelectCubeFace(direction, &face_uv->x, &face_uv->y);
+        int x = (std::min)((int) ((face_uv->x * 0.5f + 0.5f) * m_size), m_size - 1);
+        int y = (std::min)((int) ((face_uv->y * 0.5f + 0.5f) * m_size), m_size - 1);
+        return (face * m_size + y) * m_size + x;
+    }
+
+    XMFLOAT3 EnvironmentMap::Sample(const XMFLOAT3& direction) const
+    {
+        XMFLOAT2 face_uv;
+        int index = this->GetTexelIndex(direction, &face_uv);
+        return { m_channels[0][index], m_channels[1][index], m_channels[2][index] };
+    }
+
+    // Texels do not filter across face edges, the last row and column clamp.
+    XMFLOAT3 EnvironmentMap::SampleBilinear(int face, float s, float t, int level) const
+    {
+        int size = GetLevelSize(m_size, level);
+        float u = (s * 0.5f + 0.5f) * size - 0.5f;
+        float v = (t * 0.5f + 0.5f) * size - 0.5f;
+        float x_floor = floorf(u);
+        float y_floor = floorf(v);
+        float fx = u - x_floor;
+        float fy = v - y_floor;
+        int x0 = (std::min)((std::max)((int) x_floor, 0), size - 1);
+        int x1 = (std::min)((std::max)((int) x_floor + 1, 0), size - 1);
+        int y0 = (std::min)((std::max)((int) y_floor, 0), size - 1);
+        int y1 = (std::min)((std::max)((int) y_floor + 1, 0), size - 1);
+
+        int base = m_level_offsets[level] + face * size * size;
+        float result[3];
+        for (int c = 0; c < 3; ++c)
+        {
+            const float* texels = &m_channels[c][base];
+            float top = Lerp(texels[y0 * size + x0], texels[y0 * size + x1], fx);
+            float bottom = Lerp(texels[y1 * size + x0], texels[y1 * size + x1], fx);
+            result[c] = Lerp(top, bottom, fy);
+        }
+        return { result[0], result[1], result[2] };
+    }
+
+    XMFLOAT3 EnvironmentMap::SampleLevel(const XMFLOAT3& direction, float lod) const
+    {
+        float s, t;
+        int face = SelectCubeFace(direction, &s, &t);
+
+        int last_level = this->GetLevelCount() - 1;
+        lod = (std::min)((std::max)(lod, 0.0f), (float) last_level);
+        int level0 = (int) lod;
+        int level1 = (std::min)(level0 + 1, last_level);
+        float blend = lod - level0;
+
+        XMFLOAT3 color0 = this->SampleBilinear(face, s, t, level0);
+        XMFLOAT3 color1 = this->SampleBilinear(face, s, t, level1);
+        return { Lerp(color0.x, color1.x, blend), Lerp(color0.y, color1.y, blend), Lerp(color0.z, color1.z, blend) };
+    }
+
+    void EnvironmentMap::SampleLevel(int count, const XMFLOAT3* directions, const float* lods, XMFLOAT3* colors) const
+    {
+        int i = 0;
+#if defined(__AVX2__)
+        for (; i + 8 <= count; i += 8)
+        {
+            this->SampleLevel8(directions + i, lods ? lods + i : nullptr, colors + i);
+        }
+#endif
+        for (; i < count; ++i)
+        {
+            colors[i] = this->SampleLevel(directions[i], lods ? lods[i] : 0.0f);
+        }
+    }
+
+#if defined(__AVX2__)
+    static __m256 Lerp8(__m256 a, __m256 b, __m256 t)
+    {
+        return _mm256_add_ps(a, _mm256_mul_ps(_mm256_sub_ps(b, a), t));
+    }
+
+    // Eight lane version of SampleLevel, every lane may pick its own face and mips. Texel addresses are
+    // computed in integer lanes and fetched with 12 gathers per mip.
+    void EnvironmentMap::SampleLevel8(const XMFLOAT3* directions, const float* lods, XMFLOAT3* colors) const
+    {
+        float xs[8];
+        float ys[8];
+        float zs[8];
+        for (int i = 0; i < 8; ++i)
+        {
+            xs[i] = directions[i].x;
+            ys[i] = directions[i].y;
+            zs[i] = directions[i].z;
+        }
+        __m256 dx = _mm256_loadu_ps(xs);
+        __m256 dy = _mm256_loadu_ps(ys);
+        __m256 dz = _mm256_loadu_ps(zs);
+
+        // face selection, same tie breaks as SelectCubeFace
+        __m256 sign = _mm256_set1_ps(-0.0f);
+        __m256 zero = _mm256_setzero_ps();
+        __m256 ax = _mm256_andnot_ps(sign, dx);
+        __m256 ay = _mm256_andnot_ps(sign, dy);
+        __m256 az = _mm256_andnot_ps(sign, dz);
+        __m256 is_x = _mm256_and_ps(_mm256_cmp_ps(ax, ay, _CMP_GE_OQ), _mm256_cmp_ps(ax, az, _CMP_GE_OQ));
+        __m256 is_y = _mm256_andnot_ps(is_x, _mm256_cmp_ps(ay, az, _CMP_GE_OQ));
+        __m256 positive_x = _mm256_cmp_ps(dx, zero, _CMP_GE_OQ);
+        __m256 positive_y = _mm256_cmp_ps(dy, zero, _CMP_GE_OQ);
+        __m256 positive_z = _mm256_cmp_ps(dz, zero, _CMP_GE_OQ);
+
+        __m256 ma = az;
+        __m256 sc = _mm256_blendv_ps(_mm256_xor_ps(dx, sign), dx, positive_z);
+        __m256 tc = _mm256_xor_ps(dy, sign);
+        __m256 face = _mm256_blendv_ps(_mm256_set1_ps(5.0f), _mm256_set1_ps(4.0f), positive_z);
+
+        ma = _mm256_blendv_ps(ma, ay, is_y);
+        sc = _mm256_blendv_ps(sc, dx, is_y);
+        tc = _mm256_blendv_ps(tc, _mm256_blendv_ps(_mm256_xor_ps(dz, sign), dz, positive_y), is_y);
+        face = _mm256_blendv_ps(face, _mm256_blendv_ps(_mm256_set1_ps(3.0f), _mm256_set1_ps(2.0f), positive_y), is_y);
+
+        ma = _mm256_blendv_ps(ma, ax, is_x);
+        sc = _mm256_blendv_ps(sc, _mm256_blendv_ps(dz, _mm256_xor_ps(dz, sign), positive_x), is_x);
+        tc = _mm256_blendv_ps(tc, _mm256_xor_ps(dy, sign), is_x);
+        face = _mm256_blendv_ps(face, _mm256_blendv_ps(_mm256_set1_ps(1.0f), _mm256_set1_ps(0.0f), positive_x), is_x);
+
+        __m256 s = _mm256_div_ps(sc, ma);
+        __m256 t = _mm256_div_ps(tc, ma);
+        __m256i face_index = _mm256_cvttps_epi32(face);
+
+        // mip selection
+        int last_level = this->GetLevelCount() - 1;
+        __m256 lod = lods ? _mm256_loadu_ps(lods) : zero;
+        lod = _mm256_min_ps(_mm256_max_ps(lod, zero), _mm256_set1_ps((float) last_level));
+        __m256i level0 = _mm256_cvttps_epi32(lod);
+        __m256i level1 = _mm256_min_epi32(_mm256_add_epi32(level0, _mm256_set1_epi32(1)), _mm256_set1_epi32(last_level));
+        __m256 blend = _mm256_sub_ps(lod, _mm256_cvtepi32_ps(level0));
+
+        __m256 result[2][3];
+        __m256i levels[2] = { level0, level1 };
+        __m256 half = _mm256_set1_ps(0.5f);
+        __m256i one = _mm256_set1_epi32(1);
+        for (int l = 0; l < 2; ++l)
+        {
+            __m256i size = _mm256_max_epi32(_mm256_srlv_epi32(_mm256_set1_epi32(m_size), levels[l]), one);
+            __m256i size_max = _mm256_sub_epi32(size, one);
+            __m256 size_f = _mm256_cvtepi32_ps(size);
+            __m256 u = _mm256_sub_ps(_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(s, half), half), size_f), half);
+            __m256 v = _mm256_sub_ps(_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(t, half), half), size_f), half);
+            __m256 x_floor = _mm256_floor_ps(u);
+            __m256 y_floor = _mm256_floor_ps(v);
+            __m256 fx = _mm256_sub_ps(u, x_floor);
+            __m256 fy = _mm256_sub_ps(v, y_floor);
+            __m256i x = _mm256_cvttps_epi32(x_floor);
+            __m256i y = _mm256_cvttps_epi32(y_floor);
+            __m256i x0 = _mm256_min_epi32(_mm256_max_epi32(x, _mm256_setzero_si256()), size_max);
+            __m256i x1 = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(x, one), _mm256_setzero_si256()), size_max);
+            __m256i y0 = _mm256_min_epi32(_mm256_max_epi32(y, _mm256_setzero_si256()), size_max);
+            __m256i y1 = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(y, one), _mm256_setzero_si256()), size_max);
+
+            __m256i base = _mm256_i32gather_epi32(m_level_offsets.data(), levels[l], 4);
+            base = _mm256_add_epi32(base, _mm256_mullo_epi32(face_index, _mm256_mullo_epi32(size, size)));
+            __m256i row0 = _mm256_add_epi32(base, _mm256_mullo_epi32(y0, size));
+            __m256i row1 = _mm256_add_epi32(base, _mm256_mullo_epi32(y1, size));
+            __m256i index00 = _mm256_add_epi32(row0, x0);
+            __m256i index01 = _mm256_add_epi32(row0, x1);
+            __m256i index10 = _mm256_add_epi32(row1, x0);
+            __m256i index11 = _mm256_add_epi32(row1, x1);
+
+            for (int c = 0; c < 3; ++c)
+            {
+                const float* texels = m_channels[c].data();
+                __m256 top = Lerp8(_mm256_i32gather_ps(texels, index00, 4), _mm256_i32gather_ps(texels, index01, 4), fx);
+                __m256 bottom = Lerp8(_mm256_i32gather_ps(texels, index10, 4), _mm256_i32gather_ps(texels, index11, 4), fx);
+                result[l][c] = Lerp8(top, bottom, fy);
+            }
+        }
+
+        float channels[3][8];
+        for (int c = 0; c < 3; ++c)
+        {
+            _mm256_storeu_ps(channels[c], Lerp8(result[0][c], result[1][c], blend));
+        }
+        for (int i = 0; i < 8; ++i)
+        {
+            colors[i] = { channels[0][i], channels[1][i], channels[2][i] };
+        }
+    }
+#endif
+
+    XMFLOAT3 EnvironmentMap::SampleDirection(const XMFLOAT2& u, float* pdf) const
+    {
+        int index = (int) (std::lower_bound(m_cdf.begin(), m_cdf.end(), u.x) - m_cdf.begin());
+        index = (std::min)(index, (int) m_cdf.size() - 1);
+
+        // reuse the remainder of u.x inside the texel, u.y covers the other axis
+        float cdf_begin = index > 0 ? m_cdf[index - 1] : 0.0f;
+        float offset_x = (std::min)((u.x - cdf_begin) / (std::max)(m_cdf[index] - cdf_begin, 1e-12f), 0.999999f);
+        int x = index % m_size;
+        int y = (index / m_size) % m_size;
+        int face = index / (m_size * m_size);
+        float s = (x + offset_x) / m_size * 2.0f - 1.0f;
+        float t = (y + u.y) / m_size * 2.0f - 1.0f;
+
+        XMFLOAT3 direction;
+        switch (face)
+        {
+        case 0: direction = { 1.0f, -t, -s }; break;
+        case 1: direction = { -1.0f, -t, s }; break;
+        case 2: direction = { s, 1.0f, t }; break;
+        case 3: direction = { s, -1.0f, -t }; break;
+        case 4: direction = { s, -t, 1.0f }; break;
+        default: direction = { -s, -t, -1.0f }; break;
+        }
+
+        float texel_area = 4.0f / (m_size * m_size);
+        *pdf = m_texel_pdf[index] / (texel_area * GetCubeTexelSolidAngleScale(s, t));
+        return Normalize(direction);
+    }
+
+    float EnvironmentMap::GetPdf(const XMFLOAT3& direction) const
+    {
+        XMFLOAT2 face_uv;
+        int index = this->GetTexelIndex(direction, &face_uv);
+        float texel_area = 4.0f / (m_size * m_size);
+        return m_texel_pdf[index] / (texel_area * GetCubeTexelSolidAngleScale(face_uv.x, face_uv.y));
+    }
+}
@@ -0,0 +1,60 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include "DeviceResources.h"
+#include <memory>
+#include <vector>
+
+namespace dxrf
+{
+    // CPU copy of the sky cubemap MyMissShader samples, with the mip chain of the GPU cube for blurred lookups and
+    // luminance importance sampling for the path tracer. Texel values are the stored sRGB encoded ones, like the
+    // UNORM view the shader reads. Faces are in D3D order +X, -X, +Y, -Y, +Z, -Z.
+    // Texels are stored per channel so that the batched lookups gather eight directions at once.
+    class EnvironmentMap
+    {
+    public:
+        // faces_data holds six size x size RGBA8 images, same layout Texture::CreateTextureFromData takes for cubes.
+        static std::unique_ptr<EnvironmentMap> CreateFromData(int size, void** faces_data);
+        // Point filtered lookup of the top level.
+        XMFLOAT3 Sample(const XMFLOAT3& direction) const;
+        // Bilinear lookup within the face, trilinear between the mips around lod.
+        XMFLOAT3 SampleLevel(const XMFLOAT3& direction, float lod) const;
+        // SampleLevel over count directions, eight at a time with AVX2. lods may be nullptr for the top level.
+        void SampleLevel(int count, const XMFLOAT3* directions, const float* lods, XMFLOAT3* colors) const;
+        // Picks a direction proportional to texel luminance times solid angle, pdf is per unit solid angle.
+        XMFLOAT3 SampleDirection(const XMFLOAT2& u, float* pdf) const;
+        float GetPdf(const XMFLOAT3& direction) const;
+        int GetSize() const { return m_size; }
+        int GetLevelCount() const { return (int) m_level_offsets.size(); }
+
+    private:
+        EnvironmentMap() = default;
+        int GetTexelIndex(const XMFLOAT3& direction, XMFLOAT2* face_uv) const;
+        XMFLOAT3 SampleBilinear(int face, float s, float t, int level) const;
+        void SampleLevel8(const XMFLOAT3* directions, const float* lods, XMFLOAT3* colors) const;
+        void BuildDistribution();
+
+    private:
+        int m_size = 0;
+        std::vector<float> m_channels[3];   // all levels back to back, level l starts at m_level_offsets[l]
+        std::vector<int> m_level_offsets;
+        std::vector<float> m_cdf;
+        std::vector<float> m_texel_pdf;     // probability of picking the texel
+    };
+}
@@ -0,0 +1,212 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#include "IrradianceVolume.h"
+#include "CpuMath.h"
+#include <immintrin.h>
+
+namespace dxrf
+{
+    static const float GOLDEN_ANGLE = 2.39996323f;
+    // cosine lobe convolution of the bands
+    static const float BAND_FACTORS[3] = { PI, 2.0f * PI / 3.0f, PI / 4.0f };
+    // keeps a point on a cell face from losing all its probes when the ones with weight are invalid
+    static const float MIN_TRILINEAR_WEIGHT = 1e-4f;
+
+    static void EvaluateBasis(const XMFLOAT3& d, float* basis)
+    {
+        basis[0] = 0.282095f;
+        basis[1] = 0.488603f * d.y;
+        basis[2] = 0.488603f * d.z;
+        basis[3] = 0.488603f * d.x;
+        basis[4] = 1.092548f * d.x * d.y;
+        basis[5] = 1.092548f * d.y * d.z;
+        basis[6] = 0.315392f * (3.0f * d.z * d.z - 1.0f);
+        basis[7] = 1.092548f * d.x * d.z;
+        basis[8] = 0.546274f * (d.x * d.x - d.y * d.y);
+    }
+
+    static int GetBand(int coefficient)
+    {
+        return coefficient == 0 ? 0 : (coefficient < 4 ? 1 : 2);
+    }
+
+    static XMFLOAT3 EvaluateIrradiance(const float* coefficients, const XMFLOAT3& normal)
+    {
+        float basis[IrradianceVolume::COEFFICIENT_COUNT];
+        EvaluateBasis(normal, basis);
+        float irradiance[3] = { 0, 0, 0 };
+        for (int k = 0; k < IrradianceVolume::COEFFICIENT_COUNT; ++k)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                irradiance[c] += coefficients[k * 3 + c] * basis[k];
+            }
+        }
+        // ringing of the truncated series can go below zero opposite to bright directions
+        return { (std::max)(0.0f, irradiance[0]), (std::max)(0.0f, irradiance[1]), (std::max)(0.0f, irradiance[2]) };
+    }
+
+    std::unique_ptr<IrradianceVolume> IrradianceVolume::Create(const AABB& bounds, const IrradianceVolumeSettings& settings)
+    {
+        std::unique_ptr<IrradianceVolume> volume(new IrradianceVolume());
+        volume->m_settings = settings;
+        volume->m_settings.resolution = (std::max)(2, settings.resolution);
+        volume->m_settings.sample_count = (std::max)(1, settings.sample_count);
+        volume->m_bounds = bounds;
+
+        float size[3] = { bounds.max.x - bounds.min.x, bounds.max.y - bounds.min.y, bounds.max.z - bounds.min.z };
+        float longest = (std::max)(size[0], (std::max)(size[1], size[2]));
+        float target_spacing = longest / (volume->m_settings.resolution - 1);
+        float spacing[3];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            int count = 2;
+            if (target_spacing > 0.0f)
+            {
+                count = (std::max)(2, (int) ceilf(size[axis] / target_spacing) + 1);
+            }
+            volume->m_probe_count[axis] = count;
+            spacing[axis] = size[axis] / (count - 1);
+        }
+        volume->m_spacing = { spacing[0], spacing[1], spacing[2] };
+        volume->m_probes.resize(volume->m_probe_count[0] * volume->m_probe_count[1] * volume->m_probe_count[2]);
+
+        return volume;
+    }
+
+    XMFLOAT3 IrradianceVolume::GetProbePosition(int probe) const
+    {
+        int x = probe % m_probe_count[0];
+        int y = (probe / m_probe_count[0]) % m_probe_count[1];
+        int z = probe / (m_probe_count[0] * m_probe_count[1]);
+        return { m_bounds.min.x + x * m_spacing.x, m_bounds.min.y + y * m_spacing.y, m_bounds.min.z + z * m_spacing.z };
+    }
+
+    // spherical Fibonacci point set, equal area bands in z with golden angle steps in azimuth
+    XMFLOAT3 IrradianceVolume::GetSampleDirection(int sample_index) const
+    {
+        float z = 1.0f - (2.0f * sample_index + 1.0f) / m_settings.sample_count;
+        float r = sqrtf((std::max)(0.0f, 1.0f - z * z));
+        float phi = GOLDEN_ANGLE * sample_index;
+        return { r * cosf(phi), r * sinf(phi), z };
+    }
+
+    void IrradianceVolume::SetProbe(int probe, const XMFLOAT3* radiance, int backface_count)
+    {
+        XMFLOAT3 projection[COEFFICIENT_COUNT];
+        for (int k = 0; k < COEFFICIENT_COUNT; ++k)
+        {
+            projection[k] = { 0, 0, 0 };
+        }
+
+        float basis[COEFFICIENT_COUNT];
+        for (int i = 0; i < m_settings.sample_count; ++i)
+        {
+            EvaluateBasis(this->GetSampleDirection(i), basis);
+            for (int k = 0; k < COEFFICIENT_COUNT; ++k)
+            {
+                projection[k] = Add(projection[k], Scale(radiance[i], basis[k]));
+            }
+        }
+
+        // every sample covers 4 pi / n of the sphere
+        Probe& result = m_probes[probe];
+        float sample_weight = 4.0f * PI / m_settings.sample_count;
+        for (int k = 0; k < COEFFICIENT_COUNT; ++k)
+        {
+            XMFLOAT3 coefficient = Scale(projection[k], sample_weight * BAND_FACTORS[GetBand(k)]);
+            result.coefficients[k * 3 + 0] = coefficient.x;
+            result.coefficients[k * 3 + 1] = coefficient.y;
+            result.coefficients[k * 3 + 2] = coefficient.z;
+        }
+        result.valid = backface_count * 4 <= m_settings.sample_count;
+    }
+
+    XMFLOAT3 IrradianceVolume::SampleIrradiance(const XMFLOAT3& position, const XMFLOAT3& normal) const
+    {
+        float p[3] = { position.x - m_bounds.min.x, position.y - m_bounds.min.y, position.z - m_bounds.min.z };
+        float spacing[3] = { m_spacing.x, m_spacing.y, m_spacing.z };
+        int base[3];
+        float fraction[3];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float local = spacing[axis] > 0.0f ? p[axis] / spacing[axis] : 0.0f;
+            base[axis] = (std::max)(0, (std::min)(m_probe_count[axis] - 2, (int) floorf(local)));
+            fraction[axis] = (std::max)(0.0f, (std::min)(1.0f, local - base[axis]));
+        }
+
+        // the coefficients blend linearly, so the weighted probes are evaluated once
+        float blended[PROBE_STRIDE] = {};
+        float weight_sum = 0.0f;
+        for (int corner = 0; corner < 8; ++corner)
+        {
+            int offset[3] = { corner & 1, (corner >> 1) & 1, (corner >> 2) & 1 };
+            int index = (base[2] + offset[2]) * m_probe_count[0] * m_probe_count[1] + (base[1] + offset[1]) * m_probe_count[0] + base[0] + offset[0];
+            const Probe& probe = m_probes[index];
+            if (!probe.valid)
+            {
+                continue;
+            }
+
+            float weight = 1.0f;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                weight *= offset[axis] ? fraction[axis] : 1.0f - fraction[axis];
+            }
+            weight = (std::max)(weight, MIN_TRILINEAR_WEIGHT);
+            // probes behind the surface see its other side
+            XMFLOAT3 probe_position = {
+                m_bounds.min.x + (base[0] + offset[0]) * spacing[0],
+                m_bounds.min.y + (base[1] + offset[1]) * spacing[1],
+                m_bounds.min.z + (base[2] + offset[2]) * spacing[2],
+            };
+            XMFLOAT3 to_probe = Normalize(Sub(probe_position, position));
+            float facing = (Dot(to_probe, normal) + 1.0f) * 0.5f;
+            weight *= facing * facing + 0.2f;
+
+#if defined(__AVX__)
+            __m256 weights = _mm256_set1_ps(weight);
+            for (int k = 0; k < PROBE_STRIDE; k += 8)
+            {
+                __m256 sum = _mm256_add_ps(_mm256_loadu_ps(&blended[k]), _mm256_mul_ps(_mm256_loadu_ps(&probe.coefficients[k]), weights));
+                _mm256_storeu_ps(&blended[k], sum);
+            }
+#else
+            for (int k = 0; k < PROBE_STRIDE; ++k)
+            {
+                blended[k] += probe.coefficients[k] * weight;
+            }
+#endif
+            weight_sum += weight;
+        }
+        if (weight_sum <= 0.0f)
+        {
+            return { 0, 0, 0 };
+        }
+        return Scale(EvaluateIrradiance(blended, normal), 1.0f / weight_sum);
+    }
+
+    int IrradianceVolume::GetInvalidProbeCount() const
+    {
+        int count = 0;
+        for (const Probe& probe : m_probes)
+        {
+            count += probe.valid ? 0 : 1;
+        }
+        return count;
+    }
+}
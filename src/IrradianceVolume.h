@@ -0,0 +1,74 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include "BVH.h"
+
+namespace dxrf
+{
+    struct IrradianceVolumeSettings
+    {
+        int resolution = 16;        // probes along the longest axis of the bounds, at least 2 along every axis
+        int sample_count = 256;     // rays per probe
+        int bounce_count = 2;       // 1 bakes the light bounced once off the surfaces, every more bounce bakes again
+    };
+
+    // Order 2 spherical harmonics of the irradiance seen from a grid of probe points. Every probe projects the
+    // radiance along sample_count spherical Fibonacci directions and convolves it with the clamped cosine
+    // (Ramamoorthi and Hanrahan 2001), so evaluating the nine coefficients for a normal gives the irradiance.
+    // Probes that see mostly back faces sit inside geometry and are left out of the interpolation, the others
+    // are weighted trilinearly and by how much they face the shaded side of the surface (Majercik et al. 2019).
+    class IrradianceVolume
+    {
+    public:
+        static const int COEFFICIENT_COUNT = 9;
+
+        static std::unique_ptr<IrradianceVolume> Create(const AABB& bounds, const IrradianceVolumeSettings& settings);
+        int GetProbeCount() const { return (int) m_probes.size(); }
+        XMFLOAT3 GetProbePosition(int probe) const;
+        int GetSampleCount() const { return m_settings.sample_count; }
+        // Direction of the sample_index-th ray of every probe, spread evenly over the sphere.
+        XMFLOAT3 GetSampleDirection(int sample_index) const;
+        // Projects the radiance arriving along each sample direction. Probes with more than a quarter of back face
+        // hits are marked invalid. Probes may be set concurrently.
+        void SetProbe(int probe, const XMFLOAT3* radiance, int backface_count);
+        // Irradiance at a surface point with the normal facing the shaded side, interpolated from the probes of
+        // its cell. Points outside the bounds take the closest cell.
+        XMFLOAT3 SampleIrradiance(const XMFLOAT3& position, const XMFLOAT3& normal) const;
+        int GetInvalidProbeCount() const;
+
+    private:
+        // red, green and blue of each coefficient next to each other, padded with zeros to four AVX registers,
+        // SampleIrradiance blends the probes eight floats at a time
+        static const int PROBE_STRIDE = 32;
+
+        struct Probe
+        {
+            float coefficients[PROBE_STRIDE] = {};
+            bool valid = false;
+        };
+
+        IrradianceVolume() = default;
+
+    private:
+        IrradianceVolumeSettings m_settings;
+        AABB m_bounds;
+        int m_probe_count[3] = { 0, 0, 0 };
+        XMFLOAT3 m_spacing = { 0, 0, 0 };
+        std::vector<Probe> m_probes;    // x fastest, then y and z
+    };
+}
@@ -0,0 +1,178 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#include "LightVisibilityCache.h"
+#include <math.h>
+
+namespace dxrf
+{
+    static const int MAX_PROBE_COUNT = 8;
+    // key layout: 17 bits per cell coordinate, 6 bits of size level, 6 bits of normal bin and the top bit set
+    static const int COORDINATE_BITS = 17;
+    static const int MIN_LEVEL = -32;
+    static const int MAX_LEVEL = 31;
+    static const int NORMAL_BIN_COUNT = 8;     // per axis of the octahedral map
+
+    // splitmix64 finalizer
+    static uint64_t Hash64(uint64_t x)
+    {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    // octahedral map of the unit sphere onto [0, 1]^2, cut into NORMAL_BIN_COUNT^2 bins of similar solid angle
+    static uint64_t GetNormalBin(const XMFLOAT3& n)
+    {
+        float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+        if (l1 <= 0.0f)
+        {
+            return 0;
+        }
+        float u = n.x / l1;
+        float v = n.y / l1;
+        if (n.z < 0.0f)
+        {
+            float folded_u = (1.0f - fabsf(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+            float folded_v = (1.0f - fabsf(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+            u = folded_u;
+            v = folded_v;
+        }
+        int bin_u = (std::min)((int) ((u * 0.5f + 0.5f) * NORMAL_BIN_COUNT), NORMAL_BIN_COUNT - 1);
+        int bin_v = (std::min)((int) ((v * 0.5f + 0.5f) * NORMAL_BIN_COUNT), NORMAL_BIN_COUNT - 1);
+        return (uint64_t) (bin_v * NORMAL_BIN_COUNT + bin_u);
+    }
+
+    std::unique_ptr<LightVisibilityCache> LightVisibilityCache::Create()
+    {
+        std::unique_ptr<LightVisibilityCache> cache(new LightVisibilityCache());
+
+        return cache;
+    }
+
+    void LightVisibilityCache::Prepare(const LightCacheSettings& settings, uint64_t scene_version, uint64_t light_version)
+    {
+        m_settings = settings;
+        int cell_count = 1 << settings.size_log2;
+        if (cell_count != m_cell_count)
+        {
+            m_cells.reset(new Cell[cell_count]);
+            m_cell_count = cell_count;
+            m_mask = (uint64_t) cell_count - 1;
+            this->Clear();
+        }
+        else if (scene_version != m_scene_version || light_version != m_light_version)
+        {
+            this->Clear();
+        }
+        m_scene_version = scene_version;
+        m_light_version = light_version;
+    }
+
+    void LightVisibilityCache::Clear()
+    {
+        for (int i = 0; i < m_cell_count; ++i)
+        {
+            m_cells[i].key.store(0, std::memory_order_relaxed);
+            m_cells[i].counts.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t LightVisibilityCache::GetCellKey(const XMFLOAT3& position, const XMFLOAT3& normal, float footprint) const
+    {
+        int level = MIN_LEVEL;
+        float cell_size = footprint * m_settings.cell_footprint;
+        if (cell_size > 0.0f)
+        {
+            level = (std::max)(MIN_LEVEL, (std::min)(MAX_LEVEL, (int) ceilf(log2f(cell_size))));
+        }
+        float inv_size = ldexpf(1.0f, -level);
+
+        // coordinates wrap around, cells 2^17 sizes apart share a key
+        const uint64_t coordinate_mask = (1ull << COORDINATE_BITS) - 1;
+        uint64_t x = (uint64_t) (int64_t) floorf(position.x * inv_size) & coordinate_mask;
+        uint64_t y = (uint64_t) (int64_t) floorf(position.y * inv_size) & coordinate_mask;
+        uint64_t z = (uint64_t) (int64_t) floorf(position.z * inv_size) & coordinate_mask;
+        uint64_t key = x | (y << COORDINATE_BITS) | (z << (COORDINATE_BITS * 2));
+        key |= (uint64_t) (level - MIN_LEVEL) << (COORDINATE_BITS * 3);
+        key |= GetNormalBin(normal) << (COORDINATE_BITS * 3 + 6);
+        return key | (1ull << 63);
+    }
+
+    const LightVisibilityCache::Cell* LightVisibilityCache::FindCell(uint64_t key) const
+    {
+        uint64_t index = Hash64(key);
+        for (int i = 0; i < MAX_PROBE_COUNT; ++i)
+        {
+            const Cell& cell = m_cells[(index + i) & m_mask];
+            uint64_t cell_key = cell.key.load(std::memory_order_acquire);
+            if (cell_key == key)
+            {
+                return &cell;
+            }
+            if (cell_key == 0)
+            {
+                return nullptr;
+            }
+        }
+        return nullptr;
+    }
+
+    LightVisibility LightVisibilityCache::Lookup(uint64_t key) const
+    {
+        const Cell* cell = this->FindCell(key);
+        if (cell == nullptr)
+        {
+            return LightVisibility::Unknown;
+        }
+        uint64_t counts = cell->counts.load(std::memory_order_relaxed);
+        uint64_t sample_count = counts >> 32;
+        uint64_t lit_count = counts & 0xffffffffull;
+        if (sample_count < (uint64_t) m_settings.min_samples)
+        {
+            return LightVisibility::Unknown;
+        }
+        if (lit_count == sample_count)
+        {
+            return LightVisibility::Lit;
+        }
+        return lit_count == 0 ? LightVisibility::Shadowed : LightVisibility::Unknown;
+    }
+
+    void LightVisibilityCache::Record(uint64_t key, int sample_count, int lit_count)
+    {
+        uint64_t counts = ((uint64_t) sample_count << 32) | (uint64_t) lit_count;
+        uint64_t index = Hash64(key);
+        for (int i = 0; i < MAX_PROBE_COUNT; ++i)
+        {
+            Cell& cell = m_cells[(index + i) & m_mask];
+            uint64_t cell_key = cell.key.load(std::memory_order_acquire);
+            if (cell_key == 0)
+            {
+                // claim the free cell, unless another thread just took it for a key of its own
+                if (cell.key.compare_exchange_strong(cell_key, key, std::memory_order_acq_rel))
+                {
+                    cell_key = key;
+                }
+            }
+            if (cell_key == key)
+            {
+                cell.counts.fetch_add(counts, std::memory_order_relaxed);
+                return;
+            }
+        }
+    }
+}
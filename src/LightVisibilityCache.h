@@ -0,0 +1,80 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include "DeviceResources.h"
+#include <atomic>
+#include <memory>
+
+namespace dxrf
+{
+    struct LightCacheSettings
+    {
+        float cell_footprint = 4.0f;    // cell size in ray cone widths at the surface, rounded up to a power of two
+        int min_samples = 16;           // shadow rays a cell records before its result replaces tracing
+        int size_log2 = 20;             // cells of the table
+    };
+
+    enum class LightVisibility
+    {
+        Unknown,    // not enough samples yet, or the light is partially blocked from the cell
+        Lit,        // every recorded shadow ray reached the light
+        Shadowed,   // every recorded shadow ray was blocked
+    };
+
+    // Shadow ray outcomes toward one light, gathered per cell of a spatial hash (Binder et al. 2019, path space
+    // filtering by jittered spatial hashing without the jitter). Cells are keyed by the quantized position, an
+    // octahedral bin of the normal and a size level that follows the ray cone footprint, so cells stay about
+    // the same size on screen. Cells whose rays all agree stand for every later ray from them, which is only
+    // wrong where a shadow edge crosses a cell that none of its samples saw. Results are valid for one scene
+    // and light state, Prepare drops them once either version changes. Lookup and Record are thread safe.
+    class LightVisibilityCache
+    {
+    public:
+        static std::unique_ptr<LightVisibilityCache> Create();
+        // Allocates the table and empties it when the versions differ from the last call.
+        void Prepare(const LightCacheSettings& settings, uint64_t scene_version, uint64_t light_version);
+        // Key of the cell of a surface point, normal faces the side the shadow rays leave from. footprint is the
+        // ray cone width at the point. Never 0.
+        uint64_t GetCellKey(const XMFLOAT3& position, const XMFLOAT3& normal, float footprint) const;
+        LightVisibility Lookup(uint64_t key) const;
+        // Adds sample_count shadow rays, lit_count of them unblocked, to the cell. Cells that find no free slot
+        // near their hash are not cached.
+        void Record(uint64_t key, int sample_count, int lit_count);
+        int GetCellCount() const { return m_cell_count; }
+
+    private:
+        // sample count in the high half of counts and lit count in the low half, key 0 marks a free cell
+        struct Cell
+        {
+            std::atomic<uint64_t> key;
+            std::atomic<uint64_t> counts;
+        };
+
+        LightVisibilityCache() = default;
+        void Clear();
+        const Cell* FindCell(uint64_t key) const;
+
+    private:
+        LightCacheSettings m_settings;
+        std::unique_ptr<Cell[]> m_cells;
+        int m_cell_count = 0;
+        uint64_t m_mask = 0;
+        uint64_t m_scene_version = 0;
+        uint64_t m_light_version = 0;
+    };
+}
@@ -14,6 +14,9 @@ static bool g_minimized = false;
 static int g_width = 0;
 static int g_height = 0;
 static DWORD g_time = 0;
+static std::unique_ptr<CameraPath> g_camera_path;
+static const char* g_timings_path = "timings.csv";
+static bool g_playback_done = false;
 static int g_frame_count = 0;
 Renderer* g_renderer = nullptr;
 
@@ -24,6 +27,52 @@ static void Init(HWND hwnd, int width, int height)
 
     g_renderer = new Renderer(hwnd, width, height);
     g_renderer->Init();
+    if (g_camera_path)
+    {
+        g_renderer->SetCameraPath(std::move(g_camera_path));
+    }
+}
+
+// --camera-path file plays the path back and exits, writing the frame times to --timings, timings.csv by default.
+static bool ParseCommandLine()
+{
+    for (int i = 1; i < __argc; ++i)
+    {
+        if (strcmp(__argv[i], "--camera-path") == 0 && i + 1 < __argc)
+        {
+            const char* path = __argv[++i];
+            g_camera_path = CameraPath::LoadFromFile(path);
+            if (!g_camera_path)
+            {
+                std::string message = std::string("cannot read camera path ") + path;
+                MessageBoxA(NULL, message.c_str(), "dxrf", MB_OK);
+                return false;
+            }
+        }
+        else if (strcmp(__argv[i], "--timings") == 0 && i + 1 < __argc)
+        {
+            g_timings_path = __argv[++i];
+        }
+    }
+    return true;
+}
+
+static void FinishPlayback(HWND hwnd)
+{
+    g_playback_done = true;
+    bool written = g_renderer->GetFrameTimes().WriteCsv(g_timings_path);
+
+    FrameTimeSummary summary = g_renderer->GetFrameTimes().GetSummary();
+    char text[256];
+    snprintf(text, sizeof(text), "frames %d mean %.3f ms median %.3f ms p95 %.3f ms min %.3f ms max %.3f ms\n", summary.frame_count,
+        summary.mean_ms, summary.median_ms, summary.p95_ms, summary.min_ms, summary.max_ms);
+    OutputDebugStringA(text);
+
+    // the window has no console, the run ends with the summary in a message box like the load errors
+    std::string message = std::string(text) + (written ? "timings written to " : "cannot write timings to ") + g_timings_path;
+    MessageBoxA(hwnd, message.c_str(), "dxrf", written ? MB_OK : MB_OK | MB_ICONERROR);
+
+    PostMessage(hwnd, WM_CLOSE, 0, 0);
 }
 
 static void Done()
@@ -85,6 +134,11 @@ int WINAPI WinMain(
     int window_width = 1280;
     int window_height = 720;
 
+    if (!ParseCommandLine())
+    {
+        return 0;
+    }
+
     WNDCLASSEX win_class;
     ZeroMemory(&win_class, sizeof(win_class));
 
@@ -166,7 +220,7 @@ int WINAPI WinMain(
             break;
         }
 
-        if (!g_minimized)
+        if (!g_minimized && !g_playback_done)
         {
             DWORD t = timeGetTime();
             if (t - g_time > 1000)
@@ -182,6 +236,11 @@ int WINAPI WinMain(
             g_frame_count += 1;
 
             DrawFrame();
+
+            if (g_renderer->IsPlaybackFinished())
+            {
+                FinishPlayback(hwnd);
+            }
         }
     }
 
@@ -0,0 +1,85 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#include "MeshDeformer.h"
+#include "ThreadPool.h"
+
+namespace dxrf
+{
+    static const int DEFORM_GRAIN = 4096;
+
+    void ApplyBlendShapes(const Mesh& mesh, const std::vector<float>& weights, std::vector<XMFLOAT3>* positions)
+    {
+        assert(weights.size() <= mesh.blend_shapes.size());
+
+        *positions = mesh.vertices;
+        for (size_t i = 0; i < weights.size(); ++i)
+        {
+            const auto& deltas = mesh.blend_shapes[i].vertices;
+            float weight = weights[i];
+            if (weight == 0.0f || deltas.size() != positions->size())
+            {
+                continue;
+            }
+
+            ThreadPool::GetInstance()->ParallelFor(0, (int) deltas.size(), DEFORM_GRAIN, [&](int begin, int end) {
+                for (int j = begin; j < end; ++j)
+                {
+                    XMFLOAT3& p = (*positions)[j];
+                    p.x += deltas[j].x * weight;
+                    p.y += deltas[j].y * weight;
+                    p.z += deltas[j].z * weight;
+                }
+            });
+        }
+    }
+
+    void ApplySkinning(const Mesh& mesh, const std::vector<XMMATRIX>& bone_transforms, const std::vector<XMFLOAT3>& positions_in, std::vector<XMFLOAT3>* positions_out)
+    {
+        assert(bone_transforms.size() == mesh.bindposes.size());
+        assert(positions_in.size() == mesh.bone_weights.size());
+
+        // bind pose moves the vertex into bone space, the bone transform moves it back with the current pose
+        std::vector<XMFLOAT4X4> skin_matrices(bone_transforms.size());
+        for (size_t i = 0; i < bone_transforms.size(); ++i)
+        {
+            XMStoreFloat4x4(&skin_matrices[i], mesh.bindposes[i] * bone_transforms[i]);
+        }
+
+        positions_out->resize(positions_in.size());
+        ThreadPool::GetInstance()->ParallelFor(0, (int) positions_in.size(), DEFORM_GRAIN, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i)
+            {
+                const XMFLOAT3& p = positions_in[i];
+                const float* weights = &mesh.bone_weights[i].x;
+                const float* bones = &mesh.bone_indices[i].x;
+                XMFLOAT3 result = { 0, 0, 0 };
+                for (int j = 0; j < 4; ++j)
+                {
+                    if (weights[j] == 0.0f)
+                    {
+                        continue;
+                    }
+                    const XMFLOAT4X4& m = skin_matrices[(size_t) bones[j]];
+                    result.x += (p.x * m.m[0][0] + p.y * m.m[1][0] + p.z * m.m[2][0] + m.m[3][0]) * weights[j];
+                    result.y += (p.x * m.m[0][1] + p.y * m.m[1][1] + p.z * m.m[2][1] + m.m[3][1]) * weights[j];
+                    result.z += (p.x * m.m[0][2] + p.y * m.m[1][2] + p.z * m.m[2][2] + m.m[3][2]) * weights[j];
+                }
+                (*positions_out)[i] = result;
+            }
+        });
+    }
+}
@@ -0,0 +1,30 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include "Scene.h"
+
+namespace dxrf
+{
+    // CPU vertex deformation, produces the positions a refit of the mesh BVH consumes.
+
+    // Adds the weighted blend shape deltas to the mesh vertices, weights holds one weight in [0, 1] per blend shape.
+    void ApplyBlendShapes(const Mesh& mesh, const std::vector<float>& weights, std::vector<XMFLOAT3>* positions);
+    // Linear blend skinning of positions_in with up to four bones per vertex.
+    // bone_transforms are the current bone to mesh space transforms, indexed like mesh.bindposes.
+    void ApplySkinning(const Mesh& mesh, const std::vector<XMMATRIX>& bone_transforms, const std::vector<XMFLOAT3>& positions_in, std::vector<XMFLOAT3>* positions_out);
+}
@@ -0,0 +1,211 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#include "MipChain.h"
+#include "ThreadPool.h"
+#include <immintrin.h>
+#include <math.h>
+#include <string.h>
+
+namespace dxrf
+{
+    static const int SRGB_ENCODE_SIZE = 4096;
+    static const int MIP_GRAIN_TEXELS = 16384;
+
+    // Byte to linear for sRGB channels in [0, 256) and for linear channels in [256, 512), and linear back to
+    // sRGB bytes over 4096 steps, fine enough that averaging never moves a channel by more than one code.
+    struct SrgbTables
+    {
+        float decode[512];
+        int32_t encode[SRGB_ENCODE_SIZE];
+
+        SrgbTables()
+        {
+            for (int i = 0; i < 256; ++i)
+            {
+                float c = i / 255.0f;
+                decode[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+                decode[256 + i] = c;
+            }
+            for (int i = 0; i < SRGB_ENCODE_SIZE; ++i)
+            {
+                float c = i / (float) (SRGB_ENCODE_SIZE - 1);
+                float srgb = c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+                encode[i] = (int32_t) (srgb * 255.0f + 0.5f);
+            }
+        }
+    };
+
+    static const SrgbTables& GetSrgbTables()
+    {
+        static SrgbTables tables;
+        return tables;
+    }
+
+    std::unique_ptr<MipChain> MipChain::Create(int width, int height, int face_count, void** faces_data, bool srgb)
+    {
+        std::unique_ptr<MipChain> chain(new MipChain());
+        chain->m_face_count = face_count;
+        chain->m_srgb = srgb;
+
+        size_t byte_size = 0;
+        XMINT2 size = { width, height };
+        while (true)
+        {
+            chain->m_level_sizes.push_back(size);
+            chain->m_level_offsets.push_back(byte_size);
+            byte_size += (size_t) size.x * size.y * 4 * face_count;
+            if (size.x == 1 && size.y == 1)
+            {
+                break;
+            }
+            size = { (std::max)(1, size.x / 2), (std::max)(1, size.y / 2) };
+        }
+        chain->m_data.resize(byte_size);
+
+        for (int face = 0; face < face_count; ++face)
+        {
+            memcpy(chain->GetLevelData(face, 0), faces_data[face], chain->GetLevelByteSize(0));
+        }
+
+        GetSrgbTables();
+        for (int level = 1; level < chain->GetLevelCount(); ++level)
+        {
+            int level_height = chain->GetHeight(level);
+            int grain = (std::max)(1, MIP_GRAIN_TEXELS / chain->GetWidth(level));
+            ThreadPool::GetInstance()->ParallelFor(0, face_count * level_height, grain, [&](int begin, int end) {
+                for (int i = begin; i < end; ++i)
+                {
+                    chain->DownsampleRow(i / level_height, level, i % level_height);
+                }
+            });
+        }
+
+        return chain;
+    }
+
+    // One row of the level from the 2x2 blocks of its parent, odd parent sizes drop the last row or column.
+    void MipChain::DownsampleRow(int face, int level, int y)
+    {
+        const SrgbTables& tables = GetSrgbTables();
+        int width = this->GetWidth(level);
+        int parent_width = this->GetWidth(level - 1);
+        int parent_height = this->GetHeight(level - 1);
+        const uint8_t* parent = this->GetData(face, level - 1);
+        const uint8_t* row0 = parent + (size_t) (std::min)(y * 2, parent_height - 1) * parent_width * 4;
+        const uint8_t* row1 = parent + (size_t) (std::min)(y * 2 + 1, parent_height - 1) * parent_width * 4;
+        uint8_t* dst = this->GetLevelData(face, level) + (size_t) y * width * 4;
+
+        int x = 0;
+#if defined(__AVX2__)
+        // two output texels per step: the 16 source bytes of a row widen to eight channels per pair of texels,
+        // decode with one gather, sum the rows and then the texel pairs, and encode with another gather
+        __m256i decode_offset = m_srgb ? _mm256_setr_epi32(0, 0, 0, 256, 0, 0, 0, 256) : _mm256_set1_epi32(256);
+        __m256 linear_lanes = m_srgb ? _mm256_castsi256_ps(_mm256_setr_epi32(0, 0, 0, -1, 0, 0, 0, -1)) : _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        __m256 encode_scale = _mm256_set1_ps((float) (SRGB_ENCODE_SIZE - 1));
+        __m256 byte_scale = _mm256_set1_ps(255.0f);
+        __m256 half = _mm256_set1_ps(0.5f);
+        __m256 quarter = _mm256_set1_ps(0.25f);
+        for (; x + 2 <= width && x * 2 + 4 <= parent_width; x += 2)
+        {
+            __m128i bytes0 = _mm_loadu_si128((const __m128i*) (row0 + x * 8));
+            __m128i bytes1 = _mm_loadu_si128((const __m128i*) (row1 + x * 8));
+            __m256 a0 = _mm256_i32gather_ps(tables.decode, _mm256_add_epi32(_mm256_cvtepu8_epi32(bytes0), decode_offset), 4);
+            __m256 b0 = _mm256_i32gather_ps(tables.decode, _mm256_add_epi32(_mm256_cvtepu8_epi32(_mm_srli_si128(bytes0, 8)), decode_offset), 4);
+            __m256 a1 = _mm256_i32gather_ps(tables.decode, _mm256_add_epi32(_mm256_cvtepu8_epi32(bytes1), decode_offset), 4);
+            __m256 b1 = _mm256_i32gather_ps(tables.decode, _mm256_add_epi32(_mm256_cvtepu8_epi32(_mm_srli_si128(bytes1, 8)), decode_offset), 4);
+            __m256 a = _mm256_add_ps(a0, a1);
+            __m256 b = _mm256_add_ps(b0, b1);
+            __m256 sum = _mm256_add_ps(_mm256_permute2f128_ps(a, b, 0x20), _mm256_permute2f128_ps(a, b, 0x31));
+            __m256 average = _mm256_mul_ps(sum, quarter);
+
+            __m256i srgb = _mm256_i32gather_epi32(tables.encode, _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(average, encode_scale), half)), 4);
+            __m256i linear = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(average, byte_scale), half));
+            __m256i result = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(srgb), _mm256_castsi256_ps(linear), linear_lanes));
+
+            __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(result), _mm256_extracti128_si256(result, 1));
+            _mm_storel_epi64((__m128i*) (dst + x * 4), _mm_packus_epi16(words, words));
+        }
+#endif
+        for (; x < width; ++x)
+        {
+            int x0 = (std::min)(x * 2, parent_width - 1);
+            int x1 = (std::min)(x * 2 + 1, parent_width - 1);
+            for (int c = 0; c < 4; ++c)
+            {
+                int offset = m_srgb && c < 3 ? 0 : 256;
+                float sum = (tables.decode[offset + row0[x0 * 4 + c]] + tables.decode[offset + row1[x0 * 4 + c]]) +
+                    (tables.decode[offset + row0[x1 * 4 + c]] + tables.decode[offset + row1[x1 * 4 + c]]);
+                float average = sum * 0.25f;
+                dst[x * 4 + c] = (uint8_t) (offset == 0 ?
+                    tables.encode[(int) (average * (SRGB_ENCODE_SIZE - 1) + 0.5f)] :
+                    (int) (average * 255.0f + 0.5f));
+            }
+        }
+    }
+
+    XMFLOAT4 MipChain::SampleBilinear(int face, int level, const XMFLOAT2& uv) const
+    {
+        int width = this->GetWidth(level);
+        int height = this->GetHeight(level);
+        float u = uv.x * width - 0.5f;
+        float v = uv.y * height - 0.5f;
+        float x_floor = floorf(u);
+        float y_floor = floorf(v);
+        float fx = u - x_floor;
+        float fy = v - y_floor;
+        int x0 = ((int) x_floor % width + width) % width;
+        int y0 = ((int) y_floor % height + height) % height;
+        int x1 = (x0 + 1) % width;
+        int y1 = (y0 + 1) % height;
+
+        const uint8_t* data = this->GetData(face, level);
+        float result[4];
+        for (int c = 0; c < 4; ++c)
+        {
+            float c00 = data[(y0 * width + x0) * 4 + c];
+            float c10 = data[(y0 * width + x1) * 4 + c];
+            float c01 = data[(y1 * width + x0) * 4 + c];
+            float c11 = data[(y1 * width + x1) * 4 + c];
+            float top = c00 + (c10 - c00) * fx;
+            float bottom = c01 + (c11 - c01) * fx;
+            result[c] = (top + (bottom - top) * fy) * (1.0f / 255.0f);
+        }
+        return { result[0], result[1], result[2], result[3] };
+    }
+
+    XMFLOAT4 MipChain::SampleLevel(int face, const XMFLOAT2& uv, float lod) const
+    {
+        int last_level = this->GetLevelCount() - 1;
+        lod = (std::min)((std::max)(lod, 0.0f), (float) last_level);
+        int level0 = (int) lod;
+        int level1 = (std::min)(level0 + 1, last_level);
+        float blend = lod - level0;
+
+        XMFLOAT4 color0 = this->SampleBilinear(face, level0, uv);
+        if (blend == 0.0f)
+        {
+            return color0;
+        }
+        XMFLOAT4 color1 = this->SampleBilinear(face, level1, uv);
+        return {
+            color0.x + (color1.x - color0.x) * blend,
+            color0.y + (color1.y - color0.y) * blend,
+            color0.z + (color1.z - color0.z) * blend,
+            color0.w + (color1.w - color0.w) * blend,
+        };
+    }
+}
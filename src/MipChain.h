@@ -0,0 +1,55 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include "DeviceResources.h"
+#include <memory>
+#include <vector>
+
+namespace dxrf
+{
+    // RGBA8 mip chain of a 2D or cube texture, level 0 is a copy of the source images. Levels halve down to 1x1
+    // with a 2x2 box filter that averages color in linear space when the data is sRGB encoded, alpha always
+    // averages linearly. Levels build one after the other, the rows of a level are spread over the thread pool.
+    class MipChain
+    {
+    public:
+        static std::unique_ptr<MipChain> Create(int width, int height, int face_count, void** faces_data, bool srgb);
+        int GetLevelCount() const { return (int) m_level_sizes.size(); }
+        int GetFaceCount() const { return m_face_count; }
+        int GetWidth(int level) const { return m_level_sizes[level].x; }
+        int GetHeight(int level) const { return m_level_sizes[level].y; }
+        const uint8_t* GetData(int face, int level) const { return &m_data[m_level_offsets[level] + (size_t) face * this->GetLevelByteSize(level)]; }
+        // Trilinear lookup with wrap addressing, same as the static sampler of the raytracing root signature.
+        // Texel values are filtered as stored, like the UNORM views the shaders read.
+        XMFLOAT4 SampleLevel(int face, const XMFLOAT2& uv, float lod) const;
+
+    private:
+        MipChain() = default;
+        size_t GetLevelByteSize(int level) const { return (size_t) this->GetWidth(level) * this->GetHeight(level) * 4; }
+        uint8_t* GetLevelData(int face, int level) { return &m_data[m_level_offsets[level] + (size_t) face * this->GetLevelByteSize(level)]; }
+        void DownsampleRow(int face, int level, int y);
+        XMFLOAT4 SampleBilinear(int face, int level, const XMFLOAT2& uv) const;
+
+    private:
+        int m_face_count = 0;
+        bool m_srgb = false;
+        std::vector<XMINT2> m_level_sizes;
+        std::vector<size_t> m_level_offsets;
+        std::vector<uint8_t> m_data;
+    };
+}
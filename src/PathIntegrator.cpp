@@ -0,0 +1,432 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#include "PathIntegrator.h"
+#include "CpuMath.h"
+#include "Denoiser.h"
+#include "EnvironmentMap.h"
+#include "LightVisibilityCache.h"
+#include "MipChain.h"
+#include "ThreadPool.h"
+#include "Timer.h"
+#include <atomic>
+
+namespace dxrf
+{
+    // keep in sync with Raytracing.hlsl
+    static const float PATH_RAY_T_MIN = 0.01f;
+    static const float PATH_RAY_T_MAX = 1000.0f;
+
+    static const int PATH_GRAIN = 256;
+    static const int MISS_BATCH_SIZE = 64;
+    static const float MAX_SURVIVAL_PROBABILITY = 0.95f;
+
+    static float NextPathRandom(UINT* state)
+    {
+        *state = Hash(*state + 0x9e3779b9u);
+        return ToUnitFloat(*state);
+    }
+
+    static float PowerHeuristic(float pdf, float other_pdf)
+    {
+        float a = pdf * pdf;
+        float b = other_pdf * other_pdf;
+        return a + b > 0.0f ? a / (a + b) : 0.0f;
+    }
+
+    std::unique_ptr<PathIntegrator> PathIntegrator::Create(const Tracer* tracer)
+    {
+        std::unique_ptr<PathIntegrator> integrator(new PathIntegrator());
+        integrator->m_tracer = tracer;
+        integrator->m_extension_stream = RayStream::Create(tracer);
+        integrator->m_shadow_stream = RayStream::Create(tracer);
+
+        return integrator;
+    }
+
+    void PathIntegrator::Render(const PathIntegratorSettings& settings, const Ray* camera_rays, int path_count, UINT seed, XMFLOAT3* radiance,
+        DenoiserGuide* guides, const RayHit* camera_hits, const UINT* path_ids)
+    {
+        m_settings = settings;
+        m_camera_hits = camera_hits;
+        m_stats = PathIntegratorStats();
+        m_extension_stream->SetSortEnabled(settings.sort_rays);
+        m_shadow_stream->SetSortEnabled(settings.sort_rays);
+
+        m_paths.resize(path_count);
+        UINT seed_hash = Hash(seed * 0x632be5abu + 1);
+        ThreadPool::GetInstance()->ParallelFor(0, path_count, PATH_GRAIN, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i)
+            {
+                PathState& path = m_paths[i];
+                path.origin = camera_rays[i].origin;
+                path.direction = camera_rays[i].direction;
+                path.throughput = { 1.0f, 1.0f, 1.0f };
+                path.bsdf_pdf = 0.0f;
+                path.cone_width = 0.0f;
+                path.cone_spread = settings.pixel_spread_angle;
+                path.path_index = (UINT) i;
+                path.rng = Hash((path_ids ? path_ids[i] : (UINT) i) ^ seed_hash);
+                path.alive = true;
+                radiance[i] = { 0, 0, 0 };
+                if (guides)
+                {
+                    guides[i] = DenoiserGuide();
+                }
+            }
+        });
+
+        for (int depth = 0; !m_paths.empty(); ++depth)
+        {
+            Timer timer;
+            if (!m_camera_hits)
+            {
+                this->TraceExtensionRays();
+            }
+            m_stats.extension_ms += timer.GetElapsedMs();
+
+            timer.Reset();
+            this->ShadeMisses();
+            this->ShadeHits(depth, radiance, depth == 0 ? guides : nullptr);
+            m_stats.shade_ms += timer.GetElapsedMs();
+
+            timer.Reset();
+            this->TraceShadowRays(radiance);
+            m_stats.shadow_ms += timer.GetElapsedMs();
+
+            this->CompactPaths();
+            m_camera_hits = nullptr;
+            m_stats.max_path_depth = depth;
+        }
+    }
+
+    void PathIntegrator::TraceExtensionRays()
+    {
+        int path_count = (int) m_paths.size();
+        m_extension_stream->Clear();
+        m_extension_stream->Resize(path_count);
+        ThreadPool::GetInstance()->ParallelFor(0, path_count, PATH_GRAIN, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i)
+            {
+                Ray ray;
+                ray.origin = m_paths[i].origin;
+                ray.direction = m_paths[i].direction;
+                ray.t_min = PATH_RAY_T_MIN;
+                ray.t_max = PATH_RAY_T_MAX;
+                m_extension_stream->SetRay(i, ray);
+            }
+        });
+
+        m_extension_stream->TraceClosestHit(m_settings.instance_mask);
+        m_stats.extension_ray_count += path_count;
+    }
+
+    // Sky lookups of the rays that left the scene, batched so the environment map samples eight at a time.
+    void PathIntegrator::ShadeMisses()
+    {
+        int path_count = (int) m_paths.size();
+        m_miss_radiance.resize(path_count);
+        if (!m_environment)
+        {
+            return;
+        }
+
+        ThreadPool::GetInstance()->ParallelFor(0, path_count, PATH_GRAIN, [&](int begin, int end) {
+            XMFLOAT3 directions[MISS_BATCH_SIZE];
+            XMFLOAT3 colors[MISS_BATCH_SIZE];
+            int indices[MISS_BATCH_SIZE];
+            int miss_count = 0;
+            auto flush = [&]() {
+                m_environment->SampleLevel(miss_count, directions, nullptr, colors);
+                for (int k = 0; k < miss_count; ++k)
+                {
+                    m_miss_radiance[indices[k]] = colors[k];
+                }
+                miss_count = 0;
+            };
+
+            for (int i = begin; i < end; ++i)
+            {
+                if (this->GetExtensionHit(i).t < FLT_MAX)
+                {
+                    continue;
+                }
+                directions[miss_count] = m_paths[i].direction;
+                indices[miss_count] = i;
+                if (++miss_count == MISS_BATCH_SIZE)
+                {
+                    flush();
+                }
+            }
+            flush();
+        });
+    }
+
+    // Every path owns two shadow slots, 2 * i toward the light and 2 * i + 1 toward the sky. Slots without a
+    // sample keep an inverted interval, which the traversal drops before the first node.
+    void PathIntegrator::ShadeHits(int depth, XMFLOAT3* radiance, DenoiserGuide* guides)
+    {
+        int path_count = (int) m_paths.size();
+        m_shadow_samples.resize(path_count * 2);
+        m_shadow_stream->Clear();
+        m_shadow_stream->Resize(path_count * 2);
+
+        const XMFLOAT3& light_position = m_settings.light_position;
+        float light_radius = m_settings.light_radius;
+
+        std::atomic<int> cached_count(0);
+        std::atomic<int> queued_count(0);
+        ThreadPool::GetInstance()->ParallelFor(0, path_count, PATH_GRAIN, [&](int begin, int end) {
+            int batch_cached_count = 0;
+            int batch_queued_count = 0;
+            for (int i = begin; i < end; ++i)
+            {
+                PathState& path = m_paths[i];
+                const RayHit& hit = this->GetExtensionHit(i);
+                XMFLOAT3& path_radiance = radiance[path.path_index];
+
+                Ray empty_ray;
+                empty_ray.origin = path.origin;
+                empty_ray.t_min = 1.0f;
+                empty_ray.t_max = 0.0f;
+                for (int k = 0; k < 2; ++k)
+                {
+                    m_shadow_samples[i * 2 + k].contribution = { 0, 0, 0 };
+                    m_shadow_samples[i * 2 + k].light_cache_key = 0;
+                    m_shadow_stream->SetRay(i * 2 + k, empty_ray);
+                }
+
+                // the light is not part of the scene BVH, it is found analytically in front of the closest hit
+                float light_t = IntersectSphere(path.origin, path.direction, light_position, light_radius, PATH_RAY_T_MIN, hit.t);
+                if (light_t < FLT_MAX)
+                {
+                    float weight = 1.0f;
+                    if (path.bsdf_pdf > 0.0f)
+                    {
+                        weight = PowerHeuristic(path.bsdf_pdf, SphereLightPdf(path.origin, light_position, light_radius));
+                    }
+                    path_radiance = Add(path_radiance, Scale(Mul(path.throughput, m_settings.light_radiance), weight));
+                    path.alive = false;
+                    continue;
+                }
+
+                if (hit.t == FLT_MAX)
+                {
+                    float weight = 1.0f;
+                    if (path.bsdf_pdf > 0.0f)
+                    {
+                        weight = PowerHeuristic(path.bsdf_pdf, this->GetEnvironmentPdf(path.direction));
+                    }
+                    XMFLOAT3 environment = m_environment ? m_miss_radiance[i] : m_settings.background;
+                    path_radiance = Add(path_radiance, Scale(Mul(path.throughput, environment), weight));
+                    path.alive = false;
+                    continue;
+                }
+
+                XMFLOAT3 position = Add(path.origin, Scale(path.direction, hit.t));
+                XMFLOAT3 normal = m_tracer->GetShadingNormal(hit);
+                if (Dot(normal, path.direction) > 0.0f)
+                {
+                    normal = Scale(normal, -1.0f);
+                }
+                XMFLOAT3 albedo = this->GetAlbedo(path, hit);
+                if (guides)
+                {
+                    guides[path.path_index] = { albedo, normal, hit.t };
+                }
+                XMFLOAT3 path_brdf = Mul(path.throughput, Scale(albedo, 1.0f / PI));
+                // the last vertex has no continuation to share the light and sky with
+                bool continues = depth < m_settings.max_depth;
+                // surfaces that do not receive shadows keep the empty shadow rays, nothing blocks their samples
+                bool receive_shadow = m_tracer->GetInstances()[hit.instance_id].receive_shadow;
+
+                // next event estimation toward the light
+                SphereLightSample light_sample;
+                XMFLOAT2 u = { NextPathRandom(&path.rng), NextPathRandom(&path.rng) };
+                if (SampleSphereLight(position, light_position, light_radius, u, &light_sample))
+                {
+                    float cos_theta = Dot(normal, light_sample.direction);
+                    if (cos_theta > 0.0f)
+                    {
+                        float weight = continues ? PowerHeuristic(light_sample.pdf, cos_theta / PI) : 1.0f;
+                        XMFLOAT3 contribution = Scale(Mul(path_brdf, m_settings.light_radiance), cos_theta * weight / light_sample.pdf);
+                        m_shadow_samples[i * 2].contribution = contribution;
+
+                        LightVisibility cached = LightVisibility::Unknown;
+                        if (receive_shadow && m_light_cache)
+                        {
+                            uint64_t key = m_light_cache->GetCellKey(position, normal, path.cone_width + path.cone_spread * hit.t);
+                            cached = m_light_cache->Lookup(key);
+                            m_shadow_samples[i * 2].light_cache_key = cached == LightVisibility::Unknown ? key : 0;
+                        }
+
+                        Ray ray;
+                        ray.origin = position;
+                        ray.direction = light_sample.direction;
+                        ray.t_min = PATH_RAY_T_MIN;
+                        ray.t_max = light_sample.distance;
+                        if (cached != LightVisibility::Unknown)
+                        {
+                            // the empty ray is never blocked, a shadowed cell drops the contribution instead
+                            batch_cached_count += 1;
+                            if (cached == LightVisibility::Shadowed)
+                            {
+                                m_shadow_samples[i * 2].contribution = { 0, 0, 0 };
+                            }
+                        }
+                        else if (receive_shadow)
+                        {
+                            m_shadow_stream->SetRay(i * 2, ray);
+                            batch_queued_count += 1;
+                        }
+                    }
+                }
+
+                // next event estimation toward the sky, directions behind the light sphere are blocked by it
+                float environment_pdf = 0.0f;
+                u = { NextPathRandom(&path.rng), NextPathRandom(&path.rng) };
+                XMFLOAT3 environment_direction = this->SampleEnvironment(u, &environment_pdf);
+                XMFLOAT3 environment = this->GetEnvironmentRadiance(environment_direction);
+                float cos_theta = Dot(normal, environment_direction);
+                if (cos_theta > 0.0f && environment_pdf > 0.0f && Luminance(environment) > 0.0f &&
+                    IntersectSphere(position, environment_direction, light_position, light_radius, PATH_RAY_T_MIN, FLT_MAX) == FLT_MAX)
+                {
+                    float weight = continues ? PowerHeuristic(environment_pdf, cos_theta / PI) : 1.0f;
+                    m_shadow_samples[i * 2 + 1].contribution = Scale(Mul(path_brdf, environment), cos_theta * weight / environment_pdf);
+
+                    Ray ray;
+                    ray.origin = position;
+                    ray.direction = environment_direction;
+                    ray.t_min = PATH_RAY_T_MIN;
+                    ray.t_max = PATH_RAY_T_MAX;
+                    if (receive_shadow)
+                    {
+                        m_shadow_stream->SetRay(i * 2 + 1, ray);
+                        batch_queued_count += 1;
+                    }
+                }
+
+                if (!continues)
+                {
+                    path.alive = false;
+                    continue;
+                }
+
+                // cosine weighted continuation, the Lambert brdf over the pdf leaves the albedo
+                u = { NextPathRandom(&path.rng), NextPathRandom(&path.rng) };
+                path.direction = SampleCosineHemisphere(normal, u);
+                path.bsdf_pdf = (std::max)(Dot(normal, path.direction), 0.0f) / PI;
+                path.origin = position;
+                path.throughput = Mul(path.throughput, albedo);
+                // diffuse bounces keep the spread, the cone carries on from its footprint at the hit
+                path.cone_width += path.cone_spread * hit.t;
+                if (path.bsdf_pdf <= 0.0f)
+                {
+                    path.alive = false;
+                    continue;
+                }
+
+                if (depth + 1 >= m_settings.russian_roulette_depth)
+                {
+                    float survival = (std::min)(MAX_SURVIVAL_PROBABILITY, (std::max)(path.throughput.x, (std::max)(path.throughput.y, path.throughput.z)));
+                    if (NextPathRandom(&path.rng) >= survival)
+                    {
+                        path.alive = false;
+                        continue;
+                    }
+                    path.throughput = Scale(path.throughput, 1.0f / survival);
+                }
+            }
+            cached_count += batch_cached_count;
+            queued_count += batch_queued_count;
+        });
+        m_stats.cached_shadow_ray_count += cached_count;
+        // the empty rays of the other slots are never blocked and not counted
+        m_stats.shadow_ray_count += queued_count;
+    }
+
+    void PathIntegrator::TraceShadowRays(XMFLOAT3* radiance)
+    {
+        int path_count = (int) m_paths.size();
+        m_shadow_stream->TraceOcclusion(m_settings.shadow_instance_mask);
+
+        ThreadPool::GetInstance()->ParallelFor(0, path_count, PATH_GRAIN, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i)
+            {
+                XMFLOAT3& path_radiance = radiance[m_paths[i].path_index];
+                for (int k = 0; k < 2; ++k)
+                {
+                    bool occluded = m_shadow_stream->IsOccluded(i * 2 + k);
+                    if (!occluded)
+                    {
+                        path_radiance = Add(path_radiance, m_shadow_samples[i * 2 + k].contribution);
+                    }
+                    if (m_shadow_samples[i * 2 + k].light_cache_key != 0)
+                    {
+                        m_light_cache->Record(m_shadow_samples[i * 2 + k].light_cache_key, 1, occluded ? 0 : 1);
+                    }
+                }
+            }
+        });
+    }
+
+    // Keeps the live paths at the front, the next extension stream only holds rays that contribute.
+    void PathIntegrator::CompactPaths()
+    {
+        size_t alive_count = 0;
+        for (size_t i = 0; i < m_paths.size(); ++i)
+        {
+            if (m_paths[i].alive)
+            {
+                m_paths[alive_count++] = m_paths[i];
+            }
+        }
+        m_paths.resize(alive_count);
+    }
+
+    XMFLOAT3 PathIntegrator::GetAlbedo(const PathState& path, const RayHit& hit) const
+    {
+        if (!m_mesh_texture)
+        {
+            return m_settings.albedo;
+        }
+
+        float cone_width = path.cone_width + path.cone_spread * hit.t;
+        float lod = m_tracer->GetTextureLod(hit, path.direction, cone_width, m_mesh_texture->GetWidth(0), m_mesh_texture->GetHeight(0));
+        XMFLOAT4 texel = m_mesh_texture->SampleLevel(0, m_tracer->GetTextureCoordinate(hit), lod);
+        return Mul(m_settings.albedo, XMFLOAT3(texel.x, texel.y, texel.z));
+    }
+
+    XMFLOAT3 PathIntegrator::GetEnvironmentRadiance(const XMFLOAT3& direction) const
+    {
+        return m_environment ? m_environment->SampleLevel(direction, 0.0f) : m_settings.background;
+    }
+
+    XMFLOAT3 PathIntegrator::SampleEnvironment(const XMFLOAT2& u, float* pdf) const
+    {
+        if (m_environment)
+        {
+            return m_environment->SampleDirection(u, pdf);
+        }
+        *pdf = 1.0f / (4.0f * PI);
+        return SampleUniformSphere(u);
+    }
+
+    float PathIntegrator::GetEnvironmentPdf(const XMFLOAT3& direction) const
+    {
+        return m_environment ? m_environment->GetPdf(direction) : 1.0f / (4.0f * PI);
+    }
+}
@@ -0,0 +1,126 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include "RayStream.h"
+
+namespace dxrf
+{
+    class EnvironmentMap;
+    class MipChain;
+    class LightVisibilityCache;
+    struct DenoiserGuide;
+
+    struct PathIntegratorSettings
+    {
+        int max_depth = 8;                  // bounces after the camera ray
+        int russian_roulette_depth = 3;     // paths may terminate from this bounce on
+        XMFLOAT3 albedo = { 0.7f, 0.7f, 0.7f };    // multiplied by the mesh texture when one is set
+        float pixel_spread_angle = 0.0f;            // ray cone spread of the camera rays, for texture LOD
+        XMFLOAT3 light_position = { 0, 0, 0 };
+        float light_radius = 1.0f;
+        XMFLOAT3 light_radiance = { 0, 0, 0 };
+        XMFLOAT3 background = { 0, 0, 0 };  // uniform sky when there is no environment map
+        UINT instance_mask = VISIBILITY_CAMERA;
+        UINT shadow_instance_mask = VISIBILITY_SHADOW_CASTER;
+        bool sort_rays = true;
+    };
+
+    struct PathIntegratorStats
+    {
+        int extension_ray_count = 0;
+        int shadow_ray_count = 0;
+        int cached_shadow_ray_count = 0;    // light samples the light cache resolved without a ray
+        int max_path_depth = 0;
+        double extension_ms = 0.0;
+        double shadow_ms = 0.0;
+        double shade_ms = 0.0;
+    };
+
+    // Unidirectional path tracer over Lambertian surfaces, a sphere light and the sky. Every bounce samples the
+    // light and the sky with next event estimation and a cosine weighted continuation, combined with the power
+    // heuristic. All paths advance one bounce at a time: the extension rays of the live paths are traced as one
+    // sorted stream, the sky is looked up for all misses in SIMD batches, shading runs over the hits in parallel
+    // and queues the shadow rays into a second stream, then terminated paths are compacted away.
+    class PathIntegrator
+    {
+    public:
+        static std::unique_ptr<PathIntegrator> Create(const Tracer* tracer);
+        // Sky seen by the miss rays, nullptr falls back to settings.background.
+        void SetEnvironment(const EnvironmentMap* environment) { m_environment = environment; }
+        // Albedo texture of every mesh, sampled at the ray cone mip level of each hit. nullptr shades untextured.
+        void SetMeshTexture(const MipChain* texture) { m_mesh_texture = texture; }
+        // Light samples from cells the cache knows as fully lit or shadowed skip their shadow ray, the others
+        // record their outcome. The cache must be prepared for the light of the settings, nullptr traces every ray.
+        void SetLightCache(LightVisibilityCache* cache) { m_light_cache = cache; }
+        // Traces one path per camera ray, radiance[i] receives the estimate of camera_rays[i].
+        // seed decorrelates the random numbers of successive calls. guides, when not nullptr, receives the albedo,
+        // normal and distance of the first surface each camera ray hit. camera_hits, when not nullptr, holds the
+        // closest hit of every camera ray, found by other means, and the first bounce is not traced. path_ids, when
+        // not nullptr, replaces i in the random numbers of path i, so a path samples the same whatever other paths
+        // are traced along with it.
+        void Render(const PathIntegratorSettings& settings, const Ray* camera_rays, int path_count, UINT seed, XMFLOAT3* radiance,
+            DenoiserGuide* guides = nullptr, const RayHit* camera_hits = nullptr, const UINT* path_ids = nullptr);
+        const PathIntegratorStats& GetStats() const { return m_stats; }
+
+    private:
+        struct PathState
+        {
+            XMFLOAT3 origin;
+            XMFLOAT3 direction;
+            XMFLOAT3 throughput;
+            float bsdf_pdf = 0.0f;  // solid angle pdf of direction, 0 for camera rays
+            float cone_width = 0.0f;    // ray cone at origin
+            float cone_spread = 0.0f;
+            UINT path_index = 0;
+            UINT rng = 0;
+            bool alive = false;
+        };
+
+        struct ShadowSample
+        {
+            XMFLOAT3 contribution;  // added to the path when the shadow ray is not blocked
+            uint64_t light_cache_key;   // cell the outcome of the light sample is recorded to, 0 for none
+        };
+
+        PathIntegrator() = default;
+        void TraceExtensionRays();
+        void ShadeMisses();
+        void ShadeHits(int depth, XMFLOAT3* radiance, DenoiserGuide* guides);
+        void TraceShadowRays(XMFLOAT3* radiance);
+        void CompactPaths();
+        const RayHit& GetExtensionHit(int path) const { return m_camera_hits ? m_camera_hits[path] : m_extension_stream->GetHit(path); }
+        XMFLOAT3 GetAlbedo(const PathState& path, const RayHit& hit) const;
+        XMFLOAT3 GetEnvironmentRadiance(const XMFLOAT3& direction) const;
+        XMFLOAT3 SampleEnvironment(const XMFLOAT2& u, float* pdf) const;
+        float GetEnvironmentPdf(const XMFLOAT3& direction) const;
+
+    private:
+        const Tracer* m_tracer = nullptr;
+        const EnvironmentMap* m_environment = nullptr;
+        const MipChain* m_mesh_texture = nullptr;
+        LightVisibilityCache* m_light_cache = nullptr;
+        const RayHit* m_camera_hits = nullptr;  // extension hits of the first bounce, the paths are not compacted yet
+        PathIntegratorSettings m_settings;
+        std::unique_ptr<RayStream> m_extension_stream;
+        std::unique_ptr<RayStream> m_shadow_stream;
+        std::vector<PathState> m_paths;
+        std::vector<ShadowSample> m_shadow_samples;
+        std::vector<XMFLOAT3> m_miss_radiance;
+        PathIntegratorStats m_stats;
+    };
+}
@@ -0,0 +1,472 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#include "Rasterizer.h"
+#include "ThreadPool.h"
+#include "Timer.h"
+#include <immintrin.h>
+#include <math.h>
+#include <algorithm>
+
+namespace dxrf
+{
+    static const int RASTER_BIN_SIZE = 64;
+    // a triangle clipped at both planes splits in up to three, so the triangles of a chunk fit in 16 bits
+    static const int CHUNK_TRIANGLE_COUNT = 4096;
+    static const int VERTEX_GRAIN = 4096;
+    static const int BIN_GRAIN = 1;
+
+    // Samples of the bin a thread rasterizes, kept between bins.
+    struct BinBuffers
+    {
+        alignas(32) float depth[RASTER_BIN_SIZE * RASTER_BIN_SIZE];        // 1 / w, 0 where nothing was drawn
+        alignas(32) UINT triangle[RASTER_BIN_SIZE * RASTER_BIN_SIZE];
+        alignas(32) float sample_x[RASTER_BIN_SIZE * RASTER_BIN_SIZE];     // relative to the bin origin
+        alignas(32) float sample_y[RASTER_BIN_SIZE * RASTER_BIN_SIZE];
+    };
+
+    static BinBuffers& GetBinBuffers()
+    {
+        static thread_local BinBuffers buffers;
+        return buffers;
+    }
+
+    static XMFLOAT4 Lerp(const XMFLOAT4& a, const XMFLOAT4& b, float s)
+    {
+        return { a.x + (b.x - a.x) * s, a.y + (b.y - a.y) * s, a.z + (b.z - a.z) * s, a.w + (b.w - a.w) * s };
+    }
+
+    // Sutherland-Hodgman step against the D3D near plane z >= 0 (plane 0) or the far plane z <= w (plane 1).
+    static int ClipPolygon(const XMFLOAT4* input, int input_count, int plane, XMFLOAT4* output)
+    {
+        int output_count = 0;
+        for (int i = 0; i < input_count; ++i)
+        {
+            const XMFLOAT4& a = input[i];
+            const XMFLOAT4& b = input[(i + 1) % input_count];
+            float distance_a = plane == 0 ? a.z : a.w - a.z;
+            float distance_b = plane == 0 ? b.z : b.w - b.z;
+            if (distance_a >= 0.0f)
+            {
+                output[output_count++] = a;
+            }
+            if ((distance_a >= 0.0f) != (distance_b >= 0.0f))
+            {
+                output[output_count++] = Lerp(a, b, distance_a / (distance_a - distance_b));
+            }
+        }
+        return output_count;
+    }
+
+    std::unique_ptr<Rasterizer> Rasterizer::Create(const Tracer* tracer)
+    {
+        std::unique_ptr<Rasterizer> rasterizer(new Rasterizer());
+        rasterizer->m_tracer = tracer;
+
+        return rasterizer;
+    }
+
+    void Rasterizer::Render(const XMMATRIX& world_to_projection, UINT instance_mask, int width, int height, const XMFLOAT2* sample_offsets,
+        const uint8_t* pixel_active, VisibilitySample* samples)
+    {
+        Timer timer;
+        m_stats = RasterizerStats();
+        m_width = width;
+        m_height = height;
+        m_center_samples = sample_offsets == nullptr;
+        m_bin_count_x = (width + RASTER_BIN_SIZE - 1) / RASTER_BIN_SIZE;
+        m_bin_count_y = (height + RASTER_BIN_SIZE - 1) / RASTER_BIN_SIZE;
+        int bin_count = m_bin_count_x * m_bin_count_y;
+
+        m_instances.clear();
+        UINT vertex_count = 0;
+        m_triangle_count = 0;
+        for (const TracerInstance& instance : m_tracer->GetInstances())
+        {
+            if ((instance.mask & instance_mask) == 0)
+            {
+                continue;
+            }
+
+            const Mesh* mesh = m_tracer->GetBottomStructure(instance.mesh_index)->GetMesh();
+            const std::vector<XMFLOAT3>& vertices = m_tracer->GetMeshVertices(instance.mesh_index);
+            RasterInstance raster_instance;
+            raster_instance.instance_id = instance.instance_id;
+            raster_instance.vertices = vertices.data();
+            raster_instance.indices = mesh->indices.data();
+            raster_instance.first_vertex = vertex_count;
+            raster_instance.first_triangle = m_triangle_count;
+            XMStoreFloat4x4(&raster_instance.object_to_clip, XMMatrixMultiply(XMLoadFloat4x4(&instance.object_to_world), world_to_projection));
+            m_instances.push_back(raster_instance);
+            vertex_count += (UINT) vertices.size();
+            m_triangle_count += (UINT) mesh->indices.size() / 3;
+        }
+        m_clip_vertices.resize(vertex_count);
+        this->TransformVertices();
+
+        int chunk_count = (int) ((m_triangle_count + CHUNK_TRIANGLE_COUNT - 1) / CHUNK_TRIANGLE_COUNT);
+        assert(chunk_count <= 1 << 16);
+        if ((int) m_chunk_triangles.size() < chunk_count)
+        {
+            m_chunk_triangles.resize(chunk_count);
+            m_chunk_entries.resize(chunk_count);
+        }
+        m_bin_counts.assign((size_t) chunk_count * bin_count, 0);
+        ThreadPool::GetInstance()->ParallelFor(0, chunk_count, 1, [&](int begin, int end) {
+            for (int chunk = begin; chunk < end; ++chunk)
+            {
+                this->SetupTriangles(chunk);
+            }
+        });
+
+        // counting sort of the entries by bin, chunk after chunk, so every bin draws its triangles in scene order
+        m_bin_offsets.resize(bin_count + 1);
+        UINT offset = 0;
+        for (int bin = 0; bin < bin_count; ++bin)
+        {
+            m_bin_offsets[bin] = offset;
+            for (int chunk = 0; chunk < chunk_count; ++chunk)
+            {
+                UINT& count = m_bin_counts[(size_t) chunk * bin_count + bin];
+                UINT chunk_offset = offset;
+                offset += count;
+                count = chunk_offset;
+            }
+        }
+        m_bin_offsets[bin_count] = offset;
+        m_bin_triangles.resize(offset);
+        ThreadPool::GetInstance()->ParallelFor(0, chunk_count, 1, [&](int begin, int end) {
+            for (int chunk = begin; chunk < end; ++chunk)
+            {
+                UINT* bin_offsets = &m_bin_counts[(size_t) chunk * bin_count];
+                for (const BinEntry& entry : m_chunk_entries[chunk])
+                {
+                    m_bin_triangles[bin_offsets[entry.bin]++] = (UINT) chunk << 16 | entry.triangle;
+                }
+            }
+        });
+
+        m_stats.triangle_count = (int) m_triangle_count;
+        for (int chunk = 0; chunk < chunk_count; ++chunk)
+        {
+            m_stats.setup_triangle_count += (int) m_chunk_triangles[chunk].size();
+        }
+        m_stats.bin_entry_count = (int) offset;
+        m_stats.setup_ms = timer.GetElapsedMs();
+
+        timer.Reset();
+        ThreadPool::GetInstance()->ParallelFor(0, bin_count, BIN_GRAIN, [&](int begin, int end) {
+            for (int bin = begin; bin < end; ++bin)
+            {
+                this->RasterizeBin(bin, sample_offsets, pixel_active, samples);
+            }
+        });
+        m_stats.raster_ms = timer.GetElapsedMs();
+    }
+
+    void Rasterizer::TransformVertices()
+    {
+        ThreadPool::GetInstance()->ParallelFor(0, (int) m_clip_vertices.size(), VERTEX_GRAIN, [&](int begin, int end) {
+            size_t instance_index = std::upper_bound(m_instances.begin(), m_instances.end(), (UINT) begin,
+                [](UINT vertex, const RasterInstance& instance) { return vertex < instance.first_vertex; }) - m_instances.begin() - 1;
+            XMMATRIX object_to_clip = XMLoadFloat4x4(&m_instances[instance_index].object_to_clip);
+            for (int i = begin; i < end; ++i)
+            {
+                // instances without vertices share their first vertex with the next one
+                size_t previous = instance_index;
+                while (instance_index + 1 < m_instances.size() && (UINT) i >= m_instances[instance_index + 1].first_vertex)
+                {
+                    ++instance_index;
+                }
+                if (instance_index != previous)
+                {
+                    object_to_clip = XMLoadFloat4x4(&m_instances[instance_index].object_to_clip);
+                }
+                const RasterInstance& instance = m_instances[instance_index];
+                XMStoreFloat4(&m_clip_vertices[i], XMVector3Transform(XMLoadFloat3(&instance.vertices[i - instance.first_vertex]), object_to_clip));
+            }
+        });
+    }
+
+    void Rasterizer::SetupTriangles(int chunk)
+    {
+        std::vector<RasterTriangle>& triangles = m_chunk_triangles[chunk];
+        std::vector<BinEntry>& entries = m_chunk_entries[chunk];
+        UINT* bin_counts = &m_bin_counts[(size_t) chunk * m_bin_count_x * m_bin_count_y];
+        triangles.clear();
+        entries.clear();
+
+        UINT begin = (UINT) chunk * CHUNK_TRIANGLE_COUNT;
+        UINT end = (std::min)(begin + CHUNK_TRIANGLE_COUNT, m_triangle_count);
+        size_t instance_index = std::upper_bound(m_instances.begin(), m_instances.end(), begin,
+            [](UINT triangle, const RasterInstance& instance) { return triangle < instance.first_triangle; }) - m_instances.begin() - 1;
+        for (UINT i = begin; i < end; ++i)
+        {
+            while (instance_index + 1 < m_instances.size() && i >= m_instances[instance_index + 1].first_triangle)
+            {
+                ++instance_index;
+            }
+            const RasterInstance& instance = m_instances[instance_index];
+            UINT primitive_index = i - instance.first_triangle;
+            const uint16_t* indices = &instance.indices[primitive_index * 3];
+            XMFLOAT4 clip[3];
+            for (int j = 0; j < 3; ++j)
+            {
+                clip[j] = m_clip_vertices[instance.first_vertex + indices[j]];
+            }
+
+            size_t first = triangles.size();
+            this->SetupTriangle(clip, instance.instance_id, primitive_index, &triangles);
+            for (size_t t = first; t < triangles.size(); ++t)
+            {
+                const RasterTriangle& triangle = triangles[t];
+                for (int bin_y = triangle.min_y / RASTER_BIN_SIZE; bin_y <= triangle.max_y / RASTER_BIN_SIZE; ++bin_y)
+                {
+                    for (int bin_x = triangle.min_x / RASTER_BIN_SIZE; bin_x <= triangle.max_x / RASTER_BIN_SIZE; ++bin_x)
+                    {
+                        UINT bin = (UINT) (bin_y * m_bin_count_x + bin_x);
+                        entries.push_back({ bin, (UINT) t });
+                        bin_counts[bin] += 1;
+                    }
+                }
+            }
+        }
+    }
+
+    // Culls triangles outside the frustum and clips the ones crossing the near or far plane into a fan.
+    void Rasterizer::SetupTriangle(const XMFLOAT4* clip, UINT instance_id, UINT primitive_index, std::vector<RasterTriangle>* triangles) const
+    {
+        UINT outside_all = 0x3f;
+        UINT outside_any = 0;
+        for (int j = 0; j < 3; ++j)
+        {
+            const XMFLOAT4& v = clip[j];
+            UINT outside = (v.x < -v.w ? 1 : 0) | (v.x > v.w ? 2 : 0) | (v.y < -v.w ? 4 : 0) | (v.y > v.w ? 8 : 0) |
+                (v.z < 0.0f ? 16 : 0) | (v.z > v.w ? 32 : 0);
+            outside_all &= outside;
+            outside_any |= outside;
+        }
+        if (outside_all != 0)
+        {
+            return;
+        }
+
+        XMFLOAT4 polygon[2][8];
+        int vertex_count = 3;
+        std::copy(clip, clip + 3, polygon[0]);
+        int current = 0;
+        for (int plane = 0; plane < 2; ++plane)
+        {
+            if ((outside_any & (16 << plane)) != 0)
+            {
+                vertex_count = ClipPolygon(polygon[current], vertex_count, plane, polygon[1 - current]);
+                current = 1 - current;
+            }
+        }
+
+        for (int j = 2; j < vertex_count; ++j)
+        {
+            XMFLOAT4 fan[3] = { polygon[current][0], polygon[current][j - 1], polygon[current][j] };
+            RasterTriangle triangle;
+            if (this->SetupScreenTriangle(fan, &triangle))
+            {
+                triangle.instance_id = instance_id;
+                triangle.primitive_index = primitive_index;
+                triangles->push_back(triangle);
+            }
+        }
+    }
+
+    // Pixel (x, y) covers [x, x + 1) x [y, y + 1) and ndc y points up. Edges are oriented so the inside is
+    // positive whatever the winding, rays hit both faces. Samples on an edge count as inside of both triangles,
+    // the depth test picks one of them.
+    bool Rasterizer::SetupScreenTriangle(const XMFLOAT4* clip, RasterTriangle* triangle) const
+    {
+        double x[3];
+        double y[3];
+        double z[3];
+        for (int j = 0; j < 3; ++j)
+        {
+            double inv_w = 1.0 / clip[j].w;
+            x[j] = (clip[j].x * inv_w * 0.5 + 0.5) * m_width;
+            y[j] = (0.5 - clip[j].y * inv_w * 0.5) * m_height;
+            z[j] = inv_w;
+        }
+
+        // pixels whose sample can fall inside the bounds, with centered samples the many triangles smaller than
+        // a pixel mostly fall between the centers and are dropped here
+        double sample_margin = m_center_samples ? 0.5 : 0.0;
+        double min_x = (std::max)(ceil((std::min)((std::min)(x[0], x[1]), x[2]) - 1.0 + sample_margin), 0.0);
+        double min_y = (std::max)(ceil((std::min)((std::min)(y[0], y[1]), y[2]) - 1.0 + sample_margin), 0.0);
+        double max_x = (std::min)(floor((std::max)((std::max)(x[0], x[1]), x[2]) - sample_margin), m_width - 1.0);
+        double max_y = (std::min)(floor((std::max)((std::max)(y[0], y[1]), y[2]) - sample_margin), m_height - 1.0);
+        double area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+        if (min_x > max_x || min_y > max_y || area == 0.0)
+        {
+            return false;
+        }
+        triangle->min_x = (int) min_x;
+        triangle->min_y = (int) min_y;
+        triangle->max_x = (int) max_x;
+        triangle->max_y = (int) max_y;
+
+        double orientation = area > 0.0 ? 1.0 : -1.0;
+        for (int i = 0; i < 3; ++i)
+        {
+            // edge opposite vertex i, through vertex a with the rounded slopes so neighbors share the line exactly
+            int a = (i + 1) % 3;
+            int b = (i + 2) % 3;
+            triangle->edge_a[i] = (float) ((y[a] - y[b]) * orientation);
+            triangle->edge_b[i] = (float) ((x[b] - x[a]) * orientation);
+            triangle->edge_c[i] = -(triangle->edge_a[i] * x[a] + triangle->edge_b[i] * y[a]);
+        }
+
+        double inv_area = 1.0 / area;
+        triangle->depth_a = (float) (((z[1] - z[0]) * (y[2] - y[0]) - (z[2] - z[0]) * (y[1] - y[0])) * inv_area);
+        triangle->depth_b = (float) (((z[2] - z[0]) * (x[1] - x[0]) - (z[1] - z[0]) * (x[2] - x[0])) * inv_area);
+        triangle->depth_c = z[0] - triangle->depth_a * x[0] - triangle->depth_b * y[0];
+        return true;
+    }
+
+    void Rasterizer::RasterizeBin(int bin, const XMFLOAT2* sample_offsets, const uint8_t* pixel_active, VisibilitySample* samples) const
+    {
+        int bin_x = (bin % m_bin_count_x) * RASTER_BIN_SIZE;
+        int bin_y = (bin / m_bin_count_x) * RASTER_BIN_SIZE;
+        int width = (std::min)(RASTER_BIN_SIZE, m_width - bin_x);
+        int height = (std::min)(RASTER_BIN_SIZE, m_height - bin_y);
+        if (pixel_active)
+        {
+            bool active = false;
+            for (int y = 0; y < height && !active; ++y)
+            {
+                const uint8_t* row = &pixel_active[(bin_y + y) * m_width + bin_x];
+                active = std::any_of(row, row + width, [](uint8_t pixel) { return pixel != 0; });
+            }
+            if (!active)
+            {
+                return;
+            }
+        }
+
+        // rows are padded to the bin size, the samples past the screen edge are drawn but never stored
+        BinBuffers& buffers = GetBinBuffers();
+        for (int y = 0; y < height; ++y)
+        {
+            for (int x = 0; x < RASTER_BIN_SIZE; ++x)
+            {
+                int i = y * RASTER_BIN_SIZE + x;
+                XMFLOAT2 offset = (sample_offsets && x < width) ? sample_offsets[(bin_y + y) * m_width + bin_x + x] : XMFLOAT2(0.5f, 0.5f);
+                buffers.depth[i] = 0.0f;
+                buffers.triangle[i] = UINT_MAX;
+                buffers.sample_x[i] = x + offset.x;
+                buffers.sample_y[i] = y + offset.y;
+            }
+        }
+
+        for (UINT e = m_bin_offsets[bin]; e < m_bin_offsets[bin + 1]; ++e)
+        {
+            UINT id = m_bin_triangles[e];
+            const RasterTriangle& triangle = m_chunk_triangles[id >> 16][id & 0xffff];
+            int x_begin = (std::max)(triangle.min_x - bin_x, 0);
+            int y_begin = (std::max)(triangle.min_y - bin_y, 0);
+            int x_last = (std::min)(triangle.max_x - bin_x, width - 1);
+            int y_last = (std::min)(triangle.max_y - bin_y, height - 1);
+            float edge_c[3];
+            for (int k = 0; k < 3; ++k)
+            {
+                edge_c[k] = (float) (triangle.edge_c[k] + (double) triangle.edge_a[k] * bin_x + (double) triangle.edge_b[k] * bin_y);
+            }
+            float depth_c = (float) (triangle.depth_c + (double) triangle.depth_a * bin_x + (double) triangle.depth_b * bin_y);
+
+#if defined(__AVX2__)
+            __m256 a0 = _mm256_set1_ps(triangle.edge_a[0]);
+            __m256 a1 = _mm256_set1_ps(triangle.edge_a[1]);
+            __m256 a2 = _mm256_set1_ps(triangle.edge_a[2]);
+            __m256 b0 = _mm256_set1_ps(triangle.edge_b[0]);
+            __m256 b1 = _mm256_set1_ps(triangle.edge_b[1]);
+            __m256 b2 = _mm256_set1_ps(triangle.edge_b[2]);
+            __m256 c0 = _mm256_set1_ps(edge_c[0]);
+            __m256 c1 = _mm256_set1_ps(edge_c[1]);
+            __m256 c2 = _mm256_set1_ps(edge_c[2]);
+            __m256 za = _mm256_set1_ps(triangle.depth_a);
+            __m256 zb = _mm256_set1_ps(triangle.depth_b);
+            __m256 zc = _mm256_set1_ps(depth_c);
+            __m256 zero = _mm256_setzero_ps();
+            __m256 ids = _mm256_castsi256_ps(_mm256_set1_epi32((int) id));
+            for (int y = y_begin; y <= y_last; ++y)
+            {
+                for (int x = x_begin & ~7; x <= x_last; x += 8)
+                {
+                    int i = y * RASTER_BIN_SIZE + x;
+                    __m256 px = _mm256_load_ps(&buffers.sample_x[i]);
+                    __m256 py = _mm256_load_ps(&buffers.sample_y[i]);
+                    __m256 e0 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a0, px), _mm256_mul_ps(b0, py)), c0);
+                    __m256 e1 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a1, px), _mm256_mul_ps(b1, py)), c1);
+                    __m256 e2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a2, px), _mm256_mul_ps(b2, py)), c2);
+                    __m256 inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(e0, zero, _CMP_GE_OQ), _mm256_cmp_ps(e1, zero, _CMP_GE_OQ)),
+                        _mm256_cmp_ps(e2, zero, _CMP_GE_OQ));
+                    if (_mm256_movemask_ps(inside) == 0)
+                    {
+                        continue;
+                    }
+                    __m256 z = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(za, px), _mm256_mul_ps(zb, py)), zc);
+                    __m256 depth = _mm256_load_ps(&buffers.depth[i]);
+                    __m256 closer = _mm256_and_ps(inside, _mm256_cmp_ps(z, depth, _CMP_GT_OQ));
+                    _mm256_store_ps(&buffers.depth[i], _mm256_blendv_ps(depth, z, closer));
+                    __m256 visible = _mm256_load_ps((const float*) &buffers.triangle[i]);
+                    _mm256_store_ps((float*) &buffers.triangle[i], _mm256_blendv_ps(visible, ids, closer));
+                }
+            }
+#else
+            for (int y = y_begin; y <= y_last; ++y)
+            {
+                for (int x = x_begin; x <= x_last; ++x)
+                {
+                    int i = y * RASTER_BIN_SIZE + x;
+                    float px = buffers.sample_x[i];
+                    float py = buffers.sample_y[i];
+                    float e0 = triangle.edge_a[0] * px + triangle.edge_b[0] * py + edge_c[0];
+                    float e1 = triangle.edge_a[1] * px + triangle.edge_b[1] * py + edge_c[1];
+                    float e2 = triangle.edge_a[2] * px + triangle.edge_b[2] * py + edge_c[2];
+                    float z = triangle.depth_a * px + triangle.depth_b * py + depth_c;
+                    if (e0 >= 0.0f && e1 >= 0.0f && e2 >= 0.0f && z > buffers.depth[i])
+                    {
+                        buffers.depth[i] = z;
+                        buffers.triangle[i] = id;
+                    }
+                }
+            }
+#endif
+        }
+
+        for (int y = 0; y < height; ++y)
+        {
+            for (int x = 0; x < width; ++x)
+            {
+                UINT id = buffers.triangle[y * RASTER_BIN_SIZE + x];
+                VisibilitySample& sample = samples[(bin_y + y) * m_width + bin_x + x];
+                if (id == UINT_MAX)
+                {
+                    sample = VisibilitySample();
+                    continue;
+                }
+                const RasterTriangle& triangle = m_chunk_triangles[id >> 16][id & 0xffff];
+                sample.instance_id = triangle.instance_id;
+                sample.primitive_index = triangle.primitive_index;
+            }
+        }
+    }
+}
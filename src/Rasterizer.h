@@ -0,0 +1,117 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include "Tracer.h"
+
+namespace dxrf
+{
+    // Triangle seen by a pixel sample, instance_id is UINT_MAX where the sample sees nothing.
+    struct VisibilitySample
+    {
+        UINT instance_id = UINT_MAX;
+        UINT primitive_index = UINT_MAX;
+    };
+
+    struct RasterizerStats
+    {
+        int triangle_count = 0;         // triangles of the instances in the mask
+        int setup_triangle_count = 0;   // left after culling, clipped triangles count once per piece
+        int bin_entry_count = 0;        // triangles summed over the bins they overlap
+        double setup_ms = 0.0;
+        double raster_ms = 0.0;
+    };
+
+    // Visibility buffer of a camera (Burns and Hunt 2013). Triangles of the tracer instances go to clip space
+    // through the same object to world matrices the instance BVH uses, are clipped at the near and far planes and
+    // binned into screen bins. Bins rasterize in parallel, eight samples of a row at once with AVX2, keeping the
+    // triangle of largest 1 / w per sample. Only the ids are stored: intersecting the camera ray with the visible
+    // triangle (Tracer::IntersectPrimitive) gives the t and barycentrics of TraceRay without any traversal.
+    class Rasterizer
+    {
+    public:
+        static std::unique_ptr<Rasterizer> Create(const Tracer* tracer);
+        // Writes the closest triangle of the instances whose mask overlaps instance_mask to samples[y * width + x].
+        // world_to_projection maps to D3D clip space. The sample of pixel (x, y) is at (x, y) + sample_offsets[...]
+        // in pixels, with offsets in [0, 1), nullptr samples the pixel centers. Bins without any pixel_active
+        // pixel are skipped and keep their samples, nullptr renders every bin.
+        void Render(const XMMATRIX& world_to_projection, UINT instance_mask, int width, int height, const XMFLOAT2* sample_offsets,
+            const uint8_t* pixel_active, VisibilitySample* samples);
+        const RasterizerStats& GetStats() const { return m_stats; }
+
+    private:
+        // Edge functions and 1 / w are planes over the screen. The constant terms are kept in double and moved to
+        // the origin of each bin before rasterizing in float, so triangles reaching far past the screen after near
+        // clipping keep their precision. The bounds cover the pixels whose sample may be inside.
+        struct RasterTriangle
+        {
+            float edge_a[3];
+            float edge_b[3];
+            double edge_c[3];
+            float depth_a;
+            float depth_b;
+            double depth_c;
+            int min_x;
+            int min_y;
+            int max_x;      // inclusive
+            int max_y;
+            UINT instance_id;
+            UINT primitive_index;
+        };
+
+        struct RasterInstance
+        {
+            UINT instance_id = 0;
+            const XMFLOAT3* vertices = nullptr;
+            const uint16_t* indices = nullptr;
+            UINT first_vertex = 0;      // of the instance in m_clip_vertices
+            UINT first_triangle = 0;
+            XMFLOAT4X4 object_to_clip;
+        };
+
+        // triangle of a chunk overlapping a bin
+        struct BinEntry
+        {
+            UINT bin;
+            UINT triangle;
+        };
+
+        Rasterizer() = default;
+        void TransformVertices();
+        void SetupTriangles(int chunk);
+        void SetupTriangle(const XMFLOAT4* clip, UINT instance_id, UINT primitive_index, std::vector<RasterTriangle>* triangles) const;
+        bool SetupScreenTriangle(const XMFLOAT4* clip, RasterTriangle* triangle) const;
+        void RasterizeBin(int bin, const XMFLOAT2* sample_offsets, const uint8_t* pixel_active, VisibilitySample* samples) const;
+
+    private:
+        const Tracer* m_tracer = nullptr;
+        int m_width = 0;
+        int m_height = 0;
+        bool m_center_samples = true;
+        int m_bin_count_x = 0;
+        int m_bin_count_y = 0;
+        std::vector<RasterInstance> m_instances;
+        UINT m_triangle_count = 0;
+        std::vector<XMFLOAT4> m_clip_vertices;
+        std::vector<std::vector<RasterTriangle>> m_chunk_triangles;
+        std::vector<std::vector<BinEntry>> m_chunk_entries;
+        std::vector<UINT> m_bin_counts;                 // entries per chunk and bin, then where each chunk starts in the bin
+        std::vector<UINT> m_bin_offsets;
+        std::vector<UINT> m_bin_triangles;              // chunk << 16 | triangle of the chunk
+        RasterizerStats m_stats;
+    };
+}
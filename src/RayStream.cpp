@@ -0,0 +1,177 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#include "RayStream.h"
+#include "Timer.h"
+
+namespace dxrf
+{
+    static const int CELL_BITS = 9;
+
+    // spreads the low 9 bits so that two zero bits follow each one
+    static UINT InterleaveBits9(UINT x)
+    {
+        x &= 0x1ff;
+        x = (x | (x << 16)) & 0x030000ff;
+        x = (x | (x << 8)) & 0x0300f00f;
+        x = (x | (x << 4)) & 0x030c30c3;
+        x = (x | (x << 2)) & 0x09249249;
+        return x;
+    }
+
+    std::unique_ptr<RayStream> RayStream::Create(const Tracer* tracer)
+    {
+        std::unique_ptr<RayStream> stream(new RayStream());
+        stream->m_tracer = tracer;
+
+        return stream;
+    }
+
+    void RayStream::Clear()
+    {
+        m_rays.clear();
+    }
+
+    UINT RayStream::AddRay(const Ray& ray)
+    {
+        m_rays.push_back(ray);
+        return (UINT) m_rays.size() - 1;
+    }
+
+    // 3 bit direction octant above a 27 bit Morton code of the origin cell within the bounds of all origins.
+    void RayStream::ComputeKeys()
+    {
+        AABB bounds;
+        for (const Ray& ray : m_rays)
+        {
+            bounds.Grow(ray.origin);
+        }
+
+        float scale[3];
+        for (int a = 0; a < 3; ++a)
+        {
+            float extent = GetAxis(bounds.max, a) - GetAxis(bounds.min, a);
+            scale[a] = extent > 0.0f ? ((1 << CELL_BITS) - 1) / extent : 0.0f;
+        }
+
+        m_keys.resize(m_rays.size());
+        for (size_t i = 0; i < m_rays.size(); ++i)
+        {
+            const Ray& ray = m_rays[i];
+            UINT octant = (ray.direction.x < 0.0f ? 1 : 0) | (ray.direction.y < 0.0f ? 2 : 0) | (ray.direction.z < 0.0f ? 4 : 0);
+            UINT x = (UINT) ((ray.origin.x - bounds.min.x) * scale[0]);
+            UINT y = (UINT) ((ray.origin.y - bounds.min.y) * scale[1]);
+            UINT z = (UINT) ((ray.origin.z - bounds.min.z) * scale[2]);
+            UINT cell = (InterleaveBits9(x) << 2) | (InterleaveBits9(y) << 1) | InterleaveBits9(z);
+            m_keys[i] = (octant << (CELL_BITS * 3)) | cell;
+        }
+    }
+
+    // LSD radix sort of the 30 bit keys in 8 bit digits, then gathers the rays in sorted order.
+    void RayStream::Sort()
+    {
+        size_t count = m_rays.size();
+        m_order.resize(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            m_order[i] = (UINT) i;
+        }
+
+        if (m_sort_enabled)
+        {
+            this->ComputeKeys();
+            m_keys_temp.resize(count);
+            m_order_temp.resize(count);
+            for (int shift = 0; shift < CELL_BITS * 3 + 3; shift += 8)
+            {
+                UINT histogram[256] = { };
+                for (size_t i = 0; i < count; ++i)
+                {
+                    histogram[(m_keys[i] >> shift) & 0xff] += 1;
+                }
+                UINT offset = 0;
+                for (int d = 0; d < 256; ++d)
+                {
+                    UINT n = histogram[d];
+                    histogram[d] = offset;
+                    offset += n;
+                }
+                for (size_t i = 0; i < count; ++i)
+                {
+                    UINT dst = histogram[(m_keys[i] >> shift) & 0xff]++;
+                    m_keys_temp[dst] = m_keys[i];
+                    m_order_temp[dst] = m_order[i];
+                }
+                m_keys.swap(m_keys_temp);
+                m_order.swap(m_order_temp);
+            }
+        }
+
+        m_sorted_rays.resize(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            m_sorted_rays[i] = m_rays[m_order[i]];
+        }
+    }
+
+    void RayStream::TraceOcclusion(UINT instance_mask)
+    {
+        Timer timer;
+        this->Sort();
+        m_stats.ray_count = (int) m_rays.size();
+        m_stats.sort_ms = timer.GetElapsedMs();
+
+        timer.Reset();
+        size_t count = m_rays.size();
+        if (m_sorted_occluded_size < count)
+        {
+            m_sorted_occluded.reset(new bool[count]);
+            m_sorted_occluded_size = count;
+        }
+        m_occluded.resize(count);
+        if (count > 0)
+        {
+            m_tracer->TraceOcclusion(&m_sorted_rays[0], (int) count, instance_mask, m_sorted_occluded.get());
+        }
+        for (size_t i = 0; i < count; ++i)
+        {
+            m_occluded[m_order[i]] = m_sorted_occluded[i] ? 1 : 0;
+        }
+        m_stats.trace_ms = timer.GetElapsedMs();
+    }
+
+    void RayStream::TraceClosestHit(UINT instance_mask)
+    {
+        Timer timer;
+        this->Sort();
+        m_stats.ray_count = (int) m_rays.size();
+        m_stats.sort_ms = timer.GetElapsedMs();
+
+        timer.Reset();
+        size_t count = m_rays.size();
+        m_sorted_hits.resize(count);
+        m_hits.resize(count);
+        if (count > 0)
+        {
+            m_tracer->TraceRays(&m_sorted_rays[0], (int) count, instance_mask, &m_sorted_hits[0]);
+        }
+        for (size_t i = 0; i < count; ++i)
+        {
+            m_hits[m_order[i]] = m_sorted_hits[i];
+        }
+        m_stats.trace_ms = timer.GetElapsedMs();
+    }
+}
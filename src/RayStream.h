@@ -0,0 +1,74 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include "Tracer.h"
+
+namespace dxrf
+{
+    struct RayStreamStats
+    {
+        int ray_count = 0;
+        double sort_ms = 0.0;   // key computation, radix sort and gather into sorted order
+        double trace_ms = 0.0;  // traversal of the sorted batches and scatter of the results
+    };
+
+    // Collects the secondary rays of a tile or frame and traces them as one stream. Rays are sorted by direction
+    // octant and origin cell so that neighboring rays of a batch walk the same BVH nodes, then traced with the
+    // batch queries of the tracer, which go breadth first for large streams. Results are indexed by the order in
+    // which rays were added. Buffers are kept between frames.
+    class RayStream
+    {
+    public:
+        static std::unique_ptr<RayStream> Create(const Tracer* tracer);
+        void Clear();
+        // Returns the index of the ray's result.
+        UINT AddRay(const Ray& ray);
+        // For filling the stream from several threads, resize once and set every ray.
+        void Resize(size_t ray_count) { m_rays.resize(ray_count); }
+        void SetRay(UINT ray_index, const Ray& ray) { m_rays[ray_index] = ray; }
+        void TraceOcclusion(UINT instance_mask);
+        void TraceClosestHit(UINT instance_mask);
+        bool IsOccluded(UINT ray_index) const { return m_occluded[ray_index] != 0; }
+        const RayHit& GetHit(UINT ray_index) const { return m_hits[ray_index]; }
+        // Tracing unsorted streams is kept for measuring the sort against the traversal it saves.
+        void SetSortEnabled(bool enabled) { m_sort_enabled = enabled; }
+        const RayStreamStats& GetStats() const { return m_stats; }
+        size_t GetRayCount() const { return m_rays.size(); }
+
+    private:
+        RayStream() = default;
+        void Sort();
+        void ComputeKeys();
+
+    private:
+        const Tracer* m_tracer = nullptr;
+        bool m_sort_enabled = true;
+        std::vector<Ray> m_rays;
+        std::vector<Ray> m_sorted_rays;
+        std::vector<UINT> m_keys;
+        std::vector<UINT> m_keys_temp;
+        std::vector<UINT> m_order;
+        std::vector<UINT> m_order_temp;
+        std::vector<uint8_t> m_occluded;
+        std::vector<RayHit> m_hits;
+        std::unique_ptr<bool[]> m_sorted_occluded;
+        size_t m_sorted_occluded_size = 0;
+        std::vector<RayHit> m_sorted_hits;
+        RayStreamStats m_stats;
+    };
+}
@@ -15,11 +15,22 @@ using namespace DirectX;
 typedef UINT16 Index;
 #endif
 
+// Visibility flags of a mesh renderer. The low byte is the instance mask, a ray only sees the instances whose
+// mask overlaps the InstanceInclusionMask of its TraceRay. Receiving shadows is a property of the surface that
+// is hit, the hit shader reads it from MeshConstantBuffer::visibility.
+static const UINT VISIBILITY_CAMERA = 0x01;             // camera and bounce rays
+static const UINT VISIBILITY_SHADOW_CASTER = 0x02;      // shadow rays
+static const UINT VISIBILITY_LIGHT_PROXY = 0x04;        // stands in for the analytic sphere light
+static const UINT VISIBILITY_INSTANCE_MASK = 0xff;
+static const UINT VISIBILITY_SHADOW_RECEIVER = 0x100;
+
 struct SceneConstantBuffer
 {
     XMMATRIX projection_to_world;
     XMVECTOR camera_position;
     XMVECTOR light_position;
+    float pixel_spread_angle;   // angle one pixel subtends, camera rays start as cones of this spread
+    XMFLOAT3 padding;
 };
 
 struct MeshConstantBuffer
@@ -28,6 +39,7 @@ struct MeshConstantBuffer
     UINT vertex_buffer_offset;
     UINT vertex_stride;
     UINT index_buffer_offset;
+    UINT visibility;
 };
 
 struct Vertex
@@ -54,6 +54,8 @@ struct RayPayload
     bool skip_shading;
     float ray_hit_t;
     uint hit_instance_id;
+    float cone_width;   // ray cone at the ray origin, for texture LOD
+    float cone_spread;
 };
 
 // Retrieve hit world position.
@@ -79,6 +81,30 @@ Vertex HitVertex(Vertex vertices[3], BuiltInTriangleIntersectionAttributes attr)
     return v;
 }
 
+// Ray cone texture LOD, Akenine-Moller et al. 2019. The texel to world area ratio of the triangle turns the cone
+// width into texels, grazing angles stretch the footprint by 1 / |n.d|. Keep in sync with Tracer::GetTextureLod.
+static const float LOD_MIN_COS_THETA = 1e-4;
+
+float ComputeTextureLod(Vertex vertices[3], float cone_width, float2 texture_size)
+{
+    float3x3 object_to_world = (float3x3) ObjectToWorld4x3();
+    float3 normal = cross(mul(vertices[1].position - vertices[0].position, object_to_world),
+        mul(vertices[2].position - vertices[0].position, object_to_world));
+    float world_area = length(normal);
+    float2 uv1 = vertices[1].uv - vertices[0].uv;
+    float2 uv2 = vertices[2].uv - vertices[0].uv;
+    float texel_area = abs(uv1.x * uv2.y - uv1.y * uv2.x) * texture_size.x * texture_size.y;
+    // degenerate triangles and meshes without UVs have no texel to world ratio
+    if (world_area <= 0.0 || texel_area <= 0.0)
+    {
+        return 0.0;
+    }
+    // a ray along the surface would stretch the footprint without bound
+    float cos_theta = max(abs(dot(normal, WorldRayDirection())) / world_area, LOD_MIN_COS_THETA);
+
+    return 0.5 * log2(texel_area / world_area) + log2(cone_width / cos_theta);
+}
+
 // Generate a ray in world space for a camera pixel corresponding to an index from the dispatched 2D grid.
 inline void GenerateCameraRay(uint2 index, out float3 origin, out float3 direction)
 {
@@ -112,8 +138,9 @@ void MyRaygenShader()
     ray.Direction = rayDir;
     ray.TMin = 0.01;
     ray.TMax = 1000.0;
-    RayPayload payload = { float4(0, 0, 0, 0), false, FLT_MAX, UINT_NAX };
-    TraceRay(Scene, RAY_FLAG_CULL_BACK_FACING_TRIANGLES, 1, 0, 1, 0, ray, payload);
+    // camera rays start as cones of one pixel from the pinhole
+    RayPayload payload = { float4(0, 0, 0, 0), false, FLT_MAX, UINT_NAX, 0.0, g_scene.pixel_spread_angle };
+    TraceRay(Scene, RAY_FLAG_CULL_BACK_FACING_TRIANGLES, VISIBILITY_CAMERA, 0, 1, 0, ray, payload);
 
     // Write the raytraced color to the output texture.
     RenderTarget[DispatchRaysIndex().xy] = payload.color;
@@ -170,14 +197,18 @@ void MyClosestHitShader(inout RayPayload payload, in MyAttributes attr)
     };
     Vertex vertex = HitVertex(vertices, attr);
 
-    //float4 color = g_texture_local.SampleLevel(g_sampler, vertex.uv, 0);
+    float2 texture_size;
+    g_texture_local.GetDimensions(texture_size.x, texture_size.y);
+    float cone_width = payload.cone_width + payload.cone_spread * RayTCurrent();
+    float lod = ComputeTextureLod(vertices, cone_width, texture_size);
+    float3 albedo = g_texture_local.SampleLevel(g_sampler, vertex.uv, lod).rgb;
 
     float3 hit_pos = HitWorldPosition();
     float3 normal = normalize(mul(vertex.normal, ObjectToWorld3x4()).xyz);
     float3 light_pos = g_scene.light_position.xyz;
     float3 light_offset = light_pos - hit_pos;
     float3 light_dir = normalize(light_offset);
-    float3 color = max(0.0, dot(normal, light_dir));
+    float3 color = albedo * max(0.0, dot(normal, light_dir));
 
     float light_dis = length(light_offset);
     float light_atten_a = 1.0;
@@ -187,33 +218,27 @@ void MyClosestHitShader(inout RayPayload payload, in MyAttributes attr)
     float light_intensity = 60.0;
     color *= light_atten * light_intensity;
 
-    float shadow_sum = 0.0;
-    const int shadow_ray_count = 1;
-    // Trace rays from hit point to light
-    for (int i = 0; i < shadow_ray_count; ++i)
+    float shadow = 1.0;
+    if (g_mesh.visibility & VISIBILITY_SHADOW_RECEIVER)
     {
-        RayDesc shadow_ray;
-        shadow_ray.Origin = hit_pos;
-        shadow_ray.Direction = light_dir;
-        shadow_ray.TMin = 0.01;
-        shadow_ray.TMax = 1000.0;
-        RayPayload shadow_payload = { float4(0, 0, 0, 0), true, FLT_MAX, UINT_NAX };
-        TraceRay(Scene, 0, ~0, 0, 1, 0, shadow_ray, shadow_payload);
-        float shadow = 1.0;
-        if (shadow_payload.ray_hit_t < FLT_MAX)
+        float shadow_sum = 0.0;
+        const int shadow_ray_count = 1;
+        // Trace rays from hit point to light. Only shadow casters are in the mask, so the first hit blocks the
+        // light, the payload starts blocked and the miss shader clears it.
+        for (int i = 0; i < shadow_ray_count; ++i)
         {
-            if (shadow_payload.hit_instance_id < 6)
-            {
-                shadow = 0.0;
-            }
-            else if (shadow_payload.hit_instance_id == 6) // light
-            {
-
-            }
+            RayDesc shadow_ray;
+            shadow_ray.Origin = hit_pos;
+            shadow_ray.Direction = light_dir;
+            shadow_ray.TMin = 0.01;
+            shadow_ray.TMax = light_dis;
+            RayPayload shadow_payload = { float4(0, 0, 0, 0), true, 0.0, UINT_NAX, 0.0, 0.0 };
+            TraceRay(Scene, RAY_FLAG_ACCEPT_FIRST_HIT_AND_END_SEARCH | RAY_FLAG_SKIP_CLOSEST_HIT_SHADER, VISIBILITY_SHADOW_CASTER, 0, 1, 0, shadow_ray, shadow_payload);
+            shadow_sum += shadow_payload.ray_hit_t == FLT_MAX ? 1.0 : 0.0;
         }
-        shadow_sum += shadow;
+        shadow = shadow_sum / shadow_ray_count;
     }
-    color *= shadow_sum / shadow_ray_count;
+    color *= shadow;
 
     // Tone mapping
     color = float3(1.0, 1.0, 1.0) - exp(-color);
@@ -228,10 +253,15 @@ void MyMissShader(inout RayPayload payload)
 {
     if (payload.skip_shading)
     {
+        payload.ray_hit_t = FLT_MAX;
         return;
     }
 
-    float3 color = g_texture_global.SampleLevel(g_sampler, WorldRayDirection(), 0).rgb;
+    // a texel at the face center subtends 2 / size radians
+    float2 sky_size;
+    g_texture_global.GetDimensions(sky_size.x, sky_size.y);
+    float lod = log2(payload.cone_spread * sky_size.x * 0.5);
+    float3 color = g_texture_global.SampleLevel(g_sampler, WorldRayDirection(), lod).rgb;
 
     color = ShadeSphereLight(color, FLT_MAX);
 
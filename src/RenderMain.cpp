@@ -0,0 +1,495 @@
+#include <Windows.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <assert.h>
+
+#include "DistributedRender.h"
+#include "RenderServer.h"
+#include "CameraPath.h"
+#include "Timer.h"
+
+// Renderer.cpp is not part of this executable
+#define STB_IMAGE_IMPLEMENTATION
+#include "3rd/stb/stb_image.h"
+
+using namespace dxrf;
+
+// Console front end of the CPU renderer, no window and no D3D device.
+//
+//   dxrf_render --coordinator [--workers N] [--remote] [--spawn N] [--port P] [--width W] [--height H] [--frames N]
+//               [--spp N] [--path] [--tile N] [--output file.png] [--assets dir] [--scene name]
+//   dxrf_render --worker [--host H] [--port P] [--assets dir] [--scene name]
+//   dxrf_render --serve [--port P] [--assets dir]
+//   dxrf_render --submit [--host H] [--port P] [--scene name] [--eye x,y,z] [--at x,y,z] [--up x,y,z]
+//               [--width W] [--height H] [--spp N] [--path] [--output file.png] [--stop]
+//   dxrf_render --playback path.txt [--timings file.csv] [--width W] [--height H] [--spp N] [--path] [--output file.png]
+//               [--assets dir] [--scene name]
+//
+// The coordinator waits for --workers workers plus --spawn worker processes it starts on this machine, renders the
+// frames on them and writes the last one to --output. It only listens on the loopback interface unless --remote
+// lets workers on other machines join, they are not authenticated. --serve keeps a RenderServer running until
+// a --submit with --stop, every --submit renders one job on it. --playback renders the frames of a CameraPath in
+// this process and writes their times to --timings, an --output with %d writes every timed frame, else the last.
+
+struct Options
+{
+    bool coordinator = false;
+    bool worker = false;
+    bool serve = false;
+    bool submit = false;
+    bool stop = false;
+    std::string playback;
+    std::string timings = "timings.csv";
+    std::string host = "127.0.0.1";
+    int port = 7710;
+    int worker_count = 0;
+    bool remote_workers = false;
+    int spawn_count = 0;
+    int width = 1280;
+    int height = 720;
+    int frame_count = 1;
+    int spp = 0;            // 1 or less renders one sample per pixel without accumulation, same as a RenderJob
+    bool path_tracing = false;
+    int tile_size = 64;
+    std::string output = "frame.png";
+    std::string assets;
+    std::string scene = "scene";
+    CameraPose camera;
+};
+
+static std::string GetExeDir()
+{
+    char path[MAX_PATH];
+    GetModuleFileNameA(NULL, path, MAX_PATH);
+    char* slash = strrchr(path, '\\');
+    if (slash)
+    {
+        *slash = 0;
+    }
+    return path;
+}
+
+static bool ParseVector(const char* text, XMFLOAT3* v)
+{
+    return sscanf(text, "%f,%f,%f", &v->x, &v->y, &v->z) == 3;
+}
+
+static bool ParseOptions(int argc, char** argv, Options* options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--coordinator")
+        {
+            options->coordinator = true;
+        }
+        else if (arg == "--worker")
+        {
+            options->worker = true;
+        }
+        else if (arg == "--serve")
+        {
+            options->serve = true;
+        }
+        else if (arg == "--submit")
+        {
+            options->submit = true;
+        }
+        else if (arg == "--stop")
+        {
+            options->stop = true;
+        }
+        else if (arg == "--path")
+        {
+            options->path_tracing = true;
+        }
+        else if (arg == "--remote")
+        {
+            options->remote_workers = true;
+        }
+        else if (has_value && arg == "--playback")
+        {
+            options->playback = argv[++i];
+        }
+        else if (has_value && arg == "--timings")
+        {
+            options->timings = argv[++i];
+        }
+        else if (has_value && arg == "--host")
+        {
+            options->host = argv[++i];
+        }
+        else if (has_value && arg == "--port")
+        {
+            options->port = atoi(argv[++i]);
+        }
+        else if (has_value && arg == "--workers")
+        {
+            options->worker_count = atoi(argv[++i]);
+        }
+        else if (has_value && arg == "--spawn")
+        {
+            options->spawn_count = atoi(argv[++i]);
+        }
+        else if (has_value && arg == "--width")
+        {
+            options->width = atoi(argv[++i]);
+        }
+        else if (has_value && arg == "--height")
+        {
+            options->height = atoi(argv[++i]);
+        }
+        else if (has_value && arg == "--frames")
+        {
+            options->frame_count = atoi(argv[++i]);
+        }
+        else if (has_value && arg == "--spp")
+        {
+            options->spp = atoi(argv[++i]);
+        }
+        else if (has_value && arg == "--tile")
+        {
+            options->tile_size = atoi(argv[++i]);
+        }
+        else if (has_value && arg == "--output")
+        {
+            options->output = argv[++i];
+        }
+        else if (has_value && arg == "--assets")
+        {
+            options->assets = argv[++i];
+        }
+        else if (has_value && arg == "--scene")
+        {
+            options->scene = argv[++i];
+        }
+        else if (has_value && arg == "--eye" && ParseVector(argv[i + 1], &options->camera.eye))
+        {
+            ++i;
+        }
+        else if (has_value && arg == "--at" && ParseVector(argv[i + 1], &options->camera.at))
+        {
+            ++i;
+        }
+        else if (has_value && arg == "--up" && ParseVector(argv[i + 1], &options->camera.up))
+        {
+            ++i;
+        }
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", arg.c_str());
+            return false;
+        }
+    }
+    if (options->assets.empty())
+    {
+        options->assets = GetExeDir() + "/assets";
+    }
+    int mode_count = (options->coordinator ? 1 : 0) + (options->worker ? 1 : 0) + (options->serve ? 1 : 0) + (options->submit ? 1 : 0) +
+        (options->playback.empty() ? 0 : 1);
+    return mode_count == 1 && options->width > 0 && options->height > 0;
+}
+
+static CpuRenderSettings GetRenderSettings(const Options& options)
+{
+    return GetSampleCountSettings(options.path_tracing ? CpuIntegrator::PathTracing : CpuIntegrator::DirectLighting, options.spp);
+}
+
+// process_handle receives the handle of the worker process, the caller closes it
+static bool SpawnWorker(const Options& options, int port, HANDLE* process_handle)
+{
+    char exe[MAX_PATH];
+    GetModuleFileNameA(NULL, exe, MAX_PATH);
+
+    // CreateProcessA may write to the command line, the string is its buffer
+    std::string command = "\"" + std::string(exe) + "\" --worker --host 127.0.0.1 --port " + std::to_string(port) + " --assets \"" +
+        options.assets + "\" --scene \"" + options.scene + "\"";
+
+    STARTUPINFOA startup = {};
+    startup.cb = sizeof(startup);
+    PROCESS_INFORMATION process = {};
+    if (!CreateProcessA(NULL, &command[0], NULL, NULL, FALSE, 0, NULL, NULL, &startup, &process))
+    {
+        return false;
+    }
+    CloseHandle(process.hThread);
+    *process_handle = process.hProcess;
+    return true;
+}
+
+static bool IsRunning(const std::vector<HANDLE>& processes)
+{
+    for (HANDLE process : processes)
+    {
+        if (WaitForSingleObject(process, 0) != WAIT_TIMEOUT)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool WriteFile(const std::string& path, const std::vector<uint8_t>& bytes)
+{
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file)
+    {
+        return false;
+    }
+    bool written = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    fclose(file);
+    return written;
+}
+
+static int RunCoordinator(const Options& options)
+{
+    DistributedRenderSettings distributed_settings;
+    distributed_settings.tile_size = options.tile_size;
+    distributed_settings.remote_workers = options.remote_workers;
+    std::unique_ptr<RenderCoordinator> coordinator = RenderCoordinator::Create(options.port, distributed_settings);
+    if (!coordinator)
+    {
+        fprintf(stderr, "cannot listen on port %d\n", options.port);
+        return 1;
+    }
+
+    std::vector<HANDLE> processes;
+    for (int i = 0; i < options.spawn_count; ++i)
+    {
+        HANDLE process = NULL;
+        if (!SpawnWorker(options, coordinator->GetPort(), &process))
+        {
+            fprintf(stderr, "cannot start worker %d\n", i);
+            return 1;
+        }
+        processes.push_back(process);
+    }
+    int worker_count = options.worker_count + options.spawn_count;
+    printf("waiting for %d workers on port %d\n", worker_count, coordinator->GetPort());
+    // a spawned worker that cannot load the scene exits without ever connecting, stop waiting for it then
+    std::function<bool()> keep_waiting;
+    if (!processes.empty())
+    {
+        keep_waiting = [&]() { return IsRunning(processes); };
+    }
+    bool accepted = coordinator->AcceptWorkers(worker_count, keep_waiting);
+    bool spawned_running = IsRunning(processes);
+    for (HANDLE process : processes)
+    {
+        CloseHandle(process);
+    }
+    if (!accepted)
+    {
+        fprintf(stderr, "%s\n", spawned_running ? "cannot accept workers" : "a spawned worker exited before all workers joined");
+        return 1;
+    }
+
+    CpuRenderSettings settings = GetRenderSettings(options);
+    SceneConstantBuffer constants = GetSceneConstants(options.camera, options.width, options.height);
+    std::vector<XMFLOAT4> frame(options.width * options.height);
+    for (int i = 0; i < options.frame_count; ++i)
+    {
+        if (!coordinator->RenderFrame(settings, constants, options.width, options.height, frame.data()))
+        {
+            fprintf(stderr, "every worker dropped out\n");
+            return 1;
+        }
+
+        const DistributedRenderStats& stats = coordinator->GetStats();
+        printf("frame %d: %.1f ms, %d tiles, %d requeued\n", i, stats.frame_ms, stats.tile_count, stats.requeued_tile_count);
+        for (int w = 0; w < (int) stats.worker_tile_count.size(); ++w)
+        {
+            printf("  worker %d: %d tiles, %.1f ms rendering\n", w, stats.worker_tile_count[w], stats.worker_render_ms[w]);
+        }
+    }
+
+    std::vector<uint8_t> png;
+    if (!EncodePng(frame, options.width, options.height, &png) || !WriteFile(options.output, png))
+    {
+        fprintf(stderr, "cannot write %s\n", options.output.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+static int RunWorker(const Options& options)
+{
+    std::unique_ptr<BVHCache> bvh_cache = BVHCache::Create(GetExeDir() + "/cache");
+    std::unique_ptr<SceneAssets> assets = SceneAssets::Load(options.assets, options.scene, bvh_cache.get());
+    if (!assets)
+    {
+        fprintf(stderr, "cannot load %s from %s\n", options.scene.c_str(), options.assets.c_str());
+        return 1;
+    }
+
+    std::unique_ptr<RenderWorker> worker = RenderWorker::Create(assets->GetRenderer());
+    if (!worker->Run(options.host, options.port))
+    {
+        fprintf(stderr, "cannot join the coordinator at %s:%d\n", options.host.c_str(), options.port);
+        return 1;
+    }
+    printf("rendered %d tiles\n", worker->GetRenderedTileCount());
+    return 0;
+}
+
+static int RunServer(const Options& options)
+{
+    std::unique_ptr<RenderServer> server = RenderServer::Create(options.assets, GetExeDir() + "/cache", options.port);
+    if (!server)
+    {
+        fprintf(stderr, "cannot listen on port %d\n", options.port);
+        return 1;
+    }
+    printf("serving %s on port %d\n", options.assets.c_str(), server->GetPort());
+    server->Run();
+    return 0;
+}
+
+static int RunSubmit(const Options& options)
+{
+    std::unique_ptr<RenderClient> client = RenderClient::Connect(options.host, options.port);
+    if (!client)
+    {
+        fprintf(stderr, "no server at %s:%d\n", options.host.c_str(), options.port);
+        return 1;
+    }
+
+    RenderJob job;
+    job.scene = options.scene;
+    job.camera = options.camera;
+    job.width = options.width;
+    job.height = options.height;
+    job.spp = (std::max)(1, options.spp);
+    job.path_tracing = options.path_tracing;
+    RenderJobResult result;
+    if (!client->Render(job, &result))
+    {
+        fprintf(stderr, "the server dropped the connection\n");
+        return 1;
+    }
+    if (result.status != RenderJobStatus::Ok)
+    {
+        fprintf(stderr, result.status == RenderJobStatus::SceneNotFound ? "scene %s not found\n" : "invalid job for %s\n", job.scene.c_str());
+        return 1;
+    }
+    printf("load %.1f ms, render %.1f ms, encode %.1f ms, %d bytes\n", result.load_ms, result.render_ms, result.encode_ms, (int) result.png.size());
+    if (!WriteFile(options.output, result.png))
+    {
+        fprintf(stderr, "cannot write %s\n", options.output.c_str());
+        return 1;
+    }
+    if (options.stop)
+    {
+        client->StopServer();
+    }
+    return 0;
+}
+
+static int RunPlayback(const Options& options)
+{
+    std::unique_ptr<CameraPath> path = CameraPath::LoadFromFile(options.playback);
+    if (!path)
+    {
+        fprintf(stderr, "cannot read camera path %s\n", options.playback.c_str());
+        return 1;
+    }
+    std::unique_ptr<BVHCache> bvh_cache = BVHCache::Create(GetExeDir() + "/cache");
+    std::unique_ptr<SceneAssets> assets = SceneAssets::Load(options.assets, options.scene, bvh_cache.get());
+    if (!assets)
+    {
+        fprintf(stderr, "cannot load %s from %s\n", options.scene.c_str(), options.assets.c_str());
+        return 1;
+    }
+
+    CpuRenderer* renderer = assets->GetRenderer();
+    CpuRenderSettings settings = GetRenderSettings(options);
+    renderer->OnSizeChanged(options.width, options.height);
+    renderer->SetSettings(settings);
+    renderer->SetFrameIndex(0);
+
+    size_t frame_number_at = options.output.find("%d");
+    bool output_every_frame = frame_number_at != std::string::npos;
+    FrameTimeLog frame_times;
+    for (int frame = -path->GetWarmupFrameCount(); frame < path->GetFrameCount(); ++frame)
+    {
+        SceneConstantBuffer constants = GetSceneConstants(path->GetFramePose((std::max)(frame, 0)), options.width, options.height);
+
+        // a warmup frame at the same pose would leave the first timed one converged
+        Timer timer;
+        renderer->ResetAccumulation();
+        renderer->Render(constants);
+        while (settings.accumulate && !renderer->IsConverged())
+        {
+            renderer->Render(constants);
+        }
+        if (frame < 0)
+        {
+            continue;
+        }
+        double ms = timer.GetElapsedMs();
+        frame_times.Add(ms);
+        printf("frame %d: %.2f ms\n", frame, ms);
+
+        if (output_every_frame || frame == path->GetFrameCount() - 1)
+        {
+            // only the first %d is replaced, the path is no format string
+            std::string file = options.output;
+            if (output_every_frame)
+            {
+                file.replace(frame_number_at, 2, std::to_string(frame));
+            }
+            std::vector<uint8_t> png;
+            if (!EncodePng(renderer->GetOutput(), options.width, options.height, &png) || !WriteFile(file, png))
+            {
+                fprintf(stderr, "cannot write %s\n", file.c_str());
+                return 1;
+            }
+        }
+    }
+
+    FrameTimeSummary summary = frame_times.GetSummary();
+    printf("%d frames: mean %.2f ms, median %.2f ms, p95 %.2f ms, min %.2f ms, max %.2f ms\n", summary.frame_count, summary.mean_ms,
+        summary.median_ms, summary.p95_ms, summary.min_ms, summary.max_ms);
+    if (!frame_times.WriteCsv(options.timings))
+    {
+        fprintf(stderr, "cannot write %s\n", options.timings.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!ParseOptions(argc, argv, &options))
+    {
+        fprintf(stderr, "usage: dxrf_render --coordinator [--workers N] [--remote] [--spawn N] [--port P] [--width W]\n"
+            "                   [--height H] [--frames N] [--spp N] [--path] [--tile N] [--output file.png] [--assets dir]\n"
+            "       dxrf_render --worker [--host H] [--port P] [--assets dir] [--scene name]\n"
+            "       dxrf_render --serve [--port P] [--assets dir]\n"
+            "       dxrf_render --submit [--host H] [--port P] [--scene name] [--eye x,y,z] [--at x,y,z] [--up x,y,z]\n"
+            "                   [--width W] [--height H] [--spp N] [--path] [--output file.png] [--stop]\n"
+            "       dxrf_render --playback path.txt [--timings file.csv] [--width W] [--height H] [--spp N] [--path]\n"
+            "                   [--output file.png] [--assets dir] [--scene name]\n");
+        return 1;
+    }
+
+    if (options.coordinator)
+    {
+        return RunCoordinator(options);
+    }
+    if (options.worker)
+    {
+        return RunWorker(options);
+    }
+    if (!options.playback.empty())
+    {
+        return RunPlayback(options);
+    }
+    return options.serve ? RunServer(options) : RunSubmit(options);
+}
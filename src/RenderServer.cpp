@@ -0,0 +1,272 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#include "RenderServer.h"
+#include "Timer.h"
+#include <string.h>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "3rd/stb/stb_image_write.h"
+
+namespace dxrf
+{
+    static const int MAX_JOB_SIZE = 16384;
+    // DCI 4K, the renderer buffers take about 500 bytes a pixel, some 4 GB here, and the PNG stays far below the
+    // packet size limit
+    static const int64_t MAX_JOB_PIXEL_COUNT = 4096 * 2160;
+    static const int MAX_JOB_SPP = 65536;
+    static const uint32_t MAX_SCENE_NAME_LENGTH = 256;
+
+    enum ServerMessageType : uint32_t
+    {
+        MESSAGE_JOB = 1,    // client to server, JobMessage followed by the scene name
+        MESSAGE_RESULT,     // server to client, ResultMessage followed by the PNG
+        MESSAGE_STOP,       // client to server
+    };
+
+    struct JobMessage
+    {
+        CameraPose camera;
+        int32_t width;
+        int32_t height;
+        int32_t spp;
+        int32_t path_tracing;
+    };
+
+    struct ResultMessage
+    {
+        uint32_t status;
+        float load_ms;
+        float render_ms;
+        float encode_ms;
+    };
+
+    static void AppendBytes(void* context, void* data, int size)
+    {
+        std::vector<uint8_t>* bytes = (std::vector<uint8_t>*) context;
+        bytes->insert(bytes->end(), (const uint8_t*) data, (const uint8_t*) data + size);
+    }
+
+    bool EncodePng(const std::vector<XMFLOAT4>& pixels, int width, int height, std::vector<uint8_t>* png)
+    {
+        std::vector<uint8_t> rgba(pixels.size() * 4);
+        for (size_t i = 0; i < pixels.size(); ++i)
+        {
+            const float* color = &pixels[i].x;
+            for (int c = 0; c < 4; ++c)
+            {
+                rgba[i * 4 + c] = (uint8_t) ((std::min)((std::max)(color[c], 0.0f), 1.0f) * 255.0f + 0.5f);
+            }
+        }
+        png->clear();
+        return stbi_write_png_to_func(AppendBytes, png, width, height, 4, rgba.data(), width * 4) != 0;
+    }
+
+    // plain directory names only, jobs cannot reach outside the assets
+    static bool IsValidSceneName(const std::string& name)
+    {
+        if (name.empty() || name[0] == '.' || name.size() > MAX_SCENE_NAME_LENGTH)
+        {
+            return false;
+        }
+        for (char c : name)
+        {
+            if (!isalnum((unsigned char) c) && c != '_' && c != '-' && c != '.')
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::unique_ptr<RenderServer> RenderServer::Create(const std::string& assets_dir, const std::string& cache_dir, int port)
+    {
+        std::unique_ptr<Socket> listener = Socket::Listen(port, true);
+        if (!listener)
+        {
+            return nullptr;
+        }
+
+        std::unique_ptr<RenderServer> server(new RenderServer());
+        server->m_assets_dir = assets_dir;
+        server->m_bvh_cache = BVHCache::Create(cache_dir);
+        server->m_listener = std::move(listener);
+
+        return server;
+    }
+
+    void RenderServer::Run()
+    {
+        while (true)
+        {
+            std::unique_ptr<Socket> socket = m_listener->Accept();
+            if (!socket)
+            {
+                return;
+            }
+            if (this->Serve(socket.get()))
+            {
+                return;
+            }
+        }
+    }
+
+    bool RenderServer::Serve(Socket* socket)
+    {
+        bool stop = false;
+        uint32_t type = 0;
+        std::vector<uint8_t> payload;
+        while (socket->ReceivePacket(&type, &payload))
+        {
+            if (type == MESSAGE_STOP)
+            {
+                stop = true;
+                continue;
+            }
+            if (type != MESSAGE_JOB || payload.size() < sizeof(JobMessage))
+            {
+                break;
+            }
+
+            JobMessage message;
+            memcpy(&message, payload.data(), sizeof(message));
+            RenderJob job;
+            job.scene.assign((const char*) payload.data() + sizeof(message), payload.size() - sizeof(message));
+            job.camera = message.camera;
+            job.width = message.width;
+            job.height = message.height;
+            job.spp = message.spp;
+            job.path_tracing = message.path_tracing != 0;
+
+            RenderJobResult result = this->Render(job);
+            ResultMessage reply = { (uint32_t) result.status, (float) result.load_ms, (float) result.render_ms, (float) result.encode_ms };
+            if (!socket->SendPacket(MESSAGE_RESULT, &reply, sizeof(reply), result.png.data(), (uint32_t) result.png.size()))
+            {
+                break;
+            }
+        }
+        return stop;
+    }
+
+    SceneAssets* RenderServer::GetScene(const std::string& name, double* load_ms)
+    {
+        *load_ms = 0.0;
+        auto it = m_scenes.find(name);
+        if (it != m_scenes.end())
+        {
+            return it->second.get();
+        }
+
+        std::unique_ptr<SceneAssets> assets = SceneAssets::Load(m_assets_dir, name, m_bvh_cache.get());
+        if (!assets)
+        {
+            return nullptr;
+        }
+        *load_ms = assets->GetLoadMs();
+        SceneAssets* result = assets.get();
+        m_scenes[name] = std::move(assets);
+        return result;
+    }
+
+    RenderJobResult RenderServer::Render(const RenderJob& job)
+    {
+        RenderJobResult result;
+        if (!IsValidSceneName(job.scene) || job.width <= 0 || job.height <= 0 || job.width > MAX_JOB_SIZE || job.height > MAX_JOB_SIZE ||
+            (int64_t) job.width * job.height > MAX_JOB_PIXEL_COUNT || job.spp <= 0 || job.spp > MAX_JOB_SPP)
+        {
+            result.status = RenderJobStatus::InvalidJob;
+            return result;
+        }
+        SceneAssets* assets = this->GetScene(job.scene, &result.load_ms);
+        if (!assets)
+        {
+            result.status = RenderJobStatus::SceneNotFound;
+            return result;
+        }
+
+        Timer timer;
+        CpuRenderer* renderer = assets->GetRenderer();
+        CpuRenderSettings settings = GetSampleCountSettings(job.path_tracing ? CpuIntegrator::PathTracing : CpuIntegrator::DirectLighting,
+            job.spp);
+        if (job.width != renderer->GetWidth() || job.height != renderer->GetHeight())
+        {
+            renderer->OnSizeChanged(job.width, job.height);
+        }
+        renderer->SetSettings(settings);
+        renderer->SetFrameIndex(0);
+
+        SceneConstantBuffer constants = GetSceneConstants(job.camera, job.width, job.height);
+        renderer->Render(constants);
+        while (settings.accumulate && !renderer->IsConverged())
+        {
+            renderer->Render(constants);
+        }
+        result.render_ms = timer.GetElapsedMs();
+
+        timer.Reset();
+        EncodePng(renderer->GetOutput(), job.width, job.height, &result.png);
+        result.encode_ms = timer.GetElapsedMs();
+
+        return result;
+    }
+
+    std::unique_ptr<RenderClient> RenderClient::Connect(const std::string& host, int port)
+    {
+        std::unique_ptr<Socket> socket = Socket::Connect(host, port);
+        if (!socket)
+        {
+            return nullptr;
+        }
+
+        std::unique_ptr<RenderClient> client(new RenderClient());
+        client->m_socket = std::move(socket);
+
+        return client;
+    }
+
+    bool RenderClient::Submit(const RenderJob& job)
+    {
+        JobMessage message;
+        message.camera = job.camera;
+        message.width = job.width;
+        message.height = job.height;
+        message.spp = job.spp;
+        message.path_tracing = job.path_tracing ? 1 : 0;
+        return m_socket->SendPacket(MESSAGE_JOB, &message, sizeof(message), job.scene.data(), (uint32_t) job.scene.size());
+    }
+
+    bool RenderClient::ReceiveResult(RenderJobResult* result)
+    {
+        uint32_t type = 0;
+        std::vector<uint8_t> payload;
+        ResultMessage reply;
+        if (!m_socket->ReceivePacket(&type, &payload) || type != MESSAGE_RESULT || payload.size() < sizeof(reply))
+        {
+            return false;
+        }
+        memcpy(&reply, payload.data(), sizeof(reply));
+        result->status = (RenderJobStatus) reply.status;
+        result->load_ms = reply.load_ms;
+        result->render_ms = reply.render_ms;
+        result->encode_ms = reply.encode_ms;
+        result->png.assign(payload.begin() + sizeof(reply), payload.end());
+        return true;
+    }
+
+    bool RenderClient::StopServer()
+    {
+        return m_socket->SendPacket(MESSAGE_STOP, nullptr, 0);
+    }
+}
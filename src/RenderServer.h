@@ -0,0 +1,104 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include "SceneAssets.h"
+#include "Camera.h"
+#include "Socket.h"
+#include <unordered_map>
+
+namespace dxrf
+{
+    enum class RenderJobStatus : uint32_t
+    {
+        Ok,
+        SceneNotFound,
+        InvalidJob,     // size or sample count out of range, or a scene name that is not a plain directory name
+    };
+
+    struct RenderJob
+    {
+        std::string scene = "scene";    // directory of the assets holding objects.go
+        CameraPose camera;
+        int width = 1280;               // up to 16384 per side and 4096 x 2160 pixels in total
+        int height = 720;
+        int spp = 1;                    // more than 1 accumulates exactly spp jittered samples per pixel
+        bool path_tracing = false;
+    };
+
+    struct RenderJobResult
+    {
+        RenderJobStatus status = RenderJobStatus::Ok;
+        double load_ms = 0.0;       // scene load and BVH build, 0 once the scene is resident
+        double render_ms = 0.0;
+        double encode_ms = 0.0;
+        std::vector<uint8_t> png;
+    };
+
+    // PNG of a CPU renderer frame, colors clamped to [0, 1].
+    bool EncodePng(const std::vector<XMFLOAT4>& pixels, int width, int height, std::vector<uint8_t>* png);
+
+    // Renders jobs for clients on this machine. Every scene a job names is loaded once, with its BVHs and
+    // textures, and stays resident for the jobs after it, so a job costs its rendering and encoding only. Jobs
+    // render one at a time on the shared thread pool, connections are served one after another and each may
+    // send any number of jobs, the images come back in order as each one is done. The same job always gives
+    // the same image.
+    class RenderServer
+    {
+    public:
+        // Listens on the loopback interface, port 0 takes any free port. Mesh BVHs are kept in cache_dir across
+        // runs, same as the windowed renderer does.
+        static std::unique_ptr<RenderServer> Create(const std::string& assets_dir, const std::string& cache_dir, int port);
+        int GetPort() const { return m_listener->GetPort(); }
+        // Serves connections until a client asks the server to stop.
+        void Run();
+        RenderJobResult Render(const RenderJob& job);
+        int GetResidentSceneCount() const { return (int) m_scenes.size(); }
+
+    private:
+        RenderServer() = default;
+        // true when the client asked the server to stop
+        bool Serve(Socket* socket);
+        SceneAssets* GetScene(const std::string& name, double* load_ms);
+
+    private:
+        std::string m_assets_dir;
+        std::unique_ptr<BVHCache> m_bvh_cache;
+        std::unique_ptr<Socket> m_listener;
+        std::unordered_map<std::string, std::unique_ptr<SceneAssets>> m_scenes;
+    };
+
+    // Connection to a RenderServer. Jobs may be submitted ahead of their results, which arrive in job order.
+    class RenderClient
+    {
+    public:
+        // nullptr when no server listens on port.
+        static std::unique_ptr<RenderClient> Connect(const std::string& host, int port);
+        bool Submit(const RenderJob& job);
+        // Waits for the result of the oldest job without one. False when the connection broke.
+        bool ReceiveResult(RenderJobResult* result);
+        bool Render(const RenderJob& job, RenderJobResult* result) { return this->Submit(job) && this->ReceiveResult(result); }
+        // The server exits once this connection closes.
+        bool StopServer();
+
+    private:
+        RenderClient() = default;
+
+    private:
+        std::unique_ptr<Socket> m_socket;
+    };
+}
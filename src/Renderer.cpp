@@ -39,7 +39,6 @@ Renderer::Renderer(HWND hwnd, int width, int height)
     m_hwnd = hwnd;
     m_width = width;
     m_height = height;
-    m_aspect = width / (float) height;
 
     GetModuleFileName(NULL, m_work_dir, MAX_PATH);
     size_t len = strrchr(m_work_dir, '\\') - m_work_dir;
@@ -83,7 +82,6 @@ void Renderer::OnSizeChanged(int width, int height, bool minimized)
 {
     m_width = width;
     m_height = height;
-    m_aspect = width / (float) height;
 
     if (!m_device->WindowSizeChanged(width, height, minimized))
     {
@@ -96,6 +94,11 @@ void Renderer::OnSizeChanged(int width, int height, bool minimized)
 
 void Renderer::Update()
 {
+    if (m_camera_path && !this->IsPlaybackFinished())
+    {
+        m_camera = m_camera_path->GetFramePose((std::max)(m_playback_frame, 0));
+    }
+
     this->UpdateCameraMatrices();
 }
 
@@ -106,11 +109,31 @@ void Renderer::Render()
         return;
     }
 
+    bool playing = m_camera_path && !this->IsPlaybackFinished();
+    Timer timer;
+
     m_device->Prepare();
     this->DoRaytracing();
     this->CopyRaytracingOutputToBackbuffer();
 
     m_device->Present(D3D12_RESOURCE_STATE_PRESENT);
+
+    if (playing)
+    {
+        m_device->WaitForGpu();
+        if (m_playback_frame >= 0)
+        {
+            m_frame_times.Add(timer.GetElapsedMs());
+        }
+        m_playback_frame += 1;
+    }
+}
+
+void Renderer::SetCameraPath(std::unique_ptr<CameraPath> camera_path)
+{
+    m_camera_path = std::move(camera_path);
+    m_playback_frame = m_camera_path ? -m_camera_path->GetWarmupFrameCount() : 0;
+    m_frame_times.Clear();
 }
 
 void Renderer::OnDeviceLost()
@@ -129,14 +152,10 @@ void Renderer::InitializeScene()
 {
     auto frame_index = m_device->GetCurrentFrameIndex();
 
-    m_eye = { -6.0f, 7.0f, -7.0f, 1.0f };
-    m_at = { 0.0f, 0.0f, 0.0f, 1.0f };
-    m_up = { 0.0f, 1.0f, 0.0f, 1.0f };
+    m_camera = CameraPose();
 
     this->UpdateCameraMatrices();
 
-    m_scene_cb[frame_index].light_position = { 0, 4, 3, 0 };
-
     for (auto& cb : m_scene_cb)
     {
         cb = m_scene_cb[frame_index];
@@ -147,13 +166,7 @@ void Renderer::UpdateCameraMatrices()
 {
     auto frame_index = m_device->GetCurrentFrameIndex();
 
-    float fov = 45.0f;
-    XMMATRIX view = XMMatrixLookAtLH(m_eye, m_at, m_up);
-    XMMATRIX proj = XMMatrixPerspectiveFovLH(XMConvertToRadians(fov), m_aspect, 0.01f, 1000.0f);
-    XMMATRIX view_proj = view * proj;
-
-    m_scene_cb[frame_index].camera_position = m_eye;
-    m_scene_cb[frame_index].projection_to_world = XMMatrixInverse(nullptr, view_proj);
+    m_scene_cb[frame_index] = GetSceneConstants(m_camera, m_width, m_height);
 }
 
 void Renderer::CreateDeviceDependentResources()
@@ -166,7 +179,7 @@ void Renderer::CreateDeviceDependentResources()
         void* data = stbi_load(path, &w, &h, &c, 4);
         if (data)
         {
-            m_texture_mesh = Texture::CreateTextureFromData(m_device.get(), w, h, DXGI_FORMAT_R8G8B8A8_UNORM, false, &data);
+            m_texture_mesh = Texture::CreateTextureFromData(m_device.get(), w, h, DXGI_FORMAT_R8G8B8A8_UNORM, false, &data, MipGeneration::Srgb);
 
             stbi_image_free(data);
         }
@@ -183,7 +196,7 @@ void Renderer::CreateDeviceDependentResources()
             datas[i] = stbi_load(path, &w, &h, &c, 4);
         }
 
-        m_texture_bg = Texture::CreateTextureFromData(m_device.get(), w, h, DXGI_FORMAT_R8G8B8A8_UNORM, true, &datas[0]);
+        m_texture_bg = Texture::CreateTextureFromData(m_device.get(), w, h, DXGI_FORMAT_R8G8B8A8_UNORM, true, &datas[0], MipGeneration::Srgb);
 
         for (int i = 0; i < 6; ++i)
         {
@@ -324,7 +337,7 @@ void Renderer::CreateRootSignatures()
 
     {
         D3D12_STATIC_SAMPLER_DESC sampler = { };
-        sampler.Filter = D3D12_FILTER_MIN_MAG_MIP_POINT;
+        sampler.Filter = D3D12_FILTER_MIN_MAG_MIP_LINEAR;
         sampler.AddressU = D3D12_TEXTURE_ADDRESS_MODE_WRAP;
         sampler.AddressV = D3D12_TEXTURE_ADDRESS_MODE_WRAP;
         sampler.AddressW = D3D12_TEXTURE_ADDRESS_MODE_WRAP;
@@ -396,7 +409,7 @@ void Renderer::CreateRaytracingPipelineStateObject()
     hit_group->SetHitGroupType(D3D12_HIT_GROUP_TYPE_TRIANGLES);
 
     auto shader_config = pipeline.CreateSubobject<CD3DX12_RAYTRACING_SHADER_CONFIG_SUBOBJECT>();
-    UINT payload_size = sizeof(XMFLOAT4) * 2;    // float4 pixelColor
+    UINT payload_size = sizeof(XMFLOAT4) * 3;    // RayPayload, color, hit and ray cone
     UINT attribute_size = sizeof(XMFLOAT2);  // float2 barycentrics
     shader_config->Config(payload_size, attribute_size);
 
@@ -427,7 +440,15 @@ void Renderer::LoadScene()
     char data_dir[MAX_PATH];
     sprintf(data_dir, "%s/assets/scene", m_work_dir);
 
-    m_scene = Scene::LoadFromFile(m_device.get(), data_dir, "objects.go");
+    // serialized bottom level structures, later launches on the same driver skip the builds
+    if (!m_bvh_cache)
+    {
+        char cache_dir[MAX_PATH];
+        sprintf(cache_dir, "%s/cache", m_work_dir);
+        m_bvh_cache = BVHCache::Create(cache_dir);
+    }
+
+    m_scene = Scene::LoadFromFile(m_device.get(), data_dir, "objects.go", m_bvh_cache.get());
 }
 
 void Renderer::CreateConstantBuffers()
@@ -514,6 +535,7 @@ void Renderer::BuildShaderTables()
             arguments[i].mesh_cb.vertex_buffer_offset = (UINT) mesh->vertex_buffer_offset;
             arguments[i].mesh_cb.vertex_stride = sizeof(Vertex);
             arguments[i].mesh_cb.index_buffer_offset = (UINT) mesh->index_buffer_offset;
+            arguments[i].mesh_cb.visibility = objects[i]->mesh_renderer->visibility;
             arguments[i].srv = m_texture_mesh->GetGpuHandle();
         }
 
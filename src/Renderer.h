@@ -4,6 +4,9 @@
 #include "RaytracingHlslCompat.h"
 #include "Texture.h"
 #include "Scene.h"
+#include "BVHCache.h"
+#include "CameraPath.h"
+#include "Timer.h"
 
 using namespace DX;
 using namespace dxrf;
@@ -17,6 +20,11 @@ public:
     void OnSizeChanged(int width, int height, bool minimized);
     void Update();
     void Render();
+    // Plays the path back instead of the fixed camera, one path frame per Render after the warmup frames. Every
+    // played frame waits for the GPU, so its time covers the whole frame, see GetFrameTimes.
+    void SetCameraPath(std::unique_ptr<CameraPath> camera_path);
+    bool IsPlaybackFinished() const { return m_camera_path && m_playback_frame >= m_camera_path->GetFrameCount(); }
+    const FrameTimeLog& GetFrameTimes() const { return m_frame_times; }
     
     virtual void OnDeviceLost() override;
     virtual void OnDeviceRestored() override;
@@ -45,7 +53,6 @@ private:
     HWND m_hwnd = NULL;
     int m_width = 0;
     int m_height = 0;
-    float m_aspect = 1.0f;
     std::unique_ptr<DeviceResources> m_device;
 
     // Raytracing output
@@ -62,9 +69,12 @@ private:
 
     // Raytracing scene
     SceneConstantBuffer m_scene_cb[BACK_BUFFER_COUNT] = { };
-    XMVECTOR m_eye = { };
-    XMVECTOR m_at = { };
-    XMVECTOR m_up = { };
+    CameraPose m_camera;
+
+    // Camera path playback, frames count from -warmup
+    std::unique_ptr<CameraPath> m_camera_path;
+    int m_playback_frame = 0;
+    FrameTimeLog m_frame_times;
 
     // ConstantBuffer
     static_assert(sizeof(SceneConstantBuffer) < D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT, "Checking the size here.");
@@ -86,4 +96,5 @@ private:
     std::unique_ptr<Texture> m_texture_mesh;
 
     std::unique_ptr<Scene> m_scene;
+    std::unique_ptr<BVHCache> m_bvh_cache;
 };
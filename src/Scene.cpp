@@ -15,6 +15,7 @@ copies or substantial portions of the Software.
 */
 
 #include "Scene.h"
+#include "BVHCache.h"
 #include "DirectXRaytracingHelper.h"
 #include <DirectXMath.h>
 
@@ -182,6 +183,15 @@ namespace dxrf
         XMFLOAT4 lightmap_scale_offset = Read<XMFLOAT4>(is);
         bool cast_shadow = Read<uint8_t>(is) == 1;
         bool receive_shadow = Read<uint8_t>(is) == 1;
+        renderer->visibility = VISIBILITY_CAMERA;
+        if (cast_shadow)
+        {
+            renderer->visibility |= VISIBILITY_SHADOW_CASTER;
+        }
+        if (receive_shadow)
+        {
+            renderer->visibility |= VISIBILITY_SHADOW_RECEIVER;
+        }
 
         int keyword_count = Read<int>(is);
         for (int i = 0; i < keyword_count; ++i)
@@ -232,6 +242,12 @@ namespace dxrf
             if (com_name == "MeshRenderer")
             {
                 obj->mesh_renderer = ReadMeshRenderer(is, this);
+                // the exporter has no light component, the mesh of an object named "Light ..." marks where the
+                // analytic sphere light is, it is neither seen by the camera nor blocks the light it stands for
+                if (name.compare(0, 5, "Light") == 0)
+                {
+                    obj->mesh_renderer->visibility = VISIBILITY_LIGHT_PROXY;
+                }
                 m_render_objects.push_back(obj);
             }
             else
@@ -253,7 +269,8 @@ namespace dxrf
         return obj;
     }
 
-    std::unique_ptr<Scene> Scene::LoadFromFile(DeviceResources* device, const std::string& data_dir, const std::string& local_path)
+    std::unique_ptr<Scene> Scene::LoadFromFile(DeviceResources* device, const std::string& data_dir, const std::string& local_path,
+        BVHCache* cache)
     {
         std::unique_ptr<Scene> scene(new Scene());
         scene->m_device = device;
@@ -263,8 +280,11 @@ namespace dxrf
         if (is)
         {
             scene->m_root_object = scene->ReadObject(is);
-            scene->CreateGeometryBuffer();
-            scene->CreateAccelerationStructures();
+            if (device)
+            {
+                scene->CreateGeometryBuffer();
+                scene->CreateAccelerationStructures(cache);
+            }
 
             is.close();
         }
@@ -278,9 +298,12 @@ namespace dxrf
         m_top_structure.Reset();
 
         m_vertex_buffer.resource.Reset();
-        m_device->ReleaseDescriptor(m_vertex_buffer.heap_index);
         m_index_buffer.resource.Reset();
-        m_device->ReleaseDescriptor(m_index_buffer.heap_index);
+        if (m_device)
+        {
+            m_device->ReleaseDescriptor(m_vertex_buffer.heap_index);
+            m_device->ReleaseDescriptor(m_index_buffer.heap_index);
+        }
     }
 
     void Scene::CreateGeometryBuffer()
@@ -358,7 +381,27 @@ namespace dxrf
         buffer->gpu_handle = m_device->GetGPUDescriptorHandle(buffer->heap_index);
     }
 
-    void Scene::CreateAccelerationStructures()
+    static void AllocateReadbackBuffer(ID3D12Device* device, UINT64 size, ID3D12Resource** resource)
+    {
+        auto heap_properties = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_READBACK);
+        auto buffer_desc = CD3DX12_RESOURCE_DESC::Buffer(size);
+        ThrowIfFailed(device->CreateCommittedResource(
+            &heap_properties,
+            D3D12_HEAP_FLAG_NONE,
+            &buffer_desc,
+            D3D12_RESOURCE_STATE_COPY_DEST,
+            nullptr,
+            IID_PPV_ARGS(resource)));
+    }
+
+    // Cache keys of device structures, kept apart from the CPU BVH keys of the same mesh by the tag.
+    static uint64_t GetDeviceCacheSeed(D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS build_flags, D3D12_RAYTRACING_GEOMETRY_FLAGS geometry_flags)
+    {
+        static const uint64_t DEVICE_CACHE_TAG = 0x4433443132000000ull; // "D3D12"
+        return DEVICE_CACHE_TAG | ((uint64_t) build_flags << 16) | (uint64_t) geometry_flags;
+    }
+
+    void Scene::CreateAccelerationStructures(BVHCache* cache)
     {
         auto d3d = m_device->GetD3DDevice();
         auto cmd = m_device->GetCommandList();
@@ -386,9 +429,22 @@ namespace dxrf
         m_bottom_structures.resize(m_mesh_array.size());
         std::vector<ComPtr<ID3D12Resource>> scratch_resources;
 
+        std::vector<uint64_t> cache_keys(m_mesh_array.size());
+        std::vector<size_t> built_meshes;
+
         std::vector<D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC> bottom_level_descs(m_mesh_array.size());
         for (size_t i = 0; i < bottom_level_descs.size(); ++i)
         {
+            if (cache != nullptr)
+            {
+                cache_keys[i] = BVHCache::GetMeshKey(*m_mesh_array[i], GetDeviceCacheSeed(build_flags, geometrys[i].Flags));
+                if (this->LoadBottomStructure(cache, cache_keys[i], i, &scratch_resources))
+                {
+                    continue;
+                }
+                built_meshes.push_back(i);
+            }
+
             auto& bottom_level_desc = bottom_level_descs[i];
             bottom_level_desc = { };
             auto& bottom_inputs = bottom_level_descs[i].Inputs;
@@ -416,6 +472,11 @@ namespace dxrf
         auto barrier = CD3DX12_RESOURCE_BARRIER::UAV(nullptr);
         cmd->ResourceBarrier(1, &barrier);
 
+        if (cache != nullptr)
+        {
+            this->StoreBottomStructures(cache, cache_keys, built_meshes);
+        }
+
         std::vector<D3D12_RAYTRACING_INSTANCE_DESC> instance_descs(m_render_objects.size());
         for (size_t i = 0; i < instance_descs.size(); ++i)
         {
@@ -433,12 +494,11 @@ namespace dxrf
             }
 
             instance.InstanceID = i;
-            instance.InstanceMask = 1;
+            instance.InstanceMask = m_render_objects[i]->mesh_renderer->visibility & VISIBILITY_INSTANCE_MASK;
             instance.AccelerationStructure = m_bottom_structures[m_render_objects[i]->mesh_renderer->mesh_index]->GetGPUVirtualAddress();
             instance.InstanceContributionToHitGroupIndex = i;
             instance.Flags = D3D12_RAYTRACING_INSTANCE_FLAG_TRIANGLE_FRONT_COUNTERCLOCKWISE;
         }
-        instance_descs[6].InstanceMask = 2;
 
         ComPtr<ID3D12Resource> instance_desc_buffer;
         AllocateUploadBuffer(d3d, &instance_descs[0], sizeof(D3D12_RAYTRACING_INSTANCE_DESC) * instance_descs.size(), &instance_desc_buffer);
@@ -470,4 +530,111 @@ namespace dxrf
         m_device->ExecuteCommandList();
         m_device->WaitForGpu();
     }
+
+    bool Scene::LoadBottomStructure(BVHCache* cache, uint64_t key, size_t index, std::vector<ComPtr<ID3D12Resource>>* upload_resources)
+    {
+        auto d3d = m_device->GetD3DDevice();
+
+        std::vector<uint8_t> data;
+        if (!cache->Load(key, &data) || data.size() < sizeof(D3D12_SERIALIZED_RAYTRACING_ACCELERATION_STRUCTURE_HEADER))
+        {
+            return false;
+        }
+
+        // serialized structures are opaque to the application and only load on a compatible driver
+        D3D12_SERIALIZED_RAYTRACING_ACCELERATION_STRUCTURE_HEADER header;
+        memcpy(&header, &data[0], sizeof(header));
+        D3D12_DRIVER_MATCHING_IDENTIFIER_STATUS status = m_device->GetDXRDevice()->CheckDriverMatchingIdentifier(
+            D3D12_SERIALIZED_DATA_RAYTRACING_ACCELERATION_STRUCTURE, &header.DriverMatchingIdentifier);
+        if (status != D3D12_DRIVER_MATCHING_IDENTIFIER_COMPATIBLE_WITH_DEVICE ||
+            header.SerializedSizeInBytesIncludingHeader != data.size() || header.DeserializedSizeInBytes == 0)
+        {
+            return false;
+        }
+
+        ComPtr<ID3D12Resource> upload_resource;
+        AllocateUploadBuffer(d3d, &data[0], data.size(), &upload_resource);
+        upload_resources->push_back(upload_resource);
+
+        AllocateUAVBuffer(d3d, header.DeserializedSizeInBytes, &m_bottom_structures[index], D3D12_RESOURCE_STATE_RAYTRACING_ACCELERATION_STRUCTURE);
+        m_device->GetDXRCommandList()->CopyRaytracingAccelerationStructure(m_bottom_structures[index]->GetGPUVirtualAddress(),
+            upload_resource->GetGPUVirtualAddress(), D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_DESERIALIZE);
+
+        return true;
+    }
+
+    // Serializes the bottom level structures built this load into the cache. The serialized sizes are only known
+    // on the GPU, so this waits twice: for the sizes, then for the copies. The command list is reset afterwards.
+    void Scene::StoreBottomStructures(BVHCache* cache, const std::vector<uint64_t>& keys, const std::vector<size_t>& built)
+    {
+        if (built.empty())
+        {
+            return;
+        }
+
+        auto d3d = m_device->GetD3DDevice();
+        auto cmd = m_device->GetCommandList();
+        auto dxr_cmd = m_device->GetDXRCommandList();
+        UINT count = (UINT) built.size();
+
+        std::vector<D3D12_GPU_VIRTUAL_ADDRESS> sources(count);
+        for (UINT i = 0; i < count; ++i)
+        {
+            sources[i] = m_bottom_structures[built[i]]->GetGPUVirtualAddress();
+        }
+
+        typedef D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_SERIALIZATION_DESC SerializationInfo;
+        UINT64 info_size = sizeof(SerializationInfo) * count;
+        ComPtr<ID3D12Resource> info_resource;
+        ComPtr<ID3D12Resource> info_readback;
+        AllocateUAVBuffer(d3d, info_size, &info_resource, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+        AllocateReadbackBuffer(d3d, info_size, &info_readback);
+
+        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_DESC info_desc = { };
+        info_desc.DestBuffer = info_resource->GetGPUVirtualAddress();
+        info_desc.InfoType = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_SERIALIZATION;
+        dxr_cmd->EmitRaytracingAccelerationStructurePostbuildInfo(&info_desc, count, &sources[0]);
+        auto info_barrier = CD3DX12_RESOURCE_BARRIER::Transition(info_resource.Get(), D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_COPY_SOURCE);
+        cmd->ResourceBarrier(1, &info_barrier);
+        cmd->CopyBufferRegion(info_readback.Get(), 0, info_resource.Get(), 0, info_size);
+
+        m_device->ExecuteCommandList();
+        m_device->WaitForGpu();
+        cmd->Reset(m_device->GetCommandAllocator(), nullptr);
+
+        std::vector<SerializationInfo> infos(count);
+        void* mapped = nullptr;
+        ThrowIfFailed(info_readback->Map(0, nullptr, &mapped));
+        memcpy(&infos[0], mapped, (size_t) info_size);
+        info_readback->Unmap(0, nullptr);
+
+        std::vector<ComPtr<ID3D12Resource>> serialized_resources(count);
+        std::vector<ComPtr<ID3D12Resource>> readback_resources(count);
+        std::vector<D3D12_RESOURCE_BARRIER> barriers(count);
+        for (UINT i = 0; i < count; ++i)
+        {
+            UINT64 size = infos[i].SerializedSizeInBytes;
+            AllocateUAVBuffer(d3d, size, &serialized_resources[i], D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+            AllocateReadbackBuffer(d3d, size, &readback_resources[i]);
+            dxr_cmd->CopyRaytracingAccelerationStructure(serialized_resources[i]->GetGPUVirtualAddress(), sources[i],
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_SERIALIZE);
+            barriers[i] = CD3DX12_RESOURCE_BARRIER::Transition(serialized_resources[i].Get(), D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_COPY_SOURCE);
+        }
+        cmd->ResourceBarrier(count, &barriers[0]);
+        for (UINT i = 0; i < count; ++i)
+        {
+            cmd->CopyBufferRegion(readback_resources[i].Get(), 0, serialized_resources[i].Get(), 0, infos[i].SerializedSizeInBytes);
+        }
+
+        m_device->ExecuteCommandList();
+        m_device->WaitForGpu();
+        cmd->Reset(m_device->GetCommandAllocator(), nullptr);
+
+        for (UINT i = 0; i < count; ++i)
+        {
+            ThrowIfFailed(readback_resources[i]->Map(0, nullptr, &mapped));
+            cache->Store(keys[built[i]], mapped, (size_t) infos[i].SerializedSizeInBytes);
+            readback_resources[i]->Unmap(0, nullptr);
+        }
+    }
 }
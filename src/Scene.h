@@ -27,6 +27,8 @@ using namespace DX;
 
 namespace dxrf
 {
+    class BVHCache;
+
     struct D3DBuffer
     {
         ComPtr<ID3D12Resource> resource;
@@ -71,6 +73,7 @@ namespace dxrf
 
     struct MeshRenderer
     {
+        UINT visibility = VISIBILITY_CAMERA | VISIBILITY_SHADOW_CASTER | VISIBILITY_SHADOW_RECEIVER;
         int mesh_index = -1;
         std::string mesh_key;
         std::weak_ptr<Mesh> mesh;
@@ -87,7 +90,11 @@ namespace dxrf
     class Scene
     {
     public:
-        static std::unique_ptr<Scene> LoadFromFile(DeviceResources* device, const std::string& data_dir, const std::string& local_path);
+        // Bottom level structures come from cache when it holds them for this driver and are stored to it after
+        // building otherwise, nullptr always builds. A nullptr device only reads the meshes and objects, for the
+        // CPU renderer, no GPU buffers or acceleration structures are created.
+        static std::unique_ptr<Scene> LoadFromFile(DeviceResources* device, const std::string& data_dir, const std::string& local_path,
+            BVHCache* cache = nullptr);
         ~Scene();
         const std::string& GetDataDir() const { return m_data_dir; }
         std::unordered_map<std::string, std::shared_ptr<Mesh>>& GetMeshMap() { return m_mesh_map; }
@@ -102,10 +109,12 @@ namespace dxrf
         std::shared_ptr<Object> ReadObject(std::ifstream& is);
         void CreateGeometryBuffer();
         void CreateBufferView(D3DBuffer* buffer, UINT num_elements, UINT element_size);
-        void CreateAccelerationStructures();
+        void CreateAccelerationStructures(BVHCache* cache);
+        bool LoadBottomStructure(BVHCache* cache, uint64_t key, size_t index, std::vector<ComPtr<ID3D12Resource>>* upload_resources);
+        void StoreBottomStructures(BVHCache* cache, const std::vector<uint64_t>& keys, const std::vector<size_t>& built);
 
     private:
-        DeviceResources* m_device;
+        DeviceResources* m_device = nullptr;
         std::string m_data_dir;
         std::shared_ptr<Object> m_root_object;
         std::vector<std::shared_ptr<Object>> m_render_objects;
@@ -0,0 +1,82 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#include "SceneAssets.h"
+#include "Timer.h"
+#include "3rd/stb/stb_image.h"
+
+namespace dxrf
+{
+    std::unique_ptr<SceneAssets> SceneAssets::Load(const std::string& assets_dir, const std::string& scene_dir, BVHCache* bvh_cache)
+    {
+        Timer timer;
+        std::string data_dir = assets_dir + "/" + scene_dir;
+        std::ifstream probe(data_dir + "/objects.go", std::ios::binary);
+        if (!probe)
+        {
+            return nullptr;
+        }
+        probe.close();
+
+        std::unique_ptr<SceneAssets> assets(new SceneAssets());
+        assets->m_scene = Scene::LoadFromFile(nullptr, data_dir, "objects.go", bvh_cache);
+        assets->m_renderer = CpuRenderer::CreateFromScene(assets->m_scene.get(), 1, 1, BVHBuildSettings(), bvh_cache);
+        assets->LoadMeshTexture(assets_dir);
+        assets->LoadEnvironment(assets_dir);
+        assets->m_load_ms = timer.GetElapsedMs();
+
+        return assets;
+    }
+
+    void SceneAssets::LoadMeshTexture(const std::string& assets_dir)
+    {
+        int w, h, c;
+
+        std::string path = assets_dir + "/720x1280.png";
+        void* data = stbi_load(path.c_str(), &w, &h, &c, 4);
+        if (data)
+        {
+            m_mesh_texture = MipChain::Create(w, h, 1, &data, true);
+            m_renderer->SetMeshTexture(m_mesh_texture.get());
+
+            stbi_image_free(data);
+        }
+    }
+
+    void SceneAssets::LoadEnvironment(const std::string& assets_dir)
+    {
+        int w = 0, h, c;
+
+        std::vector<void*> datas(6);
+        bool complete = true;
+        for (int i = 0; i < 6; ++i)
+        {
+            std::string path = assets_dir + "/sky/0_" + std::to_string(i) + ".png";
+            datas[i] = stbi_load(path.c_str(), &w, &h, &c, 4);
+            complete = complete && datas[i];
+        }
+
+        if (complete)
+        {
+            m_renderer->SetEnvironment(EnvironmentMap::CreateFromData(w, &datas[0]));
+        }
+
+        for (int i = 0; i < 6; ++i)
+        {
+            stbi_image_free(datas[i]);
+        }
+    }
+}
@@ -0,0 +1,49 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include "Scene.h"
+#include "BVHCache.h"
+#include "MipChain.h"
+#include "CpuRenderer.h"
+
+namespace dxrf
+{
+    // Scene, mesh texture and sky of the windowed renderer, read without a device and set up on a CpuRenderer.
+    // Everything stays resident until the assets are destroyed.
+    class SceneAssets
+    {
+    public:
+        // Reads assets_dir/scene_dir/objects.go and the textures of assets_dir, textures that cannot be read are
+        // left out. nullptr when the scene file is missing. bvh_cache, when not nullptr, provides the mesh BVHs.
+        static std::unique_ptr<SceneAssets> Load(const std::string& assets_dir, const std::string& scene_dir, BVHCache* bvh_cache);
+        Scene* GetScene() const { return m_scene.get(); }
+        CpuRenderer* GetRenderer() const { return m_renderer.get(); }
+        double GetLoadMs() const { return m_load_ms; }
+
+    private:
+        SceneAssets() = default;
+        void LoadMeshTexture(const std::string& assets_dir);
+        void LoadEnvironment(const std::string& assets_dir);
+
+    private:
+        std::unique_ptr<Scene> m_scene;
+        std::unique_ptr<MipChain> m_mesh_texture;
+        std::unique_ptr<CpuRenderer> m_renderer;
+        double m_load_ms = 0.0;
+    };
+}
@@ -0,0 +1,228 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#include "Socket.h"
+#include <WinSock2.h>
+#include <WS2tcpip.h>
+#include <limits.h>
+#include <algorithm>
+#include <mutex>
+
+namespace dxrf
+{
+    // packets larger than this come from a broken or foreign peer
+    static const uint32_t MAX_PACKET_SIZE = 1u << 30;
+
+    struct PacketHeader
+    {
+        uint32_t type;
+        uint32_t size;
+    };
+
+    static void InitializeWinsock()
+    {
+        static std::once_flag once;
+        std::call_once(once, []() {
+            WSADATA data;
+            WSAStartup(MAKEWORD(2, 2), &data);
+        });
+    }
+
+    // results and tiles are small and answered right away, Nagle would hold them back
+    static void DisableNagle(SOCKET s)
+    {
+        BOOL no_delay = TRUE;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*) &no_delay, sizeof(no_delay));
+    }
+
+    std::unique_ptr<Socket> Socket::Listen(int port, bool local_only)
+    {
+        InitializeWinsock();
+
+        SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (s == INVALID_SOCKET)
+        {
+            return nullptr;
+        }
+
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(local_only ? INADDR_LOOPBACK : INADDR_ANY);
+        address.sin_port = htons((u_short) port);
+        if (bind(s, (const sockaddr*) &address, sizeof(address)) != 0 || listen(s, SOMAXCONN) != 0)
+        {
+            closesocket(s);
+            return nullptr;
+        }
+
+        std::unique_ptr<Socket> result(new Socket(s));
+
+        return result;
+    }
+
+    std::unique_ptr<Socket> Socket::Connect(const std::string& host, int port)
+    {
+        InitializeWinsock();
+
+        addrinfo hints = {};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        addrinfo* addresses = nullptr;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0)
+        {
+            return nullptr;
+        }
+
+        SOCKET s = INVALID_SOCKET;
+        for (addrinfo* address = addresses; address; address = address->ai_next)
+        {
+            s = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+            if (s == INVALID_SOCKET)
+            {
+                continue;
+            }
+            if (connect(s, address->ai_addr, (int) address->ai_addrlen) == 0)
+            {
+                break;
+            }
+            closesocket(s);
+            s = INVALID_SOCKET;
+        }
+        freeaddrinfo(addresses);
+        if (s == INVALID_SOCKET)
+        {
+            return nullptr;
+        }
+        DisableNagle(s);
+
+        std::unique_ptr<Socket> result(new Socket(s));
+
+        return result;
+    }
+
+    Socket::~Socket()
+    {
+        closesocket((SOCKET) m_socket);
+    }
+
+    std::unique_ptr<Socket> Socket::Accept(int timeout_ms, bool* timed_out)
+    {
+        if (timed_out)
+        {
+            *timed_out = false;
+        }
+        if (timeout_ms >= 0)
+        {
+            fd_set readable;
+            FD_ZERO(&readable);
+            FD_SET((SOCKET) m_socket, &readable);
+            timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+            int ready = select((int) m_socket + 1, &readable, nullptr, nullptr, &timeout);
+            if (ready <= 0)
+            {
+                if (timed_out)
+                {
+                    *timed_out = ready == 0;
+                }
+                return nullptr;
+            }
+        }
+
+        SOCKET s = accept((SOCKET) m_socket, nullptr, nullptr);
+        if (s == INVALID_SOCKET)
+        {
+            return nullptr;
+        }
+        DisableNagle(s);
+
+        std::unique_ptr<Socket> result(new Socket(s));
+
+        return result;
+    }
+
+    int Socket::GetPort() const
+    {
+        sockaddr_in address = {};
+        socklen_t size = sizeof(address);
+        if (getsockname((SOCKET) m_socket, (sockaddr*) &address, &size) != 0)
+        {
+            return 0;
+        }
+        return ntohs(address.sin_port);
+    }
+
+    bool Socket::Send(const void* data, size_t size)
+    {
+        const char* bytes = (const char*) data;
+        while (size > 0)
+        {
+            int chunk = (int) (std::min)(size, (size_t) INT_MAX);
+            int sent = send((SOCKET) m_socket, bytes, chunk, 0);
+            if (sent <= 0)
+            {
+                return false;
+            }
+            bytes += sent;
+            size -= sent;
+        }
+        return true;
+    }
+
+    bool Socket::Receive(void* data, size_t size)
+    {
+        char* bytes = (char*) data;
+        while (size > 0)
+        {
+            int chunk = (int) (std::min)(size, (size_t) INT_MAX);
+            int received = recv((SOCKET) m_socket, bytes, chunk, 0);
+            if (received <= 0)
+            {
+                return false;
+            }
+            bytes += received;
+            size -= received;
+        }
+        return true;
+    }
+
+    bool Socket::SendPacket(uint32_t type, const void* payload, uint32_t size)
+    {
+        return this->SendPacket(type, payload, size, nullptr, 0);
+    }
+
+    bool Socket::SendPacket(uint32_t type, const void* header, uint32_t header_size, const void* body, uint32_t body_size)
+    {
+        PacketHeader packet = { type, header_size + body_size };
+        return this->Send(&packet, sizeof(packet)) && this->Send(header, header_size) && this->Send(body, body_size);
+    }
+
+    bool Socket::ReceivePacket(uint32_t* type, std::vector<uint8_t>* payload)
+    {
+        PacketHeader packet;
+        if (!this->Receive(&packet, sizeof(packet)) || packet.size > MAX_PACKET_SIZE)
+        {
+            return false;
+        }
+        payload->resize(packet.size);
+        if (packet.size > 0 && !this->Receive(payload->data(), packet.size))
+        {
+            return false;
+        }
+        *type = packet.type;
+        return true;
+    }
+}
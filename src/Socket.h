@@ -0,0 +1,56 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace dxrf
+{
+    // Blocking TCP connection of the distributed renderer. Data goes as packets of a 32 bit type and a 32 bit
+    // payload size followed by the payload, sent and received whole. Every call returns false once the peer
+    // closed the connection or the network failed, the socket is useless after that.
+    class Socket
+    {
+    public:
+        // Listens on every interface, or on the loopback interface only when local_only is set. Port 0 takes any
+        // free port, see GetPort.
+        static std::unique_ptr<Socket> Listen(int port, bool local_only = false);
+        // nullptr when host cannot be resolved or nobody listens on port.
+        static std::unique_ptr<Socket> Connect(const std::string& host, int port);
+        ~Socket();
+        // Waits for the next connection of a listening socket. A timeout_ms of 0 or more gives up after that many
+        // milliseconds, nullptr then with timed_out set.
+        std::unique_ptr<Socket> Accept(int timeout_ms = -1, bool* timed_out = nullptr);
+        int GetPort() const;
+        bool Send(const void* data, size_t size);
+        bool Receive(void* data, size_t size);
+        bool SendPacket(uint32_t type, const void* payload, uint32_t size);
+        // Two payload parts back to back, saves copying a header and a large body into one buffer.
+        bool SendPacket(uint32_t type, const void* header, uint32_t header_size, const void* body, uint32_t body_size);
+        bool ReceivePacket(uint32_t* type, std::vector<uint8_t>* payload);
+
+    private:
+        explicit Socket(uintptr_t s): m_socket(s) { }
+
+    private:
+        // SOCKET, WinSock2.h has to come before Windows.h and stays out of the header
+        uintptr_t m_socket;
+    };
+}
@@ -15,10 +15,11 @@ copies or substantial portions of the Software.
 */
 
 #include "Texture.h"
+#include "MipChain.h"
 
 namespace dxrf
 {
-    std::unique_ptr<Texture> Texture::CreateTextureFromData(DeviceResources* device, int width, int height, DXGI_FORMAT format, bool cube, void** faces_data)
+    std::unique_ptr<Texture> Texture::CreateTextureFromData(DeviceResources* device, int width, int height, DXGI_FORMAT format, bool cube, void** faces_data, MipGeneration mips)
     {
         auto d3d = device->GetD3DDevice();
         auto cmd = device->GetCommandList();
@@ -46,6 +47,15 @@ namespace dxrf
                 break;
         }
 
+        // only needed until the upload below completes
+        std::unique_ptr<MipChain> mip_chain;
+        if (mips != MipGeneration::None)
+        {
+            mip_chain = MipChain::Create(width, height, array_size, faces_data, mips == MipGeneration::Srgb);
+            mip_levels = mip_chain->GetLevelCount();
+        }
+        int subresource_count = array_size * mip_levels;
+
         // Describe and create a Texture2D.
         D3D12_RESOURCE_DESC desc = { };
         desc.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
@@ -67,7 +77,7 @@ namespace dxrf
             IID_PPV_ARGS(&texture->m_texture.resource)));
 
         // Create the GPU upload buffer.
-        const UINT64 upload_size = GetRequiredIntermediateSize(texture->m_texture.resource.Get(), 0, array_size);
+        const UINT64 upload_size = GetRequiredIntermediateSize(texture->m_texture.resource.Get(), 0, subresource_count);
 
         ComPtr<ID3D12Resource> upload_heap;
         ThrowIfFailed(d3d->CreateCommittedResource(
@@ -78,15 +88,29 @@ namespace dxrf
             nullptr,
             IID_PPV_ARGS(&upload_heap)));
 
-        std::vector<D3D12_SUBRESOURCE_DATA> datas(array_size);
+        // subresources are ordered by face, then by mip
+        std::vector<D3D12_SUBRESOURCE_DATA> datas(subresource_count);
         for (int i = 0; i < array_size; ++i)
         {
-            datas[i].pData = faces_data[i];
-            datas[i].RowPitch = width * pixel_size;
-            datas[i].SlicePitch = datas[i].RowPitch * height;
+            for (int level = 0; level < mip_levels; ++level)
+            {
+                auto& data = datas[i * mip_levels + level];
+                if (mip_chain)
+                {
+                    data.pData = mip_chain->GetData(i, level);
+                    data.RowPitch = mip_chain->GetWidth(level) * pixel_size;
+                    data.SlicePitch = data.RowPitch * mip_chain->GetHeight(level);
+                }
+                else
+                {
+                    data.pData = faces_data[i];
+                    data.RowPitch = width * pixel_size;
+                    data.SlicePitch = data.RowPitch * height;
+                }
+            }
         }
 
-        UpdateSubresources(cmd, texture->m_texture.resource.Get(), upload_heap.Get(), 0, 0, array_size, &datas[0]);
+        UpdateSubresources(cmd, texture->m_texture.resource.Get(), upload_heap.Get(), 0, 0, subresource_count, &datas[0]);
         cmd->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(texture->m_texture.resource.Get(), D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_GENERIC_READ));
 
         texture->m_texture.heap_index = device->AllocateDescriptor(&texture->m_texture.cpu_handle);
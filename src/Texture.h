@@ -23,6 +23,13 @@ using namespace DX;
 
 namespace dxrf
 {
+    enum class MipGeneration
+    {
+        None,   // only the top level
+        Linear, // full chain, channels averaged as stored
+        Srgb,   // full chain, color averaged in linear space, for sRGB encoded images read through UNORM views
+    };
+
     class Texture
     {
     private:
@@ -35,7 +42,7 @@ namespace dxrf
         };
 
     public:
-        static std::unique_ptr<Texture> CreateTextureFromData(DeviceResources* device, int width, int height, DXGI_FORMAT format, bool cube, void** faces_data);
+        static std::unique_ptr<Texture> CreateTextureFromData(DeviceResources* device, int width, int height, DXGI_FORMAT format, bool cube, void** faces_data, MipGeneration mips);
         ~Texture();
         D3D12_GPU_DESCRIPTOR_HANDLE GetGpuHandle() const { return m_texture.gpu_handle; }
 
@@ -0,0 +1,143 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#include "ThreadPool.h"
+
+namespace dxrf
+{
+    ThreadPool* ThreadPool::GetInstance()
+    {
+        static ThreadPool pool((int) std::thread::hardware_concurrency() - 1);
+        return &pool;
+    }
+
+    ThreadPool::ThreadPool(int worker_count)
+    {
+        for (int i = 0; i < worker_count; ++i)
+        {
+            m_workers.emplace_back([this]() { this->WorkerLoop(); });
+        }
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_exit = true;
+        }
+        m_cv.notify_all();
+
+        for (auto& worker : m_workers)
+        {
+            worker.join();
+        }
+    }
+
+    void ThreadPool::Push(Task task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_tasks.push_back(std::move(task));
+        }
+        m_cv.notify_one();
+    }
+
+    // Called from waiting threads, takes the newest task to stay close to the caller's working set.
+    bool ThreadPool::RunPendingTask()
+    {
+        Task task;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_tasks.empty())
+            {
+                return false;
+            }
+            task = std::move(m_tasks.back());
+            m_tasks.pop_back();
+        }
+
+        task.func();
+        task.pending->fetch_sub(1);
+        return true;
+    }
+
+    // Workers take the oldest task, which is usually the largest piece of work.
+    void ThreadPool::WorkerLoop()
+    {
+        while (true)
+        {
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, [this]() { return m_exit || !m_tasks.empty(); });
+                if (m_tasks.empty())
+                {
+                    return;
+                }
+                task = std::move(m_tasks.front());
+                m_tasks.pop_front();
+            }
+
+            task.func();
+            task.pending->fetch_sub(1);
+        }
+    }
+
+    void ThreadPool::ParallelFor(int begin, int end, int grain, const std::function<void(int, int)>& func)
+    {
+        grain = grain > 0 ? grain : 1;
+        if (end - begin <= grain)
+        {
+            if (end > begin)
+            {
+                func(begin, end);
+            }
+            return;
+        }
+
+        TaskGroup group(this);
+        for (int i = begin; i < end; i += grain)
+        {
+            int chunk_end = end - i > grain ? i + grain : end;
+            group.Run([&func, i, chunk_end]() { func(i, chunk_end); });
+        }
+        group.Wait();
+    }
+
+    void TaskGroup::Run(std::function<void()> func)
+    {
+        m_pending.fetch_add(1);
+        if (m_pool->m_workers.empty())
+        {
+            // no workers, run inline so single threaded builds keep a shallow stack
+            func();
+            m_pending.fetch_sub(1);
+            return;
+        }
+        m_pool->Push({ std::move(func), &m_pending });
+    }
+
+    void TaskGroup::Wait()
+    {
+        while (m_pending.load() > 0)
+        {
+            if (!m_pool->RunPendingTask())
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+}
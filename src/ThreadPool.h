@@ -0,0 +1,76 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace dxrf
+{
+    class ThreadPool
+    {
+    public:
+        // Shared pool with one worker per hardware thread besides the caller.
+        static ThreadPool* GetInstance();
+        explicit ThreadPool(int worker_count);
+        ~ThreadPool();
+        int GetThreadCount() const { return (int) m_workers.size() + 1; }
+        // Splits [begin, end) into chunks of grain and runs func(chunk_begin, chunk_end) on the pool.
+        // Chunking only depends on grain, never on the thread count.
+        void ParallelFor(int begin, int end, int grain, const std::function<void(int, int)>& func);
+
+    private:
+        friend class TaskGroup;
+
+        struct Task
+        {
+            std::function<void()> func;
+            std::atomic<int>* pending;
+        };
+
+        void Push(Task task);
+        bool RunPendingTask();
+        void WorkerLoop();
+
+    private:
+        std::vector<std::thread> m_workers;
+        std::deque<Task> m_tasks;
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        bool m_exit = false;
+    };
+
+    // Fork / join scope on a pool. Wait() executes queued tasks while waiting, so groups can nest.
+    class TaskGroup
+    {
+    public:
+        explicit TaskGroup(ThreadPool* pool): m_pool(pool) { }
+        ~TaskGroup() { this->Wait(); }
+        void Run(std::function<void()> func);
+        void Wait();
+
+    private:
+        ThreadPool* m_pool;
+        std::atomic<int> m_pending { 0 };
+    };
+}
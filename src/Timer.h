@@ -0,0 +1,34 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include <chrono>
+
+namespace dxrf
+{
+    // Wall clock stopwatch for the statistics of the CPU tracer.
+    class Timer
+    {
+    public:
+        Timer(): m_start(std::chrono::steady_clock::now()) { }
+        void Reset() { m_start = std::chrono::steady_clock::now(); }
+        double GetElapsedMs() const { return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_start).count(); }
+
+    private:
+        std::chrono::steady_clock::time_point m_start;
+    };
+}
@@ -0,0 +1,566 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#include "Tracer.h"
+#include "BVHCache.h"
+#include "ThreadPool.h"
+
+namespace dxrf
+{
+    // row vector convention, same as the XMMATRIX transforms of the scene objects
+    static XMFLOAT3 TransformPoint(const XMFLOAT4X4& m, const XMFLOAT3& p)
+    {
+        return {
+            p.x * m.m[0][0] + p.y * m.m[1][0] + p.z * m.m[2][0] + m.m[3][0],
+            p.x * m.m[0][1] + p.y * m.m[1][1] + p.z * m.m[2][1] + m.m[3][1],
+            p.x * m.m[0][2] + p.y * m.m[1][2] + p.z * m.m[2][2] + m.m[3][2],
+        };
+    }
+
+    static XMFLOAT3 TransformVector(const XMFLOAT4X4& m, const XMFLOAT3& v)
+    {
+        return {
+            v.x * m.m[0][0] + v.y * m.m[1][0] + v.z * m.m[2][0],
+            v.x * m.m[0][1] + v.y * m.m[1][1] + v.z * m.m[2][1],
+            v.x * m.m[0][2] + v.y * m.m[1][2] + v.z * m.m[2][2],
+        };
+    }
+
+    static AABB TransformBounds(const XMFLOAT4X4& m, const AABB& bounds)
+    {
+        AABB result;
+        if (!bounds.IsValid())
+        {
+            return result;
+        }
+
+        for (int i = 0; i < 8; ++i)
+        {
+            XMFLOAT3 corner = {
+                (i & 1) ? bounds.max.x : bounds.min.x,
+                (i & 2) ? bounds.max.y : bounds.min.y,
+                (i & 4) ? bounds.max.z : bounds.min.z,
+            };
+            result.Grow(TransformPoint(m, corner));
+        }
+        return result;
+    }
+
+    static const int OCCLUSION_GRAIN = 256;
+    static const int STREAM_BATCH_SIZE = 4096;
+    // same as Raytracing.hlsl
+    static const float LOD_MIN_COS_THETA = 1e-4f;
+
+    // Buffers of the breadth first traversals of one thread, kept between batches.
+    struct StreamScratch
+    {
+        TraversalStream world;
+        TraversalStream object;
+        std::vector<UINT> object_rays;  // world ray of each object ray
+    };
+
+    static StreamScratch& GetStreamScratch()
+    {
+        static thread_local StreamScratch scratch;
+        return scratch;
+    }
+
+    std::unique_ptr<Tracer> Tracer::CreateFromScene(Scene* scene, const BVHBuildSettings& settings, BVHCache* cache)
+    {
+        std::unique_ptr<Tracer> tracer(new Tracer());
+        tracer->m_settings = settings;
+
+        const auto& meshes = scene->GetMeshArray();
+        tracer->m_bottom_structures.resize(meshes.size());
+        tracer->m_mesh_vertices.resize(meshes.size());
+        auto build = [&](int begin, int end) {
+            for (int i = begin; i < end; ++i)
+            {
+                if (cache != nullptr)
+                {
+                    tracer->m_bottom_structures[i] = cache->BuildFromMesh(meshes[i].get(), settings);
+                }
+                else
+                {
+                    tracer->m_bottom_structures[i] = BVH::BuildFromMesh(meshes[i].get(), settings);
+                }
+            }
+        };
+        // meshes build concurrently, each build spreads its own subtrees over the same pool
+        if (settings.parallel)
+        {
+            ThreadPool::GetInstance()->ParallelFor(0, (int) meshes.size(), 1, build);
+        }
+        else
+        {
+            build(0, (int) meshes.size());
+        }
+
+        const auto& objects = scene->GetRenderObjects();
+        tracer->m_instances.resize(objects.size());
+        for (size_t i = 0; i < objects.size(); ++i)
+        {
+            auto& instance = tracer->m_instances[i];
+            instance.instance_id = (UINT) i;
+            instance.mask = objects[i]->mesh_renderer->visibility & VISIBILITY_INSTANCE_MASK;
+            instance.receive_shadow = (objects[i]->mesh_renderer->visibility & VISIBILITY_SHADOW_RECEIVER) != 0;
+            instance.mesh_index = objects[i]->mesh_renderer->mesh_index;
+            XMStoreFloat4x4(&instance.object_to_world, objects[i]->transform);
+            XMStoreFloat4x4(&instance.world_to_object, XMMatrixInverse(nullptr, objects[i]->transform));
+        }
+        tracer->CreateTopStructure();
+
+        return tracer;
+    }
+
+    // instances are few and move every frame, a treelet optimized LBVH is close to SAH quality
+    static BVHBuildSettings GetTopSettings(const BVHBuildSettings& settings)
+    {
+        BVHBuildSettings top_settings = settings;
+        top_settings.type = BVHBuildType::Linear;
+        top_settings.max_leaf_size = 1;
+        top_settings.treelet_optimize = true;
+        return top_settings;
+    }
+
+    void Tracer::CreateTopStructure()
+    {
+        this->UpdateInstanceBounds();
+
+        m_top_structure = BVH::BuildFromBounds(m_instance_bounds, GetTopSettings(m_settings));
+        m_shadow_top_structure = m_caster_bounds.empty() ? nullptr : BVH::BuildFromBounds(m_caster_bounds, GetTopSettings(m_settings));
+    }
+
+    void Tracer::UpdateInstanceBounds()
+    {
+        m_instance_bounds.resize(m_instances.size());
+        for (size_t i = 0; i < m_instances.size(); ++i)
+        {
+            auto& instance = m_instances[i];
+            instance.bounds = TransformBounds(instance.object_to_world, m_bottom_structures[instance.mesh_index]->GetBounds());
+            m_instance_bounds[i] = instance.bounds;
+        }
+
+        m_caster_indices.clear();
+        m_caster_bounds.clear();
+        for (size_t i = 0; i < m_instances.size(); ++i)
+        {
+            if (m_instances[i].mask & VISIBILITY_SHADOW_CASTER)
+            {
+                m_caster_indices.push_back((UINT) i);
+                m_caster_bounds.push_back(m_instances[i].bounds);
+            }
+        }
+    }
+
+    void Tracer::SetInstanceTransform(UINT instance_index, const XMMATRIX& transform)
+    {
+        auto& instance = m_instances[instance_index];
+        XMStoreFloat4x4(&instance.object_to_world, transform);
+        XMStoreFloat4x4(&instance.world_to_object, XMMatrixInverse(nullptr, transform));
+    }
+
+    bool Tracer::UpdateMeshVertices(int mesh_index, const std::vector<XMFLOAT3>& positions)
+    {
+        m_mesh_vertices[mesh_index] = positions;
+        return m_bottom_structures[mesh_index]->Refit(m_mesh_vertices[mesh_index]);
+    }
+
+    void Tracer::SetInstanceCastShadow(UINT instance_index, bool cast_shadow)
+    {
+        auto& instance = m_instances[instance_index];
+        instance.mask = cast_shadow ? (instance.mask | VISIBILITY_SHADOW_CASTER) : (instance.mask & ~VISIBILITY_SHADOW_CASTER);
+    }
+
+    void Tracer::RebuildTopStructure()
+    {
+        m_version += 1;
+        this->UpdateInstanceBounds();
+        m_top_structure->Rebuild(m_instance_bounds);
+        // SetInstanceCastShadow may have emptied or refilled the caster set
+        if (m_caster_bounds.empty())
+        {
+            m_shadow_top_structure.reset();
+        }
+        else if (m_shadow_top_structure)
+        {
+            m_shadow_top_structure->Rebuild(m_caster_bounds);
+        }
+        else
+        {
+            m_shadow_top_structure = BVH::BuildFromBounds(m_caster_bounds, GetTopSettings(m_settings));
+        }
+    }
+
+    bool Tracer::TraceRay(const Ray& ray, UINT instance_mask, RayHit* hit) const
+    {
+        TraversalRay traversal_ray(ray);
+        float t_max = (std::min)(ray.t_max, hit->t);
+        bool found = false;
+        const auto& instance_indices = m_top_structure->GetPrimitiveIndices();
+
+        m_top_structure->Traverse(traversal_ray, t_max, [&](int first, int count) {
+            for (int i = 0; i < count; ++i)
+            {
+                const TracerInstance& instance = m_instances[instance_indices[first + i]];
+                if ((instance.mask & instance_mask) == 0)
+                {
+                    continue;
+                }
+
+                // the direction is not normalized, so hit distances stay in world space units
+                Ray object_ray;
+                object_ray.origin = TransformPoint(instance.world_to_object, ray.origin);
+                object_ray.direction = TransformVector(instance.world_to_object, ray.direction);
+                object_ray.t_min = ray.t_min;
+                object_ray.t_max = t_max;
+
+                if (m_bottom_structures[instance.mesh_index]->Intersect(object_ray, hit))
+                {
+                    t_max = hit->t;
+                    hit->instance_id = instance.instance_id;
+                    found = true;
+                }
+            }
+            return false;
+        });
+
+        return found;
+    }
+
+    bool Tracer::TraceOcclusion(const Ray& ray, UINT instance_mask) const
+    {
+        if (!m_shadow_top_structure)
+        {
+            return false;
+        }
+
+        TraversalRay traversal_ray(ray);
+        float t_max = ray.t_max;
+        bool occluded = false;
+        const auto& caster_indices = m_shadow_top_structure->GetPrimitiveIndices();
+
+        m_shadow_top_structure->Traverse(traversal_ray, t_max, [&](int first, int count) {
+            for (int i = 0; i < count; ++i)
+            {
+                const TracerInstance& instance = m_instances[m_caster_indices[caster_indices[first + i]]];
+                if ((instance.mask & instance_mask) == 0)
+                {
+                    continue;
+                }
+
+                Ray object_ray;
+                object_ray.origin = TransformPoint(instance.world_to_object, ray.origin);
+                object_ray.direction = TransformVector(instance.world_to_object, ray.direction);
+                object_ray.t_min = ray.t_min;
+                object_ray.t_max = ray.t_max;
+
+                if (m_bottom_structures[instance.mesh_index]->Occluded(object_ray))
+                {
+                    occluded = true;
+                    return true;
+                }
+            }
+            return false;
+        });
+
+        return occluded;
+    }
+
+    void Tracer::TraceRays(const Ray* rays, int ray_count, UINT instance_mask, RayHit* hits) const
+    {
+        auto trace = [&](int begin, int end) {
+            if (end - begin >= m_stream_ray_count)
+            {
+                this->TraceRayStream(rays + begin, end - begin, instance_mask, hits + begin);
+                return;
+            }
+            for (int i = begin; i < end; ++i)
+            {
+                hits[i] = RayHit();
+                this->TraceRay(rays[i], instance_mask, &hits[i]);
+            }
+        };
+
+        int grain = ray_count >= m_stream_ray_count ? (std::max)(STREAM_BATCH_SIZE, m_stream_ray_count) : OCCLUSION_GRAIN;
+        if (m_settings.parallel && ray_count > grain)
+        {
+            ThreadPool::GetInstance()->ParallelFor(0, ray_count, grain, trace);
+        }
+        else
+        {
+            trace(0, ray_count);
+        }
+    }
+
+    void Tracer::TraceOcclusion(const Ray* rays, int ray_count, UINT instance_mask, bool* occluded) const
+    {
+        auto trace = [&](int begin, int end) {
+            if (end - begin >= m_stream_ray_count)
+            {
+                this->TraceOcclusionStream(rays + begin, end - begin, instance_mask, occluded + begin);
+                return;
+            }
+            for (int i = begin; i < end; ++i)
+            {
+                occluded[i] = this->TraceOcclusion(rays[i], instance_mask);
+            }
+        };
+
+        int grain = ray_count >= m_stream_ray_count ? (std::max)(STREAM_BATCH_SIZE, m_stream_ray_count) : OCCLUSION_GRAIN;
+        if (m_settings.parallel && ray_count > grain)
+        {
+            ThreadPool::GetInstance()->ParallelFor(0, ray_count, grain, trace);
+        }
+        else
+        {
+            trace(0, ray_count);
+        }
+    }
+
+    // The instance BVH is traversed by the whole batch, every instance leaf then traces the rays that reached it
+    // through the mesh BVH as a second stream in object space.
+    void Tracer::TraceRayStream(const Ray* rays, int ray_count, UINT instance_mask, RayHit* hits) const
+    {
+        StreamScratch& scratch = GetStreamScratch();
+        TraversalStream& world = scratch.world;
+        TraversalStream& object = scratch.object;
+        world.Resize(ray_count);
+        for (int i = 0; i < ray_count; ++i)
+        {
+            world.SetRay(i, rays[i]);
+        }
+
+        const auto& instance_indices = m_top_structure->GetPrimitiveIndices();
+        m_top_structure->TraverseStream(world, [&](int first, int count, const UINT* active, int active_count) {
+            for (int i = 0; i < count; ++i)
+            {
+                const TracerInstance& instance = m_instances[instance_indices[first + i]];
+                if ((instance.mask & instance_mask) == 0)
+                {
+                    continue;
+                }
+
+                object.Resize(active_count);
+                for (int j = 0; j < active_count; ++j)
+                {
+                    const Ray& ray = world.rays[active[j]];
+                    Ray object_ray;
+                    object_ray.origin = TransformPoint(instance.world_to_object, ray.origin);
+                    object_ray.direction = TransformVector(instance.world_to_object, ray.direction);
+                    object_ray.t_min = ray.t_min;
+                    object_ray.t_max = world.t_max[active[j]];
+                    object.SetRay(j, object_ray);
+                }
+
+                m_bottom_structures[instance.mesh_index]->Intersect(object);
+                for (int j = 0; j < active_count; ++j)
+                {
+                    const RayHit& hit = object.hits[j];
+                    if (hit.primitive_index != UINT_MAX)
+                    {
+                        UINT r = active[j];
+                        world.t_max[r] = hit.t;
+                        world.hits[r] = hit;
+                        world.hits[r].instance_id = instance.instance_id;
+                    }
+                }
+            }
+        });
+
+        for (int i = 0; i < ray_count; ++i)
+        {
+            hits[i] = world.hits[i];
+        }
+    }
+
+    void Tracer::TraceOcclusionStream(const Ray* rays, int ray_count, UINT instance_mask, bool* occluded) const
+    {
+        if (!m_shadow_top_structure)
+        {
+            for (int i = 0; i < ray_count; ++i)
+            {
+                occluded[i] = false;
+            }
+            return;
+        }
+
+        StreamScratch& scratch = GetStreamScratch();
+        TraversalStream& world = scratch.world;
+        TraversalStream& object = scratch.object;
+        world.Resize(ray_count);
+        for (int i = 0; i < ray_count; ++i)
+        {
+            world.SetRay(i, rays[i]);
+        }
+
+        const auto& caster_indices = m_shadow_top_structure->GetPrimitiveIndices();
+        m_shadow_top_structure->TraverseStream(world, [&](int first, int count, const UINT* active, int active_count) {
+            for (int i = 0; i < count; ++i)
+            {
+                const TracerInstance& instance = m_instances[m_caster_indices[caster_indices[first + i]]];
+                if ((instance.mask & instance_mask) == 0)
+                {
+                    continue;
+                }
+
+                // rays blocked by an earlier instance of the leaf are done
+                scratch.object_rays.clear();
+                for (int j = 0; j < active_count; ++j)
+                {
+                    if (world.hits[active[j]].primitive_index == UINT_MAX)
+                    {
+                        scratch.object_rays.push_back(active[j]);
+                    }
+                }
+
+                int object_count = (int) scratch.object_rays.size();
+                object.Resize(object_count);
+                for (int j = 0; j < object_count; ++j)
+                {
+                    const Ray& ray = world.rays[scratch.object_rays[j]];
+                    Ray object_ray;
+                    object_ray.origin = TransformPoint(instance.world_to_object, ray.origin);
+                    object_ray.direction = TransformVector(instance.world_to_object, ray.direction);
+                    object_ray.t_min = ray.t_min;
+                    object_ray.t_max = ray.t_max;
+                    object.SetRay(j, object_ray);
+                }
+
+                m_bottom_structures[instance.mesh_index]->Occluded(object);
+                for (int j = 0; j < object_count; ++j)
+                {
+                    if (object.hits[j].primitive_index != UINT_MAX)
+                    {
+                        UINT r = scratch.object_rays[j];
+                        world.hits[r] = object.hits[j];
+                        world.t_max[r] = -FLT_MAX;
+                    }
+                }
+            }
+        });
+
+        for (int i = 0; i < ray_count; ++i)
+        {
+            occluded[i] = world.hits[i].primitive_index != UINT_MAX;
+        }
+    }
+
+    bool Tracer::IntersectPrimitive(const Ray& ray, UINT instance_id, UINT primitive_index, RayHit* hit) const
+    {
+        const TracerInstance& instance = m_instances[instance_id];
+        const Mesh* mesh = m_bottom_structures[instance.mesh_index]->GetMesh();
+        const std::vector<XMFLOAT3>& vertices = this->GetMeshVertices(instance.mesh_index);
+        const uint16_t* indices = &mesh->indices[primitive_index * 3];
+
+        // same object space ray as TraceRay, so t and the barycentrics match the traversal
+        Ray object_ray;
+        object_ray.origin = TransformPoint(instance.world_to_object, ray.origin);
+        object_ray.direction = TransformVector(instance.world_to_object, ray.direction);
+        object_ray.t_min = ray.t_min;
+        object_ray.t_max = ray.t_max;
+
+        float t;
+        float u;
+        float v;
+        if (!IntersectTriangle(WatertightRay(object_ray), vertices[indices[0]], vertices[indices[1]], vertices[indices[2]],
+            (std::min)(ray.t_max, hit->t), &t, &u, &v))
+        {
+            return false;
+        }
+        hit->t = t;
+        hit->barycentrics = { u, v };
+        hit->primitive_index = primitive_index;
+        hit->instance_id = instance.instance_id;
+        return true;
+    }
+
+    const std::vector<XMFLOAT3>& Tracer::GetMeshVertices(int mesh_index) const
+    {
+        return m_mesh_vertices[mesh_index].empty() ? m_bottom_structures[mesh_index]->GetMesh()->vertices : m_mesh_vertices[mesh_index];
+    }
+
+    XMFLOAT3 Tracer::GetShadingNormal(const RayHit& hit) const
+    {
+        const TracerInstance& instance = m_instances[hit.instance_id];
+        const Mesh* mesh = m_bottom_structures[instance.mesh_index]->GetMesh();
+        float weights[3] = { 1.0f - hit.barycentrics.x - hit.barycentrics.y, hit.barycentrics.x, hit.barycentrics.y };
+        XMVECTOR normal = XMVectorZero();
+        for (int i = 0; i < 3; ++i)
+        {
+            normal = XMVectorAdd(normal, XMVectorScale(XMLoadFloat3(&mesh->normals[mesh->indices[hit.primitive_index * 3 + i]]), weights[i]));
+        }
+        normal = XMVector3TransformNormal(normal, XMLoadFloat4x4(&instance.object_to_world));
+
+        XMFLOAT3 result;
+        XMStoreFloat3(&result, XMVector3Normalize(normal));
+        return result;
+    }
+
+    XMFLOAT2 Tracer::GetTextureCoordinate(const RayHit& hit) const
+    {
+        const TracerInstance& instance = m_instances[hit.instance_id];
+        const Mesh* mesh = m_bottom_structures[instance.mesh_index]->GetMesh();
+        if (mesh->uv.empty())
+        {
+            return { 0, 0 };
+        }
+
+        float weights[3] = { 1.0f - hit.barycentrics.x - hit.barycentrics.y, hit.barycentrics.x, hit.barycentrics.y };
+        XMFLOAT2 uv = { 0, 0 };
+        for (int i = 0; i < 3; ++i)
+        {
+            const XMFLOAT2& vertex_uv = mesh->uv[mesh->indices[hit.primitive_index * 3 + i]];
+            uv.x += vertex_uv.x * weights[i];
+            uv.y += vertex_uv.y * weights[i];
+        }
+        return uv;
+    }
+
+    // The texel to world area ratio of the triangle turns the cone width into texels, grazing angles stretch the
+    // footprint by 1 / |n.d|. Constant over the triangle, so it is exact for affine uv mappings only.
+    float Tracer::GetTextureLod(const RayHit& hit, const XMFLOAT3& direction, float cone_width, int width, int height) const
+    {
+        const TracerInstance& instance = m_instances[hit.instance_id];
+        const Mesh* mesh = m_bottom_structures[instance.mesh_index]->GetMesh();
+        if (mesh->uv.empty())
+        {
+            return 0.0f;
+        }
+
+        // deformed meshes are shaded at their refitted positions
+        const std::vector<XMFLOAT3>& vertices = this->GetMeshVertices(instance.mesh_index);
+        const uint16_t* indices = &mesh->indices[hit.primitive_index * 3];
+        XMFLOAT3 p0 = TransformPoint(instance.object_to_world, vertices[indices[0]]);
+        XMFLOAT3 p1 = TransformPoint(instance.object_to_world, vertices[indices[1]]);
+        XMFLOAT3 p2 = TransformPoint(instance.object_to_world, vertices[indices[2]]);
+        XMVECTOR normal = XMVector3Cross(XMVectorSubtract(XMLoadFloat3(&p1), XMLoadFloat3(&p0)), XMVectorSubtract(XMLoadFloat3(&p2), XMLoadFloat3(&p0)));
+        float world_area = XMVectorGetX(XMVector3Length(normal));
+
+        const XMFLOAT2& uv0 = mesh->uv[indices[0]];
+        const XMFLOAT2& uv1 = mesh->uv[indices[1]];
+        const XMFLOAT2& uv2 = mesh->uv[indices[2]];
+        float texel_area = fabsf((uv1.x - uv0.x) * (uv2.y - uv0.y) - (uv1.y - uv0.y) * (uv2.x - uv0.x)) * width * height;
+        if (texel_area <= 0.0f || world_area <= 0.0f)
+        {
+            return 0.0f;
+        }
+        // a ray along the surface would stretch the footprint without bound
+        float cos_theta = (std::max)(fabsf(XMVectorGetX(XMVector3Dot(normal, XMLoadFloat3(&direction)))) / world_area, LOD_MIN_COS_THETA);
+
+        return 0.5f * log2f(texel_area / world_area) + log2f(cone_width / cos_theta);
+    }
+}
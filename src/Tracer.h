@@ -0,0 +1,111 @@
+/*
+MIT License
+
+Copyright (c) 2020 stackos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+*/
+
+#pragma once
+
+#include "BVH.h"
+
+namespace dxrf
+{
+    class BVHCache;
+
+    struct TracerInstance
+    {
+        UINT instance_id = 0;
+        UINT mask = VISIBILITY_CAMERA | VISIBILITY_SHADOW_CASTER;   // VISIBILITY_INSTANCE_MASK bits of the renderer
+        bool receive_shadow = true;
+        int mesh_index = -1;
+        XMFLOAT4X4 object_to_world;
+        XMFLOAT4X4 world_to_object;
+        AABB bounds;
+    };
+
+    // Batches of incoherent rays from this size on traverse faster breadth first than ray by ray.
+    static const int DEFAULT_STREAM_RAY_COUNT = 1024;
+
+    // CPU counterpart of the scene acceleration structures, one BVH per mesh under a BVH over instances.
+    // Shadow rays traverse a second instance BVH over the shadow casters only, the others are never visited.
+    class Tracer
+    {
+    public:
+        // Mesh BVHs are loaded from cache when it has them and stored to it otherwise, nullptr always builds.
+        static std::unique_ptr<Tracer> CreateFromScene(Scene* scene, const BVHBuildSettings& settings, BVHCache* cache = nullptr);
+        // Closest hit of instances whose mask overlaps instance_mask, same semantics as TraceRay's InstanceInclusionMask.
+        bool TraceRay(const Ray& ray, UINT instance_mask, RayHit* hit) const;
+        // Shadow ray query, true if a shadow caster whose mask overlaps instance_mask blocks the ray anywhere in
+        // [ray.t_min, ray.t_max]. Stops at the first blocker, set t_max to the light distance.
+        bool TraceOcclusion(const Ray& ray, UINT instance_mask) const;
+        // TraceRay over an array of rays, hits[i] is overwritten with the closest hit of rays[i]. Large arrays are
+        // split into batches over the thread pool. Batches of at least the stream ray count traverse breadth first,
+        // which pays off for incoherent rays, smaller ones ray by ray.
+        void TraceRays(const Ray* rays, int ray_count, UINT instance_mask, RayHit* hits) const;
+        // TraceOcclusion over an array of rays, batched like TraceRays.
+        void TraceOcclusion(const Ray* rays, int ray_count, UINT instance_mask, bool* occluded) const;
+        // Tests the ray against one triangle of an instance, without traversal. Writes the same hit TraceRay would
+        // when that triangle is the closest, returns false when the ray misses it in [ray.t_min, ray.t_max).
+        bool IntersectPrimitive(const Ray& ray, UINT instance_id, UINT primitive_index, RayHit* hit) const;
+        // Smallest batch traced breadth first, INT_MAX traces every ray on its own.
+        void SetStreamRayCount(int ray_count) { m_stream_ray_count = ray_count; }
+        int GetStreamRayCount() const { return m_stream_ray_count; }
+        // Interpolated vertex normal of a TraceRay hit in world space, normalized.
+        XMFLOAT3 GetShadingNormal(const RayHit& hit) const;
+        // Interpolated texture coordinate of a TraceRay hit, (0, 0) for meshes without uv.
+        XMFLOAT2 GetTextureCoordinate(const RayHit& hit) const;
+        // Mip level of a width x height texture mapped by the mesh uv, seen by a ray cone of cone_width at the hit
+        // (Akenine-Moller et al. 2019). direction is the normalized ray direction. Same as ComputeTextureLod in Raytracing.hlsl.
+        float GetTextureLod(const RayHit& hit, const XMFLOAT3& direction, float cone_width, int width, int height) const;
+        // Instances that do not cast shadows are skipped by TraceOcclusion but still hit by TraceRay,
+        // call RebuildTopStructure() afterwards.
+        void SetInstanceCastShadow(UINT instance_index, bool cast_shadow);
+        // Moves an instance, call RebuildTopStructure() once all instances of the frame are updated.
+        void SetInstanceTransform(UINT instance_index, const XMMATRIX& transform);
+        // Refits the BVH of a deformed mesh, positions are copied and replace the mesh vertices of all its instances.
+        // Call RebuildTopStructure() afterwards, returns true when the refit fell back to a full rebuild.
+        bool UpdateMeshVertices(int mesh_index, const std::vector<XMFLOAT3>& positions);
+        // Rebuilds the instance BVH over the current instance bounds, reusing the node and index buffers of the
+        // previous build. The parallel tasks and compressed builds still allocate.
+        void RebuildTopStructure();
+        // Changes with every RebuildTopStructure, results cached for one version may not hold for the next.
+        uint64_t GetVersion() const { return m_version; }
+        const std::vector<TracerInstance>& GetInstances() const { return m_instances; }
+        const BVH* GetBottomStructure(int mesh_index) const { return m_bottom_structures[mesh_index].get(); }
+        // Object space positions the BVH of the mesh was built or refitted over.
+        const std::vector<XMFLOAT3>& GetMeshVertices(int mesh_index) const;
+        const BVH* GetTopStructure() const { return m_top_structure.get(); }
+        // nullptr when no instance casts shadows
+        const BVH* GetShadowTopStructure() const { return m_shadow_top_structure.get(); }
+
+    private:
+        Tracer() = default;
+        void CreateTopStructure();
+        void UpdateInstanceBounds();
+        void TraceRayStream(const Ray* rays, int ray_count, UINT instance_mask, RayHit* hits) const;
+        void TraceOcclusionStream(const Ray* rays, int ray_count, UINT instance_mask, bool* occluded) const;
+
+    private:
+        BVHBuildSettings m_settings;
+        std::vector<std::unique_ptr<BVH>> m_bottom_structures;
+        std::vector<std::vector<XMFLOAT3>> m_mesh_vertices;
+        std::unique_ptr<BVH> m_top_structure;
+        std::unique_ptr<BVH> m_shadow_top_structure;
+        std::vector<TracerInstance> m_instances;
+        std::vector<AABB> m_instance_bounds;
+        std::vector<UINT> m_caster_indices;     // instance of each primitive of the shadow BVH
+        std::vector<AABB> m_caster_bounds;
+        int m_stream_ray_count = DEFAULT_STREAM_RAY_COUNT;
+        uint64_t m_version = 0;
+    };
+}